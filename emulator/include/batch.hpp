@@ -0,0 +1,217 @@
+/* batch.hpp */
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "cpu.hpp"
+#include "memory.hpp"
+#include "emulator_pool.hpp"
+#include "program_image.hpp"
+#include "lockstep.hpp"
+
+/* Instruction limit of a job line that does not give one */
+#define BATCH_DEFAULT_LIMIT 1000000
+
+/* Most worker threads one runner starts */
+#define BATCH_MAX_THREADS 256
+
+/**
+ * One guest program run
+ *
+ * Job files hold one job per line: `program [stdin] [limit]`, separated
+ * by whitespace. stdin is a host file fed to fd 0 ("-" or missing: empty
+ * input), limit an instruction count. Blank lines and lines starting
+ * with # are skipped; paths are used as given.
+ */
+struct BatchJob {
+	std::string program;
+	std::string input;	/* stdin file ("" for none) */
+	uint64_t max_instructions;
+};
+
+/*
+ * How a job ended
+ *
+ * BATCH_EXITED: Guest called exit/exit_group
+ * BATCH_FAULT: Execution error (illegal instruction, bad access, ...)
+ * BATCH_LIMIT: Instruction limit reached
+ * BATCH_LOAD_ERROR: Program or stdin file could not be read
+ */
+enum batch_status_t {
+	BATCH_EXITED,
+	BATCH_FAULT,
+	BATCH_LIMIT,
+	BATCH_LOAD_ERROR
+};
+
+/**
+ * Outcome of one job
+ */
+struct BatchResult {
+	batch_status_t status;
+	int32_t exit_code;	/* a0 at exit (0 unless BATCH_EXITED) */
+	cpu_status_t fault;	/* CPU status for BATCH_FAULT */
+	uint64_t stdout_hash;	/* 64-bit FNV-1a of the guest's stdout */
+	uint64_t stdout_bytes;
+	uint64_t retired;
+	uint64_t wall_ns;	/* Load plus run time (of its whole group in lockstep mode) */
+};
+
+/*
+ * Report formats
+ *
+ * BATCH_CSV: Header line, then one line per job
+ * BATCH_JSON: Array of one object per job
+ */
+enum batch_format_t {
+	BATCH_CSV,
+	BATCH_JSON
+};
+
+/**
+ * Runs a list of jobs on a work-stealing pool of host threads
+ *
+ * Each job runs on an Emulator from an EmulatorPool (reset in the
+ * background between jobs) with the sandbox syscall backend: stdin
+ * comes from the job's file, stdout/stderr are captured, opens fail and
+ * the clock is virtual, so results depend on the program and its input
+ * only. run() loads each distinct program once into a ProgramImage that
+ * all of its jobs map copy-on-write, decoded instructions included.
+ *
+ * Work is handed out in units: one job, or with set_lockstep() up to
+ * that many jobs of the same program and limit, run as the lanes of one
+ * Lockstep. The unit list is split into one contiguous range per
+ * worker; a worker takes from the back of its own queue and, once that
+ * is empty, steals from the front of the others, so one slow unit does
+ * not hold up the rest of its range.
+ */
+class BatchRunner {
+private:
+	/* Pending units of one worker (indexes into units) */
+	struct WorkerQueue {
+		std::mutex lock;
+		std::deque<size_t> units;
+	};
+
+	cpu_engine_t engine;
+	EmulatorPool pool;	/* Instances reused across jobs */
+	std::unordered_map<std::string, std::shared_ptr<const ProgramImage>> images;	/* Per program path during run() (nullptr: unreadable) */
+	std::vector<std::vector<size_t>> units;	/* Job indexes per unit during run() */
+	std::vector<std::unique_ptr<WorkerQueue>> queues;
+	std::atomic<uint64_t> steals;
+	uint32_t lockstep;	/* Most jobs per lockstep unit (0 or 1: off) */
+	std::atomic<uint64_t> lockstep_splits;
+
+	/**
+	 * Take the next unit for a worker: its own range in order, else the far end of another's
+	 *
+	 * worker: Worker index
+	 * index: Output for unit index
+	 *
+	 * Output: true if a unit was taken, false when every queue is empty
+	 */
+	bool take_unit(uint32_t worker, size_t *index);
+
+	/**
+	 * Run the jobs of one unit as the lanes of a Lockstep
+	 *
+	 * jobs: Job list
+	 * unit: Job indexes (same program and limit)
+	 * results: Result per job (the unit's entries are written)
+	 */
+	void run_lockstep(const std::vector<BatchJob> &jobs, const std::vector<size_t> &unit, std::vector<BatchResult> *results);
+
+	/**
+	 * Thread body: run units until none are left
+	 *
+	 * worker: Worker index
+	 * jobs: Job list
+	 * results: Result per job (each written by one worker)
+	 */
+	void run_worker(uint32_t worker, const std::vector<BatchJob> *jobs, std::vector<BatchResult> *results);
+
+public:
+	/**
+	 * Initialize runner
+	 *
+	 * engine: Execution engine for every job
+	 * backend: Memory backend for every job
+	 * memory_size: Guest RAM size in bytes
+	 */
+	BatchRunner(cpu_engine_t engine, mem_backend_t backend, uint32_t memory_size = MEMORY_SIZE);
+
+	/**
+	 * Run every job and collect the results
+	 *
+	 * jobs: Job list
+	 * threads: Worker threads (clamped to 1..BATCH_MAX_THREADS and the job count)
+	 *
+	 * Output: One result per job, in job order
+	 */
+	std::vector<BatchResult> run(const std::vector<BatchJob> &jobs, uint32_t threads);
+
+	/**
+	 * Run one job on the calling thread
+	 *
+	 * job: Job to run
+	 *
+	 * Output: Job result
+	 */
+	BatchResult run_job(const BatchJob &job);
+
+	/**
+	 * Run jobs of the same program and limit in lockstep groups
+	 *
+	 * lanes: Most jobs per group (0 or 1 turns it off; at most
+	 *        LOCKSTEP_MAX_LANES)
+	 */
+	void set_lockstep(uint32_t lanes) { lockstep = std::min(lanes, (uint32_t)LOCKSTEP_MAX_LANES); }
+
+	/**
+	 * Get number of lockstep lanes that finished on their own engine in the last run()
+	 *
+	 * Output: Split lane count
+	 */
+	uint64_t get_lockstep_splits() const { return lockstep_splits.load(std::memory_order_relaxed); }
+
+	/**
+	 * Get number of units taken from another worker's queue by the last run()
+	 *
+	 * Output: Steal count
+	 */
+	uint64_t get_steals() const { return steals.load(std::memory_order_relaxed); }
+
+	/**
+	 * Read a job file
+	 *
+	 * path: Job file
+	 * jobs: Output for parsed jobs (appended)
+	 *
+	 * Output: 0 on success, -1 if the file cannot be read or a line is malformed
+	 */
+	static int parse_jobs(const char *path, std::vector<BatchJob> *jobs);
+
+	/**
+	 * Write a report with one entry per job
+	 *
+	 * file: Output stream
+	 * format: CSV or JSON
+	 * jobs: Job list
+	 * results: Results from run(), same order
+	 *
+	 * Output: 0 on success, -1 on I/O error
+	 */
+	static int write_report(FILE *file, batch_format_t format,
+		const std::vector<BatchJob> &jobs, const std::vector<BatchResult> &results);
+};
+
+#endif
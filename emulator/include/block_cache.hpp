@@ -0,0 +1,194 @@
+/* block_cache.hpp */
+#ifndef BLOCK_CACHE_HPP
+#define BLOCK_CACHE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "instructions.hpp"
+#include "decode_cache.hpp"
+
+/* Longest straight-line run translated into one block */
+#define BLOCK_MAX_INSTRUCTIONS 64
+
+class Memory;
+class JitCompiler;
+
+/*
+ * Block exit kinds
+ *
+ * BLOCK_EXIT_TAKEN: Left through the branch/jal target (chainable)
+ * BLOCK_EXIT_FALLTHROUGH: Left at end_pc (chainable)
+ * BLOCK_EXIT_INDIRECT: Left through jalr (target looked up by PC)
+ * BLOCK_EXIT_SYSTEM: Stopped before ecall/ebreak/illegal (run by CPU::step)
+ * BLOCK_EXIT_FAULT: A load or store faulted
+ * BLOCK_EXIT_STALE: A store invalidated translated code
+ */
+enum block_exit_t {
+	BLOCK_EXIT_TAKEN,
+	BLOCK_EXIT_FALLTHROUGH,
+	BLOCK_EXIT_INDIRECT,
+	BLOCK_EXIT_SYSTEM,
+	BLOCK_EXIT_FAULT,
+	BLOCK_EXIT_STALE
+};
+
+/*
+ * Block execution result: exit kind in the low byte, number of
+ * instructions completed in the upper bits. Shared by the block
+ * interpreter and native (JIT) code.
+ */
+#define BLOCK_RESULT(exit, count) ((uint32_t)(exit) | ((uint32_t)(count) << 8))
+#define BLOCK_RESULT_EXIT(result) ((block_exit_t)((result) & 0xFF))
+#define BLOCK_RESULT_COUNT(result) ((result) >> 8)
+
+/*
+ * Native block entry point
+ *
+ * regs: Guest register file (CPU::x, with CPU::pc at a fixed offset)
+ * mem: Memory instance for load/store helpers
+ *
+ * Output: BLOCK_RESULT value
+ */
+typedef uint32_t (*native_block_t)(uint32_t *regs, Memory *mem);
+
+/**
+ * Pre-bound micro-operation
+ *
+ * Operand fields are extracted once at translation time. PC-relative
+ * values (auipc results, branch and jump targets) are folded into imm,
+ * so executing a block needs no PC bookkeeping until it exits.
+ */
+struct MicroOp {
+	uint8_t op;	/* instr_op_t */
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+	uint32_t imm;
+};
+
+/**
+ * Translated basic block
+ *
+ * Straight-line guest code from start_pc up to and including the next
+ * branch, jal, jalr, ecall/ebreak or illegal instruction. Blocks also
+ * end at code page boundaries so each block belongs to exactly one page.
+ */
+struct Block {
+	uint32_t start_pc;
+	uint32_t end_pc;	/* Address after the last instruction */
+	std::vector<MicroOp> ops;
+
+	/* Chained successors (nullptr until first resolved) */
+	Block *taken;
+	Block *fallthrough;
+
+	/* Link slots of other blocks that point at this block */
+	std::vector<Block**> incoming;
+
+	uint64_t exec_count;
+
+	/* JIT-compiled body, nullptr while interpreted */
+	native_block_t native;
+};
+
+/**
+ * Basic-block translation cache keyed by guest PC
+ *
+ * Owns translated blocks, maintains the chaining links between them and
+ * drops blocks (and every link into them) when their page is written.
+ */
+class BlockCache {
+private:
+	std::unordered_map<uint32_t, std::unique_ptr<Block>> blocks;
+	std::unordered_map<uint32_t, std::vector<uint32_t>> page_blocks;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t chained;
+	uint64_t generation;
+	std::unique_ptr<JitCompiler> jit;
+
+	/**
+	 * Remove a block and unlink it from its neighbours
+	 *
+	 * block: Block to remove
+	 */
+	void unlink(Block *block);
+
+public:
+	/**
+	 * Initialize an empty block cache
+	 */
+	BlockCache();
+
+	/**
+	 * Release translated blocks and native code
+	 */
+	~BlockCache();
+
+	/**
+	 * Get JIT compiler for this cache's blocks (created on first use)
+	 *
+	 * Output: Pointer to JIT compiler
+	 */
+	JitCompiler* get_jit();
+
+	/**
+	 * Look up translated block starting at address
+	 *
+	 * addr: Guest PC
+	 *
+	 * Output: Block, or nullptr on miss (counted as hit/miss)
+	 */
+	Block* lookup(uint32_t addr);
+
+	/**
+	 * Take ownership of a freshly translated block
+	 *
+	 * block: Translated block
+	 *
+	 * Output: Pointer to the stored block
+	 */
+	Block* insert(std::unique_ptr<Block> block);
+
+	/**
+	 * Chain a block exit to its successor
+	 *
+	 * slot: Link slot of the predecessor (taken or fallthrough)
+	 * target: Successor block
+	 */
+	void link(Block **slot, Block *target);
+
+	/**
+	 * Drop every block that lies in a code page
+	 *
+	 * index: Page index (addr >> CODE_PAGE_SHIFT)
+	 */
+	void invalidate_page(uint32_t index);
+
+	/**
+	 * Drop all blocks and their native code
+	 */
+	void clear();
+
+	/**
+	 * Get invalidation generation (changes whenever blocks are dropped)
+	 *
+	 * Output: Generation counter
+	 */
+	uint64_t get_generation() const { return generation; }
+
+	/**
+	 * Record a transition that followed a chained link
+	 */
+	void count_chained() { chained++; }
+
+	/* Statistics */
+	uint64_t get_hits() const { return hits; }
+	uint64_t get_misses() const { return misses; }
+	uint64_t get_chained() const { return chained; }
+	size_t get_block_count() const { return blocks.size(); }
+};
+
+#endif
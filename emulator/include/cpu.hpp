@@ -5,10 +5,15 @@
 #include <cstdint>
 #include <memory>
 #include <array>
+#include <cstdio>
+#include "fd_table.hpp"
+#include "syscalls.hpp"
 
 /* Forward declarations */
 class Memory;
 class Instruction;
+class DecodeCache;
+struct Block;
 
 /*
  * CPU execution status codes
@@ -21,6 +26,8 @@ class Instruction;
  * CPU_EXECUTION_ERROR: Generic execution error
  * CPU_ILLEGAL_INSTRUCTION: Illegal instruction encountered
  * CPU_SYSCALL_EXIT: System call exit requested
+ * CPU_BREAKPOINT: ebreak executed (PC is past the ebreak)
+ * CPU_WATCHPOINT: Load/store hit a watchpoint (PC is at the access)
  */
 enum cpu_status_t {
 	CPU_OK,
@@ -30,18 +37,73 @@ enum cpu_status_t {
 	CPU_DECODE_ERROR,
 	CPU_EXECUTION_ERROR,
 	CPU_ILLEGAL_INSTRUCTION,
-	CPU_SYSCALL_EXIT
+	CPU_SYSCALL_EXIT,
+	CPU_BREAKPOINT,
+	CPU_WATCHPOINT
 };
 
-/* Linux-compatible RISC-V system call numbers (RV32) */
-#define SYS_exit 93
-#define SYS_read 63
-#define SYS_write 64
-#define SYS_openat 56
-#define SYS_close 57
-#define SYS_brk 214
-#define SYS_fstat 80
-#define SYS_lseek 62
+/*
+ * Execution engines
+ *
+ * ENGINE_SWITCH: Reference interpreter (CPU::step, switch-based execute)
+ * ENGINE_THREADED: Threaded-code interpreter (computed goto per instruction)
+ * ENGINE_BLOCK: Basic-block translation cache with block chaining
+ * ENGINE_JIT: Block engine that compiles hot blocks to native x86-64 code
+ */
+enum cpu_engine_t {
+	ENGINE_SWITCH,
+	ENGINE_THREADED,
+	ENGINE_BLOCK,
+	ENGINE_JIT
+};
+
+/*
+ * Instruction tracing modes
+ *
+ * TRACE_NONE: No tracing (fast path)
+ * TRACE_TEXT: Human-readable fetch/decode/execute trace on stdout
+ * TRACE_BINARY: TraceRecord stream written to a file
+ */
+enum cpu_trace_t {
+	TRACE_NONE,
+	TRACE_TEXT,
+	TRACE_BINARY
+};
+
+/*
+ * Reasons a batched run returns
+ *
+ * RUN_EXIT: Program exited (or the CPU was already stopped)
+ * RUN_FAULT: Fetch, decode or execution error (see RunResult::status)
+ * RUN_BUDGET: Instruction budget exhausted
+ * RUN_BREAKPOINT: ebreak executed; run can be resumed
+ * RUN_WATCHPOINT: Watched access about to happen; run can be resumed
+ */
+enum run_stop_t {
+	RUN_EXIT,
+	RUN_FAULT,
+	RUN_BUDGET,
+	RUN_BREAKPOINT,
+	RUN_WATCHPOINT
+};
+
+/**
+ * Outcome of CPU::run / Emulator::run
+ */
+struct RunResult {
+	run_stop_t reason;
+	cpu_status_t status;	/* Status that stopped execution (CPU_OK on budget) */
+	uint64_t retired;	/* Instructions completed, including exit/ebreak */
+};
+
+/**
+ * Architectural CPU state captured by snapshots and checkpoints
+ */
+struct CpuState {
+	std::array<uint32_t, 32> x;
+	uint32_t pc;
+	bool running;
+};
 
 /*
  * Memory layout constants
@@ -51,6 +113,9 @@ enum cpu_status_t {
 #define STACK_SIZE (1 * 1024 * 1024)
 #define STACK_TOP (STACK_BASE + STACK_SIZE)
 
+/* Machine-mode CSR numbers (read-only) */
+#define CSR_MHARTID 0xF14
+
 /**
  * CPU class for RISC-V processor emulation
  *
@@ -61,7 +126,18 @@ private:
 	std::array<uint32_t, 32> x;
 	uint32_t pc;
 	bool running;
-	bool debug_mode;
+	cpu_trace_t trace_mode;
+	FILE *trace_file;
+	FdTable files;
+	SyscallTable syscalls;
+	uint64_t instret;	/* Instructions retired by completed runs */
+	uint64_t run_retired;	/* Retired so far in the current run (published before each ecall) */
+	uint32_t hartid;	/* mhartid */
+	bool reservation_valid;	/* lr.w reservation is held */
+	uint32_t reservation_addr;
+	uint32_t reservation_value;	/* Word loaded by lr.w (sc.w compares against it) */
+	std::unique_ptr<DecodeCache> hart_decode;	/* Own decode cache, or nullptr to use the memory's */
+	uint64_t hart_decode_generation;	/* Memory code generation hart_decode was built at */
 
 	/**
 	 * Read register value (x0 always returns 0)
@@ -81,7 +157,7 @@ private:
 	void reg_write(uint8_t reg, uint32_t value);
 
 	/**
-	 * Handle system call instruction
+	 * Handle system call instruction (dispatched through the syscall table)
 	 *
 	 * mem: Memory instance
 	 *
@@ -134,6 +210,25 @@ private:
 	 */
 	uint32_t execute_alu(uint32_t rs1_val, uint32_t rs2_val_or_imm, uint8_t funct3, uint8_t funct7, bool is_imm);
 
+	/**
+	 * Execute A extension instruction (lr.w, sc.w, amo*.w)
+	 *
+	 * mem: Memory instance
+	 * instr: Decoded instruction
+	 *
+	 * Output: Execution status
+	 */
+	cpu_status_t execute_atomic(Memory *mem, Instruction *instr);
+
+	/**
+	 * Execute Zicsr instruction (only reads of mhartid are legal)
+	 *
+	 * instr: Decoded instruction
+	 *
+	 * Output: Execution status
+	 */
+	cpu_status_t execute_csr(Instruction *instr);
+
 	/**
 	 * Execute branch instruction
 	 *
@@ -153,12 +248,117 @@ private:
 	 */
 	cpu_status_t execute_system(Memory *mem, Instruction *instr);
 
+	/**
+	 * Fetch predecoded instruction at PC and advance PC
+	 *
+	 * Consults the memory's decode cache (or the hart's own, see
+	 * set_hart_decode()) first and only fetches and decodes on a miss.
+	 *
+	 * mem: Memory instance
+	 * instr: Output for decoded instruction
+	 *
+	 * Output: Fetch/decode status
+	 */
+	cpu_status_t fetch_decoded(Memory *mem, const Instruction **instr);
+
+	/**
+	 * Translate the basic block starting at PC
+	 *
+	 * mem: Memory instance
+	 *
+	 * Output: Cached block, or nullptr if the first instruction cannot
+	 *         be fetched or decoded
+	 */
+	Block* translate_block(Memory *mem);
+
+	/**
+	 * Interpret one translated block
+	 *
+	 * mem: Memory instance
+	 * block: Block starting at PC
+	 *
+	 * Output: BLOCK_RESULT (exit kind and instructions completed)
+	 */
+	uint32_t execute_block(Memory *mem, Block *block);
+
+	/**
+	 * Block engine main loop shared by the interpreter and JIT tiers
+	 *
+	 * mem: Memory instance
+	 * max_instructions: Instruction budget for this call
+	 * retired: Output for number of instructions completed
+	 * use_jit: Compile blocks once they become hot
+	 *
+	 * Output: CPU_OK if the budget was exhausted, otherwise the stop status
+	 */
+	cpu_status_t run_translated(Memory *mem, uint64_t max_instructions, uint64_t *retired, bool use_jit);
+
+	/**
+	 * Fetch, decode and execute one instruction
+	 *
+	 * Trace is a tracing policy (see trace.hpp); with NoTrace the hooks
+	 * compile to nothing.
+	 *
+	 * mem: Memory instance
+	 * trace: Tracing policy instance
+	 *
+	 * Output: Step execution status
+	 */
+	template <typename Trace>
+	cpu_status_t step_traced(Memory *mem, Trace &trace);
+
+	/**
+	 * Reference interpreter loop specialized for one tracing policy
+	 *
+	 * mem: Memory instance
+	 * max_instructions: Instruction budget for this call
+	 * retired: Output for number of instructions completed
+	 * trace: Tracing policy instance
+	 *
+	 * Output: CPU_OK if the budget was exhausted, otherwise the stop status
+	 */
+	template <typename Trace>
+	cpu_status_t run_loop(Memory *mem, uint64_t max_instructions, uint64_t *retired, Trace &trace);
+
+	/**
+	 * Reference interpreter run (selects the tracing policy once)
+	 *
+	 * mem: Memory instance
+	 * max_instructions: Instruction budget for this call
+	 * retired: Output for number of instructions completed
+	 *
+	 * Output: CPU_OK if the budget was exhausted, otherwise the stop status
+	 */
+	cpu_status_t run_switch(Memory *mem, uint64_t max_instructions, uint64_t *retired);
+
+	/**
+	 * Turn a load/store fault caused by a watchpoint into CPU_WATCHPOINT
+	 *
+	 * Every engine leaves the PC past a faulting access; this moves it
+	 * back so resuming retries the access.
+	 *
+	 * mem: Memory instance
+	 * status: Status returned by an engine
+	 *
+	 * Output: CPU_WATCHPOINT or status unchanged
+	 */
+	cpu_status_t check_watchpoint(Memory *mem, cpu_status_t status);
+
 public:
 	/**
 	 * Initialize CPU state
 	 */
 	CPU();
 
+	~CPU();
+
+	/**
+	 * Return to the state after construction: registers cleared, sp =
+	 * STACK_TOP, pc = 0, host syscall table, guest files closed, no
+	 * tracing, counters and reservation cleared
+	 */
+	void reset();
+
 	/**
 	 * Check if CPU is running
 	 *
@@ -180,6 +380,80 @@ public:
 	 */
 	void set_pc(uint32_t value);
 
+	/**
+	 * Get guest file descriptor table
+	 *
+	 * Output: Pointer to descriptor table
+	 */
+	FdTable* get_files() { return &files; }
+
+	/**
+	 * Get system call table (host backend installed by default)
+	 *
+	 * Output: Pointer to syscall table
+	 */
+	SyscallTable* get_syscalls() { return &syscalls; }
+
+	/**
+	 * Get number of retired instructions
+	 *
+	 * Exact between runs and inside system call handlers, where it
+	 * counts the instructions before the ecall (engines publish their
+	 * count only when they reach an ecall).
+	 *
+	 * Output: Instructions retired by run() since construction
+	 */
+	uint64_t get_instret() const { return instret + run_retired; }
+
+	/**
+	 * Count instructions this CPU's program retired outside run()
+	 *
+	 * Used by the lockstep engine, which executes them on its own
+	 * register file.
+	 *
+	 * count: Instructions completed
+	 */
+	void add_retired(uint64_t count) { instret += count; }
+
+	/**
+	 * Get hart id (read by the guest through the mhartid CSR)
+	 *
+	 * Output: Hart id (0 unless set)
+	 */
+	uint32_t get_hartid() const { return hartid; }
+
+	/**
+	 * Set hart id
+	 *
+	 * id: Value of mhartid
+	 */
+	void set_hartid(uint32_t id) { hartid = id; }
+
+	/**
+	 * Decode into a cache owned by this CPU instead of the memory's
+	 *
+	 * Required when several harts run on one Memory concurrently. The
+	 * cache is dropped whenever the memory's code generation changes.
+	 * The block and JIT engines always use the memory's caches.
+	 *
+	 * enable: true to use a per-hart cache
+	 */
+	void set_hart_decode(bool enable);
+
+	/**
+	 * Capture registers, PC and running flag
+	 *
+	 * Output: Current architectural state
+	 */
+	CpuState get_state() const;
+
+	/**
+	 * Replace registers, PC and running flag
+	 *
+	 * state: State previously returned by get_state()
+	 */
+	void set_state(const CpuState &state);
+
 	/**
 	 * Get register value (for testing/debugging)
 	 *
@@ -226,12 +500,83 @@ public:
 	 */
 	cpu_status_t step(Memory *mem);
 
+	/**
+	 * Execute up to max_instructions with the selected engine
+	 *
+	 * Runs in a tight loop inside the engine and returns only on exit,
+	 * fault, ebreak or when the budget is used up.
+	 *
+	 * mem: Memory instance
+	 * engine: Execution engine
+	 * max_instructions: Instruction budget for this call
+	 *
+	 * Output: Stop reason, stopping status and retired instruction count
+	 */
+	RunResult run(Memory *mem, cpu_engine_t engine, uint64_t max_instructions);
+
+	/**
+	 * Execute instructions with the threaded-code engine
+	 *
+	 * Each instruction is dispatched through an indirect jump to the
+	 * handler resolved at decode time (computed goto), without the
+	 * format/opcode/funct switches of execute().
+	 *
+	 * mem: Memory instance
+	 * max_instructions: Instruction budget for this call
+	 * retired: Output for number of instructions completed
+	 *
+	 * Output: CPU_OK if the budget was exhausted, otherwise the status
+	 *         that stopped execution
+	 */
+	cpu_status_t run_threaded(Memory *mem, uint64_t max_instructions, uint64_t *retired);
+
+	/**
+	 * Execute instructions with the basic-block engine
+	 *
+	 * Blocks are translated once into pre-bound micro-ops and chained
+	 * directly to their successors, so control only returns to the
+	 * cache lookup on indirect jumps, syscalls and invalidation.
+	 *
+	 * mem: Memory instance
+	 * max_instructions: Instruction budget for this call
+	 * retired: Output for number of instructions completed
+	 *
+	 * Output: CPU_OK if the budget was exhausted, otherwise the status
+	 *         that stopped execution
+	 */
+	cpu_status_t run_blocks(Memory *mem, uint64_t max_instructions, uint64_t *retired);
+
+	/**
+	 * Execute instructions with the tiered JIT engine
+	 *
+	 * Runs the block engine and compiles blocks that reach
+	 * JIT_HOT_THRESHOLD executions to native code. Native blocks work
+	 * directly on the register file and pc; syscalls, faults and cold
+	 * code stay in the interpreter.
+	 *
+	 * mem: Memory instance
+	 * max_instructions: Instruction budget for this call
+	 * retired: Output for number of instructions completed
+	 *
+	 * Output: CPU_OK if the budget was exhausted, otherwise the status
+	 *         that stopped execution
+	 */
+	cpu_status_t run_jit(Memory *mem, uint64_t max_instructions, uint64_t *retired);
+
 	/**
 	 * Set debug mode (enables verbose execution trace)
 	 *
 	 * enable: true to enable debug output, false to disable
 	 */
 	void set_debug_mode(bool enable);
+
+	/**
+	 * Select tracing mode
+	 *
+	 * mode: Tracing mode
+	 * file: Output file for TRACE_BINARY (ignored otherwise)
+	 */
+	void set_trace(cpu_trace_t mode, FILE *file);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,107 @@
+/* decode_cache.hpp */
+#ifndef DECODE_CACHE_HPP
+#define DECODE_CACHE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <array>
+#include <bitset>
+#include "instructions.hpp"
+
+/*
+ * Decode cache geometry
+ *
+ * Decoded instructions are grouped per 4 KiB code page, one slot
+ * per word-aligned instruction address.
+ */
+#define CODE_PAGE_SHIFT 12
+#define CODE_PAGE_SIZE (1u << CODE_PAGE_SHIFT)
+#define CODE_PAGE_SLOTS (CODE_PAGE_SIZE / 4)
+
+/* Decoded instructions of one code page */
+struct DecodedPage {
+	std::array<Instruction, CODE_PAGE_SLOTS> slots;
+	std::bitset<CODE_PAGE_SLOTS> valid;
+};
+
+/**
+ * Predecoded instruction cache keyed by guest PC
+ *
+ * Stores already-decoded instructions so that hot loops skip
+ * fetch and decode after their first iteration. Pages can also be
+ * borrowed read-only from a ProgramImage shared by several caches; the
+ * first insert into a borrowed page copies it.
+ */
+class DecodeCache {
+private:
+	std::unordered_map<uint32_t, const DecodedPage*> pages;	/* Owned or borrowed, by page index */
+	std::unordered_map<uint32_t, std::unique_ptr<DecodedPage>> owned;
+
+	/* Most recently used page (loops rarely leave their page) */
+	uint32_t last_index;
+	const DecodedPage *last_page;
+
+public:
+	/**
+	 * Initialize an empty decode cache
+	 */
+	DecodeCache();
+
+	/**
+	 * Look up decoded instruction at address
+	 *
+	 * addr: Instruction address
+	 *
+	 * Output: Cached instruction, or nullptr on miss (or misaligned address)
+	 */
+	const Instruction* lookup(uint32_t addr) {
+		if (addr & 0x3) return nullptr;
+
+		uint32_t index = addr >> CODE_PAGE_SHIFT;
+		const DecodedPage *page = last_page;
+
+		if (!page || index != last_index) {
+			auto it = pages.find(index);
+			if (it == pages.end()) return nullptr;
+			page = it->second;
+			last_index = index;
+			last_page = page;
+		}
+
+		uint32_t slot = (addr & (CODE_PAGE_SIZE - 1)) >> 2;
+		return page->valid[slot] ? &page->slots[slot] : nullptr;
+	}
+
+	/**
+	 * Decode raw instruction and store it in the cache
+	 *
+	 * addr: Word-aligned instruction address
+	 * raw: Raw 32-bit instruction word
+	 *
+	 * Output: Cached instruction, or nullptr if decoding failed
+	 */
+	const Instruction* insert(uint32_t addr, uint32_t raw);
+
+	/**
+	 * Use a page decoded elsewhere (replaces what the cache held for it)
+	 *
+	 * index: Page index (addr >> CODE_PAGE_SHIFT)
+	 * page: Decoded page; must outlive the cache's use of it
+	 */
+	void share_page(uint32_t index, const DecodedPage *page);
+
+	/**
+	 * Drop every decoded instruction of a code page
+	 *
+	 * index: Page index (addr >> CODE_PAGE_SHIFT)
+	 */
+	void invalidate_page(uint32_t index);
+
+	/**
+	 * Drop all decoded instructions
+	 */
+	void clear();
+};
+
+#endif
@@ -4,8 +4,88 @@
 
 #include <cstdint>
 #include <memory>
+#include <vector>
 #include "cpu.hpp"
 #include "memory.hpp"
+#include "program_image.hpp"
+
+/* Mapped guest region [base, end) (checkpoint and state files) */
+struct StateRegion {
+	uint64_t base;
+	uint64_t end;
+};
+
+/* Incremental checkpoint file magic ("RVCK" little-endian) and version */
+#define CHECKPOINT_MAGIC 0x4B435652
+#define CHECKPOINT_VERSION 2
+
+/**
+ * Checkpoint file header
+ *
+ * Followed by region_count StateRegion records (every region mapped when
+ * the checkpoint was taken), then page_count records of a 32-bit guest
+ * page address and MEM_PAGE_SIZE bytes of data. Written in host byte
+ * order. The first checkpoint holds every resident page, later ones only
+ * pages written since the previous checkpoint; applying them in order
+ * rebuilds memory, including heap and mmap regions.
+ */
+struct CheckpointHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t sequence;	/* 0 for the full checkpoint */
+	uint32_t page_count;
+	uint32_t region_count;
+	uint32_t program_break;	/* Guest brk */
+	uint32_t x[32];
+	uint32_t pc;
+	uint32_t running;
+};
+
+/* Machine state file magic ("RVST" little-endian) and version */
+#define STATE_MAGIC 0x54535652
+#define STATE_VERSION 1
+
+/**
+ * Machine state file header
+ *
+ * Layout (host byte order):
+ *   StateHeader
+ *   region_count x StateRegion
+ *   file_count x StateFile, each followed by its path (path_length bytes)
+ *   run_count x StateRun
+ *   zero padding up to data_offset (page-aligned)
+ *   page data of every run, back to back
+ *
+ * All-zero pages are not stored. Restoring maps the page data
+ * copy-on-write straight from the file instead of reading it.
+ */
+struct StateHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t x[32];
+	uint32_t pc;
+	uint32_t running;
+	uint32_t region_count;
+	uint32_t file_count;
+	uint32_t run_count;
+	uint32_t program_break;	/* Guest brk (0: leave the default) */
+	uint64_t data_offset;
+};
+
+/* Open guest file */
+struct StateFile {
+	int32_t guest_fd;
+	int32_t flags;
+	int64_t offset;
+	uint32_t path_length;
+	uint32_t reserved;
+};
+
+/* Consecutive non-zero guest pages */
+struct StateRun {
+	uint32_t first_page;
+	uint32_t page_count;
+};
 
 /**
  * Emulator class that owns and manages CPU and Memory
@@ -16,14 +96,30 @@ class Emulator {
 private:
 	std::unique_ptr<CPU> cpu;
 	std::unique_ptr<Memory> memory;
+	cpu_engine_t engine;
+	bool program_mapped;
+	CpuState snapshot_cpu;
+	uint32_t checkpoint_sequence;
+	bool quiet;
+
+	/**
+	 * Make the mapped regions match a checkpoint or state file
+	 *
+	 * Ranges mapped here but not in regions are unmapped (their contents
+	 * are dropped); regions not fully mapped yet are mapped.
+	 *
+	 * regions: Regions to have (sorted in place by base)
+	 */
+	void set_regions(std::vector<StateRegion> *regions);
 
 public:
 	/**
 	 * Initialize emulator with given memory size
 	 *
 	 * memory_size: Memory size in bytes
+	 * backend: Memory backend
 	 */
-	Emulator(uint32_t memory_size);
+	Emulator(uint32_t memory_size, mem_backend_t backend = MEM_BACKEND_PAGED);
 
 	/**
 	 * Get CPU instance
@@ -60,9 +156,49 @@ public:
 	 */
 	cpu_status_t step();
 
+	/**
+	 * Execute up to max_instructions with the selected engine
+	 *
+	 * max_instructions: Instruction budget for this call
+	 *
+	 * Output: Stop reason, stopping status and retired instruction count
+	 */
+	RunResult run(uint64_t max_instructions);
+
+	/**
+	 * Select execution engine used by run()
+	 *
+	 * value: Execution engine (default ENGINE_SWITCH)
+	 */
+	void set_engine(cpu_engine_t value);
+
+	/**
+	 * Suppress progress messages on stdout (errors still go to stderr)
+	 *
+	 * enable: true to load programs without the "Loaded" line
+	 */
+	void set_quiet(bool enable);
+
+	/**
+	 * Return to the state after construction
+	 *
+	 * CPU is reset (registers cleared, sp = STACK_TOP, host syscalls,
+	 * guest files closed), memory is emptied and RAM plus stack mapped
+	 * again, the engine goes back to ENGINE_SWITCH and snapshots are
+	 * forgotten. Cost is proportional to the pages used since the last
+	 * reset (they are cleared for reuse), not to the memory size.
+	 *
+	 * Output: 0 on success, -1 if memory could not be reset (discard the
+	 *         emulator)
+	 */
+	int reset();
+
 	/**
 	 * Load program from file into memory
 	 *
+	 * Page-aligned images are mapped copy-on-write from the file;
+	 * otherwise the file is read and copied in.
+	 *
 	 * filename: Path to binary file
 	 * load_address: Address to load program at
 	 *
@@ -70,6 +206,83 @@ public:
 	 */
 	int load_program(const char *filename, uint32_t load_address);
 
+	/**
+	 * Map a shared program image (no file access or decoding per call)
+	 *
+	 * image: Image loaded with ProgramImage::load()
+	 *
+	 * Output: 0 on success, -1 on error
+	 */
+	int load_image(const std::shared_ptr<const ProgramImage> &image);
+
+	/**
+	 * Check how the last program was loaded
+	 *
+	 * Output: true if the image is mapped from the file, false if copied
+	 */
+	bool is_program_mapped() const { return program_mapped; }
+
+	/**
+	 * Record CPU state and memory as the restore point
+	 *
+	 * Host file descriptors opened by the guest are not captured.
+	 */
+	void snapshot();
+
+	/**
+	 * Return CPU state and memory to the last snapshot
+	 *
+	 * Cost is proportional to the pages written since the snapshot
+	 * (or the previous restore), not to the memory size.
+	 *
+	 * Output: 0 on success, -1 if no snapshot was taken
+	 */
+	int restore();
+
+	/**
+	 * Write a checkpoint of CPU state, mapped regions, program break and
+	 * pages written since the last one
+	 *
+	 * path: Output file
+	 *
+	 * Output: 0 on success, -1 on I/O error
+	 */
+	int write_checkpoint(const char *path);
+
+	/**
+	 * Apply a checkpoint file (apply the full one first, then increments)
+	 *
+	 * Regions missing here are mapped and regions the checkpoint does not
+	 * hold are unmapped before its pages are written.
+	 *
+	 * path: Checkpoint file
+	 *
+	 * Output: 0 on success, -1 if the file is missing or malformed
+	 */
+	int apply_checkpoint(const char *path);
+
+	/**
+	 * Save registers, open files and memory to a state file
+	 *
+	 * path: Output file
+	 *
+	 * Output: 0 on success, -1 on I/O error
+	 */
+	int save_state(const char *path);
+
+	/**
+	 * Resume from a state file written by save_state()
+	 *
+	 * Mapped regions are made to match the file (as apply_checkpoint()
+	 * does), memory pages are mapped from the file and guest files are
+	 * reopened by path at their saved offsets.
+	 *
+	 * path: State file
+	 *
+	 * Output: 0 on success, -1 if the file is missing or malformed
+	 */
+	int restore_state(const char *path);
+
 	/**
 	 * Set program counter
 	 *
@@ -84,6 +297,14 @@ public:
 	 */
 	void set_debug_mode(bool enable);
 
+	/**
+	 * Select tracing mode
+	 *
+	 * mode: Tracing mode
+	 * file: Output file for TRACE_BINARY (ignored otherwise)
+	 */
+	void set_trace(cpu_trace_t mode, FILE *file);
+
 	/**
 	 * Check if CPU is running
 	 *
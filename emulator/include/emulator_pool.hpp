@@ -0,0 +1,111 @@
+/* emulator_pool.hpp */
+#ifndef EMULATOR_POOL_HPP
+#define EMULATOR_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "emulator.hpp"
+
+/* Ready instances a pool keeps by default */
+#define POOL_DEFAULT_CAPACITY 8
+
+/**
+ * Pool of ready-to-run Emulator instances
+ *
+ * acquire() hands out an instance in the state of a new one; release()
+ * gives it back. Returned instances are reset on the pool's own thread
+ * (CPU reset, used pages cleared, RAM and stack mapped again), so
+ * neither call pays for clearing memory. Instances beyond the capacity,
+ * and ones that fail to reset, are destroyed on that thread too.
+ */
+class EmulatorPool {
+private:
+	uint32_t memory_size;
+	mem_backend_t backend;
+	size_t capacity;
+	std::mutex lock;
+	std::condition_variable wake;	/* Worker: returned instances or stop */
+	std::condition_variable idle;	/* drain(): nothing left to reset */
+	std::vector<std::unique_ptr<Emulator>> ready;
+	std::deque<std::unique_ptr<Emulator>> returned;	/* Waiting for reset */
+	size_t warm;	/* Instances the worker still creates up front */
+	bool busy;	/* Worker is resetting or creating an instance */
+	bool stopping;
+	uint64_t created;
+	uint64_t reused;
+	std::thread worker;
+
+	/**
+	 * Thread body: create warm instances, then reset returned ones until stopped
+	 */
+	void run_worker();
+
+public:
+	/**
+	 * Start the pool and its reset thread
+	 *
+	 * memory_size: Guest RAM size of every instance
+	 * backend: Memory backend of every instance
+	 * capacity: Most ready instances kept
+	 * warm: Instances created in the background right away (up to capacity)
+	 */
+	EmulatorPool(uint32_t memory_size = MEMORY_SIZE, mem_backend_t backend = MEM_BACKEND_PAGED,
+		size_t capacity = POOL_DEFAULT_CAPACITY, size_t warm = 0);
+
+	/**
+	 * Stop the reset thread and destroy every pooled instance
+	 */
+	~EmulatorPool();
+
+	EmulatorPool(const EmulatorPool&) = delete;
+	EmulatorPool& operator=(const EmulatorPool&) = delete;
+
+	/**
+	 * Take an instance (a ready one, or a new one if none is ready)
+	 *
+	 * Output: Emulator in its just-constructed state
+	 */
+	std::unique_ptr<Emulator> acquire();
+
+	/**
+	 * Give an instance back; it is reset in the background
+	 *
+	 * emulator: Instance from acquire() (or any Emulator with the pool's
+	 *           memory size and backend); nullptr is ignored
+	 */
+	void release(std::unique_ptr<Emulator> emulator);
+
+	/**
+	 * Wait until every released instance has been reset
+	 */
+	void drain();
+
+	/**
+	 * Get number of instances ready for acquire()
+	 *
+	 * Output: Ready count
+	 */
+	size_t get_ready_count();
+
+	/**
+	 * Get number of instances the pool constructed
+	 *
+	 * Output: Created count
+	 */
+	uint64_t get_created();
+
+	/**
+	 * Get number of acquire() calls served from the ready instances
+	 *
+	 * Output: Reused count
+	 */
+	uint64_t get_reused();
+};
+
+#endif
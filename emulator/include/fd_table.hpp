@@ -0,0 +1,188 @@
+/* fd_table.hpp */
+#ifndef FD_TABLE_HPP
+#define FD_TABLE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+/* Guest descriptors 0-2 are the host's stdin/stdout/stderr */
+#define FD_FIRST_FILE 3
+
+/* Buffered stdout/stderr bytes that force a flush */
+#define FD_OUTPUT_BUFFER 4096
+
+/**
+ * Open guest file
+ */
+struct GuestFile {
+	int host_fd;	/* -1 if the guest descriptor is free */
+	int flags;	/* openat flags */
+	std::string path;	/* Empty for the standard streams */
+};
+
+/**
+ * Guest file descriptor table
+ *
+ * Maps guest descriptors to host descriptors and remembers how each file
+ * was opened, so machine state can be saved and the files reopened.
+ *
+ * Writes to the standard output streams are coalesced into one buffer
+ * and reach the host on newline, when FD_OUTPUT_BUFFER bytes are
+ * pending, before stdin is read, when the other stream is written (so
+ * 2>&1 keeps its order) and on flush()/exit.
+ */
+class FdTable {
+private:
+	std::vector<GuestFile> files;	/* Indexed by guest descriptor */
+	bool buffering;
+	std::vector<uint8_t> output;	/* Pending bytes for output_fd */
+	int output_fd;	/* Guest stream (1 or 2) owning output, or -1 */
+	uint64_t guest_writes;	/* write() calls by the guest */
+	uint64_t host_writes;	/* write(2) calls issued to the host */
+
+	/**
+	 * Write a whole buffer to a host descriptor
+	 *
+	 * host: Host descriptor
+	 * data: Bytes to write
+	 * count: Number of bytes
+	 *
+	 * Output: count on success, -1 on failure
+	 */
+	ssize_t host_write(int host, const void *data, size_t count);
+
+	/**
+	 * Check whether a guest descriptor is a buffered standard stream
+	 *
+	 * guest_fd: Guest descriptor
+	 *
+	 * Output: true for stdout/stderr while buffering is on
+	 */
+	bool is_buffered(int guest_fd) const {
+		return buffering && (guest_fd == 1 || guest_fd == 2) &&
+			files[guest_fd].host_fd >= 0 && files[guest_fd].path.empty();
+	}
+
+public:
+	/**
+	 * Initialize table with the standard streams
+	 */
+	FdTable();
+
+	/**
+	 * Flush buffered output and close all files opened by the guest (the
+	 * standard streams stay open)
+	 */
+	~FdTable();
+
+	FdTable(const FdTable&) = delete;
+	FdTable& operator=(const FdTable&) = delete;
+
+	/**
+	 * Open host file for the guest
+	 *
+	 * path: Host path
+	 * flags: openat flags
+	 * mode: Creation mode
+	 *
+	 * Output: Lowest free guest descriptor, or -1 on failure
+	 */
+	int open(const char *path, int flags, mode_t mode);
+
+	/**
+	 * Reopen a file at a saved position (state restore)
+	 *
+	 * guest_fd: Guest descriptor to occupy
+	 * path: Host path
+	 * flags: Original openat flags (creation/truncation are dropped)
+	 * offset: File position to seek to
+	 *
+	 * Output: 0 on success, -1 on failure
+	 */
+	int reopen(int guest_fd, const char *path, int flags, int64_t offset);
+
+	/**
+	 * Close guest descriptor
+	 *
+	 * guest_fd: Guest descriptor
+	 *
+	 * Output: Host close() result, or -1 if not open
+	 */
+	int close(int guest_fd);
+
+	/**
+	 * Write to a guest descriptor (buffered for stdout/stderr)
+	 *
+	 * guest_fd: Guest descriptor
+	 * data: Bytes to write
+	 * count: Number of bytes
+	 *
+	 * Output: Bytes accepted, or -1 on failure
+	 */
+	ssize_t write(int guest_fd, const void *data, size_t count);
+
+	/**
+	 * Write any buffered stdout/stderr bytes to the host
+	 */
+	void flush();
+
+	/**
+	 * Flush, close every file opened by the guest and return to the
+	 * state after construction (standard streams, buffering on, zero
+	 * write counts)
+	 */
+	void reset();
+
+	/**
+	 * Enable or disable output buffering (disabling flushes)
+	 *
+	 * enable: true to coalesce stdout/stderr writes
+	 */
+	void set_buffered(bool enable);
+
+	/**
+	 * Get number of guest write() calls
+	 *
+	 * Output: Write syscalls made by the guest
+	 */
+	uint64_t get_guest_writes() const { return guest_writes; }
+
+	/**
+	 * Get number of host write(2) calls
+	 *
+	 * Output: Write syscalls issued on the guest's behalf
+	 */
+	uint64_t get_host_writes() const { return host_writes; }
+
+	/**
+	 * Translate guest descriptor
+	 *
+	 * guest_fd: Guest descriptor
+	 *
+	 * Output: Host descriptor, or -1 if not open
+	 */
+	int host_fd(int guest_fd) const {
+		if (guest_fd < 0 || (size_t)guest_fd >= files.size()) return -1;
+		return files[guest_fd].host_fd;
+	}
+
+	/**
+	 * Get number of descriptor slots (open or free)
+	 *
+	 * Output: One past the highest guest descriptor ever used
+	 */
+	size_t size() const { return files.size(); }
+
+	/**
+	 * Get file behind a guest descriptor
+	 *
+	 * guest_fd: Guest descriptor (below size())
+	 *
+	 * Output: File entry (host_fd is -1 if free)
+	 */
+	const GuestFile& get(int guest_fd) const { return files[guest_fd]; }
+};
+
+#endif
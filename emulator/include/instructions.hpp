@@ -23,6 +23,81 @@ enum instr_format_t {
 	INSTR_J_TYPE
 };
 
+/*
+ * Resolved instruction operations
+ *
+ * One value per concrete RV32IMA instruction, resolved once at decode
+ * time so that execution engines can dispatch without re-examining
+ * opcode/funct3/funct7. OP_ILLEGAL marks encodings that decode but have
+ * no handler; engines execute them through CPU::execute, which reports
+ * the appropriate error. OP_CSR stands for every Zicsr instruction
+ * (CPU::execute decides which CSR accesses are legal).
+ */
+enum instr_op_t {
+	OP_ILLEGAL,
+	OP_LUI,
+	OP_AUIPC,
+	OP_JAL,
+	OP_JALR,
+	OP_BEQ,
+	OP_BNE,
+	OP_BLT,
+	OP_BGE,
+	OP_BLTU,
+	OP_BGEU,
+	OP_LB,
+	OP_LH,
+	OP_LW,
+	OP_LBU,
+	OP_LHU,
+	OP_SB,
+	OP_SH,
+	OP_SW,
+	OP_ADDI,
+	OP_SLTI,
+	OP_SLTIU,
+	OP_XORI,
+	OP_ORI,
+	OP_ANDI,
+	OP_SLLI,
+	OP_SRLI,
+	OP_SRAI,
+	OP_ADD,
+	OP_SUB,
+	OP_SLL,
+	OP_SLT,
+	OP_SLTU,
+	OP_XOR,
+	OP_SRL,
+	OP_SRA,
+	OP_OR,
+	OP_AND,
+	OP_MUL,
+	OP_MULH,
+	OP_MULHSU,
+	OP_MULHU,
+	OP_DIV,
+	OP_DIVU,
+	OP_REM,
+	OP_REMU,
+	OP_ECALL,
+	OP_EBREAK,
+	OP_LR_W,
+	OP_SC_W,
+	OP_AMOSWAP_W,
+	OP_AMOADD_W,
+	OP_AMOXOR_W,
+	OP_AMOAND_W,
+	OP_AMOOR_W,
+	OP_AMOMIN_W,
+	OP_AMOMAX_W,
+	OP_AMOMINU_W,
+	OP_AMOMAXU_W,
+	OP_FENCE,
+	OP_CSR,
+	OP_COUNT
+};
+
 /**
  * Decoded instruction class
  *
@@ -31,6 +106,7 @@ enum instr_format_t {
 class Instruction {
 private:
 	instr_format_t format;
+	instr_op_t op;
 	uint32_t raw;
 	int32_t imm;
 	uint8_t opcode;
@@ -50,16 +126,17 @@ public:
 	 */
 	bool decode(uint32_t instruction);
 
-	/* Getters */
-	instr_format_t get_format() const;
-	uint32_t get_raw() const;
-	int32_t get_imm() const;
-	uint8_t get_opcode() const;
-	uint8_t get_rd() const;
-	uint8_t get_rs1() const;
-	uint8_t get_rs2() const;
-	uint8_t get_funct3() const;
-	uint8_t get_funct7() const;
+	/* Getters (inline: read on every executed instruction) */
+	instr_format_t get_format() const { return format; }
+	instr_op_t get_op() const { return op; }
+	uint32_t get_raw() const { return raw; }
+	int32_t get_imm() const { return imm; }
+	uint8_t get_opcode() const { return opcode; }
+	uint8_t get_rd() const { return rd; }
+	uint8_t get_rs1() const { return rs1; }
+	uint8_t get_rs2() const { return rs2; }
+	uint8_t get_funct3() const { return funct3; }
+	uint8_t get_funct7() const { return funct7; }
 };
 
 /**
@@ -0,0 +1,96 @@
+/* jit.hpp */
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "block_cache.hpp"
+
+/* Executions after which a block is compiled to native code */
+#define JIT_HOT_THRESHOLD 32
+
+/* Size of the executable code buffer (compilation stops when full) */
+#define JIT_BUFFER_SIZE (8 * 1024 * 1024)
+
+/**
+ * x86-64 JIT compiler for translated basic blocks
+ *
+ * Emits one native function per block. Guest registers stay in CPU::x
+ * (addressed through rbx) and every exit stores the next pc and returns
+ * a BLOCK_RESULT, so native blocks hand control back to the block
+ * engine exactly like interpreted ones. Loads, stores and division go
+ * through small C++ helpers that keep Memory's checks and code
+ * invalidation. On other hosts compile() always returns nullptr.
+ */
+class JitCompiler {
+private:
+	uint8_t *buffer;
+	size_t capacity;
+	size_t used;
+	std::vector<uint8_t> code;
+	size_t compiled_blocks;
+
+	/* Emission helpers */
+	void emit8(uint8_t byte);
+	void emit32(uint32_t value);
+	void emit64(uint64_t value);
+	void emit_load_reg(uint8_t host_reg, uint8_t guest_reg);
+	void emit_store_eax(uint8_t guest_reg);
+	void emit_call(const void *target);
+	void emit_exit(int32_t pc_offset, uint32_t next_pc, uint32_t result);
+	void emit_epilogue();
+
+	/**
+	 * Copy emitted code into the executable buffer
+	 *
+	 * Output: Entry point, or nullptr if the buffer is full
+	 */
+	native_block_t install();
+
+public:
+	/**
+	 * Initialize compiler (executable buffer is mapped on first compile)
+	 */
+	JitCompiler();
+
+	/**
+	 * Unmap the executable buffer
+	 */
+	~JitCompiler();
+
+	JitCompiler(const JitCompiler&) = delete;
+	JitCompiler& operator=(const JitCompiler&) = delete;
+
+	/**
+	 * Compile a translated block to native code
+	 *
+	 * block: Block to compile
+	 * pc_offset: Byte offset of CPU::pc relative to CPU::x
+	 *
+	 * Output: Native entry point, or nullptr if compilation is not possible
+	 */
+	native_block_t compile(const Block *block, int32_t pc_offset);
+
+	/**
+	 * Forget all compiled code (no block may still point into it); the
+	 * buffer stays mapped and is refilled from the start
+	 */
+	void reset();
+
+	/**
+	 * Get number of blocks compiled so far
+	 *
+	 * Output: Compiled block count
+	 */
+	size_t get_compiled_count() const { return compiled_blocks; }
+
+	/**
+	 * Get bytes of native code emitted so far
+	 *
+	 * Output: Code size in bytes
+	 */
+	size_t get_code_size() const { return used; }
+};
+
+#endif
@@ -0,0 +1,264 @@
+/* lockstep.hpp */
+#ifndef LOCKSTEP_HPP
+#define LOCKSTEP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "cpu.hpp"
+#include "emulator.hpp"
+#include "instructions.hpp"
+
+/* Most lanes one group runs (one bit each in a 64-bit mask) */
+#define LOCKSTEP_MAX_LANES 64
+
+/* Lanes per host vector (16 bytes: SSE2/NEON width, no extra compiler flags) */
+#define LOCKSTEP_VECTOR_LANES 4
+#define LOCKSTEP_VECTORS (LOCKSTEP_MAX_LANES / LOCKSTEP_VECTOR_LANES)
+
+/* Lockstep steps between divergence checks */
+#define LOCKSTEP_WINDOW 1024
+
+/* Lane slots (percent) a window must use; below it only the largest group stays */
+#define LOCKSTEP_MIN_UTILIZATION 50
+
+/* One register of LOCKSTEP_VECTOR_LANES lanes (GCC/Clang vector extension) */
+typedef uint32_t lane_vec_t __attribute__((vector_size(LOCKSTEP_VECTOR_LANES * 4)));
+
+/**
+ * Runs up to LOCKSTEP_MAX_LANES copies of one program in lockstep
+ *
+ * Every lane is an Emulator holding the same program at the same
+ * addresses (typically mapped from one ProgramImage) with its own
+ * memory, syscall table and inputs. Registers live in one
+ * structure-of-arrays file, x[reg][lane], so a decoded ALU or M
+ * instruction is executed once for all lanes at its PC with host
+ * vector operations; loads and stores go to each lane's memory.
+ *
+ * Lanes at the same PC form a group; the group with the lowest PC runs
+ * next and groups that reach the same PC merge again, so the lanes of
+ * an if/else or of loops with different trip counts wait for each
+ * other at the join. System calls, ebreak, CSR and A-extension
+ * instructions and faulting accesses run on the lane's own CPU (switch
+ * engine, one instruction). When fewer than LOCKSTEP_MIN_UTILIZATION
+ * percent of the lane slots did work over a window, all but the
+ * largest group are split off; split lanes, lanes that write their
+ * code, lanes whose code differs from the others and lanes with
+ * watchpoints finish on their Emulator's own engine after the
+ * lockstep lanes are done. Results match running each lane alone.
+ */
+class Lockstep {
+private:
+	/* Lanes at one PC that execute together */
+	struct LaneGroup {
+		uint32_t pc;
+		uint64_t lanes;	/* Lane bit mask */
+		uint64_t executed;	/* Instructions run since the lanes were last credited */
+		uint64_t budget;	/* Instructions left before its most advanced lane hits the limit */
+	};
+
+	/* Code page the lanes were compared against */
+	struct CodePage {
+		std::vector<uint8_t> bytes;	/* Contents in the first lane checked (empty: unreadable) */
+		uint64_t checked;	/* Lanes whose page matched */
+	};
+
+	std::vector<Emulator*> lanes;
+	uint32_t vectors;	/* Vectors in use per register */
+	lane_vec_t x[32][LOCKSTEP_VECTORS];	/* x[reg][lane / LOCKSTEP_VECTOR_LANES] */
+	lane_vec_t mask[LOCKSTEP_VECTORS];	/* All ones in the lanes of mask_lanes */
+	uint64_t mask_lanes;
+	std::vector<LaneGroup> groups;
+	uint64_t active;	/* Lanes in some group */
+	uint64_t split;	/* Lanes left for their own engine */
+	uint64_t limit;	/* Budget per lane of the current run */
+	uint64_t retired[LOCKSTEP_MAX_LANES];	/* Credited instructions of the current run */
+	uint64_t generation[LOCKSTEP_MAX_LANES];	/* Code generation when the lane joined */
+	std::vector<RunResult> results;
+	std::unordered_map<uint32_t, CodePage> code_pages;
+	uint32_t checked_page;	/* Last page found checked for checked_lanes */
+	uint64_t checked_lanes;
+	uint64_t steps;
+	uint64_t lane_steps;
+	uint64_t splits;
+
+	uint32_t get_lane(uint8_t reg, uint32_t lane) const {
+		return x[reg][lane / LOCKSTEP_VECTOR_LANES][lane % LOCKSTEP_VECTOR_LANES];
+	}
+
+	void set_lane(uint8_t reg, uint32_t lane, uint32_t value) {
+		if (reg != 0) {
+			x[reg][lane / LOCKSTEP_VECTOR_LANES][lane % LOCKSTEP_VECTOR_LANES] = value;
+		}
+	}
+
+	/**
+	 * Copy a lane's registers from its CPU
+	 *
+	 * lane: Lane index
+	 */
+	void load_lane(uint32_t lane);
+
+	/**
+	 * Copy a lane's registers to its CPU
+	 *
+	 * lane: Lane index
+	 * pc: Lane's PC
+	 */
+	void store_lane(uint32_t lane, uint32_t pc);
+
+	/**
+	 * Credit a group's executed instructions to its lanes
+	 *
+	 * group: Group to settle (executed becomes 0)
+	 */
+	void credit(LaneGroup *group);
+
+	/**
+	 * Take lanes out of a group (the group is removed once empty)
+	 *
+	 * index: Group index
+	 * leaving: Lanes to take out
+	 */
+	void detach(size_t index, uint64_t leaving);
+
+	/**
+	 * Put a lane into the group at pc, creating it if needed
+	 *
+	 * lane: Lane index (not in any group)
+	 * pc: Lane's PC
+	 */
+	void join(uint32_t lane, uint32_t pc);
+
+	/**
+	 * Leave a lane (registers at pc) to its Emulator's engine
+	 *
+	 * lane: Lane index (not in any group)
+	 * pc: Lane's PC
+	 */
+	void split_lane(uint32_t lane, uint32_t pc);
+
+	/**
+	 * Run one instruction of a lane on its own CPU, then rejoin, split or stop it
+	 *
+	 * lane: Lane index (not in any group)
+	 * pc: Lane's PC
+	 */
+	void step_scalar(uint32_t lane, uint32_t pc);
+
+	/**
+	 * Compare a code page across lanes (once per lane and page)
+	 *
+	 * page: Page index (pc >> CODE_PAGE_SHIFT)
+	 * candidates: Lanes about to run code from it
+	 *
+	 * Output: Lanes whose page differs from the first lane checked
+	 */
+	uint64_t check_code(uint32_t page, uint64_t candidates);
+
+	/**
+	 * Execute a register-to-register operation for the masked lanes
+	 *
+	 * op: OP_LUI (rd = operand) or an R-type ALU/M operation
+	 * rd: Destination register
+	 * rs1: First source register
+	 * rs2: Second source register (ignored if use_imm)
+	 * use_imm: Use imm for every lane as the second operand
+	 * imm: Second operand
+	 */
+	void execute_vectors(instr_op_t op, uint8_t rd, uint8_t rs1, uint8_t rs2, bool use_imm, uint32_t imm);
+
+	/**
+	 * Count one instruction for a group and move it to its next PC
+	 *
+	 * Merges the group into one already waiting there.
+	 *
+	 * index: Group index
+	 * next: PC after the instruction
+	 *
+	 * Output: Lanes that executed it
+	 */
+	uint32_t advance(size_t index, uint32_t next);
+
+	/**
+	 * Count one instruction for some of a group's lanes and regroup them by PC
+	 *
+	 * index: Group index
+	 * stepped: Lanes that executed it (all lanes left in the group)
+	 * leaving: Lanes to split off instead of regrouping
+	 * targets: Next PC per lane (indexed by lane)
+	 *
+	 * Output: Lanes that executed it
+	 */
+	uint32_t scatter(size_t index, uint64_t stepped, uint64_t leaving, const uint32_t *targets);
+
+	/**
+	 * Execute one instruction for the group with the lowest PC
+	 *
+	 * Output: Lanes that executed it (in lockstep or on their CPU)
+	 */
+	uint32_t step_group();
+
+	/**
+	 * Split off every group but the largest when too few lane slots did work
+	 *
+	 * used: Lane instructions executed over the window
+	 * offered: Active lanes summed over the window's steps
+	 */
+	void check_divergence(uint64_t used, uint64_t offered);
+
+public:
+	/**
+	 * Initialize lanes
+	 *
+	 * lanes: Loaded emulators (at most LOCKSTEP_MAX_LANES are used), each
+	 *        with its PC set; they must outlive the Lockstep
+	 */
+	Lockstep(const std::vector<Emulator*> &lanes);
+
+	Lockstep(const Lockstep&) = delete;
+	Lockstep& operator=(const Lockstep&) = delete;
+
+	/**
+	 * Get number of lanes
+	 *
+	 * Output: Lane count
+	 */
+	uint32_t get_lane_count() const { return (uint32_t)lanes.size(); }
+
+	/**
+	 * Run every lane until it exits, faults, stops or uses its budget
+	 *
+	 * Like Emulator::run() per lane; each lane's CPU holds its state
+	 * afterwards, so the lanes can be run again or inspected.
+	 *
+	 * max_instructions: Instruction budget per lane
+	 *
+	 * Output: One result per lane, in lane order
+	 */
+	std::vector<RunResult> run(uint64_t max_instructions);
+
+	/**
+	 * Get number of lockstep steps (one instruction for one group)
+	 *
+	 * Output: Steps since construction
+	 */
+	uint64_t get_steps() const { return steps; }
+
+	/**
+	 * Get number of lane instructions executed in lockstep steps
+	 *
+	 * Output: Lane instructions since construction
+	 */
+	uint64_t get_lane_steps() const { return lane_steps; }
+
+	/**
+	 * Get number of lanes left to their own engine
+	 *
+	 * Output: Split lanes since construction
+	 */
+	uint64_t get_splits() const { return splits; }
+};
+
+#endif
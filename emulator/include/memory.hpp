@@ -2,8 +2,18 @@
 #ifndef MEMORY_HPP
 #define MEMORY_HPP
 
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <cstring>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "decode_cache.hpp"
+#include "block_cache.hpp"
+
+class ProgramImage;
 
 /*
  * Memory operation status codes
@@ -20,38 +30,853 @@ enum memory_status_t {
 	MEM_MISALIGNED_ERROR
 };
 
+/*
+ * Memory backends
+ *
+ * MEM_BACKEND_PAGED: Sparse page table and software TLB (portable)
+ * MEM_BACKEND_RESERVED: Whole 4 GiB guest space reserved in the host,
+ *                       unmapped accesses caught as host faults
+ */
+enum mem_backend_t {
+	MEM_BACKEND_PAGED,
+	MEM_BACKEND_RESERVED
+};
+
+/*
+ * Atomic read-modify-write operations (RV32A AMO*.W)
+ *
+ * AMO_SWAP: Store the operand
+ * AMO_ADD: Add
+ * AMO_XOR: Bitwise exclusive or
+ * AMO_AND: Bitwise and
+ * AMO_OR: Bitwise or
+ * AMO_MIN: Signed minimum
+ * AMO_MAX: Signed maximum
+ * AMO_MINU: Unsigned minimum
+ * AMO_MAXU: Unsigned maximum
+ */
+enum amo_op_t {
+	AMO_SWAP,
+	AMO_ADD,
+	AMO_XOR,
+	AMO_AND,
+	AMO_OR,
+	AMO_MIN,
+	AMO_MAX,
+	AMO_MINU,
+	AMO_MAXU
+};
+
+/* Fault-guarded host accesses (needed by MEM_BACKEND_RESERVED) */
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+#define MEM_GUARDED_ACCESS 1
+#else
+#define MEM_GUARDED_ACCESS 0
+#endif
+
+/* Guest page size (same granularity as the decode and block caches) */
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE (1u << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK (~(MEM_PAGE_SIZE - 1))
+
+/* Two-level page table: 1024 directory entries x 1024 pages */
+#define MEM_TABLE_SHIFT 10
+#define MEM_TABLE_ENTRIES (1u << MEM_TABLE_SHIFT)
+
+/* Pages per anonymous host chunk backing the paged backend */
+#define MEM_CHUNK_PAGES 16
+
+/* Direct-mapped software TLB entries (power of two) */
+#define MEM_TLB_ENTRIES 64
+
+/* TLB tag that matches no guest page (low bits are never set in a tag) */
+#define MEM_TLB_INVALID 0xFFFFFFFF
+
+static_assert(MEM_PAGE_SHIFT == CODE_PAGE_SHIFT, "code pages must match memory pages");
+
+/*
+ * Page flags
+ *
+ * MEM_PAGE_CODE: Page holds decoded instructions (writes must invalidate)
+ * MEM_PAGE_SHARED: Page data belongs to the snapshot (copy before write)
+ * MEM_PAGE_DIRTY: Page written since the last snapshot or restore
+ * MEM_PAGE_MODIFIED: Page written since the last checkpoint
+ * MEM_PAGE_WATCH_READ: A read watchpoint overlaps the page
+ * MEM_PAGE_WATCH_WRITE: A write watchpoint overlaps the page
+ */
+#define MEM_PAGE_CODE 0x1
+#define MEM_PAGE_SHARED 0x2
+#define MEM_PAGE_DIRTY 0x4
+#define MEM_PAGE_MODIFIED 0x8
+#define MEM_PAGE_WATCH_READ 0x10
+#define MEM_PAGE_WATCH_WRITE 0x20
+
+/*
+ * Watchpoint kinds (bit mask)
+ *
+ * WATCH_READ: Guest loads
+ * WATCH_WRITE: Guest stores
+ * WATCH_ACCESS: Loads and stores
+ */
+enum watch_kind_t {
+	WATCH_READ = 1,
+	WATCH_WRITE = 2,
+	WATCH_ACCESS = 3
+};
+
+/**
+ * Watchpoint hit reported by Memory::take_watch_hit
+ */
+struct WatchHit {
+	int id;	/* Watchpoint that matched */
+	uint32_t addr;	/* Address of the access */
+	uint32_t size;	/* Access size in bytes */
+	watch_kind_t kind;	/* WATCH_READ or WATCH_WRITE */
+};
+
 /**
  * Memory class for byte-addressable memory management
  *
- * Provides aligned and unaligned read/write operations
- * for 8-bit, 16-bit, and 32-bit values
+ * Sparse paged memory over the full 32-bit guest address space. Only
+ * mapped regions are accessible; their 4 KiB pages are allocated on the
+ * first write (reads of untouched pages see a shared zero page) from
+ * anonymous host mappings, which are already zero. A file image can be
+ * mapped copy-on-write in place of copying it in. A small
+ * direct-mapped TLB caches the host page for recently used guest pages.
+ * Pages holding decoded code are never writable through the TLB, so
+ * stores only check for code invalidation on the slow path.
+ *
+ * With MEM_BACKEND_RESERVED the guest space is one host reservation:
+ * mapped regions are readable and writable, everything else (and code
+ * pages, for writes) faults. Loads and stores go straight to the host
+ * address; a SIGSEGV handler turns a fault into a failed access, which
+ * then takes the checked slow path.
+ *
+ * snapshot() records the current contents as a restore point. The first
+ * write to each page afterwards takes the slow path, which keeps the
+ * snapshot contents (paged: the old page is shared and copied on write;
+ * reserved: pages are write-protected and saved before the write).
+ * restore() puts back only the pages dirtied since then (and the mapped
+ * regions and program break, if mmap/munmap/brk changed them). Checkpoints
+ * track their own per-page dirty bit the same way, so writes from every
+ * path (stores, syscalls, block copies) are seen by both.
+ *
+ * Watchpoints tag the pages they cover so those pages never enter the
+ * TLB for the watched direction (the reserved backend's direct path is
+ * off while any exist). Only accesses that miss pay for the range check.
+ *
+ * In concurrent mode (harts on several host threads, see smp.hpp) the
+ * miss paths, map/unmap and atomics run under one lock and the TLB is
+ * not filled, so paged-backend accesses are serialized while the
+ * reserved backend's direct loads and stores stay lock-free. Harts then
+ * decode into their own caches and watch get_code_generation() for
+ * invalidations. Snapshots, checkpoints and watchpoints must not be used
+ * while harts run.
  */
 class Memory {
 private:
-	std::unique_ptr<uint8_t[]> data;
+	/* Page table entry */
+	struct PageEntry {
+		uint8_t *data;	/* nullptr until first write (owned by host_mappings or file_mappings) */
+		uint32_t flags;
+	};
+
+	/*
+	 * TLB entry: host page for one guest page
+	 *
+	 * Tags hold the guest page base address, so masking an address with
+	 * MEM_PAGE_MASK | (size - 1) and comparing against a tag checks the
+	 * mapping and the alignment in a single compare.
+	 */
+	struct TlbEntry {
+		uint32_t read_tag;	/* Guest page address, or MEM_TLB_INVALID */
+		uint32_t write_tag;	/* Set only for allocated non-code pages */
+		uint8_t *host;
+	};
+
 	uint32_t size;
+	uint8_t *reserved;	/* Host base of the 4 GiB reservation, or nullptr */
+	uint8_t *direct;	/* reserved, or nullptr while watchpoints exist */
+	std::array<std::unique_ptr<PageEntry[]>, MEM_TABLE_ENTRIES> directory;
+	std::vector<std::pair<uint32_t, uint64_t>> regions;	/* [base, end) */
+	uint32_t program_break;	/* Guest brk (the heap grows from the end of RAM) */
+	mutable std::array<TlbEntry, MEM_TLB_ENTRIES> tlb;
+	size_t resident_pages;
+	std::vector<std::pair<void*, size_t>> host_mappings;	/* Anonymous chunks, unmapped on destruction */
+	std::vector<std::pair<void*, size_t>> file_mappings;	/* map_file() images (paged backend) */
+	uint8_t *chunk_next;	/* Next unused page of the current chunk */
+	size_t chunk_free;	/* Pages left in the current chunk */
+	std::vector<uint8_t*> free_pages;	/* Recycled private pages */
+	std::vector<uint8_t*> zero_pages;	/* Recycled private pages already cleared by reset() */
+	bool snapshot_active;
+	std::unordered_map<uint32_t, uint8_t*> saved;	/* Snapshot data of pages written since snapshot() */
+	std::vector<std::pair<uint32_t, uint64_t>> saved_regions;	/* Regions at snapshot() */
+	uint32_t saved_break;	/* program_break at snapshot() */
+	std::vector<uint32_t> dirty;	/* Pages with MEM_PAGE_DIRTY */
+	bool checkpoint_active;
+	std::vector<uint32_t> modified;	/* Pages with MEM_PAGE_MODIFIED */
+
+	/* Watched range [addr, addr + length) */
+	struct Watchpoint {
+		int id;
+		uint32_t addr;
+		uint64_t length;
+		watch_kind_t kind;
+	};
+
+	std::vector<Watchpoint> watchpoints;
+	int next_watch_id;
+	mutable bool watch_pending;	/* watch_hit not yet taken */
+	mutable WatchHit watch_hit;
+	mutable bool watch_skip;	/* Let watch_hit's access through once (resume) */
+	DecodeCache decode_cache;
+	BlockCache block_cache;
+	std::vector<std::shared_ptr<const ProgramImage>> images;	/* Keep borrowed decoded pages alive */
+	mutable std::recursive_mutex shared_lock;	/* Taken by slow paths in concurrent mode */
+	bool concurrent;
+	std::atomic<uint64_t> code_generation;	/* Bumped whenever decoded code is dropped */
+
+	/**
+	 * Lock the slow paths if harts run concurrently
+	 *
+	 * Output: Held lock in concurrent mode, otherwise an unlocked one
+	 */
+	std::unique_lock<std::recursive_mutex> lock_shared() const {
+		std::unique_lock<std::recursive_mutex> lock(shared_lock, std::defer_lock);
+		if (concurrent) {
+			lock.lock();
+		}
+		return lock;
+	}
+
+	/**
+	 * Forget decoded code and blocks of a code page
+	 *
+	 * page: Guest page number
+	 * entry: Page table entry for page (MEM_PAGE_CODE is cleared)
+	 */
+	void drop_code(uint32_t page, PageEntry *entry);
+
+	/**
+	 * Find page table entry
+	 *
+	 * page: Guest page number
+	 *
+	 * Output: Entry, or nullptr if its second-level table does not exist
+	 */
+	PageEntry* find_entry(uint32_t page) const;
+
+	/**
+	 * Find page table entry, allocating its second-level table if needed
+	 *
+	 * page: Guest page number
+	 *
+	 * Output: Entry
+	 */
+	PageEntry* create_entry(uint32_t page);
+
+	/**
+	 * Take a page from the free list or the current anonymous chunk
+	 *
+	 * zeroed: Clear recycled pages (chunk pages and zero_pages are always zero)
+	 *
+	 * Output: Host page, or nullptr if the host is out of memory
+	 */
+	uint8_t* alloc_page(bool zeroed);
+
+	/**
+	 * Preserve a page's snapshot contents before its first write
+	 *
+	 * page: Guest page number
+	 * entry: Page table entry for page
+	 *
+	 * Output: true on success, false if the host is out of memory
+	 */
+	bool save_page(uint32_t page, PageEntry *entry);
+
+	/**
+	 * Invalidate every TLB entry
+	 */
+	void flush_tlb();
+
+	/**
+	 * Recompute watch flags (and reserved-page protection) for a range
+	 *
+	 * addr: Start address
+	 * length: Length in bytes
+	 */
+	void retag_watched(uint32_t addr, uint64_t length);
+
+	/**
+	 * Check a slow-path load or store against the watchpoints
+	 *
+	 * addr: Access address
+	 * size: Access size in bytes
+	 * kind: WATCH_READ or WATCH_WRITE
+	 *
+	 * Output: true if the access hit a watchpoint and must not happen
+	 */
+	bool check_watch(uint32_t addr, uint32_t size, watch_kind_t kind) const;
+
+	/**
+	 * Check whether stores may bypass the slow path
+	 *
+	 * A page is writable through the TLB (and, on the reserved backend,
+	 * mapped writable) only once every active dirty bit is set.
+	 *
+	 * flags: Page flags (0 for pages without an entry)
+	 *
+	 * Output: true if the first-write bookkeeping is already done
+	 */
+	bool fast_writable(uint32_t flags) const {
+		if (flags & (MEM_PAGE_CODE | MEM_PAGE_SHARED | MEM_PAGE_WATCH_WRITE)) return false;
+		if (snapshot_active && !(flags & MEM_PAGE_DIRTY)) return false;
+		if (checkpoint_active && !(flags & MEM_PAGE_MODIFIED)) return false;
+		return true;
+	}
+
+	/**
+	 * Drop TLB entries, decoded code and blocks for a range of pages
+	 *
+	 * addr: Start address (page-aligned)
+	 * length: Length in bytes
+	 */
+	void flush_range(uint32_t addr, uint64_t length);
+
+	/**
+	 * TLB miss path for reads
+	 *
+	 * addr: Guest address
+	 *
+	 * Output: Host page, or nullptr if addr is not mapped
+	 */
+	const uint8_t* read_page(uint32_t addr) const;
+
+	/**
+	 * TLB miss path for writes (allocates the page, invalidates code)
+	 *
+	 * addr: Guest address
+	 *
+	 * Output: Host page, or nullptr if addr is not mapped
+	 */
+	uint8_t* write_page(uint32_t addr);
+
+	/**
+	 * Host page for a read (TLB hit or miss path)
+	 *
+	 * addr: Guest address
+	 *
+	 * Output: Host page, or nullptr if addr is not mapped
+	 */
+	const uint8_t* host_read(uint32_t addr) const {
+		const TlbEntry &entry = tlb[(addr >> MEM_PAGE_SHIFT) & (MEM_TLB_ENTRIES - 1)];
+		if (entry.read_tag == (addr & MEM_PAGE_MASK)) {
+			return entry.host;
+		}
+		return read_page(addr);
+	}
+
+	/**
+	 * Host page for a write (TLB hit or miss path)
+	 *
+	 * addr: Guest address
+	 *
+	 * Output: Host page, or nullptr if addr is not mapped
+	 */
+	uint8_t* host_write(uint32_t addr) {
+		const TlbEntry &entry = tlb[(addr >> MEM_PAGE_SHIFT) & (MEM_TLB_ENTRIES - 1)];
+		if (entry.write_tag == (addr & MEM_PAGE_MASK)) {
+			return entry.host;
+		}
+		return write_page(addr);
+	}
+
+	/* Slow-path accessors selected by value type */
+	memory_status_t read_any(uint32_t addr, uint8_t *value) const { return read8(addr, value); }
+	memory_status_t read_any(uint32_t addr, uint16_t *value) const { return read16(addr, value); }
+	memory_status_t read_any(uint32_t addr, uint32_t *value) const { return read32(addr, value); }
+	memory_status_t write_any(uint32_t addr, uint8_t value) { return write8(addr, value); }
+	memory_status_t write_any(uint32_t addr, uint16_t value) { return write16(addr, value); }
+	memory_status_t write_any(uint32_t addr, uint32_t value) { return write32(addr, value); }
+
+	/**
+	 * Convert between guest (little-endian) and host byte order
+	 *
+	 * value: Value to convert
+	 *
+	 * Output: Converted value (unchanged on little-endian hosts)
+	 */
+	template <typename T>
+	static T guest_order(T value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		if (sizeof(T) == 2) return (T)__builtin_bswap16((uint16_t)value);
+		if (sizeof(T) == 4) return (T)__builtin_bswap32((uint32_t)value);
+#endif
+		return value;
+	}
+
+#if MEM_GUARDED_ACCESS
+	/*
+	 * Guarded host accesses for the reserved backend
+	 *
+	 * Each access instruction is listed in the guest_extable section
+	 * together with its fault label; the SIGSEGV handler resumes there.
+	 */
+	template <typename T>
+	static bool guarded_load(const uint8_t *host, T *value) {
+		T raw;
+		asm goto("1: mov (%1), %0\n\t"
+			".pushsection guest_extable, \"a\"\n\t"
+			".balign 4\n\t"
+			".long 1b - ., %l[fault] - .\n\t"
+			".popsection"
+			: "=r"(raw) : "r"(host) : "memory" : fault);
+		*value = raw;
+		return true;
+	fault:
+		return false;
+	}
+
+	template <typename T>
+	static bool guarded_store(uint8_t *host, T value) {
+		asm goto("1: mov %0, (%1)\n\t"
+			".pushsection guest_extable, \"a\"\n\t"
+			".balign 4\n\t"
+			".long 1b - ., %l[fault] - .\n\t"
+			".popsection"
+			: : "r"(value), "r"(host) : "memory" : fault);
+		return true;
+	fault:
+		return false;
+	}
+#endif
 
 public:
 	/**
-	 * Initialize memory with given size
+	 * Load a value through the fast path, falling back to readN()
+	 *
+	 * On a TLB hit this is one compare (mapping and alignment together)
+	 * and one host-width load. Misses, misalignment and unmapped
+	 * addresses go through read8/read16/read32. A load that hits a
+	 * watchpoint fails without reading (see take_watch_hit()).
+	 *
+	 * addr: Guest address
+	 * value: Output for loaded value (uint8_t, uint16_t or uint32_t)
+	 *
+	 * Output: true on success, false if the access faults
+	 */
+	template <typename T>
+	bool load(uint32_t addr, T *value) const {
+#if MEM_GUARDED_ACCESS
+		if (direct) {
+			if ((addr & (sizeof(T) - 1)) == 0 && guarded_load(direct + addr, value)) {
+				return true;
+			}
+			return read_any(addr, value) == MEM_OK;
+		}
+#endif
+		const TlbEntry &entry = tlb[(addr >> MEM_PAGE_SHIFT) & (MEM_TLB_ENTRIES - 1)];
+		if ((addr & (MEM_PAGE_MASK | (sizeof(T) - 1))) == entry.read_tag) {
+			T raw;
+			std::memcpy(&raw, entry.host + (addr & (MEM_PAGE_SIZE - 1)), sizeof(T));
+			*value = guest_order(raw);
+			return true;
+		}
+		if (!watchpoints.empty() && check_watch(addr, sizeof(T), WATCH_READ)) {
+			return false;
+		}
+		return read_any(addr, value) == MEM_OK;
+	}
+
+	/**
+	 * Store a value through the fast path, falling back to writeN()
 	 *
-	 * size: Memory size in bytes
+	 * addr: Guest address
+	 * value: Value to store (uint8_t, uint16_t or uint32_t)
+	 *
+	 * Output: true on success, false if the access faults or hits a
+	 *         watchpoint
+	 */
+	template <typename T>
+	bool store(uint32_t addr, T value) {
+#if MEM_GUARDED_ACCESS
+		if (direct) {
+			if ((addr & (sizeof(T) - 1)) == 0 && guarded_store(direct + addr, value)) {
+				return true;
+			}
+			return write_any(addr, value) == MEM_OK;
+		}
+#endif
+		const TlbEntry &entry = tlb[(addr >> MEM_PAGE_SHIFT) & (MEM_TLB_ENTRIES - 1)];
+		if ((addr & (MEM_PAGE_MASK | (sizeof(T) - 1))) == entry.write_tag) {
+			T raw = guest_order(value);
+			std::memcpy(entry.host + (addr & (MEM_PAGE_SIZE - 1)), &raw, sizeof(T));
+			return true;
+		}
+		if (!watchpoints.empty() && check_watch(addr, sizeof(T), WATCH_WRITE)) {
+			return false;
+		}
+		return write_any(addr, value) == MEM_OK;
+	}
+
+	/**
+	 * Initialize memory with RAM mapped at [0, size)
+	 *
+	 * size: RAM size in bytes (rounded up to whole pages)
+	 * backend: Requested backend (MEM_BACKEND_RESERVED falls back to
+	 *          MEM_BACKEND_PAGED if the host cannot provide it)
+	 */
+	Memory(uint32_t size, mem_backend_t backend = MEM_BACKEND_PAGED);
+
+	~Memory();
+
+	Memory(const Memory&) = delete;
+	Memory& operator=(const Memory&) = delete;
+
+	/**
+	 * Return to the state right after construction
+	 *
+	 * Regions, contents, program break, snapshot, checkpoint tracking,
+	 * watchpoints and decoded code are all dropped, then RAM is mapped
+	 * at 0 again. Private pages are cleared here and kept for reuse, so
+	 * the pages a later run allocates need no clearing; file images are
+	 * unmapped. The reserved backend replaces its whole reservation
+	 * (the host hands out zero pages again on first touch).
+	 *
+	 * Output: 0 on success, -1 if the reservation could not be replaced
+	 *         (the memory must then be discarded)
 	 */
-	Memory(uint32_t size);
+	int reset();
 
 	/**
-	 * Get memory size
+	 * Get RAM size
 	 *
-	 * Output: Memory size in bytes
+	 * Output: Size in bytes of the region mapped at address 0
 	 */
 	uint32_t get_size() const;
 
 	/**
-	 * Get raw data pointer (for syscalls)
+	 * Get backend in use
+	 *
+	 * Output: MEM_BACKEND_RESERVED if the host reservation is active
+	 */
+	mem_backend_t get_backend() const {
+		return reserved ? MEM_BACKEND_RESERVED : MEM_BACKEND_PAGED;
+	}
+
+	/**
+	 * Make an address range accessible (pages are still allocated lazily)
+	 *
+	 * base: Start address (rounded down to a page)
+	 * length: Length in bytes (rounded up to whole pages)
+	 */
+	void map(uint32_t base, uint64_t length);
+
+	/**
+	 * Make an address range inaccessible and drop its contents
+	 *
+	 * Resident pages in the range are released (a later map() of the
+	 * range reads zeros); regions are trimmed or split. Decoded code and
+	 * TLB entries for the range are dropped.
+	 *
+	 * base: Start address (rounded down to a page)
+	 * length: Length in bytes (rounded up to whole pages)
+	 */
+	void unmap(uint32_t base, uint64_t length);
+
+	/**
+	 * Get the guest program break (brk)
+	 *
+	 * Output: Current break; starts at the page-aligned end of RAM
+	 */
+	uint32_t get_program_break() const { return program_break; }
+
+	/**
+	 * Set the guest program break (mapping is up to the caller)
+	 *
+	 * addr: New break
+	 */
+	void set_program_break(uint32_t addr) { program_break = addr; }
+
+	/**
+	 * Get mapped regions
+	 *
+	 * Output: [base, end) pairs in the order they were mapped
+	 */
+	const std::vector<std::pair<uint32_t, uint64_t>>& get_regions() const { return regions; }
+
+	/**
+	 * Check whether an address range is mapped
+	 *
+	 * addr: Start address
+	 * length: Length in bytes
+	 *
+	 * Output: true if every byte of the range is accessible
+	 */
+	bool is_mapped(uint32_t addr, uint64_t length) const;
+
+	/**
+	 * Get number of allocated pages
+	 *
+	 * Output: Resident page count (host-resident pages for the reserved backend)
+	 */
+	size_t get_resident_pages() const;
+
+	/**
+	 * List pages that may hold non-zero data
+	 *
+	 * pages: Output for guest page numbers, in ascending order
+	 */
+	void get_resident_list(std::vector<uint32_t> *pages) const;
+
+	/**
+	 * Map a file copy-on-write into guest memory
+	 *
+	 * Guest writes go to private copies of the touched pages; the file
+	 * is never modified. Bytes past the end of the file read as zero.
+	 *
+	 * addr: Guest start address (page-aligned, range must be mapped)
+	 * fd: Open file descriptor
+	 * length: Number of bytes to map
+	 * offset: File offset (page-aligned)
+	 *
+	 * Output: MEM_OK, or MEM_WRITE_ERROR if the range cannot be mapped
+	 *         (callers fall back to write_block)
+	 */
+	memory_status_t map_file(uint32_t addr, int fd, uint64_t length, uint64_t offset = 0);
+
+	/**
+	 * Map a shared program image copy-on-write and borrow its decode
+	 *
+	 * The image's pages replace the whole guest pages they cover and
+	 * are marked as code, so the first guest write to one copies it and
+	 * falls back to decoding that page locally.
+	 *
+	 * image: Loaded image (kept alive until reset() or destruction)
+	 *
+	 * Output: MEM_OK, or MEM_WRITE_ERROR if the image is not loaded or
+	 *         its range is not mapped
+	 */
+	memory_status_t map_image(const std::shared_ptr<const ProgramImage> &image);
+
+	/**
+	 * Record current contents as the restore point
+	 *
+	 * Cost is proportional to resident pages. Files mapped after the
+	 * snapshot are not tracked.
+	 */
+	void snapshot();
+
+	/**
+	 * Return memory to the last snapshot
+	 *
+	 * Only pages written since snapshot() or the previous restore() are
+	 * touched; decoded code on them is dropped. No-op without a snapshot.
+	 */
+	void restore();
+
+	/**
+	 * Check whether a restore point exists
+	 *
+	 * Output: true after snapshot()
+	 */
+	bool has_snapshot() const { return snapshot_active; }
+
+	/**
+	 * Get number of pages written since the last snapshot or restore
+	 *
+	 * Output: Dirty page count
+	 */
+	size_t get_dirty_count() const { return dirty.size(); }
+
+	/**
+	 * Collect pages written since the previous call (for checkpoints)
+	 *
+	 * The first call returns every page that may hold data and starts
+	 * tracking; later calls return only pages written in between.
+	 *
+	 * pages: Output for guest page numbers, in ascending order
+	 */
+	void take_modified_pages(std::vector<uint32_t> *pages);
+
+	/**
+	 * Stop guest loads and/or stores that touch an address range
+	 *
+	 * A hitting access fails before it happens; retrying it afterwards
+	 * lets it through once. Syscall buffer copies are not watched.
+	 *
+	 * addr: Start address
+	 * length: Length in bytes
+	 * kind: WATCH_READ, WATCH_WRITE or WATCH_ACCESS
+	 *
+	 * Output: Watchpoint id, or -1 if length is 0
+	 */
+	int add_watchpoint(uint32_t addr, uint64_t length, watch_kind_t kind);
+
+	/**
+	 * Remove a watchpoint
+	 *
+	 * id: Id returned by add_watchpoint()
+	 *
+	 * Output: true if the watchpoint existed
+	 */
+	bool remove_watchpoint(int id);
+
+	/**
+	 * Check whether the last failed load/store hit a watchpoint
+	 *
+	 * Output: true if a hit is waiting in take_watch_hit()
+	 */
+	bool has_watch_hit() const { return watch_pending; }
+
+	/**
+	 * Collect the pending watchpoint hit
+	 *
+	 * hit: Output for hit details
+	 *
+	 * Output: true if a hit was pending
+	 */
+	bool take_watch_hit(WatchHit *hit);
+
+	/**
+	 * Copy bytes out of guest memory
+	 *
+	 * addr: Guest start address
+	 * buffer: Host destination
+	 * length: Number of bytes
+	 *
+	 * Output: MEM_OK, or MEM_READ_ERROR if any byte is unmapped
+	 */
+	memory_status_t read_block(uint32_t addr, void *buffer, uint32_t length) const;
+
+	/**
+	 * Copy bytes into guest memory (invalidates decoded code like stores)
+	 *
+	 * addr: Guest start address
+	 * buffer: Host source
+	 * length: Number of bytes
+	 *
+	 * Output: MEM_OK, or MEM_WRITE_ERROR if any byte is unmapped or a page
+	 *         cannot be allocated (bytes before it may have been written)
+	 */
+	memory_status_t write_block(uint32_t addr, const void *buffer, uint32_t length);
+
+	/**
+	 * Get host memory behind a guest range so the host can fill it directly
+	 *
+	 * Each page gets the bookkeeping of a guest store (allocation,
+	 * snapshot copy, dirty tracking, code invalidation) up front, so the
+	 * returned chunks may be written by e.g. a host read(2) instead of
+	 * going through write_block. Chunks stay valid until the range is
+	 * unmapped or memory is restored.
+	 *
+	 * addr: Guest start address
+	 * length: Number of bytes
+	 * chunks: Output (host pointer, length) pairs; host-contiguous pages are merged
+	 *
+	 * Output: MEM_OK, or MEM_WRITE_ERROR if any byte is unmapped
+	 */
+	memory_status_t write_chunks(uint32_t addr, uint32_t length, std::vector<std::pair<uint8_t*, uint32_t>> *chunks);
+
+	/**
+	 * Atomically load an aligned word (lr.w)
+	 *
+	 * addr: Word-aligned guest address
+	 * value: Output for loaded value
+	 *
+	 * Output: MEM_OK, MEM_MISALIGNED_ERROR, or MEM_READ_ERROR if addr is
+	 *         unmapped or hits a watchpoint
+	 */
+	memory_status_t atomic_load(uint32_t addr, uint32_t *value) const;
+
+	/**
+	 * Perform an atomic read-modify-write on an aligned word
+	 *
+	 * Uses a host atomic instruction on the guest word, so it is atomic
+	 * against plain stores made by other harts' fast paths.
+	 *
+	 * addr: Word-aligned guest address
+	 * op: Operation
+	 * operand: Second operand (rs2)
+	 * old: Output for the previous value
+	 *
+	 * Output: MEM_OK, MEM_MISALIGNED_ERROR, or MEM_WRITE_ERROR if addr is
+	 *         unmapped or hits a watchpoint
+	 */
+	memory_status_t atomic_rmw(uint32_t addr, amo_op_t op, uint32_t operand, uint32_t *old);
+
+	/**
+	 * Atomically replace an aligned word if it holds an expected value
+	 *
+	 * addr: Word-aligned guest address
+	 * expected: Value the word must hold
+	 * desired: Value to store
+	 * old: Output for the value found (equal to expected on success)
+	 *
+	 * Output: MEM_OK (whether or not the word was replaced),
+	 *         MEM_MISALIGNED_ERROR or MEM_WRITE_ERROR
+	 */
+	memory_status_t atomic_cas(uint32_t addr, uint32_t expected, uint32_t desired, uint32_t *old);
+
+	/**
+	 * Enter or leave concurrent mode (harts on several host threads)
+	 *
+	 * enable: true while more than one thread uses this memory
+	 */
+	void set_concurrent(bool enable);
+
+	/**
+	 * Check whether any watchpoint is set
+	 *
+	 * Output: true if add_watchpoint() ranges are active
+	 */
+	bool has_watchpoints() const { return !watchpoints.empty(); }
+
+	/**
+	 * Get code invalidation counter
+	 *
+	 * Output: Value that changes whenever decoded code may be stale
+	 */
+	uint64_t get_code_generation() const { return code_generation.load(std::memory_order_acquire); }
+
+	/**
+	 * Mark the page holding addr as code (later writes invalidate it)
+	 *
+	 * Used by harts that keep their own decode cache; call before
+	 * reading the instruction so a racing store is either seen or
+	 * bumps the code generation.
+	 *
+	 * addr: Instruction address (must be mapped)
+	 */
+	void mark_code(uint32_t addr);
+
+	/**
+	 * Look up predecoded instruction
+	 *
+	 * addr: Instruction address
+	 *
+	 * Output: Cached instruction, or nullptr on miss
+	 */
+	const Instruction* lookup_decoded(uint32_t addr) {
+		return decode_cache.lookup(addr);
+	}
+
+	/**
+	 * Decode instruction and remember it for later fetches
+	 *
+	 * addr: Instruction address (must be mapped and word-aligned)
+	 * raw: Raw instruction word read from addr
+	 *
+	 * Output: Cached instruction, or nullptr if decoding failed
+	 */
+	const Instruction* insert_decoded(uint32_t addr, uint32_t raw);
+
+	/**
+	 * Get translated block cache (invalidated together with decode cache)
 	 *
-	 * Output: Pointer to memory data
+	 * Output: Pointer to block cache
 	 */
-	uint8_t* get_data();
+	BlockCache* get_block_cache() { return &block_cache; }
 
 	/**
 	 * Read 8-bit value from memory
@@ -114,4 +939,4 @@ public:
 	memory_status_t write32(uint32_t addr, uint32_t value);
 };
 
-#endif
\ No newline at end of file
+#endif
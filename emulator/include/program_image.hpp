@@ -0,0 +1,107 @@
+/* program_image.hpp */
+#ifndef PROGRAM_IMAGE_HPP
+#define PROGRAM_IMAGE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "decode_cache.hpp"
+
+/**
+ * Program loaded and decoded once, shared by any number of memories
+ *
+ * The file is placed at its load address within whole guest pages (the
+ * rest of the first and last page is zero) in an anonymous host file.
+ * Memory::map_image() maps that file copy-on-write, so every instance
+ * reads the same host pages until it writes one, and borrows the
+ * decoded pages instead of decoding the program again. The image never
+ * changes after load(); guest writes to code drop the borrowed decode
+ * of that page in the writing instance only.
+ */
+class ProgramImage {
+private:
+	int fd;	/* Host file holding the page-aligned image, or -1 */
+	uint32_t base;	/* Guest address of the first page */
+	uint32_t load_address;
+	uint64_t length;	/* Whole pages */
+	uint64_t file_size;
+	std::vector<std::unique_ptr<DecodedPage>> decoded;	/* One per page */
+
+public:
+	/**
+	 * Initialize an empty image
+	 */
+	ProgramImage();
+
+	/**
+	 * Close the host file (memories keep their mappings)
+	 */
+	~ProgramImage();
+
+	ProgramImage(const ProgramImage&) = delete;
+	ProgramImage& operator=(const ProgramImage&) = delete;
+
+	/**
+	 * Read and decode a program (only once per image)
+	 *
+	 * path: Path to binary file
+	 * load_address: Guest address of the first byte
+	 *
+	 * Output: 0 on success, -1 if the file cannot be read or does not fit
+	 *         the address space
+	 */
+	int load(const char *path, uint32_t load_address);
+
+	/**
+	 * Check whether load() succeeded
+	 *
+	 * Output: true if the image holds a program
+	 */
+	bool is_loaded() const { return fd >= 0; }
+
+	/**
+	 * Get host file holding the image (map it MAP_PRIVATE only)
+	 *
+	 * Output: File descriptor
+	 */
+	int get_fd() const { return fd; }
+
+	/**
+	 * Get guest address of the first image page
+	 *
+	 * Output: Page-aligned address
+	 */
+	uint32_t get_base() const { return base; }
+
+	/**
+	 * Get guest address the program was loaded at
+	 *
+	 * Output: Load address
+	 */
+	uint32_t get_load_address() const { return load_address; }
+
+	/**
+	 * Get mapped length
+	 *
+	 * Output: Length in bytes (whole pages)
+	 */
+	uint64_t get_length() const { return length; }
+
+	/**
+	 * Get size of the program file
+	 *
+	 * Output: Size in bytes
+	 */
+	uint64_t get_file_size() const { return file_size; }
+
+	/**
+	 * Get decoded instructions of one image page
+	 *
+	 * index: Page number within the image (0 for base)
+	 *
+	 * Output: Decoded page (valid bits set where decoding succeeded)
+	 */
+	const DecodedPage* get_decoded(uint32_t index) const { return decoded[index].get(); }
+};
+
+#endif
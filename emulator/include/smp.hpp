@@ -0,0 +1,151 @@
+/* smp.hpp */
+#ifndef SMP_HPP
+#define SMP_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "cpu.hpp"
+#include "fd_table.hpp"
+#include "syscalls.hpp"
+
+/* Most harts one group can run */
+#define SMP_MAX_HARTS 16
+
+/* Stack carved out for each hart below the previous one (hart 0 keeps its own) */
+#define SMP_HART_STACK (64 * 1024)
+
+/* Instructions a hart runs between checks for a group-wide stop */
+#define SMP_QUANTUM 10000
+
+static_assert(SMP_MAX_HARTS * SMP_HART_STACK <= STACK_SIZE, "hart stacks must fit the stack region");
+
+/**
+ * Outcome of Smp::run
+ */
+struct SmpResult {
+	run_stop_t reason;	/* RUN_EXIT once every hart exited or one called exit_group */
+	cpu_status_t status;	/* Status of the hart that stopped the group */
+	uint32_t hart;	/* Hart that stopped the group (fault, ebreak, watchpoint, exit_group) */
+	uint64_t retired;	/* Instructions completed by all harts */
+};
+
+/**
+ * Group of harts sharing one Memory, each run on its own host thread
+ *
+ * Hart 0 is the CPU the program was loaded into; the others start as
+ * copies of its registers with their own stack (sp lowered by
+ * SMP_HART_STACK per hart) and a0 = mhartid, so the guest can branch
+ * on either. Harts decode into their own caches and run the switch or
+ * threaded engine (block and JIT requests use threaded: their caches
+ * live in the shared memory).
+ *
+ * System calls are serialized: every hart's table is wrapped for the
+ * duration of run() so one call runs at a time, against one descriptor
+ * table shared by the group. exit ends only the calling hart;
+ * exit_group, faults and ebreak stop the whole group (other harts
+ * notice within SMP_QUANTUM instructions).
+ */
+class Smp {
+private:
+	/* Wrapped syscall table of one hart */
+	struct HartCalls {
+		Smp *smp;
+		uint32_t hart;
+		std::vector<SyscallEntry> inner;	/* Original entries, indexed by number */
+	};
+
+	Memory *mem;
+	std::vector<CPU*> harts;	/* harts[0] is the boot CPU */
+	std::vector<std::unique_ptr<CPU>> owned;	/* Harts 1..N-1 */
+	std::vector<HartCalls> calls;
+	FdTable files;	/* Descriptor table shared by all harts */
+	std::mutex syscall_lock;
+	std::mutex stop_lock;
+	std::atomic<bool> stopping;	/* Harts leave at their next quantum */
+	bool stopped;	/* A hart recorded why the group stopped */
+	SmpResult stop;	/* Valid when stopped */
+	std::atomic<bool> group_exited;
+	uint32_t exit_status;	/* exit_group status (written before group_exited) */
+
+	static syscall_action_t sys_serialized(SyscallCall *call, void *data);
+
+	/**
+	 * Record why the group stops and tell every hart (first caller wins)
+	 *
+	 * hart: Hart that stopped
+	 * result: Its run result
+	 */
+	void stop_group(uint32_t hart, const RunResult &result);
+
+	/**
+	 * Thread body: run one hart in quanta until it stops or the group does
+	 *
+	 * hart: Hart index
+	 * engine: Execution engine
+	 * max_instructions: Budget for this hart
+	 * retired: Output for instructions completed
+	 */
+	void run_hart(uint32_t hart, cpu_engine_t engine, uint64_t max_instructions, uint64_t *retired);
+
+public:
+	/**
+	 * Create harts 1..count-1 next to a loaded boot hart
+	 *
+	 * mem: Shared memory
+	 * boot: Hart 0 (registers and syscall table are copied to the others)
+	 * count: Number of harts (1 to SMP_MAX_HARTS)
+	 */
+	Smp(Memory *mem, CPU *boot, uint32_t count);
+
+	Smp(const Smp&) = delete;
+	Smp& operator=(const Smp&) = delete;
+
+	/**
+	 * Get number of harts
+	 *
+	 * Output: Hart count
+	 */
+	uint32_t get_hart_count() const { return (uint32_t)harts.size(); }
+
+	/**
+	 * Get a hart
+	 *
+	 * hart: Hart index (below get_hart_count())
+	 *
+	 * Output: CPU of that hart
+	 */
+	CPU* get_hart(uint32_t hart) { return harts[hart]; }
+
+	/**
+	 * Get descriptor table used by every hart's system calls
+	 *
+	 * Output: Pointer to shared descriptor table
+	 */
+	FdTable* get_files() { return &files; }
+
+	/**
+	 * Run every hart on its own thread until the group stops
+	 *
+	 * Memory is in concurrent mode for the duration; watchpoints,
+	 * snapshots and checkpoints must not be used meanwhile. A stopped
+	 * group (other than by exit) can be run again.
+	 *
+	 * engine: Execution engine (ENGINE_BLOCK/ENGINE_JIT run threaded)
+	 * max_instructions: Instruction budget per hart
+	 *
+	 * Output: Stop reason, stopping hart and total retired count
+	 */
+	SmpResult run(cpu_engine_t engine, uint64_t max_instructions);
+
+	/**
+	 * Get the program's exit status
+	 *
+	 * Output: exit_group status, or hart 0's exit status
+	 */
+	uint32_t get_exit_status() const;
+};
+
+#endif
@@ -0,0 +1,274 @@
+/* syscall_backends.hpp */
+#ifndef SYSCALL_BACKENDS_HPP
+#define SYSCALL_BACKENDS_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "syscalls.hpp"
+
+/* Syscall log identification ("RVSL" little-endian) */
+#define SYSCALL_LOG_MAGIC 0x4C535652
+#define SYSCALL_LOG_VERSION 2
+
+/* Syscall trace identification ("RVST" little-endian) */
+#define SYSCALL_TRACE_MAGIC 0x54535652
+#define SYSCALL_TRACE_VERSION 1
+
+/* Default number of records kept by the syscall tracer */
+#define SYSCALL_TRACE_DEFAULT_CAPACITY 65536
+
+/* Virtual clock step per clock_gettime call in the sandbox */
+#define SANDBOX_CLOCK_STEP_NS 1000
+
+/**
+ * Syscall log file header
+ */
+struct SyscallLogHeader {
+	uint32_t magic;
+	uint32_t version;
+};
+
+/**
+ * One logged system call, followed by out_length bytes of guest output
+ */
+struct SyscallRecord {
+	uint32_t number;
+	uint32_t action;	/* syscall_action_t */
+	uint32_t result;
+	uint32_t out_addr;	/* Guest buffer the call filled */
+	uint32_t out_length;
+};
+
+/**
+ * Syscall trace file header, followed by count records (oldest first)
+ */
+struct SyscallTraceHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;	/* sizeof(SyscallTraceRecord) */
+	uint32_t count;	/* Records in the file */
+	uint64_t total;	/* Calls traced (earlier ones were overwritten) */
+};
+
+/**
+ * One traced system call (64 bytes)
+ */
+struct SyscallTraceRecord {
+	uint64_t sequence;	/* Call index since the tracer was installed */
+	uint64_t retired;	/* Instructions retired before the ecall */
+	uint64_t latency_ns;	/* Host time spent in the handler */
+	uint32_t pc;	/* Address of the ecall */
+	uint32_t number;
+	uint32_t args[6];
+	uint32_t result;
+	uint32_t action;	/* syscall_action_t */
+};
+
+/**
+ * In-memory sandbox backend
+ *
+ * Replaces every call that would touch the host: stdin comes from a
+ * string, stdout/stderr are collected, opening files fails with EACCES
+ * and clocks are virtual (start at 0, advance SANDBOX_CLOCK_STEP_NS per
+ * call), so runs are deterministic and need no host I/O. Memory calls
+ * (brk, mmap, munmap) and exit keep their current handlers.
+ */
+class SyscallSandbox {
+private:
+	std::string input;
+	size_t input_offset;
+	std::string output[2];	/* stdout, stderr */
+	uint64_t clock_ns;
+
+	static syscall_action_t sys_read(SyscallCall *call, void *data);
+	static syscall_action_t sys_write(SyscallCall *call, void *data);
+	static syscall_action_t sys_writev(SyscallCall *call, void *data);
+	static syscall_action_t sys_openat(SyscallCall *call, void *data);
+	static syscall_action_t sys_close(SyscallCall *call, void *data);
+	static syscall_action_t sys_fstat(SyscallCall *call, void *data);
+	static syscall_action_t sys_lseek(SyscallCall *call, void *data);
+	static syscall_action_t sys_clock_gettime(SyscallCall *call, void *data);
+
+	/**
+	 * Append guest bytes to a captured stream
+	 *
+	 * call: Current call (fd in args[0], result set to the byte count)
+	 * bytes: Data
+	 */
+	void append(SyscallCall *call, const std::vector<uint8_t> &bytes);
+
+public:
+	/**
+	 * Initialize sandbox
+	 *
+	 * stdin_data: Bytes the guest reads from fd 0
+	 */
+	explicit SyscallSandbox(const std::string &stdin_data = std::string());
+
+	/**
+	 * Install sandbox handlers (the sandbox must outlive the table's use)
+	 *
+	 * table: Table to modify
+	 */
+	void install(SyscallTable *table);
+
+	/**
+	 * Get captured output
+	 *
+	 * fd: 1 for stdout, 2 for stderr
+	 *
+	 * Output: Bytes written by the guest
+	 */
+	const std::string& get_output(int fd) const { return output[fd == 2 ? 1 : 0]; }
+};
+
+/**
+ * Record backend: logs every registered call's result and guest output
+ *
+ * Wraps the handlers present at install() time; the wrapped handlers
+ * still run (and still do host I/O). Memory calls (brk, mmap, munmap)
+ * are left unwrapped: they only depend on guest state.
+ */
+class SyscallRecorder {
+private:
+	FILE *file;
+	std::vector<SyscallEntry> inner;	/* Wrapped entries, indexed by number */
+
+	static syscall_action_t sys_record(SyscallCall *call, void *data);
+
+public:
+	SyscallRecorder();
+	~SyscallRecorder();
+
+	SyscallRecorder(const SyscallRecorder&) = delete;
+	SyscallRecorder& operator=(const SyscallRecorder&) = delete;
+
+	/**
+	 * Create log file
+	 *
+	 * path: Output path
+	 *
+	 * Output: 0 on success, -1 on failure
+	 */
+	int open(const char *path);
+
+	/**
+	 * Wrap every registered handler
+	 *
+	 * table: Table to modify
+	 */
+	void install(SyscallTable *table);
+};
+
+/**
+ * Trace backend: keeps the most recent calls in a fixed-size ring
+ *
+ * Wraps every registered handler (including memory calls) and stores
+ * one fixed-size record per call in a preallocated ring, so tracing
+ * costs two clock reads and a 64-byte store per call; nothing is
+ * formatted or written while the guest runs. write() saves the ring,
+ * decode() turns a saved ring into strace-like text.
+ */
+class SyscallTracer {
+private:
+	std::vector<SyscallTraceRecord> ring;
+	uint64_t total;	/* Calls traced; the next record goes to ring[total % size] */
+	std::vector<SyscallEntry> inner;	/* Wrapped entries, indexed by number */
+
+	static syscall_action_t sys_trace(SyscallCall *call, void *data);
+
+public:
+	/**
+	 * Initialize tracer
+	 *
+	 * capacity: Records kept (older calls are overwritten); at least 1
+	 */
+	explicit SyscallTracer(size_t capacity = SYSCALL_TRACE_DEFAULT_CAPACITY);
+
+	/**
+	 * Wrap every registered handler
+	 *
+	 * table: Table to modify
+	 */
+	void install(SyscallTable *table);
+
+	/**
+	 * Get number of traced calls
+	 *
+	 * Output: Calls since install(), including overwritten ones
+	 */
+	uint64_t get_total() const { return total; }
+
+	/**
+	 * Copy the retained records
+	 *
+	 * records: Output, oldest first
+	 */
+	void get_records(std::vector<SyscallTraceRecord> *records) const;
+
+	/**
+	 * Save the retained records
+	 *
+	 * path: Output path
+	 *
+	 * Output: 0 on success, -1 on failure
+	 */
+	int write(const char *path) const;
+
+	/**
+	 * Print a saved trace as text, one line per call
+	 *
+	 * path: Trace written by write()
+	 * out: Output stream
+	 *
+	 * Output: 0 on success, -1 on a missing or invalid file
+	 */
+	static int decode(const char *path, FILE *out);
+};
+
+/**
+ * Replay backend: answers registered calls from a log without running them
+ *
+ * Results and guest output bytes come from the log, so a replayed run
+ * does no host I/O. Memory calls (brk, mmap, munmap) are not logged and
+ * keep their handlers, so the replayed guest gets the same mappings. A
+ * call that does not match the next record stops the run with an
+ * execution error.
+ */
+class SyscallReplayer {
+private:
+	std::vector<uint8_t> log;
+	size_t offset;	/* Next record in log */
+
+	static syscall_action_t sys_replay(SyscallCall *call, void *data);
+
+public:
+	SyscallReplayer();
+
+	/**
+	 * Load log file
+	 *
+	 * path: Log written by SyscallRecorder
+	 *
+	 * Output: 0 on success, -1 on failure
+	 */
+	int open(const char *path);
+
+	/**
+	 * Replace every registered handler with the replayer
+	 *
+	 * table: Table to modify
+	 */
+	void install(SyscallTable *table);
+
+	/**
+	 * Check whether every logged call has been replayed
+	 *
+	 * Output: true at the end of the log
+	 */
+	bool finished() const { return offset >= log.size(); }
+};
+
+#endif
@@ -0,0 +1,209 @@
+/* syscalls.hpp */
+#ifndef SYSCALLS_HPP
+#define SYSCALLS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <vector>
+
+/* Forward declarations */
+class CPU;
+class Memory;
+class FdTable;
+
+/* Linux-compatible RISC-V system call numbers (RV32) */
+#define SYS_exit 93
+#define SYS_exit_group 94
+#define SYS_read 63
+#define SYS_write 64
+#define SYS_writev 66
+#define SYS_openat 56
+#define SYS_close 57
+#define SYS_brk 214
+#define SYS_fstat 80
+#define SYS_lseek 62
+#define SYS_mmap 222
+#define SYS_munmap 215
+#define SYS_clock_gettime 113
+#define SYS_clock_gettime64 403
+
+/* Highest system call number the table can hold, plus one */
+#define SYSCALL_TABLE_SIZE 512
+
+/* Guest address range handed out by anonymous mmap */
+#define MMAP_BASE 0x40000000
+#define MMAP_END 0x7F000000
+
+/* Highest program break (the heap grows from the end of RAM up to the mmap area) */
+#define BRK_END MMAP_BASE
+
+/*
+ * What the CPU does after a system call handler returns
+ *
+ * SYSCALL_CONTINUE: Write the result to a0 and continue
+ * SYSCALL_EXIT: Stop the program (a0 keeps the exit status)
+ * SYSCALL_FAULT: Stop with an execution error (e.g. replay diverged)
+ */
+enum syscall_action_t {
+	SYSCALL_CONTINUE,
+	SYSCALL_EXIT,
+	SYSCALL_FAULT
+};
+
+/**
+ * One system call as seen by a handler
+ */
+struct SyscallCall {
+	CPU *cpu;
+	Memory *mem;
+	FdTable *files;
+	uint32_t number;	/* a7 */
+	uint32_t args[6];	/* a0-a5 */
+	uint32_t result;	/* Value written to a0 (negative errno on failure) */
+};
+
+/**
+ * System call handler
+ *
+ * call: Arguments in, result out
+ * data: Pointer registered with the handler
+ *
+ * Output: Action for the CPU
+ */
+typedef syscall_action_t (*syscall_handler_t)(SyscallCall *call, void *data);
+
+/**
+ * Registered system call
+ *
+ * out_arg/out_size describe the guest buffer the handler fills, so
+ * record/replay can capture it: args[out_arg] receives out_size bytes,
+ * or result bytes when out_size is 0 (read). out_arg is -1 if the call
+ * writes no guest memory.
+ */
+struct SyscallEntry {
+	const char *name;	/* nullptr if the number is not registered */
+	syscall_handler_t handler;
+	void *data;
+	int out_arg;
+	uint32_t out_size;
+};
+
+/**
+ * System call registry (number -> handler)
+ *
+ * Every CPU starts with the host backend installed. Embedders replace
+ * or add entries with set(); backends (sandbox, record/replay) are sets
+ * of entries installed over the current ones.
+ */
+class SyscallTable {
+private:
+	std::array<SyscallEntry, SYSCALL_TABLE_SIZE> entries;
+
+public:
+	/**
+	 * Initialize an empty table (every call returns -ENOSYS)
+	 */
+	SyscallTable();
+
+	/**
+	 * Register or replace a handler
+	 *
+	 * number: System call number (below SYSCALL_TABLE_SIZE)
+	 * name: Name for diagnostics
+	 * handler: Handler function
+	 * data: Passed to the handler
+	 * out_arg: Index of the guest output buffer argument, or -1
+	 * out_size: Output size in bytes (0: the result is the size)
+	 *
+	 * Output: true on success, false if number is out of range
+	 */
+	bool set(uint32_t number, const char *name, syscall_handler_t handler, void *data = nullptr,
+		int out_arg = -1, uint32_t out_size = 0);
+
+	/**
+	 * Register an existing entry under a number (used by wrapping backends)
+	 *
+	 * number: System call number
+	 * entry: Entry to store
+	 */
+	void set_entry(uint32_t number, const SyscallEntry &entry);
+
+	/**
+	 * Remove a handler (the call then returns -ENOSYS)
+	 *
+	 * number: System call number
+	 */
+	void remove(uint32_t number);
+
+	/**
+	 * Look up a handler
+	 *
+	 * number: System call number
+	 *
+	 * Output: Entry, or nullptr if none is registered
+	 */
+	const SyscallEntry* get(uint32_t number) const {
+		if (number >= SYSCALL_TABLE_SIZE || !entries[number].handler) return nullptr;
+		return &entries[number];
+	}
+
+	/**
+	 * Run the handler for call->number
+	 *
+	 * call: Call to dispatch (result set to -ENOSYS if unregistered)
+	 *
+	 * Output: Action for the CPU
+	 */
+	syscall_action_t dispatch(SyscallCall *call) const;
+};
+
+/**
+ * Store a struct timespec in guest memory
+ *
+ * mem: Memory instance
+ * addr: Guest address
+ * seconds: tv_sec
+ * nanoseconds: tv_nsec
+ * wide: 64-bit fields (clock_gettime64) instead of 32-bit
+ *
+ * Output: true on success, false if addr is not mapped
+ */
+bool write_timespec(Memory *mem, uint32_t addr, uint64_t seconds, uint32_t nanoseconds, bool wide);
+
+/**
+ * Copy a NUL-terminated string out of guest memory
+ *
+ * mem: Memory instance
+ * addr: Guest address
+ * buffer: Output (always terminated, truncated to size - 1 bytes)
+ * size: Buffer size
+ */
+void read_guest_string(Memory *mem, uint32_t addr, char *buffer, size_t size);
+
+/**
+ * Concatenate the buffers of a guest iovec array (writev)
+ *
+ * mem: Memory instance
+ * iov_addr: Guest address of the RV32 struct iovec array
+ * iov_count: Number of entries
+ * buffer: Output for the gathered bytes
+ *
+ * Output: 0 on success, -EINVAL or -EFAULT
+ */
+int gather_iovec(Memory *mem, uint32_t iov_addr, uint32_t iov_count, std::vector<uint8_t> *buffer);
+
+/**
+ * Install the host passthrough backend
+ *
+ * exit, exit_group, read, write, writev, openat, close, fstat, lseek,
+ * brk, mmap (anonymous), munmap, clock_gettime and clock_gettime64;
+ * file calls go to the host through the CPU's FdTable. brk, mmap and
+ * munmap only change the guest address space (pages are committed on
+ * first touch).
+ *
+ * table: Table to fill
+ */
+void syscalls_install_host(SyscallTable *table);
+
+#endif
@@ -0,0 +1,107 @@
+/* trace.hpp */
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <cstdint>
+#include <cstdio>
+#include "cpu.hpp"
+#include "instructions.hpp"
+
+/*
+ * Tracing policies for CPU::step_traced / CPU::run_loop
+ *
+ * Each policy provides the same four hooks. The step and run loops are
+ * templates over the policy, so the NoTrace instantiation compiles the
+ * hooks away and the production path contains no tracing branches.
+ */
+
+/**
+ * Binary trace record (one per executed or faulting instruction)
+ *
+ * Written in host byte order. Fetch/decode errors have raw = 0 and
+ * next_pc equal to the faulting pc.
+ */
+struct TraceRecord {
+	uint32_t pc;
+	uint32_t raw;
+	uint32_t next_pc;
+	uint32_t status;	/* cpu_status_t */
+};
+
+/**
+ * No tracing (production path)
+ */
+struct NoTrace {
+	void fetch(uint32_t) {}
+	void fetch_error(cpu_status_t) {}
+	void decode(const Instruction&, uint32_t) {}
+	void execute(cpu_status_t, uint32_t) {}
+};
+
+/**
+ * Human-readable trace on stdout (--debug)
+ */
+struct TextTrace {
+	/**
+	 * Trace fetch at pc
+	 *
+	 * pc: Address being fetched
+	 */
+	void fetch(uint32_t pc);
+
+	/**
+	 * Trace fetch or decode failure
+	 *
+	 * status: Failure status
+	 */
+	void fetch_error(cpu_status_t status);
+
+	/**
+	 * Trace decoded instruction
+	 *
+	 * instr: Decoded instruction
+	 * pc: PC after fetch (branch/jump targets are printed relative to it)
+	 */
+	void decode(const Instruction &instr, uint32_t pc);
+
+	/**
+	 * Trace execution result
+	 *
+	 * status: Execution status
+	 * next_pc: PC after execution
+	 */
+	void execute(cpu_status_t status, uint32_t next_pc);
+};
+
+/**
+ * Compact binary trace (TraceRecord stream)
+ */
+struct BinaryTrace {
+	FILE *out;
+	TraceRecord record;
+
+	explicit BinaryTrace(FILE *file) : out(file), record() {}
+
+	void fetch(uint32_t pc) {
+		record.pc = pc;
+		record.raw = 0;
+	}
+
+	void fetch_error(cpu_status_t status) {
+		record.next_pc = record.pc;
+		record.status = status;
+		std::fwrite(&record, sizeof(record), 1, out);
+	}
+
+	void decode(const Instruction &instr, uint32_t) {
+		record.raw = instr.get_raw();
+	}
+
+	void execute(cpu_status_t status, uint32_t next_pc) {
+		record.next_pc = next_pc;
+		record.status = status;
+		std::fwrite(&record, sizeof(record), 1, out);
+	}
+};
+
+#endif
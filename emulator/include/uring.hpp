@@ -0,0 +1,148 @@
+/* uring.hpp */
+#ifndef URING_HPP
+#define URING_HPP
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "syscalls.hpp"
+
+/* io_uring needs Linux headers; build with IO_URING=0 (NO_IO_URING) to leave it out */
+#if defined(__linux__) && defined(__has_include) && !defined(NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#define IO_URING_SUPPORTED 1
+#endif
+#endif
+
+/* Submission queue size (also the most writes batched into one flush) */
+#define URING_ENTRIES 64
+
+/* Smallest guest read() that goes straight into guest memory */
+#define URING_DIRECT_READ 4096
+
+/* Pending output bytes that force a flush */
+#define URING_BATCH_BYTES 65536
+
+/**
+ * io_uring I/O backend
+ *
+ * Replaces read, write and writev for host descriptors. Guest writes
+ * (standard streams and files alike) are copied into one output buffer
+ * and sent as a chain of linked write requests in a single io_uring_enter
+ * call per flush, so their order is kept. A flush happens when
+ * URING_ENTRIES writes or URING_BATCH_BYTES bytes are pending, before
+ * any other system call (reads, close, lseek, exit, ...), on flush() and
+ * on destruction. Reads of at least URING_DIRECT_READ bytes are issued
+ * as one readv over the guest pages themselves, without a bounce buffer;
+ * smaller reads use the handler that was installed before.
+ *
+ * Write errors are only seen at flush time (like the FdTable's
+ * stdout buffering). Requires Linux 5.6 or later; open() fails on older
+ * kernels and in builds without IO_URING_SUPPORTED.
+ */
+class SyscallUring {
+private:
+	/* Queued guest write (bytes live in output) */
+	struct PendingWrite {
+		int host_fd;
+		size_t offset;	/* Start in output */
+		size_t length;
+	};
+
+	/* Mapped submission and completion rings (defined in uring.cpp) */
+	struct Ring;
+
+	std::unique_ptr<Ring> ring;	/* nullptr until open() succeeds */
+	std::vector<SyscallEntry> inner;	/* Replaced or wrapped entries, indexed by number */
+	std::vector<uint8_t> output;	/* Pending write bytes */
+	std::vector<PendingWrite> pending;
+	bool batching;
+	uint64_t guest_writes;	/* write/writev calls queued */
+	uint64_t submissions;	/* io_uring_enter calls that submitted requests */
+	uint64_t direct_reads;	/* Reads done straight into guest memory */
+
+	static syscall_action_t sys_read(SyscallCall *call, void *data);
+	static syscall_action_t sys_write(SyscallCall *call, void *data);
+	static syscall_action_t sys_writev(SyscallCall *call, void *data);
+	static syscall_action_t sys_flush_first(SyscallCall *call, void *data);
+
+	/**
+	 * Queue the bytes appended to output (flushing when the batch is full)
+	 *
+	 * call: Current call (result set to the byte count)
+	 * host_fd: Host descriptor to write to
+	 * start: Offset in output where the call's bytes begin
+	 */
+	void queue(SyscallCall *call, int host_fd, size_t start);
+
+	/**
+	 * Submit requests already placed in the submission queue and wait
+	 *
+	 * count: Requests to submit
+	 * results: Output, indexed by request user_data (count entries)
+	 *
+	 * Output: 0 on success, -1 if io_uring_enter failed
+	 */
+	int submit_and_wait(uint32_t count, std::vector<int32_t> *results);
+
+public:
+	SyscallUring();
+	~SyscallUring();
+
+	SyscallUring(const SyscallUring&) = delete;
+	SyscallUring& operator=(const SyscallUring&) = delete;
+
+	/**
+	 * Set up the ring
+	 *
+	 * Output: 0 on success, -1 if io_uring is unavailable (callers fall
+	 *         back to the host backend)
+	 */
+	int open();
+
+	/**
+	 * Install read/write/writev handlers and make every other registered
+	 * call flush pending writes first (the backend must outlive the
+	 * table's use; open() must have succeeded)
+	 *
+	 * table: Table to modify
+	 */
+	void install(SyscallTable *table);
+
+	/**
+	 * Submit pending writes in one io_uring_enter call and wait for them
+	 *
+	 * Output: 0 on success, -1 if a write failed
+	 */
+	int flush();
+
+	/**
+	 * Enable or disable batching (disabling flushes)
+	 *
+	 * enable: false to submit every write as soon as it is made
+	 */
+	void set_batching(bool enable);
+
+	/**
+	 * Get number of guest write/writev calls handled
+	 *
+	 * Output: Calls queued since open()
+	 */
+	uint64_t get_guest_writes() const { return guest_writes; }
+
+	/**
+	 * Get number of io_uring submissions
+	 *
+	 * Output: io_uring_enter calls that submitted writes or reads
+	 */
+	uint64_t get_submissions() const { return submissions; }
+
+	/**
+	 * Get number of reads done without a bounce buffer
+	 *
+	 * Output: Guest reads of at least URING_DIRECT_READ bytes
+	 */
+	uint64_t get_direct_reads() const { return direct_reads; }
+};
+
+#endif
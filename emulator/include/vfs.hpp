@@ -0,0 +1,189 @@
+/* vfs.hpp */
+#ifndef VFS_HPP
+#define VFS_HPP
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "syscalls.hpp"
+
+/* First guest descriptor handed out by the VFS (0-2 stay with the inner backend) */
+#define VFS_FIRST_FD 3
+
+/* Longest guest path accepted by openat */
+#define VFS_PATH_MAX 256
+
+/* Default size limit of one file the guest writes (larger writes fail with EFBIG) */
+#define VFS_FILE_MAX (64u << 20)
+
+/* Default limit on the bytes of all files the guest created or wrote (ENOSPC beyond) */
+#define VFS_TOTAL_MAX (256u << 20)
+
+/**
+ * In-memory virtual filesystem backend
+ *
+ * Files are loaded from a host directory or tar archive once and kept
+ * in host memory; the guest sees them through openat, read, write,
+ * writev, lseek, fstat and close, so file reads are copies into guest
+ * memory instead of host syscalls. Files created or written by the
+ * guest stay in memory until collected with get_file() or
+ * write_directory(). Descriptors 0-2 are passed to the handlers that
+ * were installed before the VFS.
+ *
+ * File contents are shared (copy-on-write) between VFS instances set up
+ * with share_files(), so many jobs can read the same inputs without
+ * holding one copy each. Guest writes are bounded per file and in total
+ * (set_limits()), so a guest cannot grow host memory without limit.
+ */
+class Vfs {
+private:
+	/* File contents (shared with other instances until written) */
+	struct File {
+		std::shared_ptr<std::vector<uint8_t>> data;
+		bool modified;	/* Created or written by the guest */
+	};
+
+	/* Open guest descriptor */
+	struct Handle {
+		std::string path;	/* Empty if the descriptor is free */
+		int flags;
+		uint64_t offset;
+	};
+
+	std::map<std::string, File> files;	/* Guest path (no leading '/') -> contents */
+	std::vector<Handle> handles;	/* Indexed by guest descriptor - VFS_FIRST_FD */
+	std::vector<SyscallEntry> inner;	/* Handlers for descriptors 0-2 */
+	uint64_t file_max;
+	uint64_t total_max;
+	uint64_t modified_bytes;	/* Size of all files with modified set */
+
+	static syscall_action_t sys_openat(SyscallCall *call, void *data);
+	static syscall_action_t sys_read(SyscallCall *call, void *data);
+	static syscall_action_t sys_write(SyscallCall *call, void *data);
+	static syscall_action_t sys_writev(SyscallCall *call, void *data);
+	static syscall_action_t sys_lseek(SyscallCall *call, void *data);
+	static syscall_action_t sys_fstat(SyscallCall *call, void *data);
+	static syscall_action_t sys_close(SyscallCall *call, void *data);
+
+	/**
+	 * Find an open descriptor
+	 *
+	 * guest_fd: Guest descriptor
+	 *
+	 * Output: Handle, or nullptr if guest_fd is not a VFS descriptor
+	 */
+	Handle* find_handle(uint32_t guest_fd);
+
+	/**
+	 * Pass a call for descriptors 0-2 to the previous handler
+	 *
+	 * call: Current call
+	 *
+	 * Output: Inner handler's action (-EBADF if there is none)
+	 */
+	syscall_action_t forward(SyscallCall *call);
+
+	/**
+	 * Write bytes at a descriptor's offset (copying shared contents first)
+	 *
+	 * handle: Open descriptor
+	 * bytes: Data
+	 * length: Number of bytes
+	 *
+	 * Output: Bytes written (stopping at the file size limit), -EBADF if
+	 *         not opened for writing, -EFBIG if the offset is at the file
+	 *         size limit or -ENOSPC if the total limit would be exceeded
+	 */
+	int32_t write_handle(Handle *handle, const uint8_t *bytes, size_t length);
+
+public:
+	Vfs();
+
+	/**
+	 * Normalize a guest path ("./a//b" and "/a/b" both become "a/b")
+	 *
+	 * path: Guest path
+	 *
+	 * Output: Key used in the file map
+	 */
+	static std::string normalize(const std::string &path);
+
+	/**
+	 * Add or replace a file
+	 *
+	 * path: Guest path
+	 * data: Contents
+	 */
+	void add_file(const std::string &path, const std::vector<uint8_t> &data);
+
+	/**
+	 * Load every regular file below a host directory
+	 *
+	 * host_dir: Host directory (its files appear at the guest root)
+	 *
+	 * Output: Number of files loaded, or -1 if the directory cannot be read
+	 */
+	int add_directory(const char *host_dir);
+
+	/**
+	 * Load every regular file from a tar (ustar) archive
+	 *
+	 * host_path: Host archive path
+	 *
+	 * Output: Number of files loaded, or -1 on a missing or corrupt archive
+	 */
+	int add_archive(const char *host_path);
+
+	/**
+	 * Share another VFS's files (contents are copied on first write)
+	 *
+	 * other: VFS to take files from (its descriptors are not copied)
+	 */
+	void share_files(const Vfs &other);
+
+	/**
+	 * Get file contents
+	 *
+	 * path: Guest path
+	 *
+	 * Output: Contents, or nullptr if the file does not exist
+	 */
+	const std::vector<uint8_t>* get_file(const std::string &path) const;
+
+	/**
+	 * Get all guest paths
+	 *
+	 * Output: Normalized paths in sorted order
+	 */
+	std::vector<std::string> list_files() const;
+
+	/**
+	 * Write files below a host directory (creating subdirectories)
+	 *
+	 * host_dir: Existing host directory
+	 * only_modified: Only files created or written by the guest
+	 *
+	 * Output: Number of files written, or -1 on failure
+	 */
+	int write_directory(const char *host_dir, bool only_modified) const;
+
+	/**
+	 * Limit the files the guest writes
+	 *
+	 * file_limit: Largest size of one file in bytes (default VFS_FILE_MAX)
+	 * total_limit: Largest size of all created or written files in bytes
+	 *              (default VFS_TOTAL_MAX)
+	 */
+	void set_limits(uint64_t file_limit, uint64_t total_limit);
+
+	/**
+	 * Install VFS handlers over the current ones (the VFS must outlive the table's use)
+	 *
+	 * table: Table to modify
+	 */
+	void install(SyscallTable *table);
+};
+
+#endif
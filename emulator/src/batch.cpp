@@ -0,0 +1,437 @@
+/* batch.cpp */
+#include "batch.hpp"
+#include "emulator.hpp"
+#include "syscall_backends.hpp"
+#include "lockstep.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+/* 64-bit FNV-1a parameters */
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+/* Longest job line (including newline) */
+#define BATCH_LINE_MAX 4096
+
+/**
+ * Read a whole host file
+ *
+ * path: Host path
+ * data: Output for contents
+ *
+ * Output: true on success
+ */
+static bool read_host_file(const char *path, std::string *data) {
+	FILE *file = std::fopen(path, "rb");
+	if (!file) {
+		return false;
+	}
+
+	char chunk[65536];
+	size_t count;
+	data->clear();
+	while ((count = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		data->append(chunk, count);
+	}
+	bool ok = !std::ferror(file);
+	std::fclose(file);
+	return ok;
+}
+
+/**
+ * Hash bytes with 64-bit FNV-1a
+ *
+ * data: Bytes to hash
+ *
+ * Output: Hash value
+ */
+static uint64_t fnv1a(const std::string &data) {
+	uint64_t hash = FNV_OFFSET_BASIS;
+	for (unsigned char byte : data) {
+		hash = (hash ^ byte) * FNV_PRIME;
+	}
+	return hash;
+}
+
+static const char* status_name(batch_status_t status) {
+	switch (status) {
+		case BATCH_EXITED: return "exited";
+		case BATCH_FAULT: return "fault";
+		case BATCH_LIMIT: return "limit";
+		case BATCH_LOAD_ERROR: return "load_error";
+	}
+	return "unknown";
+}
+
+/**
+ * Write a CSV field, quoted if it holds a separator, quote or newline
+ *
+ * file: Output stream
+ * text: Field value
+ */
+static void write_csv_field(FILE *file, const std::string &text) {
+	if (text.find_first_of(",\"\n\r") == std::string::npos) {
+		std::fputs(text.c_str(), file);
+		return;
+	}
+	std::fputc('"', file);
+	for (char c : text) {
+		if (c == '"') {
+			std::fputc('"', file);
+		}
+		std::fputc(c, file);
+	}
+	std::fputc('"', file);
+}
+
+/**
+ * Write a JSON string literal
+ *
+ * file: Output stream
+ * text: String value
+ */
+static void write_json_string(FILE *file, const std::string &text) {
+	std::fputc('"', file);
+	for (unsigned char c : text) {
+		if (c == '"' || c == '\\') {
+			std::fprintf(file, "\\%c", c);
+		} else if (c < 0x20) {
+			std::fprintf(file, "\\u%04x", c);
+		} else {
+			std::fputc(c, file);
+		}
+	}
+	std::fputc('"', file);
+}
+
+/**
+ * Account a job's run and continue it until it exits, faults or uses its limit
+ *
+ * ebreak stops a run but not the job.
+ *
+ * emulator: Job's instance
+ * job: Job being run
+ * run: Result of the first run (its retired count included)
+ * result: Job result (retired, status, exit code and fault are set)
+ */
+static void finish_job(Emulator *emulator, const BatchJob &job, RunResult run, BatchResult *result) {
+	result->status = BATCH_LIMIT;
+	while (true) {
+		result->retired += run.retired;
+		if (run.reason == RUN_EXIT) {
+			result->status = BATCH_EXITED;
+			result->exit_code = (int32_t)emulator->get_cpu()->get_register(10);
+			return;
+		}
+		if (run.reason == RUN_FAULT) {
+			result->status = BATCH_FAULT;
+			result->fault = run.status;
+			return;
+		}
+		if (result->retired >= job.max_instructions) {
+			return;
+		}
+		run = emulator->run(job.max_instructions - result->retired);
+	}
+}
+
+BatchRunner::BatchRunner(cpu_engine_t engine, mem_backend_t backend, uint32_t memory_size)
+	: engine(engine), pool(memory_size, backend, BATCH_MAX_THREADS), steals(0), lockstep(0), lockstep_splits(0) {
+}
+
+BatchResult BatchRunner::run_job(const BatchJob &job) {
+	BatchResult result = {BATCH_LOAD_ERROR, 0, CPU_OK, fnv1a(std::string()), 0, 0, 0};
+	auto start = std::chrono::steady_clock::now();
+
+	std::string input;
+	if (job.input.empty() || read_host_file(job.input.c_str(), &input)) {
+		std::unique_ptr<Emulator> emulator = pool.acquire();
+		emulator->set_quiet(true);
+
+		auto image = images.find(job.program);
+		int loaded;
+		if (image == images.end()) {
+			loaded = emulator->load_program(job.program.c_str(), 0);
+		} else {
+			loaded = image->second ? emulator->load_image(image->second) : -1;
+		}
+
+		if (loaded == 0) {
+			emulator->set_pc(0);
+			emulator->set_engine(engine);
+			SyscallSandbox sandbox(input);
+			sandbox.install(emulator->get_cpu()->get_syscalls());
+			finish_job(emulator.get(), job, emulator->run(job.max_instructions), &result);
+
+			const std::string &output = sandbox.get_output(1);
+			result.stdout_hash = fnv1a(output);
+			result.stdout_bytes = output.size();
+		}
+		pool.release(std::move(emulator));
+	} else {
+		std::fprintf(stderr, "Error: Cannot read stdin file '%s'\n", job.input.c_str());
+	}
+
+	result.wall_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+	return result;
+}
+
+void BatchRunner::run_lockstep(const std::vector<BatchJob> &jobs, const std::vector<size_t> &unit,
+	std::vector<BatchResult> *results) {
+	auto start = std::chrono::steady_clock::now();
+	auto image = images.find(jobs[unit[0]].program);
+	std::vector<size_t> members;
+	std::vector<std::unique_ptr<Emulator>> emulators;
+	std::vector<std::unique_ptr<SyscallSandbox>> sandboxes;
+	std::vector<Emulator*> lanes;
+
+	for (size_t index : unit) {
+		const BatchJob &job = jobs[index];
+		(*results)[index] = BatchResult{BATCH_LOAD_ERROR, 0, CPU_OK, fnv1a(std::string()), 0, 0, 0};
+
+		std::string input;
+		if (!job.input.empty() && !read_host_file(job.input.c_str(), &input)) {
+			std::fprintf(stderr, "Error: Cannot read stdin file '%s'\n", job.input.c_str());
+			continue;
+		}
+		std::unique_ptr<Emulator> emulator = pool.acquire();
+		emulator->set_quiet(true);
+		if (image == images.end() || !image->second || emulator->load_image(image->second) != 0) {
+			pool.release(std::move(emulator));
+			continue;
+		}
+		emulator->set_pc(0);
+		emulator->set_engine(engine);
+		sandboxes.push_back(std::make_unique<SyscallSandbox>(input));
+		sandboxes.back()->install(emulator->get_cpu()->get_syscalls());
+
+		members.push_back(index);
+		lanes.push_back(emulator.get());
+		emulators.push_back(std::move(emulator));
+	}
+
+	Lockstep group(lanes);
+	std::vector<RunResult> runs = group.run(jobs[unit[0]].max_instructions);
+	lockstep_splits.fetch_add(group.get_splits(), std::memory_order_relaxed);
+
+	for (size_t lane = 0; lane < members.size(); lane++) {
+		BatchResult &result = (*results)[members[lane]];
+		finish_job(emulators[lane].get(), jobs[members[lane]], runs[lane], &result);
+		const std::string &output = sandboxes[lane]->get_output(1);
+		result.stdout_hash = fnv1a(output);
+		result.stdout_bytes = output.size();
+		pool.release(std::move(emulators[lane]));
+	}
+
+	uint64_t wall_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+	for (size_t index : unit) {
+		(*results)[index].wall_ns = wall_ns;
+	}
+}
+
+bool BatchRunner::take_unit(uint32_t worker, size_t *index) {
+	{
+		WorkerQueue &own = *queues[worker];
+		std::lock_guard<std::mutex> lock(own.lock);
+		if (!own.units.empty()) {
+			*index = own.units.back();
+			own.units.pop_back();
+			return true;
+		}
+	}
+
+	/* No unit is ever added, so one empty pass means the batch is done */
+	uint32_t count = (uint32_t)queues.size();
+	for (uint32_t offset = 1; offset < count; offset++) {
+		WorkerQueue &victim = *queues[(worker + offset) % count];
+		std::lock_guard<std::mutex> lock(victim.lock);
+		if (!victim.units.empty()) {
+			*index = victim.units.front();
+			victim.units.pop_front();
+			steals.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	return false;
+}
+
+void BatchRunner::run_worker(uint32_t worker, const std::vector<BatchJob> *jobs, std::vector<BatchResult> *results) {
+	size_t index;
+	while (take_unit(worker, &index)) {
+		const std::vector<size_t> &unit = units[index];
+		if (unit.size() == 1) {
+			(*results)[unit[0]] = run_job((*jobs)[unit[0]]);
+		} else {
+			run_lockstep(*jobs, unit, results);
+		}
+	}
+}
+
+std::vector<BatchResult> BatchRunner::run(const std::vector<BatchJob> &jobs, uint32_t threads) {
+	std::vector<BatchResult> results(jobs.size());
+	if (jobs.empty()) {
+		return results;
+	}
+
+	/* Lockstep units collect jobs of one program and limit in job order */
+	units.clear();
+	std::unordered_map<std::string, size_t> filling;
+	for (size_t index = 0; index < jobs.size(); index++) {
+		if (lockstep < 2) {
+			units.push_back(std::vector<size_t>(1, index));
+			continue;
+		}
+		std::string key = jobs[index].program + '\n' + std::to_string(jobs[index].max_instructions);
+		auto open = filling.find(key);
+		if (open == filling.end() || units[open->second].size() == lockstep) {
+			filling[key] = units.size();
+			units.push_back(std::vector<size_t>(1, index));
+		} else {
+			units[open->second].push_back(index);
+		}
+	}
+
+	threads = std::max(1u, std::min(threads, (uint32_t)BATCH_MAX_THREADS));
+	threads = (uint32_t)std::min<size_t>(threads, units.size());
+
+	/* Worker w starts with units [w * n / threads, (w + 1) * n / threads) */
+	queues.clear();
+	for (uint32_t worker = 0; worker < threads; worker++) {
+		queues.push_back(std::make_unique<WorkerQueue>());
+		size_t first = units.size() * worker / threads;
+		size_t last = units.size() * (worker + 1) / threads;
+		for (size_t index = last; index > first; index--) {
+			queues[worker]->units.push_back(index - 1);
+		}
+	}
+	steals.store(0, std::memory_order_relaxed);
+	lockstep_splits.store(0, std::memory_order_relaxed);
+
+	/* Read and decode every program once; workers only look images up */
+	images.clear();
+	for (const BatchJob &job : jobs) {
+		if (images.count(job.program)) {
+			continue;
+		}
+		std::shared_ptr<ProgramImage> image = std::make_shared<ProgramImage>();
+		images[job.program] = image->load(job.program.c_str(), 0) == 0 ? image : nullptr;
+	}
+
+	std::vector<std::thread> workers;
+	for (uint32_t worker = 1; worker < threads; worker++) {
+		workers.emplace_back(&BatchRunner::run_worker, this, worker, &jobs, &results);
+	}
+	run_worker(0, &jobs, &results);
+	for (std::thread &thread : workers) {
+		thread.join();
+	}
+
+	queues.clear();
+	units.clear();
+	images.clear();
+	return results;
+}
+
+int BatchRunner::parse_jobs(const char *path, std::vector<BatchJob> *jobs) {
+	FILE *file = std::fopen(path, "r");
+	if (!file) {
+		std::fprintf(stderr, "Error: Cannot open job file '%s'\n", path);
+		return -1;
+	}
+
+	char line[BATCH_LINE_MAX];
+	int number = 0;
+	int status = 0;
+	while (status == 0 && std::fgets(line, sizeof(line), file)) {
+		number++;
+		size_t length = std::strlen(line);
+		if (length == sizeof(line) - 1 && line[length - 1] != '\n' && !std::feof(file)) {
+			std::fprintf(stderr, "Error: %s:%d: line too long\n", path, number);
+			status = -1;
+			break;
+		}
+
+		std::vector<std::string> fields;
+		char *save = nullptr;
+		for (char *token = strtok_r(line, " \t\r\n", &save); token; token = strtok_r(nullptr, " \t\r\n", &save)) {
+			fields.push_back(token);
+		}
+		if (fields.empty() || fields[0][0] == '#') {
+			continue;
+		}
+
+		BatchJob job;
+		job.program = fields[0];
+		job.max_instructions = BATCH_DEFAULT_LIMIT;
+		if (fields.size() > 1 && fields[1] != "-") {
+			job.input = fields[1];
+		}
+		if (fields.size() > 2) {
+			char *end;
+			job.max_instructions = std::strtoull(fields[2].c_str(), &end, 0);
+			if (*end != '\0' || job.max_instructions == 0) {
+				std::fprintf(stderr, "Error: %s:%d: invalid instruction limit '%s'\n", path, number, fields[2].c_str());
+				status = -1;
+			}
+		}
+		if (fields.size() > 3) {
+			std::fprintf(stderr, "Error: %s:%d: expected 'program [stdin] [limit]'\n", path, number);
+			status = -1;
+		}
+		jobs->push_back(job);
+	}
+
+	if (std::ferror(file)) {
+		status = -1;
+	}
+	std::fclose(file);
+	return status;
+}
+
+int BatchRunner::write_report(FILE *file, batch_format_t format,
+	const std::vector<BatchJob> &jobs, const std::vector<BatchResult> &results) {
+	if (format == BATCH_CSV) {
+		std::fprintf(file, "job,program,stdin,status,exit_code,fault,stdout_hash,stdout_bytes,retired,wall_ms\n");
+	} else {
+		std::fprintf(file, "[");
+	}
+
+	for (size_t index = 0; index < results.size(); index++) {
+		const BatchJob &job = jobs[index];
+		const BatchResult &result = results[index];
+		double wall_ms = (double)result.wall_ns / 1e6;
+
+		if (format == BATCH_CSV) {
+			std::fprintf(file, "%zu,", index);
+			write_csv_field(file, job.program);
+			std::fputc(',', file);
+			write_csv_field(file, job.input);
+			std::fprintf(file, ",%s,%d,%d,%016llx,%llu,%llu,%.3f\n",
+				status_name(result.status), result.exit_code, (int)result.fault,
+				(unsigned long long)result.stdout_hash, (unsigned long long)result.stdout_bytes,
+				(unsigned long long)result.retired, wall_ms);
+		} else {
+			std::fprintf(file, "%s\n  {\"job\": %zu, \"program\": ", index ? "," : "", index);
+			write_json_string(file, job.program);
+			std::fprintf(file, ", \"stdin\": ");
+			write_json_string(file, job.input);
+			std::fprintf(file, ", \"status\": \"%s\", \"exit_code\": %d, \"fault\": %d, "
+				"\"stdout_hash\": \"%016llx\", \"stdout_bytes\": %llu, \"retired\": %llu, \"wall_ms\": %.3f}",
+				status_name(result.status), result.exit_code, (int)result.fault,
+				(unsigned long long)result.stdout_hash, (unsigned long long)result.stdout_bytes,
+				(unsigned long long)result.retired, wall_ms);
+		}
+	}
+
+	if (format == BATCH_JSON) {
+		std::fprintf(file, "%s]\n", results.empty() ? "" : "\n");
+	}
+	return std::ferror(file) ? -1 : 0;
+}
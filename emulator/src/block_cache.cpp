@@ -0,0 +1,94 @@
+/* block_cache.cpp */
+#include "block_cache.hpp"
+#include "jit.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+BlockCache::BlockCache() : hits(0), misses(0), chained(0), generation(0) {
+}
+
+BlockCache::~BlockCache() {
+}
+
+JitCompiler* BlockCache::get_jit() {
+	if (!jit) {
+		jit = std::make_unique<JitCompiler>();
+	}
+	return jit.get();
+}
+
+Block* BlockCache::lookup(uint32_t addr) {
+	auto it = blocks.find(addr);
+	if (it == blocks.end()) {
+		misses++;
+		return nullptr;
+	}
+
+	hits++;
+	return it->second.get();
+}
+
+Block* BlockCache::insert(std::unique_ptr<Block> block) {
+	uint32_t start = block->start_pc;
+	Block *stored = block.get();
+
+	/* A block may already exist here if the old one was dropped mid-run */
+	auto it = blocks.find(start);
+	if (it != blocks.end()) {
+		unlink(it->second.get());
+		blocks.erase(it);
+	} else {
+		page_blocks[start >> CODE_PAGE_SHIFT].push_back(start);
+	}
+
+	blocks[start] = std::move(block);
+	return stored;
+}
+
+void BlockCache::link(Block **slot, Block *target) {
+	*slot = target;
+	target->incoming.push_back(slot);
+}
+
+void BlockCache::unlink(Block *block) {
+	/* Predecessors must not jump into freed memory */
+	for (Block **slot : block->incoming) {
+		*slot = nullptr;
+	}
+
+	/* Successors must not keep stale back-references into this block */
+	Block *successors[2] = { block->taken, block->fallthrough };
+	Block **slots[2] = { &block->taken, &block->fallthrough };
+	for (int i = 0; i < 2; i++) {
+		if (!successors[i]) continue;
+		std::vector<Block**> &in = successors[i]->incoming;
+		in.erase(std::remove(in.begin(), in.end(), slots[i]), in.end());
+	}
+}
+
+void BlockCache::invalidate_page(uint32_t index) {
+	auto page = page_blocks.find(index);
+	if (page == page_blocks.end()) {
+		return;
+	}
+
+	for (uint32_t start : page->second) {
+		auto it = blocks.find(start);
+		if (it == blocks.end()) continue;
+		unlink(it->second.get());
+		blocks.erase(it);
+	}
+
+	page_blocks.erase(page);
+	generation++;
+}
+
+void BlockCache::clear() {
+	blocks.clear();
+	page_blocks.clear();
+	generation++;
+	if (jit) {
+		jit->reset();
+	}
+}
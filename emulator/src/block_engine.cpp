@@ -0,0 +1,378 @@
+/* block_engine.cpp */
+#include "cpu.hpp"
+#include "memory.hpp"
+#include "instructions.hpp"
+#include "block_cache.hpp"
+#include "jit.hpp"
+#include <cstdint>
+#include <memory>
+
+/* Instructions that end a basic block */
+static bool is_terminator(uint8_t op) {
+	switch (op) {
+		case OP_BEQ: case OP_BNE: case OP_BLT:
+		case OP_BGE: case OP_BLTU: case OP_BGEU:
+		case OP_JAL: case OP_JALR:
+		case OP_ECALL: case OP_EBREAK: case OP_ILLEGAL:
+		case OP_LR_W: case OP_SC_W: case OP_AMOSWAP_W:
+		case OP_AMOADD_W: case OP_AMOXOR_W: case OP_AMOAND_W:
+		case OP_AMOOR_W: case OP_AMOMIN_W: case OP_AMOMAX_W:
+		case OP_AMOMINU_W: case OP_AMOMAXU_W:
+		case OP_FENCE: case OP_CSR:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static MicroOp bind_micro_op(const Instruction *instr, uint32_t addr) {
+	MicroOp uop;
+	uop.op = instr->get_op();
+	uop.rd = instr->get_rd();
+	uop.rs1 = instr->get_rs1();
+	uop.rs2 = instr->get_rs2();
+	uop.imm = (uint32_t)instr->get_imm();
+
+	switch (uop.op) {
+		case OP_AUIPC:
+			/* PC is known at translation time */
+			uop.op = OP_LUI;
+			uop.imm += addr;
+			break;
+
+		case OP_JAL:
+		case OP_BEQ: case OP_BNE: case OP_BLT:
+		case OP_BGE: case OP_BLTU: case OP_BGEU:
+			uop.imm += addr;
+			break;
+
+		default:
+			break;
+	}
+
+	return uop;
+}
+
+Block* CPU::translate_block(Memory *mem) {
+	auto block = std::make_unique<Block>();
+	block->start_pc = pc;
+	block->taken = nullptr;
+	block->fallthrough = nullptr;
+	block->exec_count = 0;
+	block->native = nullptr;
+
+	uint32_t addr = pc;
+	uint32_t page = pc >> CODE_PAGE_SHIFT;
+
+	while (block->ops.size() < BLOCK_MAX_INSTRUCTIONS && (addr >> CODE_PAGE_SHIFT) == page) {
+		const Instruction *instr = mem->lookup_decoded(addr);
+		if (!instr) {
+			uint32_t raw;
+			if (mem->read32(addr, &raw) != MEM_OK) break;
+			instr = mem->insert_decoded(addr, raw);
+			if (!instr) break;
+		}
+
+		block->ops.push_back(bind_micro_op(instr, addr));
+		addr += 4;
+
+		if (is_terminator(instr->get_op())) break;
+	}
+
+	/* Fetch/decode faults are reported by CPU::step at that address */
+	if (block->ops.empty()) {
+		return nullptr;
+	}
+
+	block->end_pc = addr;
+	return mem->get_block_cache()->insert(std::move(block));
+}
+
+#define RD_WRITE(value) do { x[uop->rd] = (value); x[0] = 0; } while (0)
+#define RS1 (x[uop->rs1])
+#define RS2 (x[uop->rs2])
+
+uint32_t CPU::execute_block(Memory *mem, Block *block) {
+	BlockCache *cache = mem->get_block_cache();
+	const MicroOp *ops = block->ops.data();
+	size_t length = block->ops.size();
+	const MicroOp *term = &ops[length - 1];
+	size_t body = is_terminator(term->op) ? length - 1 : length;
+	uint32_t start_pc = block->start_pc;
+	uint64_t generation = cache->get_generation();
+
+	for (size_t i = 0; i < body; i++) {
+		const MicroOp *uop = &ops[i];
+		bool ok = true;
+		bool store = false;
+
+		switch (uop->op) {
+			case OP_LUI:   RD_WRITE(uop->imm); break;
+			case OP_ADDI:  RD_WRITE(RS1 + uop->imm); break;
+			case OP_SLTI:  RD_WRITE((int32_t)RS1 < (int32_t)uop->imm ? 1 : 0); break;
+			case OP_SLTIU: RD_WRITE(RS1 < uop->imm ? 1 : 0); break;
+			case OP_XORI:  RD_WRITE(RS1 ^ uop->imm); break;
+			case OP_ORI:   RD_WRITE(RS1 | uop->imm); break;
+			case OP_ANDI:  RD_WRITE(RS1 & uop->imm); break;
+			case OP_SLLI:  RD_WRITE(RS1 << (uop->imm & 0x1F)); break;
+			case OP_SRLI:  RD_WRITE(RS1 >> (uop->imm & 0x1F)); break;
+			case OP_SRAI:  RD_WRITE((uint32_t)((int32_t)RS1 >> (uop->imm & 0x1F))); break;
+			case OP_ADD:   RD_WRITE(RS1 + RS2); break;
+			case OP_SUB:   RD_WRITE(RS1 - RS2); break;
+			case OP_SLL:   RD_WRITE(RS1 << (RS2 & 0x1F)); break;
+			case OP_SLT:   RD_WRITE((int32_t)RS1 < (int32_t)RS2 ? 1 : 0); break;
+			case OP_SLTU:  RD_WRITE(RS1 < RS2 ? 1 : 0); break;
+			case OP_XOR:   RD_WRITE(RS1 ^ RS2); break;
+			case OP_SRL:   RD_WRITE(RS1 >> (RS2 & 0x1F)); break;
+			case OP_SRA:   RD_WRITE((uint32_t)((int32_t)RS1 >> (RS2 & 0x1F))); break;
+			case OP_OR:    RD_WRITE(RS1 | RS2); break;
+			case OP_AND:   RD_WRITE(RS1 & RS2); break;
+
+			case OP_MUL:
+			case OP_MULH:
+			case OP_MULHSU:
+			case OP_MULHU:
+			case OP_DIV:
+			case OP_DIVU:
+			case OP_REM:
+			case OP_REMU:
+				RD_WRITE(execute_mul_div(RS1, RS2, (uint8_t)(uop->op - OP_MUL)));
+				break;
+
+			case OP_LB: {
+				uint8_t value;
+				ok = mem->load(RS1 + uop->imm, &value);
+				if (ok) RD_WRITE((uint32_t)(int32_t)(int8_t)value);
+				break;
+			}
+
+			case OP_LH: {
+				uint16_t value;
+				ok = mem->load(RS1 + uop->imm, &value);
+				if (ok) RD_WRITE((uint32_t)(int32_t)(int16_t)value);
+				break;
+			}
+
+			case OP_LW: {
+				uint32_t value;
+				ok = mem->load(RS1 + uop->imm, &value);
+				if (ok) RD_WRITE(value);
+				break;
+			}
+
+			case OP_LBU: {
+				uint8_t value;
+				ok = mem->load(RS1 + uop->imm, &value);
+				if (ok) RD_WRITE(value);
+				break;
+			}
+
+			case OP_LHU: {
+				uint16_t value;
+				ok = mem->load(RS1 + uop->imm, &value);
+				if (ok) RD_WRITE(value);
+				break;
+			}
+
+			case OP_SB:
+				ok = mem->store(RS1 + uop->imm, (uint8_t)RS2);
+				store = true;
+				break;
+
+			case OP_SH:
+				ok = mem->store(RS1 + uop->imm, (uint16_t)RS2);
+				store = true;
+				break;
+
+			case OP_SW:
+				ok = mem->store(RS1 + uop->imm, RS2);
+				store = true;
+				break;
+
+			default:
+				ok = false;
+				break;
+		}
+
+		if (!ok) {
+			/* Same state CPU::step leaves behind: pc past the faulting instruction */
+			pc = start_pc + 4 * (uint32_t)(i + 1);
+			return BLOCK_RESULT(BLOCK_EXIT_FAULT, i);
+		}
+
+		if (store && cache->get_generation() != generation) {
+			/* This block may have been freed by its own store */
+			pc = start_pc + 4 * (uint32_t)(i + 1);
+			return BLOCK_RESULT(BLOCK_EXIT_STALE, i + 1);
+		}
+	}
+
+	if (body == length) {
+		/* Block was cut at the size limit or a page boundary */
+		pc = block->end_pc;
+		return BLOCK_RESULT(BLOCK_EXIT_FALLTHROUGH, length);
+	}
+
+	const MicroOp *uop = term;
+	bool taken;
+
+	switch (uop->op) {
+		case OP_BEQ:  taken = RS1 == RS2; break;
+		case OP_BNE:  taken = RS1 != RS2; break;
+		case OP_BLT:  taken = (int32_t)RS1 < (int32_t)RS2; break;
+		case OP_BGE:  taken = (int32_t)RS1 >= (int32_t)RS2; break;
+		case OP_BLTU: taken = RS1 < RS2; break;
+		case OP_BGEU: taken = RS1 >= RS2; break;
+
+		case OP_JAL:
+			RD_WRITE(block->end_pc);
+			taken = true;
+			break;
+
+		case OP_JALR: {
+			/* Indirect target: resolved through the cache lookup */
+			uint32_t target = (RS1 + uop->imm) & ~1u;
+			RD_WRITE(block->end_pc);
+			pc = target;
+			return BLOCK_RESULT(BLOCK_EXIT_INDIRECT, length);
+		}
+
+		default:
+			/* ecall/ebreak/illegal/atomic/fence/csr: left to CPU::step */
+			pc = block->end_pc - 4;
+			return BLOCK_RESULT(BLOCK_EXIT_SYSTEM, body);
+	}
+
+	if (taken) {
+		pc = uop->imm;
+		return BLOCK_RESULT(BLOCK_EXIT_TAKEN, length);
+	}
+
+	pc = block->end_pc;
+	return BLOCK_RESULT(BLOCK_EXIT_FALLTHROUGH, length);
+}
+
+cpu_status_t CPU::run_translated(Memory *mem, uint64_t max_instructions, uint64_t *retired, bool use_jit) {
+	BlockCache *cache = mem->get_block_cache();
+	JitCompiler *jit = use_jit ? cache->get_jit() : nullptr;
+	int32_t pc_offset = (int32_t)((uint8_t*)&pc - (uint8_t*)x.data());
+	cpu_status_t status = CPU_OK;
+	uint64_t count = 0;
+	Block *block = nullptr;
+
+	if (!running) {
+		*retired = 0;
+		return CPU_SYSCALL_EXIT;
+	}
+
+	while (count < max_instructions) {
+		if (!block) {
+			block = cache->lookup(pc);
+			if (!block) {
+				block = translate_block(mem);
+			}
+		}
+
+		size_t length = block ? block->ops.size() : 0;
+
+		/* Untranslatable PC or not enough budget: single-step */
+		if (!block || length > max_instructions - count) {
+			run_retired = count;
+			status = step(mem);
+			if (status != CPU_OK) {
+				if (status == CPU_SYSCALL_EXIT || status == CPU_BREAKPOINT) count++;
+				break;
+			}
+			count++;
+			block = nullptr;
+			continue;
+		}
+
+		uint32_t result;
+		if (block->native) {
+			result = block->native(x.data(), mem);
+		} else {
+			block->exec_count++;
+			if (jit && block->exec_count == JIT_HOT_THRESHOLD) {
+				block->native = jit->compile(block, pc_offset);
+			}
+			result = execute_block(mem, block);
+		}
+
+		count += BLOCK_RESULT_COUNT(result);
+		Block **next;
+
+		switch (BLOCK_RESULT_EXIT(result)) {
+			case BLOCK_EXIT_TAKEN:
+				next = &block->taken;
+				break;
+
+			case BLOCK_EXIT_FALLTHROUGH:
+				next = &block->fallthrough;
+				break;
+
+			case BLOCK_EXIT_FAULT:
+				*retired = count;
+				return CPU_EXECUTION_ERROR;
+
+			case BLOCK_EXIT_SYSTEM: {
+				uint32_t end_pc = block->end_pc;
+				uint64_t generation = cache->get_generation();
+
+				run_retired = count;
+				status = step(mem);
+				if (status != CPU_OK) {
+					if (status == CPU_SYSCALL_EXIT || status == CPU_BREAKPOINT) count++;
+					*retired = count;
+					return status;
+				}
+				count++;
+
+				/* The syscall may have rewritten code (e.g. read into text) */
+				if (cache->get_generation() != generation || pc != end_pc) {
+					next = nullptr;
+				} else {
+					next = &block->fallthrough;
+				}
+				break;
+			}
+
+			default:
+				/* Indirect jump or block invalidated by its own store */
+				next = nullptr;
+				break;
+		}
+
+		if (!next) {
+			block = nullptr;
+			continue;
+		}
+
+		if (*next) {
+			cache->count_chained();
+			block = *next;
+			continue;
+		}
+
+		/* First time through this exit: resolve and chain it */
+		Block *successor = cache->lookup(pc);
+		if (!successor) {
+			successor = translate_block(mem);
+		}
+		if (successor) {
+			cache->link(next, successor);
+		}
+		block = successor;
+	}
+
+	*retired = count;
+	return status;
+}
+
+cpu_status_t CPU::run_blocks(Memory *mem, uint64_t max_instructions, uint64_t *retired) {
+	return run_translated(mem, max_instructions, retired, false);
+}
+
+cpu_status_t CPU::run_jit(Memory *mem, uint64_t max_instructions, uint64_t *retired) {
+	return run_translated(mem, max_instructions, retired, true);
+}
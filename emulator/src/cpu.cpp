@@ -2,6 +2,9 @@
 #include "cpu.hpp"
 #include "memory.hpp"
 #include "instructions.hpp"
+#include "decode_cache.hpp"
+#include "trace.hpp"
+#include <atomic>
 #include <cstdlib>
 #include <memory>
 #include <cstdio>
@@ -10,16 +13,46 @@
 #include <sys/stat.h>
 #include <cerrno>
 #include <cstring>
+#include <vector>
 
 CPU::CPU() {
+	reset();
+}
+
+CPU::~CPU() {
+}
+
+void CPU::reset() {
 	for (int i = 0; i < 32; i++) {
 		x[i] = 0;
 	}
 	pc = 0;
 	running = true;
-	debug_mode = false;
+	trace_mode = TRACE_NONE;
+	trace_file = nullptr;
+	instret = 0;
+	run_retired = 0;
+	hartid = 0;
+	reservation_valid = false;
+	reservation_addr = 0;
+	reservation_value = 0;
+	hart_decode_generation = 0;
+	hart_decode.reset();
 
 	x[2] = STACK_TOP;
+
+	files.reset();
+	syscalls = SyscallTable();
+	syscalls_install_host(&syscalls);
+}
+
+void CPU::set_hart_decode(bool enable) {
+	if (!enable) {
+		hart_decode.reset();
+	} else if (!hart_decode) {
+		hart_decode = std::make_unique<DecodeCache>();
+		hart_decode_generation = 0;
+	}
 }
 
 bool CPU::is_running() const {
@@ -27,86 +60,12 @@ bool CPU::is_running() const {
 }
 
 void CPU::set_debug_mode(bool enable) {
-	debug_mode = enable;
-}
-
-/* Helper function to get instruction name */
-static const char* get_instruction_name(uint8_t opcode, uint8_t funct3, uint8_t funct7) {
-	switch (opcode) {
-		case 0x33: /* R-type ALU */
-			if (funct7 == 0x00) {
-				switch (funct3) {
-					case 0x0: return "add";
-					case 0x4: return "xor";
-					case 0x6: return "or";
-					case 0x7: return "and";
-					case 0x1: return "sll";
-					case 0x5: return "srl";
-					case 0x2: return "slt";
-					case 0x3: return "sltu";
-				}
-			} else if (funct7 == 0x20) {
-				if (funct3 == 0x0) return "sub";
-				if (funct3 == 0x5) return "sra";
-			} else if (funct7 == 0x01) {
-				/* M Extension */
-				switch (funct3) {
-					case 0x0: return "mul";
-					case 0x1: return "mulh";
-					case 0x2: return "mulhsu";
-					case 0x3: return "mulhu";
-					case 0x4: return "div";
-					case 0x5: return "divu";
-					case 0x6: return "rem";
-					case 0x7: return "remu";
-				}
-			}
-			return "alu-r";
-		case 0x13: /* I-type ALU */
-			switch (funct3) {
-				case 0x0: return "addi";
-				case 0x4: return "xori";
-				case 0x6: return "ori";
-				case 0x7: return "andi";
-				case 0x1: return "slli";
-				case 0x5: return (funct7 == 0x00) ? "srli" : "srai";
-				case 0x2: return "slti";
-				case 0x3: return "sltiu";
-			}
-			return "alu-i";
-		case 0x03: /* Load */
-			switch (funct3) {
-				case 0x0: return "lb";
-				case 0x1: return "lh";
-				case 0x2: return "lw";
-				case 0x4: return "lbu";
-				case 0x5: return "lhu";
-			}
-			return "load";
-		case 0x23: /* Store */
-			switch (funct3) {
-				case 0x0: return "sb";
-				case 0x1: return "sh";
-				case 0x2: return "sw";
-			}
-			return "store";
-		case 0x63: /* Branch */
-			switch (funct3) {
-				case 0x0: return "beq";
-				case 0x1: return "bne";
-				case 0x4: return "blt";
-				case 0x5: return "bge";
-				case 0x6: return "bltu";
-				case 0x7: return "bgeu";
-			}
-			return "branch";
-		case 0x6f: return "jal";
-		case 0x67: return "jalr";
-		case 0x37: return "lui";
-		case 0x17: return "auipc";
-		case 0x73: return (funct3 == 0x0) ? "ecall" : "system";
-		default: return "unknown";
-	}
+	trace_mode = enable ? TRACE_TEXT : TRACE_NONE;
+}
+
+void CPU::set_trace(cpu_trace_t mode, FILE *file) {
+	trace_mode = mode;
+	trace_file = file;
 }
 
 uint32_t CPU::get_pc() const {
@@ -117,6 +76,22 @@ void CPU::set_pc(uint32_t value) {
 	pc = value;
 }
 
+CpuState CPU::get_state() const {
+	CpuState state;
+	state.x = x;
+	state.pc = pc;
+	state.running = running;
+	return state;
+}
+
+void CPU::set_state(const CpuState &state) {
+	x = state.x;
+	x[0] = 0;
+	pc = state.pc;
+	running = state.running;
+	reservation_valid = false;
+}
+
 uint32_t CPU::get_register(uint8_t reg) const {
 	if (reg >= 32) return 0;
 	return (reg == 0) ? 0 : x[reg];
@@ -155,136 +130,113 @@ cpu_status_t CPU::fetch(Memory *mem, uint32_t *instruction) {
 	return CPU_FETCH_ERROR;
 }
 
-cpu_status_t CPU::handle_syscall(Memory *mem) {
-	uint32_t syscall_num = x[17];
-	uint32_t arg1 = x[10];
-	uint32_t arg2 = x[11];
-	uint32_t arg3 = x[12];
-
-	switch (syscall_num) {
-		case SYS_exit: {
-			running = false;
-			return CPU_SYSCALL_EXIT;
-		}
-
-		case SYS_write: {
-			int fd = (int)arg1;
-			uint32_t buf_addr = arg2;
-			size_t count = (size_t)arg3;
-
-			if (buf_addr + count > mem->get_size()) {
-				x[10] = -1;
-				break;
-			}
-
-			ssize_t result = write(fd, &mem->get_data()[buf_addr], count);
-			x[10] = (uint32_t)result;
-			break;
-		}
-
-		case SYS_read: {
-			int fd = (int)arg1;
-			uint32_t buf_addr = arg2;
-			size_t count = (size_t)arg3;
-
-			if (buf_addr + count > mem->get_size()) {
-				x[10] = -1;
-				break;
-			}
-
-			ssize_t result = read(fd, &mem->get_data()[buf_addr], count);
-			x[10] = (uint32_t)result;
-			break;
+cpu_status_t CPU::fetch_decoded(Memory *mem, const Instruction **instr) {
+	const Instruction *cached;
+	if (hart_decode) {
+		/* Another hart (or a syscall) may have rewritten code since the last fetch */
+		uint64_t generation = mem->get_code_generation();
+		if (generation != hart_decode_generation) {
+			hart_decode->clear();
+			hart_decode_generation = generation;
 		}
+		cached = hart_decode->lookup(pc);
+	} else {
+		cached = mem->lookup_decoded(pc);
+	}
+	if (cached) {
+		pc += 4;
+		*instr = cached;
+		return CPU_OK;
+	}
 
-		case SYS_openat: {
-			uint32_t path_addr = arg2;
-			int flags = (int)arg3;
-			mode_t mode = (mode_t)arg3;
-
-			char path[256];
-			int i;
-			for (i = 0; i < (int)sizeof(path) - 1; i++) {
-				if (path_addr + i >= mem->get_size()) break;
-				path[i] = mem->get_data()[path_addr + i];
-				if (path[i] == '\0') break;
-			}
-			path[i] = '\0';
+	/* Mark the page first so a store racing with the fetch invalidates it */
+	if (hart_decode && (pc & 0x3) == 0 && mem->is_mapped(pc, 4)) {
+		mem->mark_code(pc);
+	}
 
-			int result = open(path, flags, mode);
-			x[10] = (uint32_t)result;
-			break;
-		}
+	uint32_t raw_instr;
+	cpu_status_t status = fetch(mem, &raw_instr);
+	if (status != CPU_OK) {
+		return status;
+	}
 
-		case SYS_close: {
-			int fd = (int)arg1;
-			int result = close(fd);
-			x[10] = (uint32_t)result;
-			break;
-		}
+	if (hart_decode) {
+		cached = hart_decode->insert(pc - 4, raw_instr);
+	} else {
+		cached = mem->insert_decoded(pc - 4, raw_instr);
+	}
+	if (!cached) {
+		return CPU_DECODE_ERROR;
+	}
 
-		case SYS_brk: {
-			x[10] = -ENOMEM;
-			break;
-		}
+	*instr = cached;
+	return CPU_OK;
+}
 
-		case SYS_fstat: {
-			int fd = (int)arg1;
-			struct stat st;
-			int result = fstat(fd, &st);
+cpu_status_t CPU::handle_syscall(Memory *mem) {
+	SyscallCall call;
+	call.cpu = this;
+	call.mem = mem;
+	call.files = &files;
+	call.number = x[17];
+	for (int i = 0; i < 6; i++) {
+		call.args[i] = x[10 + i];
+	}
+	call.result = 0;
 
-			if (result == 0 && arg2 + sizeof(st) <= mem->get_size()) {
-				size_t copy_size = sizeof(st) < 64 ? sizeof(st) : 64;
-				std::memcpy(&mem->get_data()[arg2], &st, copy_size);
-			}
+	switch (syscalls.dispatch(&call)) {
+		case SYSCALL_EXIT:
+			files.flush();
+			running = false;
+			return CPU_SYSCALL_EXIT;
 
-			x[10] = (uint32_t)result;
-			break;
-		}
+		case SYSCALL_FAULT:
+			return CPU_EXECUTION_ERROR;
 
 		default:
-			x[10] = -ENOSYS;
-			break;
+			x[10] = call.result;
+			return CPU_OK;
 	}
-
-	return CPU_OK;
 }
 
 cpu_status_t CPU::execute_load(Memory *mem, Instruction *instr, uint32_t *result) {
 	uint32_t addr = reg_read(instr->get_rs1()) + instr->get_imm();
-	uint32_t value;
-	memory_status_t status;
 
 	switch (instr->get_funct3()) {
-		case 0x0:
-			status = mem->read8(addr, (uint8_t*)&value);
-			if (status != MEM_OK) return CPU_EXECUTION_ERROR;
-			*result = sign_extend(value & 0xFF, 8);
+		case 0x0: {
+			uint8_t value;
+			if (!mem->load(addr, &value)) return CPU_EXECUTION_ERROR;
+			*result = sign_extend(value, 8);
 			break;
+		}
 
-		case 0x1:
-			status = mem->read16(addr, (uint16_t*)&value);
-			if (status != MEM_OK) return CPU_EXECUTION_ERROR;
-			*result = sign_extend(value & 0xFFFF, 16);
+		case 0x1: {
+			uint16_t value;
+			if (!mem->load(addr, &value)) return CPU_EXECUTION_ERROR;
+			*result = sign_extend(value, 16);
 			break;
+		}
 
-		case 0x2:
-			status = mem->read32(addr, &value);
-			if (status != MEM_OK) return CPU_EXECUTION_ERROR;
+		case 0x2: {
+			uint32_t value;
+			if (!mem->load(addr, &value)) return CPU_EXECUTION_ERROR;
 			*result = value;
 			break;
+		}
 
-		case 0x4:
-			status = mem->read8(addr, (uint8_t*)&value);
-			if (status != MEM_OK) return CPU_EXECUTION_ERROR;
-			*result = value & 0xFF;
+		case 0x4: {
+			uint8_t value;
+			if (!mem->load(addr, &value)) return CPU_EXECUTION_ERROR;
+			*result = value;
 			break;
+		}
 
-		case 0x5:
-			status = mem->read16(addr, (uint16_t*)&value);
-			if (status != MEM_OK) return CPU_EXECUTION_ERROR;
-			*result = value & 0xFFFF;
+		case 0x5: {
+			uint16_t value;
+			if (!mem->load(addr, &value)) return CPU_EXECUTION_ERROR;
+			*result = value;
 			break;
+		}
 
 		default:
 			return CPU_ILLEGAL_INSTRUCTION;
@@ -296,26 +248,26 @@ cpu_status_t CPU::execute_load(Memory *mem, Instruction *instr, uint32_t *result
 cpu_status_t CPU::execute_store(Memory *mem, Instruction *instr) {
 	uint32_t addr = reg_read(instr->get_rs1()) + instr->get_imm();
 	uint32_t value = reg_read(instr->get_rs2());
-	memory_status_t status;
+	bool ok;
 
 	switch (instr->get_funct3()) {
 		case 0x0:
-			status = mem->write8(addr, value & 0xFF);
+			ok = mem->store(addr, (uint8_t)value);
 			break;
 
 		case 0x1:
-			status = mem->write16(addr, value & 0xFFFF);
+			ok = mem->store(addr, (uint16_t)value);
 			break;
 
 		case 0x2:
-			status = mem->write32(addr, value);
+			ok = mem->store(addr, value);
 			break;
 
 		default:
 			return CPU_ILLEGAL_INSTRUCTION;
 	}
 
-	return (status == MEM_OK) ? CPU_OK : CPU_EXECUTION_ERROR;
+	return ok ? CPU_OK : CPU_EXECUTION_ERROR;
 }
 
 uint32_t CPU::execute_mul_div(uint32_t rs1_val, uint32_t rs2_val, uint8_t funct3) {
@@ -330,11 +282,15 @@ uint32_t CPU::execute_mul_div(uint32_t rs1_val, uint32_t rs2_val, uint8_t funct3
 		case 0x3:
 			return ((uint64_t)rs1_val * (uint64_t)rs2_val) >> 32;
 		case 0x4:
-			return (rs2_val == 0) ? (uint32_t)-1 : (uint32_t)((int32_t)rs1_val / (int32_t)rs2_val);
+			if (rs2_val == 0) return (uint32_t)-1;
+			if (rs1_val == 0x80000000 && rs2_val == 0xFFFFFFFF) return rs1_val;  /* Overflow */
+			return (uint32_t)((int32_t)rs1_val / (int32_t)rs2_val);
 		case 0x5:
 			return (rs2_val == 0) ? (uint32_t)-1 : rs1_val / rs2_val;
 		case 0x6:
-			return (rs2_val == 0) ? rs1_val : (uint32_t)((int32_t)rs1_val % (int32_t)rs2_val);
+			if (rs2_val == 0) return rs1_val;
+			if (rs1_val == 0x80000000 && rs2_val == 0xFFFFFFFF) return 0;  /* Overflow */
+			return (uint32_t)((int32_t)rs1_val % (int32_t)rs2_val);
 		case 0x7:
 			return (rs2_val == 0) ? rs1_val : rs1_val % rs2_val;
 		default:
@@ -420,14 +376,81 @@ cpu_status_t CPU::execute_branch(Instruction *instr) {
 	return CPU_OK;
 }
 
+cpu_status_t CPU::execute_atomic(Memory *mem, Instruction *instr) {
+	static const amo_op_t amo_ops[] = {
+		AMO_SWAP, AMO_ADD, AMO_XOR, AMO_AND, AMO_OR,
+		AMO_MIN, AMO_MAX, AMO_MINU, AMO_MAXU
+	};
+
+	uint32_t addr = reg_read(instr->get_rs1());
+	uint32_t value = reg_read(instr->get_rs2());
+	uint32_t old;
+
+	switch (instr->get_op()) {
+		case OP_LR_W:
+			if (mem->atomic_load(addr, &old) != MEM_OK) return CPU_EXECUTION_ERROR;
+			reservation_valid = true;
+			reservation_addr = addr;
+			reservation_value = old;
+			reg_write(instr->get_rd(), old);
+			return CPU_OK;
+
+		case OP_SC_W: {
+			/* Succeeds if the word still holds what lr.w saw (no ABA detection) */
+			bool held = reservation_valid && reservation_addr == addr;
+			reservation_valid = false;
+			if (!held) {
+				reg_write(instr->get_rd(), 1);
+				return CPU_OK;
+			}
+			if (mem->atomic_cas(addr, reservation_value, value, &old) != MEM_OK) {
+				return CPU_EXECUTION_ERROR;
+			}
+			reg_write(instr->get_rd(), old == reservation_value ? 0 : 1);
+			return CPU_OK;
+		}
+
+		case OP_AMOSWAP_W: case OP_AMOADD_W: case OP_AMOXOR_W:
+		case OP_AMOAND_W: case OP_AMOOR_W: case OP_AMOMIN_W:
+		case OP_AMOMAX_W: case OP_AMOMINU_W: case OP_AMOMAXU_W:
+			if (mem->atomic_rmw(addr, amo_ops[instr->get_op() - OP_AMOSWAP_W], value, &old) != MEM_OK) {
+				return CPU_EXECUTION_ERROR;
+			}
+			reg_write(instr->get_rd(), old);
+			return CPU_OK;
+
+		default:
+			return CPU_ILLEGAL_INSTRUCTION;
+	}
+}
+
+cpu_status_t CPU::execute_csr(Instruction *instr) {
+	uint32_t csr = (uint32_t)instr->get_imm() & 0xFFF;
+	uint8_t funct3 = instr->get_funct3();
+
+	/* csrrs/csrrc with x0 and csrrsi/csrrci with 0 only read */
+	bool read_only = (funct3 == 0x2 || funct3 == 0x3 || funct3 == 0x6 || funct3 == 0x7) &&
+		instr->get_rs1() == 0;
+
+	if (csr != CSR_MHARTID || !read_only) {
+		return CPU_ILLEGAL_INSTRUCTION;
+	}
+
+	reg_write(instr->get_rd(), hartid);
+	return CPU_OK;
+}
+
 cpu_status_t CPU::execute_system(Memory *mem, Instruction *instr) {
+	if (instr->get_funct3() != 0x0) {
+		return execute_csr(instr);
+	}
+
 	switch (instr->get_imm() & 0xFFF) {
 		case 0x000:
 			return handle_syscall(mem);
 
 		case 0x001:
-			std::fprintf(stderr, "Breakpoint at PC: 0x%08x\n", pc - 4);
-			return CPU_OK;
+			return CPU_BREAKPOINT;
 
 		default:
 			return CPU_ILLEGAL_INSTRUCTION;
@@ -439,7 +462,9 @@ cpu_status_t CPU::execute(Memory *mem, Instruction *instr) {
 		case INSTR_R_TYPE: {
 			uint32_t rs1_val = reg_read(instr->get_rs1());
 			uint32_t rs2_val = reg_read(instr->get_rs2());
-			if (instr->get_funct7() == 0x01) { /* Add M extension */
+			if (instr->get_opcode() == 0x2F) { /* A extension */
+				return execute_atomic(mem, instr);
+			} else if (instr->get_funct7() == 0x01) { /* Add M extension */
 				uint32_t result = execute_mul_div(rs1_val, rs2_val, instr->get_funct3());
 				reg_write(instr->get_rd(), result);
 			} else {
@@ -481,6 +506,11 @@ cpu_status_t CPU::execute(Memory *mem, Instruction *instr) {
 				case 0x73:
 					return execute_system(mem, instr);
 
+				case 0x0F:
+					/* Harts share memory directly: a full host fence orders it */
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+					break;
+
 				default:
 					return CPU_ILLEGAL_INSTRUCTION;
 			}
@@ -523,88 +553,148 @@ cpu_status_t CPU::execute(Memory *mem, Instruction *instr) {
 	return CPU_OK;
 }
 
+template <typename Trace>
+cpu_status_t CPU::step_traced(Memory *mem, Trace &trace) {
+	trace.fetch(pc);
+
+	const Instruction *cached;
+	cpu_status_t status = fetch_decoded(mem, &cached);
+	if (status != CPU_OK) {
+		trace.fetch_error(status);
+		return status;
+	}
+
+	/* Copy so self-modifying stores cannot invalidate the operand */
+	Instruction decoded = *cached;
+	trace.decode(decoded, pc);
+
+	status = execute(mem, &decoded);
+	trace.execute(status, pc);
+
+	return status;
+}
+
 cpu_status_t CPU::step(Memory *mem) {
 	if (!running) {
 		return CPU_SYSCALL_EXIT;
 	}
 
-	uint32_t raw_instr;
-	Instruction decoded;
+	cpu_status_t status;
+	switch (trace_mode) {
+		case TRACE_TEXT: {
+			TextTrace trace;
+			status = step_traced(mem, trace);
+			break;
+		}
 
-	/* FETCH */
-	if (debug_mode) {
-		std::printf("[FETCH] PC=0x%08x\n", pc);
+		case TRACE_BINARY: {
+			BinaryTrace trace(trace_file);
+			status = step_traced(mem, trace);
+			break;
+		}
+
+		default: {
+			NoTrace trace;
+			status = step_traced(mem, trace);
+			break;
+		}
 	}
 
-	cpu_status_t status = fetch(mem, &raw_instr);
+	status = check_watchpoint(mem, status);
 	if (status != CPU_OK) {
-		if (debug_mode) {
-			std::printf("  FETCH ERROR: status=%d\n", status);
-		}
-		return status;
+		files.flush();
 	}
+	return status;
+}
 
-	if (debug_mode) {
-		std::printf("  Instruction: 0x%08x\n", raw_instr);
+cpu_status_t CPU::check_watchpoint(Memory *mem, cpu_status_t status) {
+	if (status == CPU_EXECUTION_ERROR && mem->has_watch_hit()) {
+		pc -= 4;
+		return CPU_WATCHPOINT;
 	}
+	return status;
+}
+
+template <typename Trace>
+cpu_status_t CPU::run_loop(Memory *mem, uint64_t max_instructions, uint64_t *retired, Trace &trace) {
+	cpu_status_t status = CPU_OK;
+	uint64_t count = 0;
 
-	/* DECODE */
-	if (!decoded.decode(raw_instr)) {
-		if (debug_mode) {
-			std::printf("  DECODE ERROR\n");
+	while (count < max_instructions) {
+		run_retired = count;
+		status = step_traced(mem, trace);
+		if (status != CPU_OK) {
+			if (status == CPU_SYSCALL_EXIT || status == CPU_BREAKPOINT) count++;
+			break;
 		}
-		return CPU_DECODE_ERROR;
+		count++;
+	}
+
+	*retired = count;
+	return status;
+}
+
+cpu_status_t CPU::run_switch(Memory *mem, uint64_t max_instructions, uint64_t *retired) {
+	if (!running) {
+		*retired = 0;
+		return CPU_SYSCALL_EXIT;
 	}
 
-	if (debug_mode) {
-		const char* instr_name = get_instruction_name(decoded.get_opcode(),
-			decoded.get_funct3(), decoded.get_funct7());
-		std::printf("[DECODE] %s (opcode=0x%02x", instr_name, decoded.get_opcode());
-
-		switch (decoded.get_format()) {
-			case INSTR_R_TYPE:
-				std::printf(", rd=x%d, rs1=x%d, rs2=x%d, funct3=0x%x, funct7=0x%x)\n",
-					decoded.get_rd(), decoded.get_rs1(), decoded.get_rs2(),
-					decoded.get_funct3(), decoded.get_funct7());
-				break;
-			case INSTR_I_TYPE:
-				std::printf(", rd=x%d, rs1=x%d, imm=%d)\n",
-					decoded.get_rd(), decoded.get_rs1(), decoded.get_imm());
-				break;
-			case INSTR_S_TYPE:
-				std::printf(", rs1=x%d, rs2=x%d, imm=%d)\n",
-					decoded.get_rs1(), decoded.get_rs2(), decoded.get_imm());
-				break;
-			case INSTR_B_TYPE:
-				std::printf(", rs1=x%d, rs2=x%d, imm=%d, target=0x%08x)\n",
-					decoded.get_rs1(), decoded.get_rs2(), decoded.get_imm(),
-					pc + decoded.get_imm());
-				break;
-			case INSTR_U_TYPE:
-				std::printf(", rd=x%d, imm=0x%x)\n",
-					decoded.get_rd(), decoded.get_imm());
-				break;
-			case INSTR_J_TYPE:
-				std::printf(", rd=x%d, imm=%d, target=0x%08x)\n",
-					decoded.get_rd(), decoded.get_imm(), pc + decoded.get_imm());
-				break;
+	/* Policy is chosen once per run, not per instruction */
+	switch (trace_mode) {
+		case TRACE_TEXT: {
+			TextTrace trace;
+			return run_loop(mem, max_instructions, retired, trace);
+		}
+
+		case TRACE_BINARY: {
+			BinaryTrace trace(trace_file);
+			return run_loop(mem, max_instructions, retired, trace);
+		}
+
+		default: {
+			NoTrace trace;
+			return run_loop(mem, max_instructions, retired, trace);
 		}
 	}
+}
+
+RunResult CPU::run(Memory *mem, cpu_engine_t engine, uint64_t max_instructions) {
+	RunResult result;
+
+	switch (engine) {
+		case ENGINE_THREADED:
+			result.status = run_threaded(mem, max_instructions, &result.retired);
+			break;
+
+		case ENGINE_BLOCK:
+			result.status = run_blocks(mem, max_instructions, &result.retired);
+			break;
 
-	/* EXECUTE */
-	if (debug_mode) {
-		std::printf("[EXECUTE] ");
+		case ENGINE_JIT:
+			result.status = run_jit(mem, max_instructions, &result.retired);
+			break;
+
+		default:
+			result.status = run_switch(mem, max_instructions, &result.retired);
+			break;
 	}
 
-	status = execute(mem, &decoded);
+	instret += result.retired;
+	run_retired = 0;
 
-	if (debug_mode) {
-		if (status == CPU_OK) {
-			std::printf("OK, next_pc=0x%08x\n\n", pc);
-		} else {
-			std::printf("ERROR: status=%d\n\n", status);
-		}
+	result.status = check_watchpoint(mem, result.status);
+	if (result.status != CPU_OK) {
+		files.flush();
 	}
 
-	return status;
-}
\ No newline at end of file
+	switch (result.status) {
+		case CPU_OK: result.reason = RUN_BUDGET; break;
+		case CPU_SYSCALL_EXIT: result.reason = RUN_EXIT; break;
+		case CPU_BREAKPOINT: result.reason = RUN_BREAKPOINT; break;
+		case CPU_WATCHPOINT: result.reason = RUN_WATCHPOINT; break;
+		default: result.reason = RUN_FAULT; break;
+	}
+
+	return result;
+}
@@ -0,0 +1,56 @@
+/* decode_cache.cpp */
+#include "decode_cache.hpp"
+#include "instructions.hpp"
+#include <cstdint>
+#include <memory>
+
+DecodeCache::DecodeCache() : last_index(0), last_page(nullptr) {
+}
+
+const Instruction* DecodeCache::insert(uint32_t addr, uint32_t raw) {
+	uint32_t index = addr >> CODE_PAGE_SHIFT;
+	std::unique_ptr<DecodedPage> &entry = owned[index];
+
+	/* A borrowed page is copied before its first change */
+	if (!entry) {
+		auto shared = pages.find(index);
+		if (shared != pages.end()) {
+			entry = std::make_unique<DecodedPage>(*shared->second);
+		} else {
+			entry = std::make_unique<DecodedPage>();
+		}
+		pages[index] = entry.get();
+	}
+
+	DecodedPage *page = entry.get();
+	uint32_t slot = (addr & (CODE_PAGE_SIZE - 1)) >> 2;
+
+	if (!page->slots[slot].decode(raw)) {
+		return nullptr;
+	}
+
+	page->valid[slot] = true;
+	last_index = index;
+	last_page = page;
+
+	return &page->slots[slot];
+}
+
+void DecodeCache::share_page(uint32_t index, const DecodedPage *page) {
+	invalidate_page(index);
+	pages[index] = page;
+}
+
+void DecodeCache::invalidate_page(uint32_t index) {
+	if (last_page && last_index == index) {
+		last_page = nullptr;
+	}
+	pages.erase(index);
+	owned.erase(index);
+}
+
+void DecodeCache::clear() {
+	pages.clear();
+	owned.clear();
+	last_page = nullptr;
+}
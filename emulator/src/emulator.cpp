@@ -1,10 +1,18 @@
 /* emulator.cpp */
 #include "emulator.hpp"
+#include <algorithm>
 #include <cstdio>
 #include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-Emulator::Emulator(uint32_t memory_size) {
-	memory = std::make_unique<Memory>(memory_size);
+Emulator::Emulator(uint32_t memory_size, mem_backend_t backend) : engine(ENGINE_SWITCH), program_mapped(false),
+	  checkpoint_sequence(0), quiet(false) {
+	memory = std::make_unique<Memory>(memory_size, backend);
+	memory->map(STACK_BASE, STACK_SIZE);
 	cpu = std::make_unique<CPU>();
 }
 
@@ -28,32 +36,399 @@ cpu_status_t Emulator::step() {
 	return cpu->step(memory.get());
 }
 
+RunResult Emulator::run(uint64_t max_instructions) {
+	return cpu->run(memory.get(), engine, max_instructions);
+}
+
+void Emulator::set_engine(cpu_engine_t value) {
+	engine = value;
+}
+
+int Emulator::reset() {
+	cpu->reset();
+	if (memory->reset() != 0) {
+		return -1;
+	}
+	memory->map(STACK_BASE, STACK_SIZE);
+
+	engine = ENGINE_SWITCH;
+	program_mapped = false;
+	snapshot_cpu = CpuState();
+	checkpoint_sequence = 0;
+	quiet = false;
+	return 0;
+}
+
+void Emulator::set_quiet(bool enable) {
+	quiet = enable;
+}
+
 int Emulator::load_program(const char *filename, uint32_t load_address) {
-	FILE *file = std::fopen(filename, "rb");
-	if (!file) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
 		std::fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
 		return -1;
 	}
 
-	std::fseek(file, 0, SEEK_END);
-	long file_size = std::ftell(file);
-	std::fseek(file, 0, SEEK_SET);
+	struct stat info;
+	if (fstat(fd, &info) != 0 || !memory->is_mapped(load_address, (uint64_t)info.st_size)) {
+		std::fprintf(stderr, "Error: Program too large for memory\n");
+		close(fd);
+		return -1;
+	}
+	long file_size = (long)info.st_size;
+
+	/* Map the image copy-on-write; copy it only if that is not possible */
+	program_mapped = file_size > 0 && memory->map_file(load_address, fd, (uint64_t)file_size) == MEM_OK;
+
+	if (!program_mapped) {
+		std::vector<uint8_t> image(file_size);
+		ssize_t read_size = file_size > 0 ? read(fd, image.data(), file_size) : 0;
+
+		if (read_size != (ssize_t)file_size) {
+			std::fprintf(stderr, "Error: Failed to read entire file\n");
+			close(fd);
+			return -1;
+		}
+
+		if (memory->write_block(load_address, image.data(), (uint32_t)file_size) != MEM_OK) {
+			std::fprintf(stderr, "Error: Cannot write program to memory\n");
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+
+	if (!quiet) {
+		std::printf("Loaded %ld bytes at address 0x%08x\n", file_size, load_address);
+	}
+	return 0;
+}
 
-	if (load_address + file_size > memory->get_size()) {
+int Emulator::load_image(const std::shared_ptr<const ProgramImage> &image) {
+	if (memory->map_image(image) != MEM_OK) {
 		std::fprintf(stderr, "Error: Program too large for memory\n");
-		std::fclose(file);
 		return -1;
 	}
+	program_mapped = true;
+
+	if (!quiet) {
+		std::printf("Loaded %llu bytes at address 0x%08x (shared image)\n",
+			(unsigned long long)image->get_file_size(), image->get_load_address());
+	}
+	return 0;
+}
+
+void Emulator::snapshot() {
+	snapshot_cpu = cpu->get_state();
+	memory->snapshot();
+}
+
+int Emulator::restore() {
+	if (!memory->has_snapshot()) {
+		return -1;
+	}
+
+	cpu->set_state(snapshot_cpu);
+	memory->restore();
+	return 0;
+}
+
+void Emulator::set_regions(std::vector<StateRegion> *regions) {
+	std::sort(regions->begin(), regions->end(), [](const StateRegion &a, const StateRegion &b) {
+		return a.base < b.base;
+	});
+
+	/* Unmap what the file does not cover (e.g. munmap'd or shrunk heap) */
+	std::vector<std::pair<uint32_t, uint64_t>> current = memory->get_regions();
+	for (const auto &region : current) {
+		uint64_t cursor = region.first;
+		for (const StateRegion &kept : *regions) {
+			if (kept.base >= region.second) break;
+			if (kept.base > cursor) {
+				memory->unmap((uint32_t)cursor, kept.base - cursor);
+			}
+			cursor = std::max(cursor, kept.end);
+		}
+		if (cursor < region.second) {
+			memory->unmap((uint32_t)cursor, region.second - cursor);
+		}
+	}
+
+	for (const StateRegion &region : *regions) {
+		if (!memory->is_mapped((uint32_t)region.base, region.end - region.base)) {
+			memory->map((uint32_t)region.base, region.end - region.base);
+		}
+	}
+}
+
+int Emulator::write_checkpoint(const char *path) {
+	std::vector<uint32_t> pages;
+	memory->take_modified_pages(&pages);
+
+	FILE *file = std::fopen(path, "wb");
+	if (!file) {
+		std::fprintf(stderr, "Error: Cannot create checkpoint '%s'\n", path);
+		return -1;
+	}
+
+	const auto &regions = memory->get_regions();
+	CpuState state = cpu->get_state();
+	CheckpointHeader header;
+	header.magic = CHECKPOINT_MAGIC;
+	header.version = CHECKPOINT_VERSION;
+	header.sequence = checkpoint_sequence++;
+	header.page_count = (uint32_t)pages.size();
+	header.region_count = (uint32_t)regions.size();
+	header.program_break = memory->get_program_break();
+	std::memcpy(header.x, state.x.data(), sizeof(header.x));
+	header.pc = state.pc;
+	header.running = state.running;
+
+	bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+	for (const auto &region : regions) {
+		StateRegion record{region.first, region.second};
+		ok = ok && std::fwrite(&record, sizeof(record), 1, file) == 1;
+	}
+
+	uint8_t data[MEM_PAGE_SIZE];
+	for (size_t i = 0; ok && i < pages.size(); i++) {
+		uint32_t addr = pages[i] << MEM_PAGE_SHIFT;
+		ok = memory->read_block(addr, data, MEM_PAGE_SIZE) == MEM_OK &&
+			std::fwrite(&addr, sizeof(addr), 1, file) == 1 &&
+			std::fwrite(data, MEM_PAGE_SIZE, 1, file) == 1;
+	}
+
+	if (std::fclose(file) != 0 || !ok) {
+		std::fprintf(stderr, "Error: Failed to write checkpoint '%s'\n", path);
+		return -1;
+	}
+	return 0;
+}
 
-	size_t read_size = std::fread(&memory->get_data()[load_address], 1, file_size, file);
+int Emulator::apply_checkpoint(const char *path) {
+	FILE *file = std::fopen(path, "rb");
+	if (!file) {
+		std::fprintf(stderr, "Error: Cannot open checkpoint '%s'\n", path);
+		return -1;
+	}
+
+	CheckpointHeader header;
+	bool ok = std::fread(&header, sizeof(header), 1, file) == 1 &&
+		header.magic == CHECKPOINT_MAGIC && header.version == CHECKPOINT_VERSION;
+
+	std::vector<StateRegion> regions;
+	for (uint32_t i = 0; ok && i < header.region_count; i++) {
+		StateRegion region;
+		ok = std::fread(&region, sizeof(region), 1, file) == 1 &&
+			region.base < region.end && region.end <= 0x100000000ull;
+		regions.push_back(region);
+	}
+
+	if (ok) {
+		/* Heap and mmap regions must be mapped before their pages are written */
+		set_regions(&regions);
+		memory->set_program_break(header.program_break);
+	}
+
+	uint8_t data[MEM_PAGE_SIZE];
+	for (uint32_t i = 0; ok && i < header.page_count; i++) {
+		uint32_t addr;
+		ok = std::fread(&addr, sizeof(addr), 1, file) == 1 &&
+			std::fread(data, MEM_PAGE_SIZE, 1, file) == 1 &&
+			memory->write_block(addr, data, MEM_PAGE_SIZE) == MEM_OK;
+	}
 	std::fclose(file);
 
-	if (read_size != (size_t)file_size) {
-		std::fprintf(stderr, "Error: Failed to read entire file\n");
+	if (!ok) {
+		std::fprintf(stderr, "Error: Invalid checkpoint '%s'\n", path);
 		return -1;
 	}
 
-	std::printf("Loaded %ld bytes at address 0x%08x\n", file_size, load_address);
+	CpuState state;
+	std::memcpy(state.x.data(), header.x, sizeof(header.x));
+	state.pc = header.pc;
+	state.running = header.running != 0;
+	cpu->set_state(state);
+	checkpoint_sequence = header.sequence + 1;
+	return 0;
+}
+
+int Emulator::save_state(const char *path) {
+	/* Non-zero pages, grouped into runs of consecutive pages */
+	std::vector<uint32_t> pages;
+	std::vector<StateRun> runs;
+	std::vector<uint8_t> data;
+	uint8_t page_data[MEM_PAGE_SIZE];
+	static const uint8_t zero[MEM_PAGE_SIZE] = {};
+
+	memory->get_resident_list(&pages);
+	for (uint32_t page : pages) {
+		if (memory->read_block(page << MEM_PAGE_SHIFT, page_data, MEM_PAGE_SIZE) != MEM_OK ||
+				std::memcmp(page_data, zero, MEM_PAGE_SIZE) == 0) {
+			continue;
+		}
+		if (!runs.empty() && runs.back().first_page + runs.back().page_count == page) {
+			runs.back().page_count++;
+		} else {
+			runs.push_back(StateRun{page, 1});
+		}
+		data.insert(data.end(), page_data, page_data + MEM_PAGE_SIZE);
+	}
+
+	FdTable *files = cpu->get_files();
+	std::vector<StateFile> open_files;
+	for (size_t fd = 0; fd < files->size(); fd++) {
+		const GuestFile &file = files->get((int)fd);
+		if (file.host_fd < 0 || file.path.empty()) continue;
+		StateFile record;
+		record.guest_fd = (int32_t)fd;
+		record.flags = file.flags;
+		record.offset = lseek(file.host_fd, 0, SEEK_CUR);
+		record.path_length = (uint32_t)file.path.size();
+		record.reserved = 0;
+		open_files.push_back(record);
+	}
+
+	const auto &regions = memory->get_regions();
+	uint64_t metadata = sizeof(StateHeader) + regions.size() * sizeof(StateRegion) +
+		runs.size() * sizeof(StateRun);
+	for (size_t i = 0; i < open_files.size(); i++) {
+		metadata += sizeof(StateFile) + open_files[i].path_length;
+	}
+
+	CpuState state = cpu->get_state();
+	StateHeader header;
+	header.magic = STATE_MAGIC;
+	header.version = STATE_VERSION;
+	std::memcpy(header.x, state.x.data(), sizeof(header.x));
+	header.pc = state.pc;
+	header.running = state.running;
+	header.region_count = (uint32_t)regions.size();
+	header.file_count = (uint32_t)open_files.size();
+	header.run_count = (uint32_t)runs.size();
+	header.program_break = memory->get_program_break();
+	header.data_offset = (metadata + MEM_PAGE_SIZE - 1) & ~(uint64_t)(MEM_PAGE_SIZE - 1);
+
+	FILE *file = std::fopen(path, "wb");
+	if (!file) {
+		std::fprintf(stderr, "Error: Cannot create state file '%s'\n", path);
+		return -1;
+	}
+
+	bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+	for (const auto &region : regions) {
+		StateRegion record{region.first, region.second};
+		ok = ok && std::fwrite(&record, sizeof(record), 1, file) == 1;
+	}
+	for (const StateFile &record : open_files) {
+		const std::string &file_path = files->get(record.guest_fd).path;
+		ok = ok && std::fwrite(&record, sizeof(record), 1, file) == 1 &&
+			std::fwrite(file_path.data(), 1, file_path.size(), file) == file_path.size();
+	}
+	ok = ok && (runs.empty() || std::fwrite(runs.data(), sizeof(StateRun), runs.size(), file) == runs.size());
+	ok = ok && std::fwrite(zero, 1, header.data_offset - metadata, file) == header.data_offset - metadata;
+	ok = ok && (data.empty() || std::fwrite(data.data(), 1, data.size(), file) == data.size());
+
+	if (std::fclose(file) != 0 || !ok) {
+		std::fprintf(stderr, "Error: Failed to write state file '%s'\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+int Emulator::restore_state(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		std::fprintf(stderr, "Error: Cannot open state file '%s'\n", path);
+		return -1;
+	}
+
+	struct stat info;
+	void *base = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(StateHeader)) {
+		base = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	if (base == MAP_FAILED) {
+		std::fprintf(stderr, "Error: Invalid state file '%s'\n", path);
+		close(fd);
+		return -1;
+	}
+
+	const uint8_t *bytes = (const uint8_t*)base;
+	uint64_t size = (uint64_t)info.st_size;
+	StateHeader header;
+	std::memcpy(&header, bytes, sizeof(header));
+	uint64_t cursor = sizeof(header);
+	bool ok = header.magic == STATE_MAGIC && header.version == STATE_VERSION &&
+		header.data_offset <= size && (header.data_offset & (MEM_PAGE_SIZE - 1)) == 0;
+
+	std::vector<StateRegion> regions;
+	for (uint32_t i = 0; ok && i < header.region_count; i++) {
+		StateRegion region;
+		ok = cursor + sizeof(region) <= header.data_offset;
+		if (!ok) break;
+		std::memcpy(&region, bytes + cursor, sizeof(region));
+		cursor += sizeof(region);
+		ok = region.base < region.end && region.end <= 0x100000000ull;
+		regions.push_back(region);
+	}
+	if (ok) {
+		set_regions(&regions);
+	}
+
+	for (uint32_t i = 0; ok && i < header.file_count; i++) {
+		StateFile record;
+		ok = cursor + sizeof(record) <= header.data_offset;
+		if (!ok) break;
+		std::memcpy(&record, bytes + cursor, sizeof(record));
+		cursor += sizeof(record);
+		ok = cursor + record.path_length <= header.data_offset;
+		if (!ok) break;
+		std::string file_path((const char*)bytes + cursor, record.path_length);
+		cursor += record.path_length;
+		if (cpu->get_files()->reopen(record.guest_fd, file_path.c_str(), record.flags, record.offset) != 0) {
+			std::fprintf(stderr, "Warning: Cannot reopen guest file %d ('%s')\n",
+				record.guest_fd, file_path.c_str());
+		}
+	}
+
+	uint64_t data = header.data_offset;
+	for (uint32_t i = 0; ok && i < header.run_count; i++) {
+		StateRun run;
+		ok = cursor + sizeof(run) <= header.data_offset;
+		if (!ok) break;
+		std::memcpy(&run, bytes + cursor, sizeof(run));
+		cursor += sizeof(run);
+
+		uint64_t length = (uint64_t)run.page_count << MEM_PAGE_SHIFT;
+		uint32_t addr = run.first_page << MEM_PAGE_SHIFT;
+		ok = (uint64_t)run.first_page + run.page_count <= (1ull << (32 - MEM_PAGE_SHIFT)) && data + length <= size;
+		if (!ok) break;
+
+		/* Copy only if the range cannot be mapped */
+		if (memory->map_file(addr, fd, length, data) != MEM_OK) {
+			ok = memory->write_block(addr, bytes + data, (uint32_t)length) == MEM_OK;
+		}
+		data += length;
+	}
+
+	munmap(base, info.st_size);
+	close(fd);
+
+	if (!ok) {
+		std::fprintf(stderr, "Error: Invalid state file '%s'\n", path);
+		return -1;
+	}
+
+	CpuState state;
+	std::memcpy(state.x.data(), header.x, sizeof(header.x));
+	state.pc = header.pc;
+	state.running = header.running != 0;
+	cpu->set_state(state);
+	if (header.program_break) {
+		memory->set_program_break(header.program_break);
+	}
 	return 0;
 }
 
@@ -65,6 +440,10 @@ void Emulator::set_debug_mode(bool enable) {
 	cpu->set_debug_mode(enable);
 }
 
+void Emulator::set_trace(cpu_trace_t mode, FILE *file) {
+	cpu->set_trace(mode, file);
+}
+
 bool Emulator::is_running() const {
 	return cpu->is_running();
 }
@@ -0,0 +1,110 @@
+/* emulator_pool.cpp */
+#include "emulator_pool.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+EmulatorPool::EmulatorPool(uint32_t memory_size, mem_backend_t backend, size_t capacity, size_t warm)
+	: memory_size(memory_size), backend(backend), capacity(std::max<size_t>(capacity, 1)),
+	  warm(std::min(warm, std::max<size_t>(capacity, 1))), busy(false), stopping(false),
+	  created(0), reused(0) {
+	worker = std::thread(&EmulatorPool::run_worker, this);
+}
+
+EmulatorPool::~EmulatorPool() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	worker.join();
+}
+
+void EmulatorPool::run_worker() {
+	std::unique_lock<std::mutex> guard(lock);
+	while (true) {
+		wake.wait(guard, [this] { return stopping || !returned.empty() || warm > 0; });
+		if (stopping) {
+			break;
+		}
+
+		std::unique_ptr<Emulator> emulator;
+		bool ok = true;
+		busy = true;
+		if (!returned.empty()) {
+			emulator = std::move(returned.front());
+			returned.pop_front();
+			guard.unlock();
+			ok = emulator->reset() == 0;
+		} else {
+			warm--;
+			created++;
+			guard.unlock();
+			emulator = std::make_unique<Emulator>(memory_size, backend);
+		}
+
+		guard.lock();
+		if (ok && ready.size() < capacity) {
+			ready.push_back(std::move(emulator));
+		}
+		busy = false;
+		if (returned.empty() && warm == 0) {
+			idle.notify_all();
+		}
+
+		/* Surplus instances are destroyed off the caller's path too */
+		if (emulator) {
+			guard.unlock();
+			emulator.reset();
+			guard.lock();
+		}
+	}
+}
+
+std::unique_ptr<Emulator> EmulatorPool::acquire() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (!ready.empty()) {
+			std::unique_ptr<Emulator> emulator = std::move(ready.back());
+			ready.pop_back();
+			reused++;
+			return emulator;
+		}
+		created++;
+	}
+	return std::make_unique<Emulator>(memory_size, backend);
+}
+
+void EmulatorPool::release(std::unique_ptr<Emulator> emulator) {
+	if (!emulator) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		returned.push_back(std::move(emulator));
+	}
+	wake.notify_one();
+}
+
+void EmulatorPool::drain() {
+	std::unique_lock<std::mutex> guard(lock);
+	idle.wait(guard, [this] { return returned.empty() && warm == 0 && !busy; });
+}
+
+size_t EmulatorPool::get_ready_count() {
+	std::lock_guard<std::mutex> guard(lock);
+	return ready.size();
+}
+
+uint64_t EmulatorPool::get_created() {
+	std::lock_guard<std::mutex> guard(lock);
+	return created;
+}
+
+uint64_t EmulatorPool::get_reused() {
+	std::lock_guard<std::mutex> guard(lock);
+	return reused;
+}
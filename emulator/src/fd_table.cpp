@@ -0,0 +1,162 @@
+/* fd_table.cpp */
+#include "fd_table.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+FdTable::FdTable() : buffering(true), output_fd(-1), guest_writes(0), host_writes(0) {
+	for (int fd = 0; fd < FD_FIRST_FILE; fd++) {
+		files.push_back(GuestFile{fd, 0, std::string()});
+	}
+}
+
+FdTable::~FdTable() {
+	flush();
+	for (const GuestFile &file : files) {
+		if (file.host_fd >= 0 && !file.path.empty()) {
+			::close(file.host_fd);
+		}
+	}
+}
+
+void FdTable::reset() {
+	flush();
+	for (const GuestFile &file : files) {
+		if (file.host_fd >= 0 && !file.path.empty()) {
+			::close(file.host_fd);
+		}
+	}
+
+	files.clear();
+	for (int fd = 0; fd < FD_FIRST_FILE; fd++) {
+		files.push_back(GuestFile{fd, 0, std::string()});
+	}
+	buffering = true;
+	output.clear();
+	output_fd = -1;
+	guest_writes = 0;
+	host_writes = 0;
+}
+
+int FdTable::open(const char *path, int flags, mode_t mode) {
+	int host = ::open(path, flags, mode);
+	if (host < 0) {
+		return -1;
+	}
+
+	size_t fd = 0;
+	while (fd < files.size() && files[fd].host_fd >= 0) {
+		fd++;
+	}
+	if (fd == files.size()) {
+		files.push_back(GuestFile());
+	}
+
+	files[fd] = GuestFile{host, flags, std::string(path)};
+	return (int)fd;
+}
+
+int FdTable::reopen(int guest_fd, const char *path, int flags, int64_t offset) {
+	if (guest_fd < 0) {
+		return -1;
+	}
+
+	int host = ::open(path, flags & ~(O_CREAT | O_EXCL | O_TRUNC));
+	if (host < 0) {
+		return -1;
+	}
+	if (lseek(host, (off_t)offset, SEEK_SET) < 0 && offset != 0) {
+		::close(host);
+		return -1;
+	}
+
+	if ((size_t)guest_fd >= files.size()) {
+		files.resize(guest_fd + 1, GuestFile{-1, 0, std::string()});
+	}
+	if (files[guest_fd].host_fd >= 0 && !files[guest_fd].path.empty()) {
+		::close(files[guest_fd].host_fd);
+	}
+
+	files[guest_fd] = GuestFile{host, flags, std::string(path)};
+	return 0;
+}
+
+int FdTable::close(int guest_fd) {
+	int host = host_fd(guest_fd);
+	if (host < 0) {
+		return -1;
+	}
+	if (guest_fd == output_fd) {
+		flush();
+	}
+
+	files[guest_fd] = GuestFile{-1, 0, std::string()};
+	return ::close(host);
+}
+
+ssize_t FdTable::host_write(int host, const void *data, size_t count) {
+	const uint8_t *bytes = (const uint8_t*)data;
+	size_t done = 0;
+
+	while (done < count) {
+		ssize_t result = ::write(host, bytes + done, count - done);
+		host_writes++;
+		if (result < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		done += (size_t)result;
+	}
+	return (ssize_t)count;
+}
+
+ssize_t FdTable::write(int guest_fd, const void *data, size_t count) {
+	guest_writes++;
+
+	if (!is_buffered(guest_fd)) {
+		int host = host_fd(guest_fd);
+		if (host < 0) {
+			return -1;
+		}
+		ssize_t result = ::write(host, data, count);
+		host_writes++;
+		return result;
+	}
+
+	/* Keep stdout and stderr in order when they share a destination */
+	if (output_fd != guest_fd) {
+		flush();
+		output_fd = guest_fd;
+	}
+
+	if (output.size() + count > FD_OUTPUT_BUFFER) {
+		flush();
+		if (count >= FD_OUTPUT_BUFFER) {
+			return host_write(files[guest_fd].host_fd, data, count);
+		}
+		output_fd = guest_fd;
+	}
+
+	const uint8_t *bytes = (const uint8_t*)data;
+	output.insert(output.end(), bytes, bytes + count);
+	if (std::memchr(bytes, '\n', count)) {
+		flush();
+	}
+	return (ssize_t)count;
+}
+
+void FdTable::flush() {
+	if (output_fd >= 0 && !output.empty()) {
+		host_write(files[output_fd].host_fd, output.data(), output.size());
+	}
+	output.clear();
+	output_fd = -1;
+}
+
+void FdTable::set_buffered(bool enable) {
+	if (!enable) {
+		flush();
+	}
+	buffering = enable;
+}
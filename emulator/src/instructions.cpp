@@ -29,6 +29,98 @@ static int32_t extract_j_imm(uint32_t instruction) {
 	return sign_extend((uint32_t)imm, 21);
 }
 
+static instr_op_t resolve_op(uint8_t opcode, uint8_t funct3, uint8_t funct7, int32_t imm) {
+	static const instr_op_t alu_ops[8] = {
+		OP_ADD, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_OR, OP_AND
+	};
+	static const instr_op_t alu_imm_ops[8] = {
+		OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU, OP_XORI, OP_SRLI, OP_ORI, OP_ANDI
+	};
+	static const instr_op_t mul_div_ops[8] = {
+		OP_MUL, OP_MULH, OP_MULHSU, OP_MULHU, OP_DIV, OP_DIVU, OP_REM, OP_REMU
+	};
+
+	switch (opcode) {
+		case 0x33:
+			if (funct7 == 0x01) return mul_div_ops[funct3];
+			if (funct7 & 0x20) {
+				if (funct3 == 0x0) return OP_SUB;
+				if (funct3 == 0x5) return OP_SRA;
+			}
+			return alu_ops[funct3];
+
+		case 0x13:
+			/* srai is distinguished by bit 30 (funct7 field of the immediate) */
+			if (funct3 == 0x5 && (imm & 0x400)) return OP_SRAI;
+			return alu_imm_ops[funct3];
+
+		case 0x03:
+			switch (funct3) {
+				case 0x0: return OP_LB;
+				case 0x1: return OP_LH;
+				case 0x2: return OP_LW;
+				case 0x4: return OP_LBU;
+				case 0x5: return OP_LHU;
+			}
+			return OP_ILLEGAL;
+
+		case 0x23:
+			switch (funct3) {
+				case 0x0: return OP_SB;
+				case 0x1: return OP_SH;
+				case 0x2: return OP_SW;
+			}
+			return OP_ILLEGAL;
+
+		case 0x63:
+			switch (funct3) {
+				case 0x0: return OP_BEQ;
+				case 0x1: return OP_BNE;
+				case 0x4: return OP_BLT;
+				case 0x5: return OP_BGE;
+				case 0x6: return OP_BLTU;
+				case 0x7: return OP_BGEU;
+			}
+			return OP_ILLEGAL;
+
+		case 0x67: return OP_JALR;
+		case 0x6F: return OP_JAL;
+		case 0x37: return OP_LUI;
+		case 0x17: return OP_AUIPC;
+
+		case 0x73:
+			if (funct3 != 0x0) return (funct3 == 0x4) ? OP_ILLEGAL : OP_CSR;
+			if ((imm & 0xFFF) == 0x000) return OP_ECALL;
+			if ((imm & 0xFFF) == 0x001) return OP_EBREAK;
+			return OP_ILLEGAL;
+
+		case 0x2F:
+			/* A extension: funct5 selects the operation, aq/rl are implied */
+			if (funct3 != 0x2) return OP_ILLEGAL;
+			switch (funct7 >> 2) {
+				case 0x02: return OP_LR_W;
+				case 0x03: return OP_SC_W;
+				case 0x01: return OP_AMOSWAP_W;
+				case 0x00: return OP_AMOADD_W;
+				case 0x04: return OP_AMOXOR_W;
+				case 0x0C: return OP_AMOAND_W;
+				case 0x08: return OP_AMOOR_W;
+				case 0x10: return OP_AMOMIN_W;
+				case 0x14: return OP_AMOMAX_W;
+				case 0x18: return OP_AMOMINU_W;
+				case 0x1C: return OP_AMOMAXU_W;
+			}
+			return OP_ILLEGAL;
+
+		case 0x0F:
+			/* fence and fence.i */
+			return (funct3 <= 0x1) ? OP_FENCE : OP_ILLEGAL;
+
+		default:
+			return OP_ILLEGAL;
+	}
+}
+
 bool Instruction::decode(uint32_t instruction) {
 	raw = instruction;
 	imm = 0;
@@ -43,6 +135,7 @@ bool Instruction::decode(uint32_t instruction) {
 
 	switch (opcode) {
 		case 0x33:	/* R-type */
+		case 0x2F:	/* AMO */
 			format = INSTR_R_TYPE;
 			imm = 0;
 			break;
@@ -51,6 +144,7 @@ bool Instruction::decode(uint32_t instruction) {
 		case 0x13:	/* OP-IMM */
 		case 0x67:	/* JALR */
 		case 0x73:	/* SYSTEM */
+		case 0x0F:	/* MISC-MEM */
 			format = INSTR_I_TYPE;
 			imm = sign_extend((instruction >> 20) & 0xFFF, 12);
 			break;
@@ -81,44 +175,10 @@ bool Instruction::decode(uint32_t instruction) {
 			break;
 
 		default:
+			op = OP_ILLEGAL;
 			return false;
 	}
 
+	op = resolve_op(opcode, funct3, funct7, imm);
 	return true;
 }
-
-instr_format_t Instruction::get_format() const {
-	return format;
-}
-
-uint32_t Instruction::get_raw() const {
-	return raw;
-}
-
-int32_t Instruction::get_imm() const {
-	return imm;
-}
-
-uint8_t Instruction::get_opcode() const {
-	return opcode;
-}
-
-uint8_t Instruction::get_rd() const {
-	return rd;
-}
-
-uint8_t Instruction::get_rs1() const {
-	return rs1;
-}
-
-uint8_t Instruction::get_rs2() const {
-	return rs2;
-}
-
-uint8_t Instruction::get_funct3() const {
-	return funct3;
-}
-
-uint8_t Instruction::get_funct7() const {
-	return funct7;
-}
\ No newline at end of file
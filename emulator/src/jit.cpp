@@ -0,0 +1,431 @@
+/* jit.cpp */
+#include "jit.hpp"
+#include "memory.hpp"
+#include "instructions.hpp"
+#include "block_cache.hpp"
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+
+/* Load helper result flag: access faulted */
+#define JIT_LOAD_FAULT (1ull << 32)
+
+/* Store helper results */
+#define JIT_STORE_OK 0
+#define JIT_STORE_FAULT 1
+#define JIT_STORE_STALE 2
+
+/* x86-64 register numbers */
+#define X86_EAX 0
+#define X86_ECX 1
+#define X86_EDX 2
+#define X86_ESI 6
+#define X86_EDI 7
+
+static uint64_t jit_load(Memory *mem, uint32_t addr, uint32_t op) {
+	switch (op) {
+		case OP_LB: {
+			uint8_t value;
+			if (!mem->load(addr, &value)) return JIT_LOAD_FAULT;
+			return (uint32_t)(int32_t)(int8_t)value;
+		}
+
+		case OP_LH: {
+			uint16_t value;
+			if (!mem->load(addr, &value)) return JIT_LOAD_FAULT;
+			return (uint32_t)(int32_t)(int16_t)value;
+		}
+
+		case OP_LW: {
+			uint32_t value;
+			if (!mem->load(addr, &value)) return JIT_LOAD_FAULT;
+			return value;
+		}
+
+		case OP_LBU: {
+			uint8_t value;
+			if (!mem->load(addr, &value)) return JIT_LOAD_FAULT;
+			return value;
+		}
+
+		case OP_LHU: {
+			uint16_t value;
+			if (!mem->load(addr, &value)) return JIT_LOAD_FAULT;
+			return value;
+		}
+
+		default:
+			return JIT_LOAD_FAULT;
+	}
+}
+
+static uint32_t jit_store(Memory *mem, uint32_t addr, uint32_t value, uint32_t op) {
+	uint64_t generation = mem->get_block_cache()->get_generation();
+	bool ok;
+
+	switch (op) {
+		case OP_SB: ok = mem->store(addr, (uint8_t)value); break;
+		case OP_SH: ok = mem->store(addr, (uint16_t)value); break;
+		case OP_SW: ok = mem->store(addr, value); break;
+		default: return JIT_STORE_FAULT;
+	}
+
+	if (!ok) return JIT_STORE_FAULT;
+	return mem->get_block_cache()->get_generation() != generation ? JIT_STORE_STALE : JIT_STORE_OK;
+}
+
+static uint32_t jit_div_rem(uint32_t a, uint32_t b, uint32_t op) {
+	switch (op) {
+		case OP_DIV:
+			if (b == 0) return 0xFFFFFFFF;
+			if (a == 0x80000000 && b == 0xFFFFFFFF) return a;
+			return (uint32_t)((int32_t)a / (int32_t)b);
+		case OP_DIVU:
+			return b == 0 ? 0xFFFFFFFF : a / b;
+		case OP_REM:
+			if (b == 0) return a;
+			if (a == 0x80000000 && b == 0xFFFFFFFF) return 0;
+			return (uint32_t)((int32_t)a % (int32_t)b);
+		default:
+			return b == 0 ? a : a % b;
+	}
+}
+
+JitCompiler::JitCompiler() : buffer(nullptr), capacity(0), used(0), compiled_blocks(0) {
+}
+
+JitCompiler::~JitCompiler() {
+	if (buffer) {
+		munmap(buffer, capacity);
+	}
+}
+
+void JitCompiler::reset() {
+	used = 0;
+	compiled_blocks = 0;
+}
+
+void JitCompiler::emit8(uint8_t byte) {
+	code.push_back(byte);
+}
+
+void JitCompiler::emit32(uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		code.push_back((uint8_t)(value >> (8 * i)));
+	}
+}
+
+void JitCompiler::emit64(uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		code.push_back((uint8_t)(value >> (8 * i)));
+	}
+}
+
+/* mov host_reg, dword [rbx + guest_reg*4] */
+void JitCompiler::emit_load_reg(uint8_t host_reg, uint8_t guest_reg) {
+	emit8(0x8B);
+	emit8(0x43 | (host_reg << 3));
+	emit8(guest_reg * 4);
+}
+
+/* mov dword [rbx + guest_reg*4], eax (writes to x0 are dropped) */
+void JitCompiler::emit_store_eax(uint8_t guest_reg) {
+	if (guest_reg == 0) return;
+	emit8(0x89);
+	emit8(0x43);
+	emit8(guest_reg * 4);
+}
+
+/* mov rax, imm64; call rax */
+void JitCompiler::emit_call(const void *target) {
+	emit8(0x48); emit8(0xB8);
+	emit64((uint64_t)(uintptr_t)target);
+	emit8(0xFF); emit8(0xD0);
+}
+
+void JitCompiler::emit_epilogue() {
+	emit8(0x41); emit8(0x5D);	/* pop r13 */
+	emit8(0x41); emit8(0x5C);	/* pop r12 */
+	emit8(0x5B);			/* pop rbx */
+	emit8(0xC3);			/* ret */
+}
+
+/* Store next pc, return result */
+void JitCompiler::emit_exit(int32_t pc_offset, uint32_t next_pc, uint32_t result) {
+	emit8(0xC7); emit8(0x83);	/* mov dword [rbx + disp32], imm32 */
+	emit32((uint32_t)pc_offset);
+	emit32(next_pc);
+	emit8(0xB8);			/* mov eax, imm32 */
+	emit32(result);
+	emit_epilogue();
+}
+
+native_block_t JitCompiler::install() {
+	if (!buffer) {
+		void *mapping = mmap(nullptr, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapping == MAP_FAILED) {
+			return nullptr;
+		}
+		buffer = (uint8_t*)mapping;
+		capacity = JIT_BUFFER_SIZE;
+	}
+
+	if (used + code.size() > capacity) {
+		return nullptr;
+	}
+
+	/* Keep the buffer W^X: writable only while copying new code in */
+	if (mprotect(buffer, capacity, PROT_READ | PROT_WRITE) != 0) {
+		return nullptr;
+	}
+	uint8_t *entry = buffer + used;
+	std::memcpy(entry, code.data(), code.size());
+	used += (code.size() + 15) & ~(size_t)15;
+	if (mprotect(buffer, capacity, PROT_READ | PROT_EXEC) != 0) {
+		return nullptr;
+	}
+
+	compiled_blocks++;
+	return reinterpret_cast<native_block_t>(entry);
+}
+
+#if defined(__x86_64__)
+
+native_block_t JitCompiler::compile(const Block *block, int32_t pc_offset) {
+	const std::vector<MicroOp> &ops = block->ops;
+	size_t length = ops.size();
+
+	code.clear();
+
+	/* Prologue: rbx = registers, r12 = memory (r13 keeps rsp 16-byte aligned) */
+	emit8(0x53);			/* push rbx */
+	emit8(0x41); emit8(0x54);	/* push r12 */
+	emit8(0x41); emit8(0x55);	/* push r13 */
+	emit8(0x48); emit8(0x89); emit8(0xFB);	/* mov rbx, rdi */
+	emit8(0x49); emit8(0x89); emit8(0xF4);	/* mov r12, rsi */
+
+	for (size_t i = 0; i < length; i++) {
+		const MicroOp *uop = &ops[i];
+		uint32_t instr_pc = block->start_pc + 4 * (uint32_t)i;
+
+		switch (uop->op) {
+			case OP_LUI:
+				if (uop->rd != 0) {
+					emit8(0xC7); emit8(0x43); emit8(uop->rd * 4);
+					emit32(uop->imm);
+				}
+				break;
+
+			/* op eax, imm32 */
+			case OP_ADDI:
+			case OP_XORI:
+			case OP_ORI:
+			case OP_ANDI: {
+				static const uint8_t opcode_for[] = { 0x05, 0x35, 0x0D, 0x25 };
+				int index = uop->op == OP_ADDI ? 0 : uop->op == OP_XORI ? 1 : uop->op == OP_ORI ? 2 : 3;
+				emit_load_reg(X86_EAX, uop->rs1);
+				emit8(opcode_for[index]);
+				emit32(uop->imm);
+				emit_store_eax(uop->rd);
+				break;
+			}
+
+			/* cmp eax, imm32; setcc al; movzx eax, al */
+			case OP_SLTI:
+			case OP_SLTIU:
+				emit_load_reg(X86_EAX, uop->rs1);
+				emit8(0x3D);
+				emit32(uop->imm);
+				emit8(0x0F); emit8(uop->op == OP_SLTI ? 0x9C : 0x92); emit8(0xC0);
+				emit8(0x0F); emit8(0xB6); emit8(0xC0);
+				emit_store_eax(uop->rd);
+				break;
+
+			/* shl/shr/sar eax, imm8 */
+			case OP_SLLI:
+			case OP_SRLI:
+			case OP_SRAI:
+				emit_load_reg(X86_EAX, uop->rs1);
+				emit8(0xC1);
+				emit8(uop->op == OP_SLLI ? 0xE0 : uop->op == OP_SRLI ? 0xE8 : 0xF8);
+				emit8(uop->imm & 0x1F);
+				emit_store_eax(uop->rd);
+				break;
+
+			/* op eax, dword [rbx + rs2*4] */
+			case OP_ADD:
+			case OP_SUB:
+			case OP_XOR:
+			case OP_OR:
+			case OP_AND: {
+				uint8_t opcode = uop->op == OP_ADD ? 0x03 : uop->op == OP_SUB ? 0x2B :
+					uop->op == OP_XOR ? 0x33 : uop->op == OP_OR ? 0x0B : 0x23;
+				emit_load_reg(X86_EAX, uop->rs1);
+				emit8(opcode); emit8(0x43); emit8(uop->rs2 * 4);
+				emit_store_eax(uop->rd);
+				break;
+			}
+
+			case OP_SLT:
+			case OP_SLTU:
+				emit_load_reg(X86_EAX, uop->rs1);
+				emit8(0x3B); emit8(0x43); emit8(uop->rs2 * 4);
+				emit8(0x0F); emit8(uop->op == OP_SLT ? 0x9C : 0x92); emit8(0xC0);
+				emit8(0x0F); emit8(0xB6); emit8(0xC0);
+				emit_store_eax(uop->rd);
+				break;
+
+			/* shl/shr/sar eax, cl (hardware masks the count to 5 bits) */
+			case OP_SLL:
+			case OP_SRL:
+			case OP_SRA:
+				emit_load_reg(X86_EAX, uop->rs1);
+				emit_load_reg(X86_ECX, uop->rs2);
+				emit8(0xD3);
+				emit8(uop->op == OP_SLL ? 0xE0 : uop->op == OP_SRL ? 0xE8 : 0xF8);
+				emit_store_eax(uop->rd);
+				break;
+
+			case OP_MUL:
+				emit_load_reg(X86_EAX, uop->rs1);
+				emit8(0x0F); emit8(0xAF); emit8(0x43); emit8(uop->rs2 * 4);	/* imul eax, [rs2] */
+				emit_store_eax(uop->rd);
+				break;
+
+			/* 64-bit product, keep the upper half */
+			case OP_MULH:
+			case OP_MULHSU:
+			case OP_MULHU:
+				if (uop->op == OP_MULHU) {
+					emit_load_reg(X86_EAX, uop->rs1);
+				} else {
+					emit8(0x48); emit8(0x63); emit8(0x43); emit8(uop->rs1 * 4);	/* movsxd rax, [rs1] */
+				}
+				if (uop->op == OP_MULH) {
+					emit8(0x48); emit8(0x63); emit8(0x4B); emit8(uop->rs2 * 4);	/* movsxd rcx, [rs2] */
+				} else {
+					emit_load_reg(X86_ECX, uop->rs2);
+				}
+				emit8(0x48); emit8(0x0F); emit8(0xAF); emit8(0xC1);	/* imul rax, rcx */
+				emit8(0x48); emit8(0xC1); emit8(0xE8); emit8(0x20);	/* shr rax, 32 */
+				emit_store_eax(uop->rd);
+				break;
+
+			case OP_DIV:
+			case OP_DIVU:
+			case OP_REM:
+			case OP_REMU:
+				emit_load_reg(X86_EDI, uop->rs1);
+				emit_load_reg(X86_ESI, uop->rs2);
+				emit8(0xBA); emit32(uop->op);	/* mov edx, op */
+				emit_call((const void*)&jit_div_rem);
+				emit_store_eax(uop->rd);
+				break;
+
+			case OP_LB:
+			case OP_LH:
+			case OP_LW:
+			case OP_LBU:
+			case OP_LHU: {
+				emit_load_reg(X86_EAX, uop->rs1);
+				emit8(0x05); emit32(uop->imm);		/* add eax, imm */
+				emit8(0x89); emit8(0xC6);		/* mov esi, eax */
+				emit8(0x4C); emit8(0x89); emit8(0xE7);	/* mov rdi, r12 */
+				emit8(0xBA); emit32(uop->op);		/* mov edx, op */
+				emit_call((const void*)&jit_load);
+				emit8(0x48); emit8(0x89); emit8(0xC1);	/* mov rcx, rax */
+				emit8(0x48); emit8(0xC1); emit8(0xE9); emit8(0x20);	/* shr rcx, 32 */
+				emit8(0x85); emit8(0xC9);		/* test ecx, ecx */
+				emit8(0x74); emit8(0x00);		/* jz ok */
+				size_t patch = code.size();
+				emit_exit(pc_offset, instr_pc + 4, BLOCK_RESULT(BLOCK_EXIT_FAULT, i));
+				code[patch - 1] = (uint8_t)(code.size() - patch);
+				emit_store_eax(uop->rd);
+				break;
+			}
+
+			case OP_SB:
+			case OP_SH:
+			case OP_SW: {
+				emit_load_reg(X86_EAX, uop->rs1);
+				emit8(0x05); emit32(uop->imm);		/* add eax, imm */
+				emit8(0x89); emit8(0xC6);		/* mov esi, eax */
+				emit_load_reg(X86_EDX, uop->rs2);
+				emit8(0xB9); emit32(uop->op);		/* mov ecx, op */
+				emit8(0x4C); emit8(0x89); emit8(0xE7);	/* mov rdi, r12 */
+				emit_call((const void*)&jit_store);
+				emit8(0x85); emit8(0xC0);		/* test eax, eax */
+				emit8(0x74); emit8(0x00);		/* jz ok */
+				size_t patch_ok = code.size();
+				emit8(0x83); emit8(0xF8); emit8(JIT_STORE_FAULT);	/* cmp eax, FAULT */
+				emit8(0x75); emit8(0x00);		/* jne stale */
+				size_t patch_stale = code.size();
+				emit_exit(pc_offset, instr_pc + 4, BLOCK_RESULT(BLOCK_EXIT_FAULT, i));
+				code[patch_stale - 1] = (uint8_t)(code.size() - patch_stale);
+				emit_exit(pc_offset, instr_pc + 4, BLOCK_RESULT(BLOCK_EXIT_STALE, i + 1));
+				code[patch_ok - 1] = (uint8_t)(code.size() - patch_ok);
+				break;
+			}
+
+			case OP_BEQ:
+			case OP_BNE:
+			case OP_BLT:
+			case OP_BGE:
+			case OP_BLTU:
+			case OP_BGEU: {
+				uint8_t jcc = uop->op == OP_BEQ ? 0x74 : uop->op == OP_BNE ? 0x75 :
+					uop->op == OP_BLT ? 0x7C : uop->op == OP_BGE ? 0x7D :
+					uop->op == OP_BLTU ? 0x72 : 0x73;
+				emit_load_reg(X86_EAX, uop->rs1);
+				emit8(0x3B); emit8(0x43); emit8(uop->rs2 * 4);	/* cmp eax, [rs2] */
+				emit8(jcc); emit8(0x00);
+				size_t patch = code.size();
+				emit_exit(pc_offset, block->end_pc, BLOCK_RESULT(BLOCK_EXIT_FALLTHROUGH, length));
+				code[patch - 1] = (uint8_t)(code.size() - patch);
+				emit_exit(pc_offset, uop->imm, BLOCK_RESULT(BLOCK_EXIT_TAKEN, length));
+				return install();
+			}
+
+			case OP_JAL:
+				if (uop->rd != 0) {
+					emit8(0xC7); emit8(0x43); emit8(uop->rd * 4);
+					emit32(block->end_pc);
+				}
+				emit_exit(pc_offset, uop->imm, BLOCK_RESULT(BLOCK_EXIT_TAKEN, length));
+				return install();
+
+			case OP_JALR:
+				emit_load_reg(X86_EAX, uop->rs1);
+				emit8(0x05); emit32(uop->imm);		/* add eax, imm */
+				emit8(0x25); emit32(~1u);		/* and eax, ~1 */
+				if (uop->rd != 0) {
+					emit8(0xC7); emit8(0x43); emit8(uop->rd * 4);
+					emit32(block->end_pc);
+				}
+				emit8(0x89); emit8(0x83); emit32((uint32_t)pc_offset);	/* mov [pc], eax */
+				emit8(0xB8); emit32(BLOCK_RESULT(BLOCK_EXIT_INDIRECT, length));
+				emit_epilogue();
+				return install();
+
+			default:
+				/* ecall/ebreak/illegal/atomic/fence/csr terminator: the interpreter runs it */
+				emit_exit(pc_offset, instr_pc, BLOCK_RESULT(BLOCK_EXIT_SYSTEM, i));
+				return install();
+		}
+	}
+
+	/* Block was cut at the size limit or a page boundary */
+	emit_exit(pc_offset, block->end_pc, BLOCK_RESULT(BLOCK_EXIT_FALLTHROUGH, length));
+	return install();
+}
+
+#else
+
+native_block_t JitCompiler::compile(const Block *block, int32_t pc_offset) {
+	(void)block;
+	(void)pc_offset;
+	return nullptr;
+}
+
+#endif
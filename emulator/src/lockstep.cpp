@@ -0,0 +1,608 @@
+/* lockstep.cpp */
+#include "lockstep.hpp"
+#include "cpu.hpp"
+#include "memory.hpp"
+#include "decode_cache.hpp"
+#include "instructions.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/* Signed and widened views of a lane vector (mulh*, div, rem, signed compares) */
+typedef int32_t lane_svec_t __attribute__((vector_size(LOCKSTEP_VECTOR_LANES * 4)));
+typedef int64_t lane_wide_t __attribute__((vector_size(LOCKSTEP_VECTOR_LANES * 8)));
+typedef uint64_t lane_uwide_t __attribute__((vector_size(LOCKSTEP_VECTOR_LANES * 8)));
+
+static uint32_t lane_count(uint64_t lanes) {
+	return (uint32_t)__builtin_popcountll(lanes);
+}
+
+/**
+ * Execute an ALU or M operation on one vector of lanes
+ *
+ * op: OP_LUI (result is b), R-type ALU or M operation
+ * a: First operands
+ * b: Second operands
+ *
+ * Output: Results, with the same rules as CPU::execute_alu and
+ *         CPU::execute_mul_div
+ */
+static lane_vec_t execute_lanes(instr_op_t op, lane_vec_t a, lane_vec_t b) {
+	lane_svec_t sa = (lane_svec_t)a;
+	lane_svec_t sb = (lane_svec_t)b;
+	lane_vec_t shift = b & 0x1F;
+
+	switch (op) {
+		case OP_LUI: return b;
+		case OP_ADD: return a + b;
+		case OP_SUB: return a - b;
+		case OP_SLL: return a << shift;
+		case OP_SLT: return (lane_vec_t)(sa < sb) & 1;
+		case OP_SLTU: return (lane_vec_t)(a < b) & 1;
+		case OP_XOR: return a ^ b;
+		case OP_SRL: return a >> shift;
+		case OP_SRA: return (lane_vec_t)(sa >> (lane_svec_t)shift);
+		case OP_OR: return a | b;
+		case OP_AND: return a & b;
+		case OP_MUL: return a * b;
+
+		case OP_MULH: {
+			lane_wide_t product = __builtin_convertvector(sa, lane_wide_t) * __builtin_convertvector(sb, lane_wide_t);
+			return __builtin_convertvector(product >> 32, lane_vec_t);
+		}
+		case OP_MULHSU: {
+			lane_wide_t product = __builtin_convertvector(sa, lane_wide_t) *
+				(lane_wide_t)__builtin_convertvector(b, lane_uwide_t);
+			return __builtin_convertvector(product >> 32, lane_vec_t);
+		}
+		case OP_MULHU: {
+			lane_uwide_t product = __builtin_convertvector(a, lane_uwide_t) * __builtin_convertvector(b, lane_uwide_t);
+			return __builtin_convertvector(product >> 32, lane_vec_t);
+		}
+
+		/* Lanes with a fixed result divide by 1: INT_MIN / -1 then gives INT_MIN and remainder 0 */
+		case OP_DIV:
+		case OP_REM: {
+			lane_svec_t zero = sb == 0;
+			lane_svec_t fixed = zero | ((sa == INT32_MIN) & (sb == -1));
+			lane_svec_t divisor = (sb & ~fixed) | (fixed & 1);
+			if (op == OP_DIV) {
+				return (lane_vec_t)((sa / divisor) | zero);
+			}
+			return (lane_vec_t)(((sa % divisor) & ~zero) | (sa & zero));
+		}
+		case OP_DIVU:
+		case OP_REMU: {
+			lane_vec_t zero = (lane_vec_t)(b == 0);
+			lane_vec_t divisor = b | (zero & 1);
+			if (op == OP_DIVU) {
+				return (a / divisor) | zero;
+			}
+			return ((a % divisor) & ~zero) | (a & zero);
+		}
+
+		default:
+			return a;
+	}
+}
+
+/**
+ * Evaluate a branch condition on one vector of lanes
+ *
+ * op: Branch operation
+ * a: rs1 values
+ * b: rs2 values
+ *
+ * Output: All ones in lanes that take the branch
+ */
+static lane_vec_t branch_lanes(instr_op_t op, lane_vec_t a, lane_vec_t b) {
+	lane_svec_t sa = (lane_svec_t)a;
+	lane_svec_t sb = (lane_svec_t)b;
+
+	switch (op) {
+		case OP_BEQ: return (lane_vec_t)(a == b);
+		case OP_BNE: return (lane_vec_t)(a != b);
+		case OP_BLT: return (lane_vec_t)(sa < sb);
+		case OP_BGE: return (lane_vec_t)(sa >= sb);
+		case OP_BLTU: return (lane_vec_t)(a < b);
+		default: return (lane_vec_t)(a >= b);
+	}
+}
+
+static bool load_value(Memory *mem, instr_op_t op, uint32_t addr, uint32_t *value) {
+	switch (op) {
+		case OP_LB: {
+			uint8_t byte;
+			if (!mem->load(addr, &byte)) return false;
+			*value = sign_extend(byte, 8);
+			return true;
+		}
+		case OP_LH: {
+			uint16_t half;
+			if (!mem->load(addr, &half)) return false;
+			*value = sign_extend(half, 16);
+			return true;
+		}
+		case OP_LBU: {
+			uint8_t byte;
+			if (!mem->load(addr, &byte)) return false;
+			*value = byte;
+			return true;
+		}
+		case OP_LHU: {
+			uint16_t half;
+			if (!mem->load(addr, &half)) return false;
+			*value = half;
+			return true;
+		}
+		default:
+			return mem->load(addr, value);
+	}
+}
+
+static bool store_value(Memory *mem, instr_op_t op, uint32_t addr, uint32_t value) {
+	switch (op) {
+		case OP_SB: return mem->store(addr, (uint8_t)value);
+		case OP_SH: return mem->store(addr, (uint16_t)value);
+		default: return mem->store(addr, value);
+	}
+}
+
+Lockstep::Lockstep(const std::vector<Emulator*> &lanes)
+	: lanes(lanes.begin(), lanes.begin() + std::min(lanes.size(), (size_t)LOCKSTEP_MAX_LANES)),
+	  x(), mask(), mask_lanes(0), active(0), split(0), limit(0), retired(), generation(),
+	  checked_page(UINT32_MAX), checked_lanes(0), steps(0), lane_steps(0), splits(0) {
+	vectors = ((uint32_t)this->lanes.size() + LOCKSTEP_VECTOR_LANES - 1) / LOCKSTEP_VECTOR_LANES;
+
+	/* Groups are referenced by index while lanes join, so they must not reallocate */
+	groups.reserve(LOCKSTEP_MAX_LANES);
+}
+
+void Lockstep::load_lane(uint32_t lane) {
+	CpuState state = lanes[lane]->get_cpu()->get_state();
+	for (uint8_t reg = 1; reg < 32; reg++) {
+		set_lane(reg, lane, state.x[reg]);
+	}
+}
+
+void Lockstep::store_lane(uint32_t lane, uint32_t pc) {
+	CpuState state;
+	state.x[0] = 0;
+	for (uint8_t reg = 1; reg < 32; reg++) {
+		state.x[reg] = get_lane(reg, lane);
+	}
+	state.pc = pc;
+	state.running = true;
+	lanes[lane]->get_cpu()->set_state(state);
+}
+
+void Lockstep::credit(LaneGroup *group) {
+	if (group->executed == 0) {
+		return;
+	}
+	for (uint64_t rest = group->lanes; rest; rest &= rest - 1) {
+		uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+		retired[lane] += group->executed;
+		lanes[lane]->get_cpu()->add_retired(group->executed);
+	}
+	group->budget -= group->executed;
+	group->executed = 0;
+}
+
+void Lockstep::detach(size_t index, uint64_t leaving) {
+	LaneGroup &group = groups[index];
+	credit(&group);
+	group.lanes &= ~leaving;
+	active &= ~leaving;
+	if (!group.lanes) {
+		group = groups.back();
+		groups.pop_back();
+	}
+}
+
+void Lockstep::join(uint32_t lane, uint32_t pc) {
+	uint64_t left = limit - retired[lane];
+	active |= 1ull << lane;
+
+	for (LaneGroup &group : groups) {
+		if (group.pc == pc) {
+			credit(&group);
+			group.lanes |= 1ull << lane;
+			group.budget = std::min(group.budget, left);
+			return;
+		}
+	}
+	groups.push_back(LaneGroup{pc, 1ull << lane, 0, left});
+}
+
+void Lockstep::split_lane(uint32_t lane, uint32_t pc) {
+	store_lane(lane, pc);
+	split |= 1ull << lane;
+	splits++;
+}
+
+void Lockstep::step_scalar(uint32_t lane, uint32_t pc) {
+	Emulator *emulator = lanes[lane];
+	CPU *cpu = emulator->get_cpu();
+	store_lane(lane, pc);
+
+	RunResult result = cpu->run(emulator->get_memory(), ENGINE_SWITCH, 1);
+	retired[lane] += result.retired;
+	if (result.reason != RUN_BUDGET) {
+		results[lane] = RunResult{result.reason, result.status, retired[lane]};
+		return;
+	}
+	if (emulator->get_memory()->get_code_generation() != generation[lane]) {
+		/* Its code may no longer match the other lanes' */
+		split |= 1ull << lane;
+		splits++;
+		return;
+	}
+	if (retired[lane] >= limit) {
+		results[lane] = RunResult{RUN_BUDGET, CPU_OK, retired[lane]};
+		return;
+	}
+
+	load_lane(lane);
+	join(lane, cpu->get_pc());
+}
+
+uint64_t Lockstep::check_code(uint32_t page, uint64_t candidates) {
+	CodePage &entry = code_pages[page];
+	uint32_t addr = page << CODE_PAGE_SHIFT;
+	std::vector<uint8_t> bytes(CODE_PAGE_SIZE);
+	uint64_t failed = 0;
+
+	for (uint64_t rest = candidates & ~entry.checked; rest; rest &= rest - 1) {
+		uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+		Memory *mem = lanes[lane]->get_memory();
+		if (mem->read_block(addr, bytes.data(), CODE_PAGE_SIZE) != MEM_OK) {
+			failed |= 1ull << lane;
+			continue;
+		}
+		if (entry.bytes.empty()) {
+			entry.bytes = bytes;
+		} else if (bytes != entry.bytes) {
+			failed |= 1ull << lane;
+			continue;
+		}
+
+		/* Writes to the page now change the lane's code generation */
+		mem->mark_code(addr);
+		entry.checked |= 1ull << lane;
+	}
+	return failed;
+}
+
+void Lockstep::execute_vectors(instr_op_t op, uint8_t rd, uint8_t rs1, uint8_t rs2, bool use_imm, uint32_t imm) {
+	if (rd == 0) {
+		return;
+	}
+
+	lane_vec_t constant = {};
+	constant += imm;
+	for (uint32_t vector = 0; vector < vectors; vector++) {
+		lane_vec_t result = execute_lanes(op, x[rs1][vector], use_imm ? constant : x[rs2][vector]);
+		x[rd][vector] = (result & mask[vector]) | (x[rd][vector] & ~mask[vector]);
+	}
+}
+
+uint32_t Lockstep::advance(size_t index, uint32_t next) {
+	LaneGroup &group = groups[index];
+	uint32_t count = lane_count(group.lanes);
+	steps++;
+	lane_steps += count;
+	group.executed++;
+	group.pc = next;
+
+	/* Reconverge with lanes already waiting there */
+	for (size_t other = 0; groups.size() > 1 && other < groups.size(); other++) {
+		if (other != index && groups[other].pc == next) {
+			credit(&group);
+			credit(&groups[other]);
+			groups[other].lanes |= group.lanes;
+			groups[other].budget = std::min(groups[other].budget, group.budget);
+			group = groups.back();
+			groups.pop_back();
+			break;
+		}
+	}
+	return count;
+}
+
+uint32_t Lockstep::scatter(size_t index, uint64_t stepped, uint64_t leaving, const uint32_t *targets) {
+	uint32_t count = lane_count(stepped);
+	steps++;
+	lane_steps += count;
+	groups[index].executed++;
+	detach(index, stepped);
+	for (uint64_t rest = stepped; rest; rest &= rest - 1) {
+		uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+		if (leaving & (1ull << lane)) {
+			split_lane(lane, targets[lane]);
+		} else {
+			join(lane, targets[lane]);
+		}
+	}
+	return count;
+}
+
+uint32_t Lockstep::step_group() {
+	size_t index = 0;
+	for (size_t other = 1; other < groups.size(); other++) {
+		if (groups[other].pc < groups[index].pc) {
+			index = other;
+		}
+	}
+	uint32_t pc = groups[index].pc;
+	uint64_t members = groups[index].lanes;
+
+	if (groups[index].executed == groups[index].budget) {
+		/* Lanes at the limit stop here; the others go on as a new group */
+		detach(index, members);
+		for (uint64_t rest = members; rest; rest &= rest - 1) {
+			uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+			if (retired[lane] >= limit) {
+				store_lane(lane, pc);
+				results[lane] = RunResult{RUN_BUDGET, CPU_OK, retired[lane]};
+			} else {
+				join(lane, pc);
+			}
+		}
+		return 0;
+	}
+
+	uint32_t page = pc >> CODE_PAGE_SHIFT;
+	if (page != checked_page || (members & ~checked_lanes)) {
+		uint64_t failed = check_code(page, members);
+		if (failed) {
+			detach(index, failed);
+			for (uint64_t rest = failed; rest; rest &= rest - 1) {
+				uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+				split_lane(lane, pc);
+			}
+			return 0;
+		}
+		checked_page = page;
+		checked_lanes = code_pages[page].checked;
+	}
+
+	/* Decode once, in the first lane (copied: a store below may drop the page) */
+	Memory *mem = lanes[__builtin_ctzll(members)]->get_memory();
+	const Instruction *cached = mem->lookup_decoded(pc);
+	uint32_t raw;
+	if (!cached && mem->read32(pc, &raw) == MEM_OK) {
+		cached = mem->insert_decoded(pc, raw);
+	}
+	if (!cached) {
+		detach(index, members);
+		for (uint64_t rest = members; rest; rest &= rest - 1) {
+			uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+			step_scalar(lane, pc);
+		}
+		return lane_count(members);
+	}
+	Instruction instr = *cached;
+
+	if (members != mask_lanes) {
+		for (uint32_t vector = 0; vector < vectors; vector++) {
+			for (uint32_t slot = 0; slot < LOCKSTEP_VECTOR_LANES; slot++) {
+				bool on = (members >> (vector * LOCKSTEP_VECTOR_LANES + slot)) & 1;
+				mask[vector][slot] = on ? 0xFFFFFFFF : 0;
+			}
+		}
+		mask_lanes = members;
+	}
+
+	instr_op_t op = instr.get_op();
+	uint8_t rd = instr.get_rd();
+	uint8_t rs1 = instr.get_rs1();
+	uint8_t rs2 = instr.get_rs2();
+	uint32_t imm = (uint32_t)instr.get_imm();
+	uint32_t next = pc + 4;
+	uint32_t targets[LOCKSTEP_MAX_LANES];
+
+	switch (op) {
+		case OP_LUI: execute_vectors(OP_LUI, rd, 0, 0, true, imm); break;
+		case OP_AUIPC: execute_vectors(OP_LUI, rd, 0, 0, true, pc + imm); break;
+		case OP_ADDI: execute_vectors(OP_ADD, rd, rs1, 0, true, imm); break;
+		case OP_SLTI: execute_vectors(OP_SLT, rd, rs1, 0, true, imm); break;
+		case OP_SLTIU: execute_vectors(OP_SLTU, rd, rs1, 0, true, imm); break;
+		case OP_XORI: execute_vectors(OP_XOR, rd, rs1, 0, true, imm); break;
+		case OP_ORI: execute_vectors(OP_OR, rd, rs1, 0, true, imm); break;
+		case OP_ANDI: execute_vectors(OP_AND, rd, rs1, 0, true, imm); break;
+		case OP_SLLI: execute_vectors(OP_SLL, rd, rs1, 0, true, imm); break;
+		case OP_SRLI: execute_vectors(OP_SRL, rd, rs1, 0, true, imm); break;
+		case OP_SRAI: execute_vectors(OP_SRA, rd, rs1, 0, true, imm); break;
+
+		case OP_ADD: case OP_SUB: case OP_SLL: case OP_SLT: case OP_SLTU:
+		case OP_XOR: case OP_SRL: case OP_SRA: case OP_OR: case OP_AND:
+		case OP_MUL: case OP_MULH: case OP_MULHSU: case OP_MULHU:
+		case OP_DIV: case OP_DIVU: case OP_REM: case OP_REMU:
+			execute_vectors(op, rd, rs1, rs2, false, 0);
+			break;
+
+		case OP_FENCE:
+			/* Lanes never share memory */
+			break;
+
+		case OP_JAL:
+			execute_vectors(OP_LUI, rd, 0, 0, true, next);
+			next = pc + imm;
+			break;
+
+		case OP_JALR: {
+			bool same = true;
+			uint32_t first = (get_lane(rs1, __builtin_ctzll(members)) + imm) & ~1u;
+			for (uint64_t rest = members; rest; rest &= rest - 1) {
+				uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+				targets[lane] = (get_lane(rs1, lane) + imm) & ~1u;
+				same = same && targets[lane] == first;
+			}
+			execute_vectors(OP_LUI, rd, 0, 0, true, next);
+			if (!same) {
+				return scatter(index, members, 0, targets);
+			}
+			next = first;
+			break;
+		}
+
+		case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU: {
+			uint64_t taken = 0;
+			for (uint32_t vector = 0; vector < vectors; vector++) {
+				lane_vec_t result = branch_lanes(op, x[rs1][vector], x[rs2][vector]);
+				for (uint32_t slot = 0; slot < LOCKSTEP_VECTOR_LANES; slot++) {
+					if (result[slot]) {
+						taken |= 1ull << (vector * LOCKSTEP_VECTOR_LANES + slot);
+					}
+				}
+			}
+			taken &= members;
+			if (taken == members) {
+				next = pc + imm;
+			} else if (taken) {
+				for (uint64_t rest = members; rest; rest &= rest - 1) {
+					uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+					targets[lane] = (taken & (1ull << lane)) ? pc + imm : next;
+				}
+				return scatter(index, members, 0, targets);
+			}
+			break;
+		}
+
+		case OP_LB: case OP_LH: case OP_LW: case OP_LBU: case OP_LHU:
+		case OP_SB: case OP_SH: case OP_SW: {
+			bool store = op == OP_SB || op == OP_SH || op == OP_SW;
+			uint64_t failed = 0;
+			uint64_t changed = 0;
+			for (uint64_t rest = members; rest; rest &= rest - 1) {
+				uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+				Memory *lane_mem = lanes[lane]->get_memory();
+				uint32_t addr = get_lane(rs1, lane) + imm;
+				uint32_t value;
+				targets[lane] = next;
+				if (store) {
+					if (!store_value(lane_mem, op, addr, get_lane(rs2, lane))) {
+						failed |= 1ull << lane;
+					} else if (lane_mem->get_code_generation() != generation[lane]) {
+						changed |= 1ull << lane;
+					}
+				} else if (load_value(lane_mem, op, addr, &value)) {
+					set_lane(rd, lane, value);
+				} else {
+					failed |= 1ull << lane;
+				}
+			}
+			if (!failed && !changed) {
+				break;
+			}
+
+			/* Faulting lanes retry on their CPU, which reports the fault */
+			uint32_t count = lane_count(failed);
+			if (failed) {
+				detach(index, failed);
+			}
+			if (members & ~failed) {
+				count += scatter(index, members & ~failed, changed, targets);
+			}
+			for (uint64_t rest = failed; rest; rest &= rest - 1) {
+				uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+				step_scalar(lane, pc);
+			}
+			return count;
+		}
+
+		default:
+			/* System, CSR, A extension and illegal instructions run on each lane's CPU */
+			detach(index, members);
+			for (uint64_t rest = members; rest; rest &= rest - 1) {
+				uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+				step_scalar(lane, pc);
+			}
+			return lane_count(members);
+	}
+
+	return advance(index, next);
+}
+
+void Lockstep::check_divergence(uint64_t used, uint64_t offered) {
+	if (used * 100 >= offered * LOCKSTEP_MIN_UTILIZATION || groups.size() < 2) {
+		return;
+	}
+
+	size_t largest = 0;
+	for (size_t index = 1; index < groups.size(); index++) {
+		if (lane_count(groups[index].lanes) > lane_count(groups[largest].lanes)) {
+			largest = index;
+		}
+	}
+
+	LaneGroup keep = groups[largest];
+	for (size_t index = 0; index < groups.size(); index++) {
+		if (index == largest) {
+			continue;
+		}
+		credit(&groups[index]);
+		for (uint64_t rest = groups[index].lanes; rest; rest &= rest - 1) {
+			uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+			split_lane(lane, groups[index].pc);
+		}
+		active &= ~groups[index].lanes;
+	}
+	groups.assign(1, keep);
+}
+
+std::vector<RunResult> Lockstep::run(uint64_t max_instructions) {
+	uint32_t count = (uint32_t)lanes.size();
+	results.assign(count, RunResult{RUN_BUDGET, CPU_OK, 0});
+	groups.clear();
+	code_pages.clear();
+	checked_page = UINT32_MAX;
+	checked_lanes = 0;
+	active = 0;
+	split = 0;
+	limit = max_instructions;
+
+	for (uint32_t lane = 0; lane < count; lane++) {
+		CPU *cpu = lanes[lane]->get_cpu();
+		Memory *mem = lanes[lane]->get_memory();
+		retired[lane] = 0;
+		generation[lane] = mem->get_code_generation();
+		if (count < 2 || !cpu->is_running() || mem->has_watchpoints()) {
+			split |= 1ull << lane;
+			continue;
+		}
+		load_lane(lane);
+		join(lane, cpu->get_pc());
+	}
+
+	uint64_t window = 0;
+	uint64_t used = 0;
+	uint64_t offered = 0;
+	while (!groups.empty()) {
+		if (lane_count(active) < 2) {
+			/* One lane left: its own engine runs it faster */
+			LaneGroup last = groups[0];
+			detach(0, last.lanes);
+			for (uint64_t rest = last.lanes; rest; rest &= rest - 1) {
+				uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+				split_lane(lane, last.pc);
+			}
+			break;
+		}
+
+		offered += lane_count(active);
+		used += step_group();
+		if (++window == LOCKSTEP_WINDOW) {
+			check_divergence(used, offered);
+			window = used = offered = 0;
+		}
+	}
+
+	for (uint64_t rest = split; rest; rest &= rest - 1) {
+		uint32_t lane = (uint32_t)__builtin_ctzll(rest);
+		RunResult result = lanes[lane]->run(limit - retired[lane]);
+		results[lane] = RunResult{result.reason, result.status, retired[lane] + result.retired};
+	}
+	return results;
+}
@@ -1,10 +1,22 @@
 /* main.cpp */
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
 #include "emulator.hpp"
 #include "cpu.hpp"
+#include "syscall_backends.hpp"
+#include "vfs.hpp"
+#include "uring.hpp"
+#include "smp.hpp"
+#include "batch.hpp"
+#include "jit.hpp"
 
 static void dump_registers(CPU *cpu) {
 	std::printf("\nRegister Dump:\n");
@@ -26,8 +38,82 @@ static void dump_registers(CPU *cpu) {
 	}
 }
 
+/* Watchpoint requested on the command line */
+struct WatchSpec {
+	uint32_t addr;
+	uint64_t length;
+	watch_kind_t kind;
+};
+
+/**
+ * Parse a --watch argument
+ *
+ * text: ADDR[:LEN][:r|w|rw] (length defaults to 4, kind to w)
+ * spec: Output for parsed watchpoint
+ *
+ * Output: true on success
+ */
+static bool parse_watch(const char *text, WatchSpec *spec) {
+	char *end;
+	spec->addr = (uint32_t)std::strtoul(text, &end, 0);
+	spec->length = 4;
+	spec->kind = WATCH_WRITE;
+	if (end == text) {
+		return false;
+	}
+
+	if (*end == ':' && end[1] >= '0' && end[1] <= '9') {
+		const char *start = end + 1;
+		spec->length = std::strtoull(start, &end, 0);
+		if (end == start || spec->length == 0) {
+			return false;
+		}
+	}
+
+	if (*end == ':') {
+		const char *kind = end + 1;
+		if (std::strcmp(kind, "r") == 0) {
+			spec->kind = WATCH_READ;
+		} else if (std::strcmp(kind, "w") == 0) {
+			spec->kind = WATCH_WRITE;
+		} else if (std::strcmp(kind, "rw") == 0) {
+			spec->kind = WATCH_ACCESS;
+		} else {
+			return false;
+		}
+		return true;
+	}
+
+	return *end == '\0';
+}
+
 int main(int argc, char *argv[]) {
 	bool debug_mode = false;
+	bool show_stats = false;
+	bool unbuffered = false;
+	const char *trace_path = nullptr;
+	cpu_engine_t engine = ENGINE_SWITCH;
+	mem_backend_t backend = MEM_BACKEND_PAGED;
+	uint64_t checkpoint_interval = 0;
+	const char *checkpoint_prefix = nullptr;
+	std::vector<const char*> apply_paths;
+	const char *save_path = nullptr;
+	const char *restore_path = nullptr;
+	uint64_t save_at = 0;
+	std::vector<WatchSpec> watches;
+	bool sandbox_mode = false;
+	bool uring_mode = false;
+	const char *record_path = nullptr;
+	const char *replay_path = nullptr;
+	std::vector<const char*> vfs_sources;
+	const char *vfs_output = nullptr;
+	const char *syscall_trace_path = nullptr;
+	size_t syscall_trace_size = SYSCALL_TRACE_DEFAULT_CAPACITY;
+	uint32_t hart_count = 1;
+	const char *batch_path = nullptr;
+	const char *batch_report = nullptr;
+	uint32_t batch_threads = std::thread::hardware_concurrency();
+	uint32_t batch_lockstep = 0;
 	const char *program_file = nullptr;
 	uint32_t load_address = 0x00000000;
 
@@ -35,6 +121,98 @@ int main(int argc, char *argv[]) {
 	for (int i = 1; i < argc; i++) {
 		if (std::strcmp(argv[i], "--debug") == 0) {
 			debug_mode = true;
+		} else if (std::strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (std::strcmp(name, "switch") == 0) {
+				engine = ENGINE_SWITCH;
+			} else if (std::strcmp(name, "threaded") == 0) {
+				engine = ENGINE_THREADED;
+			} else if (std::strcmp(name, "block") == 0) {
+				engine = ENGINE_BLOCK;
+			} else if (std::strcmp(name, "jit") == 0) {
+				engine = ENGINE_JIT;
+			} else {
+				std::fprintf(stderr, "Error: Unknown engine '%s' (expected switch, threaded, block or jit)\n", name);
+				return 1;
+			}
+		} else if (std::strcmp(argv[i], "--memory-backend") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (std::strcmp(name, "paged") == 0) {
+				backend = MEM_BACKEND_PAGED;
+			} else if (std::strcmp(name, "reserved") == 0) {
+				backend = MEM_BACKEND_RESERVED;
+			} else {
+				std::fprintf(stderr, "Error: Unknown memory backend '%s' (expected paged or reserved)\n", name);
+				return 1;
+			}
+		} else if (std::strcmp(argv[i], "--checkpoint") == 0 && i + 2 < argc) {
+			checkpoint_interval = std::strtoull(argv[++i], nullptr, 0);
+			checkpoint_prefix = argv[++i];
+		} else if (std::strcmp(argv[i], "--apply-checkpoint") == 0 && i + 1 < argc) {
+			apply_paths.push_back(argv[++i]);
+		} else if (std::strcmp(argv[i], "--save-state") == 0 && i + 1 < argc) {
+			save_path = argv[++i];
+		} else if (std::strcmp(argv[i], "--save-at") == 0 && i + 1 < argc) {
+			save_at = std::strtoull(argv[++i], nullptr, 0);
+		} else if (std::strcmp(argv[i], "--restore-state") == 0 && i + 1 < argc) {
+			restore_path = argv[++i];
+		} else if (std::strcmp(argv[i], "--watch") == 0 && i + 1 < argc) {
+			WatchSpec spec;
+			if (!parse_watch(argv[++i], &spec)) {
+				std::fprintf(stderr, "Error: Invalid watchpoint '%s' (expected ADDR[:LEN][:r|w|rw])\n", argv[i]);
+				return 1;
+			}
+			watches.push_back(spec);
+		} else if (std::strcmp(argv[i], "--trace-binary") == 0 && i + 1 < argc) {
+			trace_path = argv[++i];
+		} else if (std::strcmp(argv[i], "--syscalls") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			sandbox_mode = std::strcmp(name, "sandbox") == 0;
+			uring_mode = std::strcmp(name, "uring") == 0;
+			if (!sandbox_mode && !uring_mode && std::strcmp(name, "host") != 0) {
+				std::fprintf(stderr, "Error: Unknown syscall backend '%s' (expected host, sandbox or uring)\n", name);
+				return 1;
+			}
+		} else if (std::strcmp(argv[i], "--record-syscalls") == 0 && i + 1 < argc) {
+			record_path = argv[++i];
+		} else if (std::strcmp(argv[i], "--replay-syscalls") == 0 && i + 1 < argc) {
+			replay_path = argv[++i];
+		} else if (std::strcmp(argv[i], "--vfs") == 0 && i + 1 < argc) {
+			vfs_sources.push_back(argv[++i]);
+		} else if (std::strcmp(argv[i], "--vfs-output") == 0 && i + 1 < argc) {
+			vfs_output = argv[++i];
+		} else if (std::strcmp(argv[i], "--trace-syscalls") == 0 && i + 1 < argc) {
+			syscall_trace_path = argv[++i];
+		} else if (std::strcmp(argv[i], "--trace-syscalls-size") == 0 && i + 1 < argc) {
+			syscall_trace_size = std::strtoull(argv[++i], nullptr, 0);
+		} else if (std::strcmp(argv[i], "--decode-syscall-trace") == 0 && i + 1 < argc) {
+			return SyscallTracer::decode(argv[++i], stdout) == 0 ? 0 : 1;
+		} else if (std::strcmp(argv[i], "--harts") == 0 && i + 1 < argc) {
+			hart_count = (uint32_t)std::strtoul(argv[++i], nullptr, 0);
+			if (hart_count < 1 || hart_count > SMP_MAX_HARTS) {
+				std::fprintf(stderr, "Error: Hart count must be 1 to %d\n", SMP_MAX_HARTS);
+				return 1;
+			}
+		} else if (std::strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			batch_path = argv[++i];
+		} else if (std::strcmp(argv[i], "--batch-report") == 0 && i + 1 < argc) {
+			batch_report = argv[++i];
+		} else if (std::strcmp(argv[i], "--batch-threads") == 0 && i + 1 < argc) {
+			batch_threads = (uint32_t)std::strtoul(argv[++i], nullptr, 0);
+			if (batch_threads < 1 || batch_threads > BATCH_MAX_THREADS) {
+				std::fprintf(stderr, "Error: Batch thread count must be 1 to %d\n", BATCH_MAX_THREADS);
+				return 1;
+			}
+		} else if (std::strcmp(argv[i], "--batch-lockstep") == 0 && i + 1 < argc) {
+			batch_lockstep = (uint32_t)std::strtoul(argv[++i], nullptr, 0);
+			if (batch_lockstep < 2 || batch_lockstep > LOCKSTEP_MAX_LANES) {
+				std::fprintf(stderr, "Error: Lockstep lane count must be 2 to %d\n", LOCKSTEP_MAX_LANES);
+				return 1;
+			}
+		} else if (std::strcmp(argv[i], "--unbuffered") == 0) {
+			unbuffered = true;
+		} else if (std::strcmp(argv[i], "--stats") == 0) {
+			show_stats = true;
 		} else if (!program_file) {
 			program_file = argv[i];
 		} else {
@@ -42,8 +220,54 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	if (!program_file) {
-		std::fprintf(stderr, "Usage: %s [--debug] <program.bin> [load_address]\n", argv[0]);
+	/* Batch mode: sandboxed jobs on a thread pool, one report line per job */
+	if (batch_path) {
+		std::vector<BatchJob> jobs;
+		if (BatchRunner::parse_jobs(batch_path, &jobs) != 0) {
+			return 1;
+		}
+
+		const char *extension = batch_report ? std::strrchr(batch_report, '.') : nullptr;
+		batch_format_t format = extension && std::strcmp(extension, ".json") == 0 ? BATCH_JSON : BATCH_CSV;
+		FILE *report = batch_report ? std::fopen(batch_report, "w") : stdout;
+		if (!report) {
+			std::fprintf(stderr, "Error: Cannot open report file '%s'\n", batch_report);
+			return 1;
+		}
+
+		/* hardware_concurrency() may not know */
+		uint32_t threads = std::max(1u, std::min(batch_threads, (uint32_t)BATCH_MAX_THREADS));
+		BatchRunner runner(engine, backend);
+		runner.set_lockstep(batch_lockstep);
+		auto batch_start = std::chrono::steady_clock::now();
+		std::vector<BatchResult> results = runner.run(jobs, threads);
+		auto batch_end = std::chrono::steady_clock::now();
+
+		int status = BatchRunner::write_report(report, format, jobs, results);
+		if (report != stdout && std::fclose(report) != 0) {
+			status = -1;
+		}
+		if (show_stats) {
+			std::fprintf(stderr, "Batch: %zu jobs, %u threads, %.3f ms, %llu steals\n",
+				jobs.size(), (uint32_t)std::min<size_t>(threads, jobs.size()),
+				std::chrono::duration<double, std::milli>(batch_end - batch_start).count(),
+				(unsigned long long)runner.get_steals());
+			if (batch_lockstep) {
+				std::fprintf(stderr, "Lockstep: up to %u lanes per group, %llu lanes split off\n",
+					batch_lockstep, (unsigned long long)runner.get_lockstep_splits());
+			}
+		}
+		return status == 0 ? 0 : 1;
+	}
+
+	if (!program_file && !restore_path) {
+		std::fprintf(stderr, "Usage: %s [--debug] [--trace-binary FILE] [--engine switch|threaded|block|jit] [--memory-backend paged|reserved] [--checkpoint N PREFIX] [--apply-checkpoint FILE]... [--save-state FILE [--save-at N]] [--restore-state FILE] [--watch ADDR[:LEN][:r|w|rw]]... [--syscalls host|sandbox|uring] [--record-syscalls FILE | --replay-syscalls FILE] [--vfs DIR|ARCHIVE.tar]... [--vfs-output DIR] [--trace-syscalls FILE [--trace-syscalls-size N]] [--decode-syscall-trace FILE] [--harts N] [--batch JOBS [--batch-report FILE] [--batch-threads N] [--batch-lockstep N]] [--unbuffered] [--stats] <program.bin> [load_address]\n", argv[0]);
+		return 1;
+	}
+
+	/* Only the boot hart's state is saved, restored or watched */
+	if (hart_count > 1 && (checkpoint_interval || !apply_paths.empty() || save_path || restore_path || !watches.empty())) {
+		std::fprintf(stderr, "Error: --harts cannot be combined with checkpoints, saved state or watchpoints\n");
 		return 1;
 	}
 
@@ -51,53 +275,305 @@ int main(int argc, char *argv[]) {
 	std::printf("Stack: 0x%08x - 0x%08x (size: %d bytes)\n",
 		STACK_BASE, STACK_TOP, STACK_SIZE);
 
-	auto emulator = std::make_unique<Emulator>(MEMORY_SIZE);
+	/* Startup phases are timed for --stats */
+	auto time_start = std::chrono::steady_clock::now();
+	auto emulator = std::make_unique<Emulator>(MEMORY_SIZE, backend);
+	auto time_memory = std::chrono::steady_clock::now();
 	if (!emulator) {
 		std::fprintf(stderr, "Error: Failed to initialize emulator\n");
 		return 1;
 	}
 
-	if (emulator->load_program(program_file, load_address) != 0) {
-		return 1;
+	if (emulator->get_memory()->get_backend() != backend) {
+		std::fprintf(stderr, "Warning: reserved memory backend unavailable, using paged\n");
+	}
+
+	/* A saved state replaces the program image and initial registers */
+	if (restore_path) {
+		if (emulator->restore_state(restore_path) != 0) {
+			return 1;
+		}
+		std::printf("Restored state from %s\n", restore_path);
+	} else {
+		if (emulator->load_program(program_file, load_address) != 0) {
+			return 1;
+		}
+		emulator->set_pc(load_address);
+	}
+	auto time_load = std::chrono::steady_clock::now();
+
+	/* Recover from checkpoints: the full one first, then increments */
+	for (const char *path : apply_paths) {
+		if (emulator->apply_checkpoint(path) != 0) {
+			return 1;
+		}
+		std::printf("Applied checkpoint %s\n", path);
+	}
+
+	for (const WatchSpec &spec : watches) {
+		emulator->get_memory()->add_watchpoint(spec.addr, spec.length, spec.kind);
+	}
+
+	FILE *trace_file = nullptr;
+	if (trace_path) {
+		trace_file = std::fopen(trace_path, "wb");
+		if (!trace_file) {
+			std::fprintf(stderr, "Error: Cannot open trace file '%s'\n", trace_path);
+			return 1;
+		}
+		emulator->set_trace(TRACE_BINARY, trace_file);
+	} else if (debug_mode) {
+		emulator->set_trace(TRACE_TEXT, nullptr);
+	}
+
+	/* Tracing is only implemented by the reference engine */
+	if ((debug_mode || trace_file) && engine != ENGINE_SWITCH) {
+		std::fprintf(stderr, "Warning: tracing uses the switch engine\n");
+		engine = ENGINE_SWITCH;
+	}
+
+	/* Block and JIT caches are shared by the memory, not per hart */
+	if (hart_count > 1 && (engine == ENGINE_BLOCK || engine == ENGINE_JIT)) {
+		std::fprintf(stderr, "Warning: harts use the threaded engine\n");
+		engine = ENGINE_THREADED;
+	}
+
+	/* Backends stack: sandbox or io_uring replace host I/O, the VFS serves files
+	 * above descriptor 2, record/replay wrap the result, the tracer sees it all */
+	SyscallTable *syscalls = emulator->get_cpu()->get_syscalls();
+	SyscallSandbox sandbox;
+	SyscallUring uring;
+	Vfs vfs;
+	SyscallRecorder recorder;
+	SyscallReplayer replayer;
+	SyscallTracer tracer(syscall_trace_size);
+	if (sandbox_mode) {
+		sandbox.install(syscalls);
+	}
+	if (uring_mode) {
+		if (uring.open() == 0) {
+			uring.install(syscalls);
+		} else {
+			std::fprintf(stderr, "Warning: io_uring is not available, using host syscalls\n");
+			uring_mode = false;
+		}
+	}
+	if (!vfs_sources.empty() || vfs_output) {
+		for (const char *source : vfs_sources) {
+			struct stat st;
+			bool is_dir = stat(source, &st) == 0 && S_ISDIR(st.st_mode);
+			int count = is_dir ? vfs.add_directory(source) : vfs.add_archive(source);
+			if (count < 0) {
+				std::fprintf(stderr, "Error: Cannot load VFS source '%s'\n", source);
+				return 1;
+			}
+		}
+		vfs.install(syscalls);
+	}
+	if (record_path) {
+		if (recorder.open(record_path) != 0) {
+			return 1;
+		}
+		recorder.install(syscalls);
+	} else if (replay_path) {
+		if (replayer.open(replay_path) != 0) {
+			return 1;
+		}
+		replayer.install(syscalls);
+	}
+	if (syscall_trace_path) {
+		tracer.install(syscalls);
 	}
 
-	emulator->set_pc(load_address);
-	emulator->set_debug_mode(debug_mode);
+	/* Harts copy the boot hart's finished syscall table */
+	std::unique_ptr<Smp> smp;
+	if (hart_count > 1) {
+		smp = std::make_unique<Smp>(emulator->get_memory(), emulator->get_cpu(), hart_count);
+	}
+	FdTable *files = smp ? smp->get_files() : emulator->get_cpu()->get_files();
+
+	/* Trace lines and guest output must interleave as they happen */
+	if (unbuffered || debug_mode) {
+		files->set_buffered(false);
+		uring.set_batching(false);
+	}
 
 	std::printf("\nStarting execution...\n");
 	std::printf("Initial SP: 0x%08x\n", emulator->get_cpu()->get_register(2));
 	std::printf("Initial PC: 0x%08x\n", emulator->get_cpu()->get_pc());
 	std::printf("\n");
 
+	/* Guest output bypasses stdio */
+	std::fflush(stdout);
+
 	int step_count = 0;
 	const int max_steps = 1000000;
 	int exit_code = 0;
 
-	while (emulator->is_running() && step_count < max_steps) {
-		cpu_status_t status = emulator->step();
-		step_count++;
+	emulator->set_engine(engine);
+
+	uint64_t next_checkpoint = checkpoint_interval;
+
+	/* Harts run until the group stops; breakpoints resume every hart */
+	while (smp) {
+		SmpResult result = smp->run(engine, max_steps);
+		step_count += (int)result.retired;
 
-		if (status == CPU_SYSCALL_EXIT) {
+		if (result.reason == RUN_EXIT) {
+			exit_code = (int)smp->get_exit_status();
+			std::printf("Program exited with status: %d\n", exit_code);
+		} else if (result.reason == RUN_BREAKPOINT) {
+			std::fprintf(stderr, "Breakpoint on hart %u at PC: 0x%08x\n",
+				result.hart, smp->get_hart(result.hart)->get_pc() - 4);
+			continue;
+		} else if (result.reason == RUN_BUDGET) {
+			std::printf("Reached maximum step count (%d per hart)\n", max_steps);
+			dump_registers(smp->get_hart(0));
+		} else {
+			std::printf("Execution stopped on hart %u: Error %d\n", result.hart, result.status);
+			dump_registers(smp->get_hart(result.hart));
+		}
+		break;
+	}
+
+	while (!smp && step_count < max_steps) {
+		/* Run up to the next progress report (or checkpoint) in one call */
+		uint64_t budget = 10000 - step_count % 10000;
+		if (checkpoint_interval && next_checkpoint - step_count < budget) {
+			budget = next_checkpoint - step_count;
+		}
+		if (save_path && save_at > (uint64_t)step_count && save_at - step_count < budget) {
+			budget = save_at - step_count;
+		}
+		RunResult result = emulator->run(budget);
+		step_count += (int)result.retired;
+
+		if (checkpoint_interval && (uint64_t)step_count >= next_checkpoint && result.reason == RUN_BUDGET) {
+			std::string path = std::string(checkpoint_prefix) + "." + std::to_string(step_count);
+			if (emulator->write_checkpoint(path.c_str()) != 0) {
+				exit_code = 1;
+				break;
+			}
+			next_checkpoint += checkpoint_interval;
+		}
+
+		if (result.reason == RUN_EXIT) {
 			exit_code = (int)emulator->get_cpu()->get_register(10);
 			std::printf("Program exited with status: %d\n", exit_code);
 			break;
 		}
-		else if (status != CPU_OK) {
-			std::printf("Execution stopped at step %d: Error %d\n", step_count, status);
+		else if (result.reason == RUN_FAULT) {
+			std::printf("Execution stopped at step %d: Error %d\n", step_count + 1, result.status);
 			dump_registers(emulator->get_cpu());
 			break;
 		}
+		else if (result.reason == RUN_BREAKPOINT) {
+			std::fprintf(stderr, "Breakpoint at PC: 0x%08x\n", emulator->get_cpu()->get_pc() - 4);
+		}
+		else if (result.reason == RUN_WATCHPOINT) {
+			WatchHit hit;
+			if (emulator->get_memory()->take_watch_hit(&hit)) {
+				std::fprintf(stderr, "Watchpoint %d: %s of %u bytes at 0x%08x (PC: 0x%08x)\n",
+					hit.id, hit.kind == WATCH_READ ? "read" : "write", hit.size, hit.addr,
+					emulator->get_cpu()->get_pc());
+			}
+		}
+
+		/* Save warm state at the first breakpoint or after --save-at steps */
+		if (save_path && (result.reason == RUN_BREAKPOINT || (save_at && (uint64_t)step_count >= save_at))) {
+			/* Saved file positions must include queued writes */
+			uring.flush();
+			if (emulator->save_state(save_path) != 0) {
+				exit_code = 1;
+			} else {
+				std::printf("State saved to %s at step %d\n", save_path, step_count);
+			}
+			break;
+		}
 
 		if (step_count % 10000 == 0) {
 			std::printf("Step %d...\n", step_count);
 		}
 	}
 
-	if (step_count >= max_steps) {
+	auto time_run = std::chrono::steady_clock::now();
+	files->flush();
+	if (uring.flush() != 0) {
+		exit_code = 1;
+	}
+
+	if (sandbox_mode) {
+		std::fwrite(sandbox.get_output(1).data(), 1, sandbox.get_output(1).size(), stdout);
+		std::fwrite(sandbox.get_output(2).data(), 1, sandbox.get_output(2).size(), stderr);
+	}
+
+	if (syscall_trace_path && tracer.write(syscall_trace_path) != 0) {
+		exit_code = 1;
+	}
+
+	if (vfs_output) {
+		int written = vfs.write_directory(vfs_output, true);
+		if (written < 0) {
+			exit_code = 1;
+		} else {
+			std::printf("VFS: %d file(s) written to %s\n", written, vfs_output);
+		}
+	}
+
+	if (!smp && step_count >= max_steps) {
 		std::printf("Reached maximum step count (%d)\n", max_steps);
 		dump_registers(emulator->get_cpu());
 	}
 
+	if (show_stats) {
+		BlockCache *blocks = emulator->get_memory()->get_block_cache();
+		std::printf("\nStatistics:\n");
+		std::printf("  Instructions: %d\n", step_count);
+		std::printf("  Startup: memory %.3f ms, program load %.3f ms (%s)\n",
+			std::chrono::duration<double, std::milli>(time_memory - time_start).count(),
+			std::chrono::duration<double, std::milli>(time_load - time_memory).count(),
+			restore_path ? "state restored" : emulator->is_program_mapped() ? "mapped" : "copied");
+		std::printf("  Execution: %.3f ms\n",
+			std::chrono::duration<double, std::milli>(time_run - time_load).count());
+		if (smp) {
+			std::printf("  Harts: %u\n", smp->get_hart_count());
+		}
+		std::printf("  Guest output: %llu writes, %llu host writes\n",
+			(unsigned long long)files->get_guest_writes(),
+			(unsigned long long)files->get_host_writes());
+		if (uring_mode) {
+			std::printf("  io_uring: %llu writes, %llu submissions, %llu direct reads\n",
+				(unsigned long long)uring.get_guest_writes(),
+				(unsigned long long)uring.get_submissions(),
+				(unsigned long long)uring.get_direct_reads());
+		}
+		if (!vfs_sources.empty() || vfs_output) {
+			std::printf("  VFS: %zu files\n", vfs.list_files().size());
+		}
+		std::printf("  Memory backend: %s\n",
+			emulator->get_memory()->get_backend() == MEM_BACKEND_RESERVED ? "reserved" : "paged");
+		std::printf("  Resident memory: %zu pages (%zu KiB)\n",
+			emulator->get_memory()->get_resident_pages(),
+			emulator->get_memory()->get_resident_pages() * MEM_PAGE_SIZE / 1024);
+		if (engine == ENGINE_BLOCK || engine == ENGINE_JIT) {
+			std::printf("  Blocks translated: %zu\n", blocks->get_block_count());
+			std::printf("  Block lookups: %llu hits, %llu misses\n",
+				(unsigned long long)blocks->get_hits(),
+				(unsigned long long)blocks->get_misses());
+			std::printf("  Chained transitions: %llu\n",
+				(unsigned long long)blocks->get_chained());
+		}
+		if (engine == ENGINE_JIT) {
+			JitCompiler *jit = blocks->get_jit();
+			std::printf("  Blocks compiled: %zu (%zu bytes native code)\n",
+				jit->get_compiled_count(), jit->get_code_size());
+		}
+	}
+
+	if (trace_file) {
+		std::fclose(trace_file);
+	}
+
 	/* Smart pointers will automatically clean up emulator */
 
 	return exit_code;
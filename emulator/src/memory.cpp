@@ -1,41 +1,1064 @@
 /* memory.cpp */
 #include "memory.hpp"
+#include "program_image.hpp"
+#include <algorithm>
 #include <cstdlib>
 #include <cstdint>
 #include <cstring>
 #include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if MEM_GUARDED_ACCESS
+#include <ucontext.h>
+#endif
 
-Memory::Memory(uint32_t size) : size(size) {
-	data = std::make_unique<uint8_t[]>(size);
+/* Size of the host reservation backing MEM_BACKEND_RESERVED */
+#define MEM_RESERVATION_SIZE 0x100000000ull
 
-	/* Zero-initialize memory */
-	std::memset(data.get(), 0, size);
+/* Shared read-only backing for mapped pages that were never written */
+static uint8_t zero_page[MEM_PAGE_SIZE];
+
+#if MEM_GUARDED_ACCESS
+/* Entry emitted by Memory::guarded_load/guarded_store (self-relative) */
+struct ExtableEntry {
+	int32_t insn;
+	int32_t fixup;
+};
+
+/* Section bounds provided by the linker */
+extern "C" const ExtableEntry __start_guest_extable[] __attribute__((weak));
+extern "C" const ExtableEntry __stop_guest_extable[] __attribute__((weak));
+
+static struct sigaction previous_segv;
+static struct sigaction previous_bus;
+
+static void guest_fault_handler(int sig, siginfo_t *info, void *context) {
+	ucontext_t *uc = (ucontext_t*)context;
+	uintptr_t ip = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+
+	for (const ExtableEntry *entry = __start_guest_extable; entry < __stop_guest_extable; entry++) {
+		if ((uintptr_t)&entry->insn + entry->insn == ip) {
+			uc->uc_mcontext.gregs[REG_RIP] = (greg_t)((uintptr_t)&entry->fixup + entry->fixup);
+			return;
+		}
+	}
+
+	/* Not a guest access: let the previous handler (or the default) see it */
+	const struct sigaction *previous = sig == SIGBUS ? &previous_bus : &previous_segv;
+	if ((previous->sa_flags & SA_SIGINFO) && previous->sa_sigaction) {
+		previous->sa_sigaction(sig, info, context);
+	} else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN) {
+		previous->sa_handler(sig);
+	} else {
+		sigaction(sig, previous, nullptr);
+	}
+}
+
+static bool install_fault_handler() {
+	struct sigaction action;
+	std::memset(&action, 0, sizeof(action));
+	action.sa_sigaction = guest_fault_handler;
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+
+	return sigaction(SIGSEGV, &action, &previous_segv) == 0 &&
+		sigaction(SIGBUS, &action, &previous_bus) == 0;
+}
+#endif
+
+Memory::Memory(uint32_t size, mem_backend_t backend)
+	: size(size), reserved(nullptr), direct(nullptr),
+	  program_break((uint32_t)(((uint64_t)size + MEM_PAGE_SIZE - 1) & ~(uint64_t)(MEM_PAGE_SIZE - 1))),
+	  resident_pages(0), chunk_next(nullptr), chunk_free(0), snapshot_active(false), saved_break(0),
+	  checkpoint_active(false), next_watch_id(0),
+	  watch_pending(false), watch_hit(), watch_skip(false), concurrent(false), code_generation(0) {
+	for (TlbEntry &entry : tlb) {
+		entry.read_tag = MEM_TLB_INVALID;
+		entry.write_tag = MEM_TLB_INVALID;
+		entry.host = nullptr;
+	}
+
+#if MEM_GUARDED_ACCESS
+	if (backend == MEM_BACKEND_RESERVED) {
+		static const bool handler_installed = install_fault_handler();
+		void *base = mmap(nullptr, MEM_RESERVATION_SIZE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (handler_installed && base != MAP_FAILED) {
+			reserved = (uint8_t*)base;
+			direct = reserved;
+		}
+	}
+#else
+	(void)backend;
+#endif
+
+	map(0, size);
+}
+
+Memory::~Memory() {
+	for (const auto &mapping : host_mappings) {
+		munmap(mapping.first, mapping.second);
+	}
+	for (const auto &mapping : file_mappings) {
+		munmap(mapping.first, mapping.second);
+	}
+
+	if (reserved) {
+		munmap(reserved, MEM_RESERVATION_SIZE);
+	}
+}
+
+uint8_t* Memory::alloc_page(bool zeroed) {
+	if (zeroed && !zero_pages.empty()) {
+		uint8_t *page = zero_pages.back();
+		zero_pages.pop_back();
+		return page;
+	}
+
+	if (!free_pages.empty()) {
+		uint8_t *page = free_pages.back();
+		free_pages.pop_back();
+		if (zeroed) {
+			std::memset(page, 0, MEM_PAGE_SIZE);
+		}
+		return page;
+	}
+
+	if (!zero_pages.empty()) {
+		uint8_t *page = zero_pages.back();
+		zero_pages.pop_back();
+		return page;
+	}
+
+	if (chunk_free == 0) {
+		size_t length = (size_t)MEM_CHUNK_PAGES * MEM_PAGE_SIZE;
+		void *chunk = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (chunk == MAP_FAILED) {
+			return nullptr;
+		}
+		host_mappings.push_back(std::make_pair(chunk, length));
+		chunk_next = (uint8_t*)chunk;
+		chunk_free = MEM_CHUNK_PAGES;
+	}
+
+	uint8_t *page = chunk_next;
+	chunk_next += MEM_PAGE_SIZE;
+	chunk_free--;
+	return page;
+}
+
+void Memory::flush_tlb() {
+	for (TlbEntry &entry : tlb) {
+		entry.read_tag = MEM_TLB_INVALID;
+		entry.write_tag = MEM_TLB_INVALID;
+	}
+}
+
+void Memory::flush_range(uint32_t addr, uint64_t length) {
+	flush_tlb();
+
+	for (uint64_t offset = 0; offset < length; offset += MEM_PAGE_SIZE) {
+		uint32_t page = (uint32_t)((addr + offset) >> MEM_PAGE_SHIFT);
+		PageEntry *entry = find_entry(page);
+		if (entry && (entry->flags & MEM_PAGE_CODE)) {
+			drop_code(page, entry);
+		}
+	}
+}
+
+void Memory::drop_code(uint32_t page, PageEntry *entry) {
+	entry->flags &= ~MEM_PAGE_CODE;
+	decode_cache.invalidate_page(page);
+	block_cache.invalidate_page(page);
+	code_generation.fetch_add(1, std::memory_order_release);
+}
+
+void Memory::set_concurrent(bool enable) {
+	std::lock_guard<std::recursive_mutex> lock(shared_lock);
+	flush_tlb();
+	concurrent = enable;
+}
+
+memory_status_t Memory::map_file(uint32_t addr, int fd, uint64_t length, uint64_t offset) {
+	std::unique_lock<std::recursive_mutex> guard = lock_shared();
+	if ((addr & (MEM_PAGE_SIZE - 1)) != 0 || (offset & (MEM_PAGE_SIZE - 1)) != 0 ||
+			length == 0 || !is_mapped(addr, length)) {
+		return MEM_WRITE_ERROR;
+	}
+
+	size_t mapped = (size_t)((length + MEM_PAGE_SIZE - 1) & ~(uint64_t)(MEM_PAGE_SIZE - 1));
+
+	/* Reserved backend: replace the range of the reservation itself */
+	if (reserved) {
+		void *base = mmap(reserved + addr, mapped, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_FIXED, fd, (off_t)offset);
+		if (base == MAP_FAILED) {
+			return MEM_WRITE_ERROR;
+		}
+		flush_range(addr, mapped);
+		return MEM_OK;
+	}
+
+	void *base = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)offset);
+	if (base == MAP_FAILED) {
+		return MEM_WRITE_ERROR;
+	}
+	file_mappings.push_back(std::make_pair(base, mapped));
+
+	flush_range(addr, mapped);
+	for (size_t offset = 0; offset < mapped; offset += MEM_PAGE_SIZE) {
+		PageEntry *entry = create_entry((addr + (uint32_t)offset) >> MEM_PAGE_SHIFT);
+		if (!entry->data) {
+			resident_pages++;
+		}
+		entry->data = (uint8_t*)base + offset;
+	}
+
+	return MEM_OK;
+}
+
+int Memory::reset() {
+	/* Every private page is cleared once and kept; file pages go with their mapping */
+	auto from_file = [this](const uint8_t *data) {
+		for (const auto &mapping : file_mappings) {
+			const uint8_t *base = (const uint8_t*)mapping.first;
+			if (data >= base && data < base + mapping.second) {
+				return true;
+			}
+		}
+		return false;
+	};
+
+	std::unordered_set<uint8_t*> pages(free_pages.begin(), free_pages.end());
+	for (const auto &table : directory) {
+		if (!table) continue;
+		for (uint32_t i = 0; i < MEM_TABLE_ENTRIES; i++) {
+			if (table[i].data && !from_file(table[i].data)) {
+				pages.insert(table[i].data);
+			}
+			table[i].data = nullptr;
+			table[i].flags = 0;
+		}
+	}
+	for (const auto &original : saved) {
+		if (original.second && !from_file(original.second)) {
+			pages.insert(original.second);
+		}
+	}
+	for (uint8_t *page : pages) {
+		std::memset(page, 0, MEM_PAGE_SIZE);
+		zero_pages.push_back(page);
+	}
+	free_pages.clear();
+
+	for (const auto &mapping : file_mappings) {
+		munmap(mapping.first, mapping.second);
+	}
+	file_mappings.clear();
+
+	/* One fixed mapping drops committed pages, file images and protections */
+	if (reserved) {
+		void *base = mmap(reserved, MEM_RESERVATION_SIZE, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+		if (base == MAP_FAILED) {
+			return -1;
+		}
+		direct = reserved;
+	}
+
+	regions.clear();
+	program_break = (uint32_t)(((uint64_t)size + MEM_PAGE_SIZE - 1) & ~(uint64_t)(MEM_PAGE_SIZE - 1));
+	resident_pages = 0;
+	snapshot_active = false;
+	saved.clear();
+	saved_regions.clear();
+	saved_break = 0;
+	dirty.clear();
+	checkpoint_active = false;
+	modified.clear();
+	watchpoints.clear();
+	next_watch_id = 0;
+	watch_pending = false;
+	watch_skip = false;
+	decode_cache.clear();
+	block_cache.clear();
+	images.clear();
+	code_generation.fetch_add(1, std::memory_order_release);
+	concurrent = false;
+	flush_tlb();
+
+	map(0, size);
+	return 0;
+}
+
+memory_status_t Memory::map_image(const std::shared_ptr<const ProgramImage> &image) {
+	std::unique_lock<std::recursive_mutex> guard = lock_shared();
+	if (!image || !image->is_loaded() ||
+			map_file(image->get_base(), image->get_fd(), image->get_length()) != MEM_OK) {
+		return MEM_WRITE_ERROR;
+	}
+
+	images.push_back(image);
+	for (uint32_t index = 0; index < image->get_length() / MEM_PAGE_SIZE; index++) {
+		uint32_t addr = image->get_base() + index * MEM_PAGE_SIZE;
+		mark_code(addr);
+		decode_cache.share_page(addr >> CODE_PAGE_SHIFT, image->get_decoded(index));
+	}
+	return MEM_OK;
 }
 
 uint32_t Memory::get_size() const {
 	return size;
 }
 
-uint8_t* Memory::get_data() {
-	return data.get();
+void Memory::map(uint32_t base, uint64_t length) {
+	std::unique_lock<std::recursive_mutex> guard = lock_shared();
+	if (length == 0) {
+		return;
+	}
+
+	uint32_t start = base & ~(MEM_PAGE_SIZE - 1);
+	uint64_t end = ((uint64_t)base + length + MEM_PAGE_SIZE - 1) & ~(uint64_t)(MEM_PAGE_SIZE - 1);
+	if (end > 0x100000000ull) {
+		end = 0x100000000ull;
+	}
+
+	regions.push_back(std::make_pair(start, end));
+
+	/* Commit lazily: the host supplies zero pages on first touch */
+	if (reserved) {
+		bool writable = fast_writable(0);
+		mprotect(reserved + start, end - start, writable ? PROT_READ | PROT_WRITE : PROT_READ);
+
+		/* Pages unmapped earlier keep their flags; match their protection */
+		for (uint64_t base = start; base < end; base += MEM_PAGE_SIZE) {
+			PageEntry *entry = find_entry((uint32_t)(base >> MEM_PAGE_SHIFT));
+			if (entry && entry->flags && fast_writable(entry->flags) != writable) {
+				mprotect(reserved + base, MEM_PAGE_SIZE,
+					fast_writable(entry->flags) ? PROT_READ | PROT_WRITE : PROT_READ);
+			}
+		}
+	}
+}
+
+void Memory::unmap(uint32_t base, uint64_t length) {
+	std::unique_lock<std::recursive_mutex> guard = lock_shared();
+	if (length == 0) {
+		return;
+	}
+
+	uint32_t start = base & ~(MEM_PAGE_SIZE - 1);
+	uint64_t end = ((uint64_t)base + length + MEM_PAGE_SIZE - 1) & ~(uint64_t)(MEM_PAGE_SIZE - 1);
+	if (end > 0x100000000ull) {
+		end = 0x100000000ull;
+	}
+
+	/* Release contents while the pages are still mapped (snapshot pages are kept for restore()) */
+	for (uint64_t addr = start; addr < end; addr += MEM_PAGE_SIZE) {
+		uint32_t page = (uint32_t)(addr >> MEM_PAGE_SHIFT);
+		PageEntry *entry = find_entry(page);
+		if (!is_mapped((uint32_t)addr, MEM_PAGE_SIZE) || (!reserved && !(entry && entry->data))) {
+			continue;
+		}
+
+		/* The page reads as zero if mapped again, so the next checkpoint must save it */
+		if (checkpoint_active && !(entry && (entry->flags & MEM_PAGE_MODIFIED))) {
+			entry = create_entry(page);
+			entry->flags |= MEM_PAGE_MODIFIED;
+			modified.push_back(page);
+		}
+
+		if (reserved) {
+			if (snapshot_active && !(entry && (entry->flags & MEM_PAGE_DIRTY))) {
+				save_page(page, create_entry(page));
+			}
+			continue;
+		}
+
+		if (snapshot_active && !(entry->flags & MEM_PAGE_DIRTY)) {
+			if (saved.find(page) == saved.end()) {
+				saved[page] = entry->data;
+			}
+			entry->flags |= MEM_PAGE_DIRTY;
+			dirty.push_back(page);
+		}
+		if (!(entry->flags & MEM_PAGE_SHARED)) {
+			free_pages.push_back(entry->data);
+		}
+		entry->data = nullptr;
+		entry->flags &= ~MEM_PAGE_SHARED;
+		resident_pages--;
+	}
+
+	if (reserved) {
+		madvise(reserved + start, end - start, MADV_DONTNEED);
+		mprotect(reserved + start, end - start, PROT_NONE);
+	}
+
+	/* Trim or split every region overlapping [start, end) */
+	std::vector<std::pair<uint32_t, uint64_t>> kept;
+	for (const auto &region : regions) {
+		if (region.second <= start || region.first >= end) {
+			kept.push_back(region);
+			continue;
+		}
+		if (region.first < start) {
+			kept.push_back(std::make_pair(region.first, (uint64_t)start));
+		}
+		if (region.second > end) {
+			kept.push_back(std::make_pair((uint32_t)end, region.second));
+		}
+	}
+	regions.swap(kept);
+
+	flush_range(start, end - start);
+}
+
+bool Memory::is_mapped(uint32_t addr, uint64_t length) const {
+	std::unique_lock<std::recursive_mutex> guard = lock_shared();
+	uint64_t end = (uint64_t)addr + length;
+
+	if (length == 0) {
+		return true;
+	}
+
+	for (const auto &region : regions) {
+		if (addr >= region.first && end <= region.second) {
+			return true;
+		}
+	}
+
+	/* Ranges spanning adjacent regions are checked page by page */
+	for (uint64_t page = addr & ~(uint64_t)(MEM_PAGE_SIZE - 1); page < end; page += MEM_PAGE_SIZE) {
+		bool found = false;
+		for (const auto &region : regions) {
+			if (page >= region.first && page < region.second) {
+				found = true;
+				break;
+			}
+		}
+		if (!found) return false;
+	}
+
+	return true;
+}
+
+size_t Memory::get_resident_pages() const {
+	if (!reserved) {
+		return resident_pages;
+	}
+
+	size_t count = 0;
+	std::vector<unsigned char> pages;
+	long host_page = sysconf(_SC_PAGESIZE);
+	for (const auto &region : regions) {
+		uint64_t length = region.second - region.first;
+		pages.resize((length + host_page - 1) / host_page);
+		if (mincore(reserved + region.first, length, pages.data()) != 0) {
+			continue;
+		}
+		for (unsigned char page : pages) {
+			count += page & 1;
+		}
+	}
+
+	/* Report in guest pages */
+	return count * host_page / MEM_PAGE_SIZE;
+}
+
+Memory::PageEntry* Memory::find_entry(uint32_t page) const {
+	PageEntry *table = directory[page >> MEM_TABLE_SHIFT].get();
+	return table ? &table[page & (MEM_TABLE_ENTRIES - 1)] : nullptr;
+}
+
+Memory::PageEntry* Memory::create_entry(uint32_t page) {
+	std::unique_ptr<PageEntry[]> &table = directory[page >> MEM_TABLE_SHIFT];
+	if (!table) {
+		table = std::make_unique<PageEntry[]>(MEM_TABLE_ENTRIES);
+	}
+	return &table[page & (MEM_TABLE_ENTRIES - 1)];
+}
+
+const uint8_t* Memory::read_page(uint32_t addr) const {
+	std::unique_lock<std::recursive_mutex> guard = lock_shared();
+	uint32_t page = addr >> MEM_PAGE_SHIFT;
+	PageEntry *entry = find_entry(page);
+	uint32_t flags = entry ? entry->flags : 0;
+	uint32_t write_tag = fast_writable(flags) ? (addr & MEM_PAGE_MASK) : MEM_TLB_INVALID;
+	uint8_t *host;
+
+	if (reserved) {
+		if (!is_mapped(addr, 1)) {
+			return nullptr;
+		}
+		host = reserved + (addr & MEM_PAGE_MASK);
+	} else if (entry && entry->data) {
+		host = entry->data;
+	} else {
+		if (!is_mapped(addr, 1)) {
+			return nullptr;
+		}
+		host = zero_page;
+		write_tag = MEM_TLB_INVALID;
+	}
+
+	/* Concurrent harts share no TLB: every miss stays a miss */
+	if (!concurrent) {
+		TlbEntry &slot = tlb[page & (MEM_TLB_ENTRIES - 1)];
+		slot.read_tag = (flags & MEM_PAGE_WATCH_READ) ? MEM_TLB_INVALID : (addr & MEM_PAGE_MASK);
+		slot.write_tag = write_tag;
+		slot.host = host;
+	}
+	return host;
+}
+
+bool Memory::save_page(uint32_t page, PageEntry *entry) {
+	if (reserved) {
+		/* Saved copies stay valid until the next snapshot() */
+		if (saved.find(page) == saved.end()) {
+			uint8_t *copy = alloc_page(false);
+			if (!copy) {
+				return false;
+			}
+			std::memcpy(copy, reserved + ((uint64_t)page << MEM_PAGE_SHIFT), MEM_PAGE_SIZE);
+			saved[page] = copy;
+		}
+	} else {
+		if (saved.find(page) == saved.end()) {
+			saved[page] = entry->data;
+		}
+		if (entry->flags & MEM_PAGE_SHARED) {
+			uint8_t *copy = alloc_page(false);
+			if (!copy) {
+				return false;
+			}
+			std::memcpy(copy, entry->data, MEM_PAGE_SIZE);
+			entry->data = copy;
+			entry->flags &= ~MEM_PAGE_SHARED;
+		}
+	}
+
+	entry->flags |= MEM_PAGE_DIRTY;
+	dirty.push_back(page);
+	return true;
+}
+
+uint8_t* Memory::write_page(uint32_t addr) {
+	std::unique_lock<std::recursive_mutex> guard = lock_shared();
+	uint32_t page = addr >> MEM_PAGE_SHIFT;
+	PageEntry *entry = find_entry(page);
+	uint8_t *host;
+
+	if ((reserved || !entry || !entry->data) && !is_mapped(addr, 1)) {
+		return nullptr;
+	}
+	bool was_writable = fast_writable(entry ? entry->flags : 0);
+
+	/* First write since the snapshot */
+	if (snapshot_active && !(entry && (entry->flags & MEM_PAGE_DIRTY))) {
+		entry = create_entry(page);
+		if (!save_page(page, entry)) {
+			return nullptr;
+		}
+	}
+
+	/* First write since the checkpoint */
+	if (checkpoint_active && !(entry && (entry->flags & MEM_PAGE_MODIFIED))) {
+		entry = create_entry(page);
+		entry->flags |= MEM_PAGE_MODIFIED;
+		modified.push_back(page);
+	}
+
+	if (reserved) {
+		host = reserved + (addr & MEM_PAGE_MASK);
+		if (!was_writable) {
+			mprotect(host, MEM_PAGE_SIZE, PROT_READ | PROT_WRITE);
+		}
+	} else {
+		if (!entry || !entry->data) {
+			uint8_t *data = alloc_page(true);
+			if (!data) {
+				return nullptr;
+			}
+			entry = create_entry(page);
+			entry->data = data;
+			resident_pages++;
+		}
+		host = entry->data;
+	}
+
+	if (entry && (entry->flags & MEM_PAGE_CODE)) {
+		drop_code(page, entry);
+	}
+
+	/* Concurrent harts share no TLB: every miss stays a miss */
+	if (!concurrent) {
+		uint32_t flags = entry ? entry->flags : 0;
+		TlbEntry &slot = tlb[page & (MEM_TLB_ENTRIES - 1)];
+		slot.read_tag = (flags & MEM_PAGE_WATCH_READ) ? MEM_TLB_INVALID : (addr & MEM_PAGE_MASK);
+		slot.write_tag = fast_writable(flags) ? (addr & MEM_PAGE_MASK) : MEM_TLB_INVALID;
+		slot.host = host;
+	}
+	return host;
+}
+
+void Memory::snapshot() {
+	if (reserved) {
+		for (const auto &copy : saved) {
+			free_pages.push_back(copy.second);
+		}
+		for (uint32_t page : dirty) {
+			find_entry(page)->flags &= ~MEM_PAGE_DIRTY;
+		}
+		for (const auto &region : regions) {
+			mprotect(reserved + region.first, region.second - region.first, PROT_READ);
+		}
+	} else {
+		/* Snapshot data no longer referenced by the page table is recycled */
+		for (const auto &original : saved) {
+			if (original.second && find_entry(original.first)->data != original.second) {
+				free_pages.push_back(original.second);
+			}
+		}
+		for (const auto &table : directory) {
+			if (!table) continue;
+			for (uint32_t i = 0; i < MEM_TABLE_ENTRIES; i++) {
+				table[i].flags &= ~MEM_PAGE_DIRTY;
+				if (table[i].data) {
+					table[i].flags |= MEM_PAGE_SHARED;
+				}
+			}
+		}
+	}
+
+	saved.clear();
+	dirty.clear();
+	saved_regions = regions;
+	saved_break = program_break;
+	snapshot_active = true;
+	flush_tlb();
+}
+
+void Memory::restore() {
+	if (!snapshot_active) {
+		return;
+	}
+
+	for (uint32_t page : dirty) {
+		PageEntry *entry = find_entry(page);
+		uint8_t *original = saved[page];
+
+		if (reserved) {
+			uint8_t *host = reserved + ((uint64_t)page << MEM_PAGE_SHIFT);
+			mprotect(host, MEM_PAGE_SIZE, PROT_READ | PROT_WRITE);
+			std::memcpy(host, original, MEM_PAGE_SIZE);
+			bool mapped = false;
+			for (const auto &region : saved_regions) {
+				mapped = mapped || ((uint64_t)page << MEM_PAGE_SHIFT >= region.first &&
+					(uint64_t)page << MEM_PAGE_SHIFT < region.second);
+			}
+			mprotect(host, MEM_PAGE_SIZE, mapped ? PROT_READ : PROT_NONE);
+		} else {
+			/* Unmapped pages have no data; pages mapped since have no original */
+			if (entry->data && entry->data != original) {
+				free_pages.push_back(entry->data);
+			}
+			if (!original && entry->data) {
+				resident_pages--;
+			} else if (original && !entry->data) {
+				resident_pages++;
+			}
+			entry->data = original;
+			if (original) {
+				entry->flags |= MEM_PAGE_SHARED;
+			}
+		}
+
+		entry->flags &= ~MEM_PAGE_DIRTY;
+		if (checkpoint_active && !(entry->flags & MEM_PAGE_MODIFIED)) {
+			entry->flags |= MEM_PAGE_MODIFIED;
+			modified.push_back(page);
+		}
+		if (entry->flags & MEM_PAGE_CODE) {
+			drop_code(page, entry);
+		}
+	}
+
+	dirty.clear();
+
+	/* Put back the address space (every page is clean, so at most readable) */
+	if (regions != saved_regions) {
+		if (reserved) {
+			for (const auto &region : regions) {
+				mprotect(reserved + region.first, region.second - region.first, PROT_NONE);
+			}
+			for (const auto &region : saved_regions) {
+				mprotect(reserved + region.first, region.second - region.first, PROT_READ);
+			}
+		}
+		regions = saved_regions;
+	}
+	program_break = saved_break;
+	flush_tlb();
+}
+
+void Memory::get_resident_list(std::vector<uint32_t> *pages) const {
+	pages->clear();
+
+	if (reserved) {
+		std::vector<unsigned char> resident;
+		long host_page = sysconf(_SC_PAGESIZE);
+		for (const auto &region : regions) {
+			uint64_t length = region.second - region.first;
+			resident.resize((length + host_page - 1) / host_page);
+			if (mincore(reserved + region.first, length, resident.data()) != 0) {
+				continue;
+			}
+			for (size_t i = 0; i < resident.size(); i++) {
+				if (resident[i] & 1) {
+					pages->push_back((uint32_t)((region.first + i * host_page) >> MEM_PAGE_SHIFT));
+				}
+			}
+		}
+
+		/* Regions may overlap */
+		std::sort(pages->begin(), pages->end());
+		pages->erase(std::unique(pages->begin(), pages->end()), pages->end());
+		return;
+	}
+
+	for (uint32_t dir = 0; dir < MEM_TABLE_ENTRIES; dir++) {
+		if (!directory[dir]) continue;
+		for (uint32_t i = 0; i < MEM_TABLE_ENTRIES; i++) {
+			if (directory[dir][i].data) {
+				pages->push_back((dir << MEM_TABLE_SHIFT) | i);
+			}
+		}
+	}
+}
+
+void Memory::take_modified_pages(std::vector<uint32_t> *pages) {
+	pages->clear();
+
+	if (!checkpoint_active) {
+		/* First checkpoint: every page that may hold data */
+		get_resident_list(pages);
+		if (reserved) {
+			for (const auto &region : regions) {
+				mprotect(reserved + region.first, region.second - region.first, PROT_READ);
+			}
+		}
+	} else {
+		for (uint32_t page : modified) {
+			find_entry(page)->flags &= ~MEM_PAGE_MODIFIED;
+			if (reserved) {
+				mprotect(reserved + ((uint64_t)page << MEM_PAGE_SHIFT), MEM_PAGE_SIZE, PROT_READ);
+			}
+		}
+		pages->swap(modified);
+		std::sort(pages->begin(), pages->end());
+
+		/* Pages unmapped since the last call have nothing to save */
+		pages->erase(std::remove_if(pages->begin(), pages->end(), [this](uint32_t page) {
+			return !is_mapped(page << MEM_PAGE_SHIFT, MEM_PAGE_SIZE);
+		}), pages->end());
+	}
+
+	modified.clear();
+	checkpoint_active = true;
+	flush_tlb();
+}
+
+void Memory::retag_watched(uint32_t addr, uint64_t length) {
+	uint64_t start = addr & MEM_PAGE_MASK;
+	uint64_t end = (uint64_t)addr + length;
+
+	for (uint64_t base = start; base < end; base += MEM_PAGE_SIZE) {
+		uint32_t flags = 0;
+		for (const Watchpoint &watch : watchpoints) {
+			if (watch.addr < base + MEM_PAGE_SIZE && watch.addr + watch.length > base) {
+				if (watch.kind & WATCH_READ) flags |= MEM_PAGE_WATCH_READ;
+				if (watch.kind & WATCH_WRITE) flags |= MEM_PAGE_WATCH_WRITE;
+			}
+		}
+
+		uint32_t page = (uint32_t)(base >> MEM_PAGE_SHIFT);
+		PageEntry *entry = flags ? create_entry(page) : find_entry(page);
+		if (!entry) {
+			continue;
+		}
+		entry->flags = (entry->flags & ~(MEM_PAGE_WATCH_READ | MEM_PAGE_WATCH_WRITE)) | flags;
+
+		/* Keep the invariant: write tag valid => page mapped writable */
+		if (reserved && is_mapped((uint32_t)base, MEM_PAGE_SIZE)) {
+			mprotect(reserved + base, MEM_PAGE_SIZE,
+				fast_writable(entry->flags) ? PROT_READ | PROT_WRITE : PROT_READ);
+		}
+	}
+
+	flush_tlb();
+	direct = watchpoints.empty() ? reserved : nullptr;
+}
+
+int Memory::add_watchpoint(uint32_t addr, uint64_t length, watch_kind_t kind) {
+	if (length == 0) {
+		return -1;
+	}
+	if ((uint64_t)addr + length > 0x100000000ull) {
+		length = 0x100000000ull - addr;
+	}
+
+	int id = next_watch_id++;
+	watchpoints.push_back(Watchpoint{id, addr, length, kind});
+	retag_watched(addr, length);
+	return id;
+}
+
+bool Memory::remove_watchpoint(int id) {
+	for (size_t i = 0; i < watchpoints.size(); i++) {
+		if (watchpoints[i].id == id) {
+			Watchpoint watch = watchpoints[i];
+			watchpoints.erase(watchpoints.begin() + i);
+			retag_watched(watch.addr, watch.length);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Memory::check_watch(uint32_t addr, uint32_t size, watch_kind_t kind) const {
+	/* The access that stopped the run is being retried */
+	if (watch_skip) {
+		watch_skip = false;
+		if (watch_hit.addr == addr && watch_hit.size == size && watch_hit.kind == kind) {
+			watch_pending = false;
+			return false;
+		}
+	}
+
+	uint64_t end = (uint64_t)addr + size;
+	for (const Watchpoint &watch : watchpoints) {
+		if ((watch.kind & kind) && watch.addr < end && watch.addr + watch.length > addr) {
+			watch_hit = WatchHit{watch.id, addr, size, kind};
+			watch_pending = true;
+			watch_skip = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool Memory::take_watch_hit(WatchHit *hit) {
+	if (!watch_pending) {
+		return false;
+	}
+	*hit = watch_hit;
+	watch_pending = false;
+	return true;
+}
+
+memory_status_t Memory::read_block(uint32_t addr, void *buffer, uint32_t length) const {
+	uint8_t *out = (uint8_t*)buffer;
+
+	if (!is_mapped(addr, length)) {
+		return MEM_READ_ERROR;
+	}
+
+	while (length > 0) {
+		uint32_t offset = addr & (MEM_PAGE_SIZE - 1);
+		uint32_t chunk = MEM_PAGE_SIZE - offset;
+		if (chunk > length) chunk = length;
+
+		std::memcpy(out, host_read(addr) + offset, chunk);
+		out += chunk;
+		addr += chunk;
+		length -= chunk;
+	}
+
+	return MEM_OK;
+}
+
+memory_status_t Memory::write_block(uint32_t addr, const void *buffer, uint32_t length) {
+	const uint8_t *in = (const uint8_t*)buffer;
+
+	if (!is_mapped(addr, length)) {
+		return MEM_WRITE_ERROR;
+	}
+
+	while (length > 0) {
+		uint32_t offset = addr & (MEM_PAGE_SIZE - 1);
+		uint32_t chunk = MEM_PAGE_SIZE - offset;
+		if (chunk > length) chunk = length;
+
+		uint8_t *host = host_write(addr);
+		if (!host) {
+			return MEM_WRITE_ERROR;
+		}
+		std::memcpy(host + offset, in, chunk);
+		in += chunk;
+		addr += chunk;
+		length -= chunk;
+	}
+
+	return MEM_OK;
+}
+
+memory_status_t Memory::write_chunks(uint32_t addr, uint32_t length, std::vector<std::pair<uint8_t*, uint32_t>> *chunks) {
+	chunks->clear();
+	if (!is_mapped(addr, length)) {
+		return MEM_WRITE_ERROR;
+	}
+
+	while (length > 0) {
+		uint32_t offset = addr & (MEM_PAGE_SIZE - 1);
+		uint32_t chunk = MEM_PAGE_SIZE - offset;
+		if (chunk > length) chunk = length;
+
+		uint8_t *host = host_write(addr);
+		if (!host) {
+			return MEM_WRITE_ERROR;
+		}
+		host += offset;
+		if (!chunks->empty() && chunks->back().first + chunks->back().second == host) {
+			chunks->back().second += chunk;
+		} else {
+			chunks->push_back(std::make_pair(host, chunk));
+		}
+		addr += chunk;
+		length -= chunk;
+	}
+
+	return MEM_OK;
+}
+
+const Instruction* Memory::insert_decoded(uint32_t addr, uint32_t raw) {
+	mark_code(addr);
+	return decode_cache.insert(addr, raw);
+}
+
+void Memory::mark_code(uint32_t addr) {
+	std::unique_lock<std::recursive_mutex> guard = lock_shared();
+	uint32_t page = addr >> MEM_PAGE_SHIFT;
+	PageEntry *entry = create_entry(page);
+
+	/* Reserved backend: direct stores must fault into the slow path */
+	if (reserved && !(entry->flags & MEM_PAGE_CODE)) {
+		mprotect(reserved + (addr & MEM_PAGE_MASK), MEM_PAGE_SIZE, PROT_READ);
+	}
+	entry->flags |= MEM_PAGE_CODE;
+
+	/* Stores to this page must take the slow path from now on */
+	TlbEntry &slot = tlb[page & (MEM_TLB_ENTRIES - 1)];
+	if (slot.write_tag == (addr & MEM_PAGE_MASK)) {
+		slot.write_tag = MEM_TLB_INVALID;
+	}
+}
+
+memory_status_t Memory::atomic_load(uint32_t addr, uint32_t *value) const {
+	if (addr % 4 != 0) {
+		return MEM_MISALIGNED_ERROR;
+	}
+
+	if (!watchpoints.empty() && check_watch(addr, 4, WATCH_READ)) {
+		return MEM_READ_ERROR;
+	}
+
+	std::unique_lock<std::recursive_mutex> guard = lock_shared();
+	const uint8_t *host = host_read(addr);
+	if (!host) {
+		return MEM_READ_ERROR;
+	}
+
+	*value = guest_order(__atomic_load_n((const uint32_t*)(host + (addr & (MEM_PAGE_SIZE - 1))), __ATOMIC_SEQ_CST));
+	return MEM_OK;
+}
+
+memory_status_t Memory::atomic_rmw(uint32_t addr, amo_op_t op, uint32_t operand, uint32_t *old) {
+	if (addr % 4 != 0) {
+		return MEM_MISALIGNED_ERROR;
+	}
+
+	/* AMOs count as stores for watchpoints */
+	if (!watchpoints.empty() && check_watch(addr, 4, WATCH_WRITE)) {
+		return MEM_WRITE_ERROR;
+	}
+
+	std::unique_lock<std::recursive_mutex> guard = lock_shared();
+	uint8_t *host = host_write(addr);
+	if (!host) {
+		return MEM_WRITE_ERROR;
+	}
+
+	uint32_t *word = (uint32_t*)(host + (addr & (MEM_PAGE_SIZE - 1)));
+	uint32_t current = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+	uint32_t next;
+	do {
+		uint32_t value = guest_order(current);
+		uint32_t result;
+		switch (op) {
+			case AMO_SWAP: result = operand; break;
+			case AMO_ADD: result = value + operand; break;
+			case AMO_XOR: result = value ^ operand; break;
+			case AMO_AND: result = value & operand; break;
+			case AMO_OR: result = value | operand; break;
+			case AMO_MIN: result = (int32_t)value < (int32_t)operand ? value : operand; break;
+			case AMO_MAX: result = (int32_t)value > (int32_t)operand ? value : operand; break;
+			case AMO_MINU: result = value < operand ? value : operand; break;
+			default: result = value > operand ? value : operand; break;
+		}
+		next = guest_order(result);
+	} while (!__atomic_compare_exchange_n(word, &current, next, true, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+	*old = guest_order(current);
+	return MEM_OK;
+}
+
+memory_status_t Memory::atomic_cas(uint32_t addr, uint32_t expected, uint32_t desired, uint32_t *old) {
+	if (addr % 4 != 0) {
+		return MEM_MISALIGNED_ERROR;
+	}
+
+	if (!watchpoints.empty() && check_watch(addr, 4, WATCH_WRITE)) {
+		return MEM_WRITE_ERROR;
+	}
+
+	std::unique_lock<std::recursive_mutex> guard = lock_shared();
+	uint8_t *host = host_write(addr);
+	if (!host) {
+		return MEM_WRITE_ERROR;
+	}
+
+	uint32_t *word = (uint32_t*)(host + (addr & (MEM_PAGE_SIZE - 1)));
+	uint32_t current = guest_order(expected);
+	__atomic_compare_exchange_n(word, &current, guest_order(desired), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+	*old = guest_order(current);
+	return MEM_OK;
 }
 
 memory_status_t Memory::read8(uint32_t addr, uint8_t *value) const {
-	if (addr >= size) {
+	const uint8_t *host = host_read(addr);
+	if (!host) {
 		return MEM_READ_ERROR;
 	}
 
-	*value = data[addr];
+	*value = host[addr & (MEM_PAGE_SIZE - 1)];
 
 	return MEM_OK;
 }
 
 memory_status_t Memory::write8(uint32_t addr, uint8_t value) {
-	if (addr >= size) {
+	uint8_t *host = host_write(addr);
+	if (!host) {
 		return MEM_WRITE_ERROR;
 	}
 
-	data[addr] = value;
+	host[addr & (MEM_PAGE_SIZE - 1)] = value;
 
 	return MEM_OK;
 }
@@ -45,12 +1068,15 @@ memory_status_t Memory::read16(uint32_t addr, uint16_t *value) const {
 		return MEM_MISALIGNED_ERROR;
 	}
 
-	/* Check for overflow and bounds */
-	if (addr > size - 2) {
+	/* Aligned accesses never cross a page */
+	const uint8_t *host = host_read(addr);
+	if (!host) {
 		return MEM_READ_ERROR;
 	}
 
-	*value = (uint16_t)((data[addr]) | (data[addr + 1] << 8));
+	uint16_t raw;
+	std::memcpy(&raw, host + (addr & (MEM_PAGE_SIZE - 1)), sizeof(raw));
+	*value = guest_order(raw);
 
 	return MEM_OK;
 }
@@ -60,13 +1086,13 @@ memory_status_t Memory::write16(uint32_t addr, uint16_t value) {
 		return MEM_MISALIGNED_ERROR;
 	}
 
-	/* Check for overflow and bounds */
-	if (addr > size - 2) {
+	uint8_t *host = host_write(addr);
+	if (!host) {
 		return MEM_WRITE_ERROR;
 	}
 
-	data[addr] = (uint8_t)(value & 0xFF);
-	data[addr + 1] = (uint8_t)((value >> 8) & 0xFF);
+	uint16_t raw = guest_order(value);
+	std::memcpy(host + (addr & (MEM_PAGE_SIZE - 1)), &raw, sizeof(raw));
 
 	return MEM_OK;
 }
@@ -76,15 +1102,14 @@ memory_status_t Memory::read32(uint32_t addr, uint32_t *value) const {
 		return MEM_MISALIGNED_ERROR;
 	}
 
-	/* Check for overflow and bounds */
-	if (addr > size - 4) {
+	const uint8_t *host = host_read(addr);
+	if (!host) {
 		return MEM_READ_ERROR;
 	}
 
-	*value = (uint32_t)((data[addr]) |
-		(data[addr + 1] << 8) |
-		(data[addr + 2] << 16) |
-		(data[addr + 3] << 24));
+	uint32_t raw;
+	std::memcpy(&raw, host + (addr & (MEM_PAGE_SIZE - 1)), sizeof(raw));
+	*value = guest_order(raw);
 
 	return MEM_OK;
 }
@@ -94,15 +1119,13 @@ memory_status_t Memory::write32(uint32_t addr, uint32_t value) {
 		return MEM_MISALIGNED_ERROR;
 	}
 
-	/* Check for overflow and bounds */
-	if (addr > size - 4) {
+	uint8_t *host = host_write(addr);
+	if (!host) {
 		return MEM_WRITE_ERROR;
 	}
 
-	data[addr] = (uint8_t)(value & 0xFF);
-	data[addr + 1] = (uint8_t)((value >> 8) & 0xFF);
-	data[addr + 2] = (uint8_t)((value >> 16) & 0xFF);
-	data[addr + 3] = (uint8_t)((value >> 24) & 0xFF);
+	uint32_t raw = guest_order(value);
+	std::memcpy(host + (addr & (MEM_PAGE_SIZE - 1)), &raw, sizeof(raw));
 
 	return MEM_OK;
-}
\ No newline at end of file
+}
@@ -0,0 +1,85 @@
+/* program_image.cpp */
+#include "program_image.hpp"
+#include "memory.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ProgramImage::ProgramImage() : fd(-1), base(0), load_address(0), length(0), file_size(0) {
+}
+
+ProgramImage::~ProgramImage() {
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+int ProgramImage::load(const char *path, uint32_t address) {
+	if (fd >= 0) {
+		return -1;
+	}
+
+	int file = open(path, O_RDONLY);
+	if (file < 0) {
+		std::fprintf(stderr, "Error: Cannot open file '%s'\n", path);
+		return -1;
+	}
+
+	struct stat info;
+	uint32_t first = address & MEM_PAGE_MASK;
+	uint32_t offset = address - first;
+	if (fstat(file, &info) != 0 || (uint64_t)address + (uint64_t)info.st_size > 0x100000000ull) {
+		std::fprintf(stderr, "Error: Program too large for memory\n");
+		close(file);
+		return -1;
+	}
+	uint64_t size = (uint64_t)info.st_size;
+	uint64_t pages = (offset + size + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE;
+	if (pages == 0) {
+		pages = 1;
+	}
+
+	std::vector<uint8_t> data(pages * MEM_PAGE_SIZE, 0);
+	ssize_t read_size = size > 0 ? pread(file, data.data() + offset, size, 0) : 0;
+	close(file);
+	if (read_size != (ssize_t)size) {
+		std::fprintf(stderr, "Error: Failed to read entire file\n");
+		return -1;
+	}
+
+	/* Anonymous host file: every memory maps the same page-cache pages */
+	int image = memfd_create("program_image", MFD_CLOEXEC);
+	if (image < 0) {
+		return -1;
+	}
+	if (pwrite(image, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+		close(image);
+		return -1;
+	}
+
+	/* Decode every word once; data words simply stay invalid */
+	decoded.clear();
+	for (uint64_t page = 0; page < pages; page++) {
+		std::unique_ptr<DecodedPage> entry = std::make_unique<DecodedPage>();
+		const uint8_t *bytes = data.data() + page * MEM_PAGE_SIZE;
+		for (uint32_t slot = 0; slot < CODE_PAGE_SLOTS; slot++) {
+			const uint8_t *word = bytes + slot * 4;
+			uint32_t raw = (uint32_t)word[0] | ((uint32_t)word[1] << 8) |
+				((uint32_t)word[2] << 16) | ((uint32_t)word[3] << 24);
+			entry->valid[slot] = entry->slots[slot].decode(raw);
+		}
+		decoded.push_back(std::move(entry));
+	}
+
+	fd = image;
+	base = first;
+	load_address = address;
+	length = pages * MEM_PAGE_SIZE;
+	file_size = size;
+	return 0;
+}
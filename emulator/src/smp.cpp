@@ -0,0 +1,166 @@
+/* smp.cpp */
+#include "smp.hpp"
+#include "cpu.hpp"
+#include "memory.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+Smp::Smp(Memory *mem, CPU *boot, uint32_t count)
+	: mem(mem), stopping(false), stopped(false), stop(), group_exited(false), exit_status(0) {
+	count = std::max(1u, std::min(count, (uint32_t)SMP_MAX_HARTS));
+	CpuState state = boot->get_state();
+	uint32_t boot_sp = boot->get_register(2);
+
+	harts.push_back(boot);
+	for (uint32_t hart = 1; hart < count; hart++) {
+		owned.push_back(std::make_unique<CPU>());
+		CPU *cpu = owned.back().get();
+		cpu->set_state(state);
+		cpu->set_register(2, boot_sp - hart * SMP_HART_STACK);
+		*cpu->get_syscalls() = *boot->get_syscalls();
+		harts.push_back(cpu);
+	}
+
+	for (uint32_t hart = 0; hart < count; hart++) {
+		harts[hart]->set_hartid(hart);
+		harts[hart]->set_register(10, hart);
+		harts[hart]->set_hart_decode(true);
+	}
+
+	/* Wrappers point into calls, so it must not reallocate */
+	calls.resize(count);
+}
+
+syscall_action_t Smp::sys_serialized(SyscallCall *call, void *data) {
+	HartCalls *calls = (HartCalls*)data;
+	Smp *smp = calls->smp;
+	const SyscallEntry &entry = calls->inner[call->number];
+
+	std::lock_guard<std::mutex> lock(smp->syscall_lock);
+	call->files = &smp->files;
+	syscall_action_t action = entry.handler(call, entry.data);
+
+	if (action == SYSCALL_EXIT && call->number == SYS_exit_group) {
+		smp->exit_status = call->args[0];
+		smp->group_exited = true;
+		smp->stopping.store(true, std::memory_order_relaxed);
+	}
+	return action;
+}
+
+void Smp::stop_group(uint32_t hart, const RunResult &result) {
+	std::lock_guard<std::mutex> lock(stop_lock);
+	if (!stopped) {
+		stopped = true;
+		stop.reason = result.reason;
+		stop.status = result.status;
+		stop.hart = hart;
+	}
+	stopping.store(true, std::memory_order_relaxed);
+}
+
+void Smp::run_hart(uint32_t hart, cpu_engine_t engine, uint64_t max_instructions, uint64_t *retired) {
+	CPU *cpu = harts[hart];
+	uint64_t count = 0;
+
+	while (count < max_instructions && !stopping.load(std::memory_order_relaxed)) {
+		RunResult result = cpu->run(mem, engine, std::min<uint64_t>(SMP_QUANTUM, max_instructions - count));
+		count += result.retired;
+
+		if (result.reason == RUN_EXIT) {
+			if (group_exited) {
+				stop_group(hart, result);
+			}
+			break;
+		}
+		if (result.reason != RUN_BUDGET) {
+			stop_group(hart, result);
+			break;
+		}
+	}
+
+	*retired = count;
+}
+
+SmpResult Smp::run(cpu_engine_t engine, uint64_t max_instructions) {
+	uint32_t count = get_hart_count();
+	SmpResult result = {RUN_EXIT, CPU_SYSCALL_EXIT, 0, 0};
+
+	if (group_exited) {
+		return result;
+	}
+
+	/* Block and JIT caches live in the shared memory */
+	if (engine == ENGINE_BLOCK || engine == ENGINE_JIT) {
+		engine = ENGINE_THREADED;
+	}
+
+	/* Serialize system calls for this run only */
+	for (uint32_t hart = 0; hart < count; hart++) {
+		SyscallTable *table = harts[hart]->get_syscalls();
+		HartCalls &wrapped = calls[hart];
+		wrapped.smp = this;
+		wrapped.hart = hart;
+		wrapped.inner.assign(SYSCALL_TABLE_SIZE, SyscallEntry());
+		for (uint32_t number = 0; number < SYSCALL_TABLE_SIZE; number++) {
+			const SyscallEntry *entry = table->get(number);
+			if (!entry) continue;
+			wrapped.inner[number] = *entry;
+			SyscallEntry serialized = *entry;
+			serialized.handler = sys_serialized;
+			serialized.data = &wrapped;
+			table->set_entry(number, serialized);
+		}
+	}
+
+	stopping.store(false, std::memory_order_relaxed);
+	stopped = false;
+	mem->set_concurrent(true);
+
+	std::vector<uint64_t> retired(count, 0);
+	std::vector<std::thread> threads;
+	for (uint32_t hart = 1; hart < count; hart++) {
+		threads.emplace_back(&Smp::run_hart, this, hart, engine, max_instructions, &retired[hart]);
+	}
+	run_hart(0, engine, max_instructions, &retired[0]);
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+
+	mem->set_concurrent(false);
+	files.flush();
+
+	for (uint32_t hart = 0; hart < count; hart++) {
+		SyscallTable *table = harts[hart]->get_syscalls();
+		for (uint32_t number = 0; number < SYSCALL_TABLE_SIZE; number++) {
+			if (calls[hart].inner[number].handler) {
+				table->set_entry(number, calls[hart].inner[number]);
+			}
+		}
+		result.retired += retired[hart];
+	}
+
+	if (stopped) {
+		result.reason = stop.reason;
+		result.status = stop.status;
+		result.hart = stop.hart;
+		return result;
+	}
+
+	for (CPU *cpu : harts) {
+		if (cpu->is_running()) {
+			result.reason = RUN_BUDGET;
+			result.status = CPU_OK;
+			break;
+		}
+	}
+	return result;
+}
+
+uint32_t Smp::get_exit_status() const {
+	return group_exited ? exit_status : harts[0]->get_register(10);
+}
@@ -0,0 +1,433 @@
+/* syscall_backends.cpp */
+#include "syscall_backends.hpp"
+#include "cpu.hpp"
+#include "memory.hpp"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+/* Bytes of struct stat written by the sandbox (matches the host backend) */
+#define SANDBOX_STAT_SIZE 64
+
+/* Offset and value of st_mode for the standard streams (character device) */
+#define SANDBOX_STAT_MODE_OFFSET 16
+#define SANDBOX_STAT_MODE_CHR 0020620
+
+/**
+ * Check whether a call only changes the guest address space
+ *
+ * brk, mmap and munmap depend on nothing but guest state, so they are
+ * not logged; replay runs them again to rebuild the mappings.
+ *
+ * number: System call number
+ *
+ * Output: true for brk, mmap and munmap
+ */
+static bool is_memory_call(uint32_t number) {
+	return number == SYS_brk || number == SYS_mmap || number == SYS_munmap;
+}
+
+SyscallSandbox::SyscallSandbox(const std::string &stdin_data)
+	: input(stdin_data), input_offset(0), clock_ns(0) {
+}
+
+void SyscallSandbox::install(SyscallTable *table) {
+	table->set(SYS_read, "read", sys_read, this, 1, 0);
+	table->set(SYS_write, "write", sys_write, this);
+	table->set(SYS_writev, "writev", sys_writev, this);
+	table->set(SYS_openat, "openat", sys_openat, this);
+	table->set(SYS_close, "close", sys_close, this);
+	table->set(SYS_fstat, "fstat", sys_fstat, this, 1, SANDBOX_STAT_SIZE);
+	table->set(SYS_lseek, "lseek", sys_lseek, this);
+	table->set(SYS_clock_gettime, "clock_gettime", sys_clock_gettime, this, 1, 8);
+	table->set(SYS_clock_gettime64, "clock_gettime64", sys_clock_gettime, this, 1, 16);
+}
+
+void SyscallSandbox::append(SyscallCall *call, const std::vector<uint8_t> &bytes) {
+	int fd = (int)call->args[0];
+	if (fd != 1 && fd != 2) {
+		call->result = (uint32_t)-EBADF;
+		return;
+	}
+	output[fd - 1].append((const char*)bytes.data(), bytes.size());
+	call->result = (uint32_t)bytes.size();
+}
+
+syscall_action_t SyscallSandbox::sys_read(SyscallCall *call, void *data) {
+	SyscallSandbox *sandbox = (SyscallSandbox*)data;
+	uint32_t buf_addr = call->args[1];
+	uint32_t count = call->args[2];
+
+	if (call->args[0] != 0) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+	if (!call->mem->is_mapped(buf_addr, count)) {
+		call->result = (uint32_t)-EFAULT;
+		return SYSCALL_CONTINUE;
+	}
+
+	size_t available = sandbox->input.size() - sandbox->input_offset;
+	uint32_t length = count < available ? count : (uint32_t)available;
+	if (call->mem->write_block(buf_addr, sandbox->input.data() + sandbox->input_offset, length) != MEM_OK) {
+		call->result = (uint32_t)-EFAULT;
+		return SYSCALL_CONTINUE;
+	}
+	sandbox->input_offset += length;
+	call->result = length;
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t SyscallSandbox::sys_write(SyscallCall *call, void *data) {
+	uint32_t buf_addr = call->args[1];
+	uint32_t count = call->args[2];
+
+	if (!call->mem->is_mapped(buf_addr, count)) {
+		call->result = (uint32_t)-EFAULT;
+		return SYSCALL_CONTINUE;
+	}
+
+	std::vector<uint8_t> buffer(count);
+	call->mem->read_block(buf_addr, buffer.data(), count);
+	((SyscallSandbox*)data)->append(call, buffer);
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t SyscallSandbox::sys_writev(SyscallCall *call, void *data) {
+	std::vector<uint8_t> buffer;
+	int status = gather_iovec(call->mem, call->args[1], call->args[2], &buffer);
+	if (status != 0) {
+		call->result = (uint32_t)status;
+		return SYSCALL_CONTINUE;
+	}
+
+	((SyscallSandbox*)data)->append(call, buffer);
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t SyscallSandbox::sys_openat(SyscallCall *call, void *data) {
+	(void)data;
+	call->result = (uint32_t)-EACCES;
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t SyscallSandbox::sys_close(SyscallCall *call, void *data) {
+	(void)data;
+	call->result = call->args[0] <= 2 ? 0 : (uint32_t)-EBADF;
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t SyscallSandbox::sys_fstat(SyscallCall *call, void *data) {
+	(void)data;
+	if (call->args[0] > 2) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+
+	uint8_t st[SANDBOX_STAT_SIZE] = {};
+	if (call->mem->write_block(call->args[1], st, sizeof(st)) != MEM_OK ||
+			call->mem->write32(call->args[1] + SANDBOX_STAT_MODE_OFFSET, SANDBOX_STAT_MODE_CHR) != MEM_OK) {
+		call->result = (uint32_t)-EFAULT;
+		return SYSCALL_CONTINUE;
+	}
+	call->result = 0;
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t SyscallSandbox::sys_lseek(SyscallCall *call, void *data) {
+	(void)data;
+	call->result = call->args[0] <= 2 ? (uint32_t)-ESPIPE : (uint32_t)-EBADF;
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t SyscallSandbox::sys_clock_gettime(SyscallCall *call, void *data) {
+	SyscallSandbox *sandbox = (SyscallSandbox*)data;
+	sandbox->clock_ns += SANDBOX_CLOCK_STEP_NS;
+
+	bool ok = write_timespec(call->mem, call->args[1], sandbox->clock_ns / 1000000000ull,
+		(uint32_t)(sandbox->clock_ns % 1000000000ull), call->number == SYS_clock_gettime64);
+	call->result = ok ? 0 : (uint32_t)-EFAULT;
+	return SYSCALL_CONTINUE;
+}
+
+SyscallRecorder::SyscallRecorder() : file(nullptr) {
+}
+
+SyscallRecorder::~SyscallRecorder() {
+	if (file) {
+		std::fclose(file);
+	}
+}
+
+int SyscallRecorder::open(const char *path) {
+	file = std::fopen(path, "wb");
+	if (!file) {
+		std::fprintf(stderr, "Error: Cannot create syscall log '%s'\n", path);
+		return -1;
+	}
+
+	SyscallLogHeader header = { SYSCALL_LOG_MAGIC, SYSCALL_LOG_VERSION };
+	if (std::fwrite(&header, sizeof(header), 1, file) != 1) {
+		std::fprintf(stderr, "Error: Cannot write syscall log '%s'\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+void SyscallRecorder::install(SyscallTable *table) {
+	inner.assign(SYSCALL_TABLE_SIZE, SyscallEntry{nullptr, nullptr, nullptr, -1, 0});
+	for (uint32_t number = 0; number < SYSCALL_TABLE_SIZE; number++) {
+		const SyscallEntry *entry = table->get(number);
+		if (entry && !is_memory_call(number)) {
+			inner[number] = *entry;
+			table->set(number, entry->name, sys_record, this, entry->out_arg, entry->out_size);
+		}
+	}
+}
+
+syscall_action_t SyscallRecorder::sys_record(SyscallCall *call, void *data) {
+	SyscallRecorder *recorder = (SyscallRecorder*)data;
+	const SyscallEntry &entry = recorder->inner[call->number];
+	syscall_action_t action = entry.handler(call, entry.data);
+
+	SyscallRecord record = { call->number, (uint32_t)action, call->result, 0, 0 };
+	std::vector<uint8_t> bytes;
+	if (entry.out_arg >= 0 && action == SYSCALL_CONTINUE && (int32_t)call->result >= 0) {
+		record.out_addr = call->args[entry.out_arg];
+		record.out_length = entry.out_size ? entry.out_size : call->result;
+		bytes.resize(record.out_length);
+		if (call->mem->read_block(record.out_addr, bytes.data(), record.out_length) != MEM_OK) {
+			record.out_length = 0;
+			bytes.clear();
+		}
+	}
+
+	if (recorder->file) {
+		std::fwrite(&record, sizeof(record), 1, recorder->file);
+		if (!bytes.empty()) {
+			std::fwrite(bytes.data(), 1, bytes.size(), recorder->file);
+		}
+	}
+	return action;
+}
+
+SyscallTracer::SyscallTracer(size_t capacity)
+	: ring(capacity ? capacity : 1), total(0) {
+}
+
+void SyscallTracer::install(SyscallTable *table) {
+	inner.assign(SYSCALL_TABLE_SIZE, SyscallEntry{nullptr, nullptr, nullptr, -1, 0});
+	for (uint32_t number = 0; number < SYSCALL_TABLE_SIZE; number++) {
+		const SyscallEntry *entry = table->get(number);
+		if (entry) {
+			inner[number] = *entry;
+			table->set(number, entry->name, sys_trace, this, entry->out_arg, entry->out_size);
+		}
+	}
+}
+
+syscall_action_t SyscallTracer::sys_trace(SyscallCall *call, void *data) {
+	SyscallTracer *tracer = (SyscallTracer*)data;
+	const SyscallEntry &entry = tracer->inner[call->number];
+
+	SyscallTraceRecord &record = tracer->ring[tracer->total % tracer->ring.size()];
+	record.sequence = tracer->total++;
+	record.retired = call->cpu ? call->cpu->get_instret() : 0;
+	record.pc = call->cpu ? call->cpu->get_pc() - 4 : 0;
+	record.number = call->number;
+	std::memcpy(record.args, call->args, sizeof(record.args));
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	syscall_action_t action = entry.handler(call, entry.data);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	record.latency_ns = (uint64_t)((int64_t)(end.tv_sec - start.tv_sec) * 1000000000ll +
+		(end.tv_nsec - start.tv_nsec));
+	record.result = call->result;
+	record.action = (uint32_t)action;
+	return action;
+}
+
+void SyscallTracer::get_records(std::vector<SyscallTraceRecord> *records) const {
+	records->clear();
+	uint64_t first = total > ring.size() ? total - ring.size() : 0;
+	for (uint64_t sequence = first; sequence < total; sequence++) {
+		records->push_back(ring[sequence % ring.size()]);
+	}
+}
+
+int SyscallTracer::write(const char *path) const {
+	std::vector<SyscallTraceRecord> records;
+	get_records(&records);
+
+	FILE *file = std::fopen(path, "wb");
+	if (!file) {
+		std::fprintf(stderr, "Error: Cannot create syscall trace '%s'\n", path);
+		return -1;
+	}
+
+	SyscallTraceHeader header = { SYSCALL_TRACE_MAGIC, SYSCALL_TRACE_VERSION,
+		(uint32_t)sizeof(SyscallTraceRecord), (uint32_t)records.size(), total };
+	bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+		(records.empty() || std::fwrite(records.data(), sizeof(SyscallTraceRecord), records.size(), file) == records.size());
+	if (std::fclose(file) != 0 || !ok) {
+		std::fprintf(stderr, "Error: Cannot write syscall trace '%s'\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Number of arguments worth printing for a call
+ *
+ * number: System call number
+ *
+ * Output: Argument count (6 for unknown calls)
+ */
+static int trace_arg_count(uint32_t number) {
+	switch (number) {
+		case SYS_exit: case SYS_exit_group: case SYS_close: case SYS_brk: return 1;
+		case SYS_fstat: case SYS_munmap: case SYS_clock_gettime: case SYS_clock_gettime64: return 2;
+		case SYS_read: case SYS_write: case SYS_writev: case SYS_lseek: return 3;
+		case SYS_openat: return 4;
+		default: return 6;
+	}
+}
+
+int SyscallTracer::decode(const char *path, FILE *out) {
+	FILE *file = std::fopen(path, "rb");
+	if (!file) {
+		std::fprintf(stderr, "Error: Cannot open syscall trace '%s'\n", path);
+		return -1;
+	}
+
+	SyscallTraceHeader header;
+	if (std::fread(&header, sizeof(header), 1, file) != 1 || header.magic != SYSCALL_TRACE_MAGIC ||
+			header.version != SYSCALL_TRACE_VERSION || header.record_size != sizeof(SyscallTraceRecord)) {
+		std::fprintf(stderr, "Error: Invalid syscall trace '%s'\n", path);
+		std::fclose(file);
+		return -1;
+	}
+
+	/* Names come from the host backend's registry */
+	SyscallTable names;
+	syscalls_install_host(&names);
+
+	std::fprintf(out, "# %llu calls traced, last %u kept\n", (unsigned long long)header.total, header.count);
+	std::fprintf(out, "# %8s %12s %10s  call = result <seconds>\n", "seq", "retired", "pc");
+
+	SyscallTraceRecord record;
+	uint32_t count = 0;
+	while (count < header.count && std::fread(&record, sizeof(record), 1, file) == 1) {
+		const SyscallEntry *entry = names.get(record.number);
+		char name[32];
+		if (entry) {
+			std::snprintf(name, sizeof(name), "%s", entry->name);
+		} else {
+			std::snprintf(name, sizeof(name), "syscall_%u", record.number);
+		}
+
+		char args[96] = "";
+		size_t used = 0;
+		for (int i = 0; i < trace_arg_count(record.number); i++) {
+			used += std::snprintf(args + used, sizeof(args) - used, i ? ", 0x%x" : "0x%x", record.args[i]);
+		}
+
+		char result[32];
+		int32_t value = (int32_t)record.result;
+		if (record.action == SYSCALL_EXIT) {
+			std::snprintf(result, sizeof(result), "?");
+		} else if (record.action == SYSCALL_FAULT) {
+			std::snprintf(result, sizeof(result), "? (fault)");
+		} else if (value < 0 && value >= -4095) {
+			std::snprintf(result, sizeof(result), "-1 %s", std::strerror(-value));
+		} else if (record.number == SYS_brk || record.number == SYS_mmap) {
+			std::snprintf(result, sizeof(result), "0x%x", record.result);
+		} else {
+			std::snprintf(result, sizeof(result), "%d", value);
+		}
+
+		std::fprintf(out, "  %8llu %12llu 0x%08x  %s(%s) = %s <%.6f>\n",
+			(unsigned long long)record.sequence, (unsigned long long)record.retired, record.pc,
+			name, args, result, record.latency_ns / 1e9);
+		count++;
+	}
+	std::fclose(file);
+
+	if (count != header.count) {
+		std::fprintf(stderr, "Error: Truncated syscall trace '%s'\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+SyscallReplayer::SyscallReplayer() : offset(0) {
+}
+
+int SyscallReplayer::open(const char *path) {
+	FILE *file = std::fopen(path, "rb");
+	if (!file) {
+		std::fprintf(stderr, "Error: Cannot open syscall log '%s'\n", path);
+		return -1;
+	}
+
+	SyscallLogHeader header;
+	bool ok = std::fread(&header, sizeof(header), 1, file) == 1 &&
+		header.magic == SYSCALL_LOG_MAGIC && header.version == SYSCALL_LOG_VERSION;
+
+	uint8_t chunk[4096];
+	size_t count;
+	log.clear();
+	while (ok && (count = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		log.insert(log.end(), chunk, chunk + count);
+	}
+	std::fclose(file);
+
+	if (!ok) {
+		std::fprintf(stderr, "Error: Invalid syscall log '%s'\n", path);
+		return -1;
+	}
+	offset = 0;
+	return 0;
+}
+
+void SyscallReplayer::install(SyscallTable *table) {
+	for (uint32_t number = 0; number < SYSCALL_TABLE_SIZE; number++) {
+		const SyscallEntry *entry = table->get(number);
+		if (entry && !is_memory_call(number)) {
+			table->set(number, entry->name, sys_replay, this, entry->out_arg, entry->out_size);
+		}
+	}
+}
+
+syscall_action_t SyscallReplayer::sys_replay(SyscallCall *call, void *data) {
+	SyscallReplayer *replayer = (SyscallReplayer*)data;
+
+	SyscallRecord record;
+	if (replayer->log.size() - replayer->offset < sizeof(record)) {
+		std::fprintf(stderr, "Error: Syscall replay ran past the end of the log (call %u)\n", call->number);
+		return SYSCALL_FAULT;
+	}
+	std::memcpy(&record, replayer->log.data() + replayer->offset, sizeof(record));
+
+	if (record.number != call->number ||
+			replayer->log.size() - replayer->offset - sizeof(record) < record.out_length) {
+		std::fprintf(stderr, "Error: Syscall replay diverged (call %u, log has %u)\n",
+			call->number, record.number);
+		return SYSCALL_FAULT;
+	}
+	replayer->offset += sizeof(record);
+
+	if (record.out_length > 0) {
+		if (call->mem->write_block(record.out_addr, replayer->log.data() + replayer->offset,
+				record.out_length) != MEM_OK) {
+			std::fprintf(stderr, "Error: Syscall replay cannot write guest memory at 0x%08x\n", record.out_addr);
+			return SYSCALL_FAULT;
+		}
+		replayer->offset += record.out_length;
+	}
+
+	call->result = record.result;
+	return (syscall_action_t)record.action;
+}
@@ -0,0 +1,345 @@
+/* syscalls.cpp */
+#include "syscalls.hpp"
+#include "fd_table.hpp"
+#include "memory.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Bytes of struct stat copied to the guest */
+#define STAT_COPY_SIZE 64
+
+/* Largest writev vector accepted (Linux UIO_MAXIOV) */
+#define WRITEV_MAX_IOV 1024
+
+/* Guest mmap flags (Linux RISC-V values) */
+#define GUEST_MAP_FIXED 0x10
+#define GUEST_MAP_ANONYMOUS 0x20
+
+SyscallTable::SyscallTable() {
+	for (SyscallEntry &entry : entries) {
+		entry = SyscallEntry{nullptr, nullptr, nullptr, -1, 0};
+	}
+}
+
+bool SyscallTable::set(uint32_t number, const char *name, syscall_handler_t handler, void *data,
+		int out_arg, uint32_t out_size) {
+	if (number >= SYSCALL_TABLE_SIZE) {
+		return false;
+	}
+	entries[number] = SyscallEntry{name, handler, data, out_arg, out_size};
+	return true;
+}
+
+void SyscallTable::set_entry(uint32_t number, const SyscallEntry &entry) {
+	if (number < SYSCALL_TABLE_SIZE) {
+		entries[number] = entry;
+	}
+}
+
+void SyscallTable::remove(uint32_t number) {
+	if (number < SYSCALL_TABLE_SIZE) {
+		entries[number] = SyscallEntry{nullptr, nullptr, nullptr, -1, 0};
+	}
+}
+
+syscall_action_t SyscallTable::dispatch(SyscallCall *call) const {
+	const SyscallEntry *entry = get(call->number);
+	if (!entry) {
+		call->result = (uint32_t)-ENOSYS;
+		return SYSCALL_CONTINUE;
+	}
+	return entry->handler(call, entry->data);
+}
+
+bool write_timespec(Memory *mem, uint32_t addr, uint64_t seconds, uint32_t nanoseconds, bool wide) {
+	if (wide) {
+		return mem->write32(addr, (uint32_t)seconds) == MEM_OK &&
+			mem->write32(addr + 4, (uint32_t)(seconds >> 32)) == MEM_OK &&
+			mem->write32(addr + 8, nanoseconds) == MEM_OK &&
+			mem->write32(addr + 12, 0) == MEM_OK;
+	}
+	return mem->write32(addr, (uint32_t)seconds) == MEM_OK &&
+		mem->write32(addr + 4, nanoseconds) == MEM_OK;
+}
+
+void read_guest_string(Memory *mem, uint32_t addr, char *buffer, size_t size) {
+	size_t i;
+	for (i = 0; i < size - 1; i++) {
+		uint8_t c;
+		if (mem->read8(addr + (uint32_t)i, &c) != MEM_OK) break;
+		buffer[i] = (char)c;
+		if (buffer[i] == '\0') break;
+	}
+	buffer[i] = '\0';
+}
+
+int gather_iovec(Memory *mem, uint32_t iov_addr, uint32_t iov_count, std::vector<uint8_t> *buffer) {
+	if (iov_count > WRITEV_MAX_IOV) {
+		return -EINVAL;
+	}
+
+	buffer->clear();
+	for (uint32_t i = 0; i < iov_count; i++) {
+		/* RV32 struct iovec: base, length */
+		uint32_t base, length;
+		if (mem->read32(iov_addr + i * 8, &base) != MEM_OK ||
+				mem->read32(iov_addr + i * 8 + 4, &length) != MEM_OK ||
+				!mem->is_mapped(base, length)) {
+			return -EFAULT;
+		}
+		size_t offset = buffer->size();
+		buffer->resize(offset + length);
+		mem->read_block(base, buffer->data() + offset, length);
+	}
+	return 0;
+}
+
+static syscall_action_t host_exit(SyscallCall *call, void *data) {
+	(void)call;
+	(void)data;
+	return SYSCALL_EXIT;
+}
+
+static syscall_action_t host_read(SyscallCall *call, void *data) {
+	(void)data;
+	int fd = (int)call->args[0];
+	uint32_t buf_addr = call->args[1];
+	size_t count = (size_t)call->args[2];
+
+	if (!call->mem->is_mapped(buf_addr, count)) {
+		call->result = (uint32_t)-1;
+		return SYSCALL_CONTINUE;
+	}
+
+	/* Prompts must be visible before blocking on input */
+	if (fd == 0) {
+		call->files->flush();
+	}
+
+	std::vector<uint8_t> buffer(count);
+	ssize_t result = read(call->files->host_fd(fd), buffer.data(), count);
+	if (result > 0 && call->mem->write_block(buf_addr, buffer.data(), (uint32_t)result) != MEM_OK) {
+		result = -EFAULT;
+	}
+	call->result = (uint32_t)result;
+	return SYSCALL_CONTINUE;
+}
+
+static syscall_action_t host_write(SyscallCall *call, void *data) {
+	(void)data;
+	int fd = (int)call->args[0];
+	uint32_t buf_addr = call->args[1];
+	size_t count = (size_t)call->args[2];
+
+	if (!call->mem->is_mapped(buf_addr, count)) {
+		call->result = (uint32_t)-1;
+		return SYSCALL_CONTINUE;
+	}
+
+	std::vector<uint8_t> buffer(count);
+	call->mem->read_block(buf_addr, buffer.data(), (uint32_t)count);
+
+	call->result = (uint32_t)call->files->write(fd, buffer.data(), count);
+	return SYSCALL_CONTINUE;
+}
+
+static syscall_action_t host_writev(SyscallCall *call, void *data) {
+	(void)data;
+	int fd = (int)call->args[0];
+
+	/* Gather into one write so the pieces coalesce like a single write */
+	std::vector<uint8_t> buffer;
+	int status = gather_iovec(call->mem, call->args[1], call->args[2], &buffer);
+	if (status != 0) {
+		call->result = (uint32_t)status;
+		return SYSCALL_CONTINUE;
+	}
+
+	call->result = (uint32_t)call->files->write(fd, buffer.data(), buffer.size());
+	return SYSCALL_CONTINUE;
+}
+
+static syscall_action_t host_openat(SyscallCall *call, void *data) {
+	(void)data;
+	int flags = (int)call->args[2];
+	mode_t mode = (mode_t)call->args[3];
+
+	char path[256];
+	read_guest_string(call->mem, call->args[1], path, sizeof(path));
+
+	call->result = (uint32_t)call->files->open(path, flags, mode);
+	return SYSCALL_CONTINUE;
+}
+
+static syscall_action_t host_close(SyscallCall *call, void *data) {
+	(void)data;
+	call->result = (uint32_t)call->files->close((int)call->args[0]);
+	return SYSCALL_CONTINUE;
+}
+
+static syscall_action_t host_fstat(SyscallCall *call, void *data) {
+	(void)data;
+	struct stat st;
+	int result = fstat(call->files->host_fd((int)call->args[0]), &st);
+
+	if (result == 0 && call->mem->is_mapped(call->args[1], sizeof(st))) {
+		size_t copy_size = sizeof(st) < STAT_COPY_SIZE ? sizeof(st) : STAT_COPY_SIZE;
+		if (call->mem->write_block(call->args[1], &st, (uint32_t)copy_size) != MEM_OK) {
+			result = -EFAULT;
+		}
+	}
+
+	call->result = (uint32_t)result;
+	return SYSCALL_CONTINUE;
+}
+
+static syscall_action_t host_lseek(SyscallCall *call, void *data) {
+	(void)data;
+	int host_fd = call->files->host_fd((int)call->args[0]);
+	off_t result = host_fd < 0 ? -1 : lseek(host_fd, (off_t)(int32_t)call->args[1], (int)call->args[2]);
+
+	call->result = result < 0 ? (uint32_t)(host_fd < 0 ? -EBADF : -errno) : (uint32_t)result;
+	return SYSCALL_CONTINUE;
+}
+
+/**
+ * Check that no mapped region overlaps a range
+ *
+ * mem: Memory instance
+ * start: Start address
+ * end: End address (exclusive)
+ *
+ * Output: true if [start, end) is entirely unmapped
+ */
+static bool range_free(const Memory *mem, uint64_t start, uint64_t end) {
+	for (const auto &region : mem->get_regions()) {
+		if (region.first < end && region.second > start) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static syscall_action_t host_brk(SyscallCall *call, void *data) {
+	(void)data;
+	Memory *mem = call->mem;
+	uint32_t current = mem->get_program_break();
+	uint64_t request = call->args[0];
+	uint64_t heap_base = ((uint64_t)mem->get_size() + MEM_PAGE_SIZE - 1) & ~(uint64_t)(MEM_PAGE_SIZE - 1);
+
+	/* Like Linux, a failed (or zero) request returns the unchanged break */
+	call->result = current;
+	if (request < heap_base || request > BRK_END) {
+		return SYSCALL_CONTINUE;
+	}
+
+	uint64_t old_end = ((uint64_t)current + MEM_PAGE_SIZE - 1) & ~(uint64_t)(MEM_PAGE_SIZE - 1);
+	uint64_t new_end = (request + MEM_PAGE_SIZE - 1) & ~(uint64_t)(MEM_PAGE_SIZE - 1);
+	if (new_end > old_end) {
+		if (!range_free(mem, old_end, new_end)) {
+			return SYSCALL_CONTINUE;
+		}
+		mem->map((uint32_t)old_end, new_end - old_end);
+	} else if (new_end < old_end) {
+		mem->unmap((uint32_t)new_end, old_end - new_end);
+	}
+
+	mem->set_program_break((uint32_t)request);
+	call->result = (uint32_t)request;
+	return SYSCALL_CONTINUE;
+}
+
+static syscall_action_t host_mmap(SyscallCall *call, void *data) {
+	(void)data;
+	uint32_t addr = call->args[0];
+	uint64_t length = ((uint64_t)call->args[1] + MEM_PAGE_SIZE - 1) & ~(uint64_t)(MEM_PAGE_SIZE - 1);
+	uint32_t flags = call->args[3];
+
+	/* Only fresh anonymous memory; protection is not enforced */
+	if (!(flags & GUEST_MAP_ANONYMOUS)) {
+		call->result = (uint32_t)-ENODEV;
+		return SYSCALL_CONTINUE;
+	}
+	if (length == 0 || ((flags & GUEST_MAP_FIXED) && (addr & (MEM_PAGE_SIZE - 1)) != 0)) {
+		call->result = (uint32_t)-EINVAL;
+		return SYSCALL_CONTINUE;
+	}
+
+	/* MAP_FIXED replaces whatever was mapped there */
+	if (flags & GUEST_MAP_FIXED) {
+		if ((uint64_t)addr + length > 0x100000000ull) {
+			call->result = (uint32_t)-ENOMEM;
+			return SYSCALL_CONTINUE;
+		}
+		call->mem->unmap(addr, length);
+		call->mem->map(addr, length);
+		call->result = addr;
+		return SYSCALL_CONTINUE;
+	}
+
+	/* Lowest gap in the area (derived from the regions, so saved states resume) */
+	std::vector<std::pair<uint32_t, uint64_t>> regions = call->mem->get_regions();
+	std::sort(regions.begin(), regions.end());
+	uint64_t base = MMAP_BASE;
+	for (const auto &region : regions) {
+		if (region.first >= base + length) break;
+		if (region.second > base) base = region.second;
+	}
+	if (base + length > MMAP_END) {
+		call->result = (uint32_t)-ENOMEM;
+		return SYSCALL_CONTINUE;
+	}
+
+	call->mem->map((uint32_t)base, length);
+	call->result = (uint32_t)base;
+	return SYSCALL_CONTINUE;
+}
+
+static syscall_action_t host_munmap(SyscallCall *call, void *data) {
+	(void)data;
+	uint32_t addr = call->args[0];
+	uint32_t length = call->args[1];
+
+	if ((addr & (MEM_PAGE_SIZE - 1)) != 0 || length == 0) {
+		call->result = (uint32_t)-EINVAL;
+		return SYSCALL_CONTINUE;
+	}
+
+	call->mem->unmap(addr, length);
+	call->result = 0;
+	return SYSCALL_CONTINUE;
+}
+
+static syscall_action_t host_clock_gettime(SyscallCall *call, void *data) {
+	(void)data;
+	struct timespec now;
+	if (clock_gettime((clockid_t)call->args[0], &now) != 0) {
+		call->result = (uint32_t)-errno;
+		return SYSCALL_CONTINUE;
+	}
+
+	call->result = write_timespec(call->mem, call->args[1], (uint64_t)now.tv_sec, (uint32_t)now.tv_nsec,
+		call->number == SYS_clock_gettime64) ? 0 : (uint32_t)-EFAULT;
+	return SYSCALL_CONTINUE;
+}
+
+void syscalls_install_host(SyscallTable *table) {
+	table->set(SYS_exit, "exit", host_exit);
+	table->set(SYS_exit_group, "exit_group", host_exit);
+	table->set(SYS_read, "read", host_read, nullptr, 1, 0);
+	table->set(SYS_write, "write", host_write);
+	table->set(SYS_writev, "writev", host_writev);
+	table->set(SYS_openat, "openat", host_openat);
+	table->set(SYS_close, "close", host_close);
+	table->set(SYS_fstat, "fstat", host_fstat, nullptr, 1, STAT_COPY_SIZE);
+	table->set(SYS_lseek, "lseek", host_lseek);
+	table->set(SYS_brk, "brk", host_brk);
+	table->set(SYS_mmap, "mmap", host_mmap);
+	table->set(SYS_munmap, "munmap", host_munmap);
+	table->set(SYS_clock_gettime, "clock_gettime", host_clock_gettime, nullptr, 1, 8);
+	table->set(SYS_clock_gettime64, "clock_gettime64", host_clock_gettime, nullptr, 1, 16);
+}
@@ -0,0 +1,248 @@
+/* threaded.cpp */
+#include "cpu.hpp"
+#include "memory.hpp"
+#include "instructions.hpp"
+#include <atomic>
+#include <cstdint>
+
+/*
+ * Threaded-code interpreter
+ *
+ * Every decoded instruction carries its resolved operation (instr_op_t),
+ * which indexes a table of label addresses. Each handler ends with its
+ * own indirect jump to the next handler (computed goto), so the host
+ * branch predictor sees one indirect branch per guest instruction type
+ * instead of the shared format/opcode/funct switches of CPU::execute.
+ */
+
+/* Register access: x0 is re-zeroed after every write instead of tested */
+#define RS1 (x[instr->get_rs1()])
+#define RS2 (x[instr->get_rs2()])
+#define IMM ((uint32_t)instr->get_imm())
+#define WRITE_RD(value) do { x[instr->get_rd()] = (value); x[0] = 0; } while (0)
+
+/* Address of the instruction being executed (pc already points past it) */
+#define INSTR_PC (pc - 4)
+
+#define FAULT(s) do { status = (s); count--; goto done; } while (0)
+
+#define DISPATCH() do { \
+	if (count == max_instructions) goto done; \
+	instr = local_decode ? nullptr : mem->lookup_decoded(pc); \
+	if (instr) { \
+		pc += 4; \
+	} else { \
+		status = fetch_decoded(mem, &instr); \
+		if (status != CPU_OK) goto done; \
+	} \
+	count++; \
+	goto *dispatch[instr->get_op()]; \
+} while (0)
+
+#define BRANCH(cond) do { \
+	if (cond) pc = INSTR_PC + IMM; \
+	DISPATCH(); \
+} while (0)
+
+cpu_status_t CPU::run_threaded(Memory *mem, uint64_t max_instructions, uint64_t *retired) {
+	/* Indexed by instr_op_t; order must match the enum */
+	static const void *const dispatch[] = {
+		&&op_illegal,
+		&&op_lui, &&op_auipc, &&op_jal, &&op_jalr,
+		&&op_beq, &&op_bne, &&op_blt, &&op_bge, &&op_bltu, &&op_bgeu,
+		&&op_lb, &&op_lh, &&op_lw, &&op_lbu, &&op_lhu,
+		&&op_sb, &&op_sh, &&op_sw,
+		&&op_addi, &&op_slti, &&op_sltiu, &&op_xori, &&op_ori, &&op_andi,
+		&&op_slli, &&op_srli, &&op_srai,
+		&&op_add, &&op_sub, &&op_sll, &&op_slt, &&op_sltu,
+		&&op_xor, &&op_srl, &&op_sra, &&op_or, &&op_and,
+		&&op_mul, &&op_mulh, &&op_mulhsu, &&op_mulhu,
+		&&op_div, &&op_divu, &&op_rem, &&op_remu,
+		&&op_ecall, &&op_ebreak,
+		&&op_atomic, &&op_atomic, &&op_atomic, &&op_atomic, &&op_atomic, &&op_atomic,
+		&&op_atomic, &&op_atomic, &&op_atomic, &&op_atomic, &&op_atomic,
+		&&op_fence, &&op_csr
+	};
+	static_assert(sizeof(dispatch) / sizeof(dispatch[0]) == OP_COUNT,
+		"dispatch table out of sync with instr_op_t");
+
+	const Instruction *instr;
+	cpu_status_t status = CPU_OK;
+	uint64_t count = 0;
+	/* Harts sharing memory decode through fetch_decoded's per-hart cache */
+	const bool local_decode = hart_decode != nullptr;
+
+	if (!running) {
+		*retired = 0;
+		return CPU_SYSCALL_EXIT;
+	}
+
+	DISPATCH();
+
+op_illegal:
+op_atomic:
+op_csr: {
+	/* Rare (or error) paths: let the reference path produce the exact result */
+	Instruction copy = *instr;
+	status = execute(mem, &copy);
+	if (status != CPU_OK) FAULT(status);
+	DISPATCH();
+}
+
+op_lui:
+	WRITE_RD(IMM);
+	DISPATCH();
+
+op_auipc:
+	WRITE_RD(INSTR_PC + IMM);
+	DISPATCH();
+
+op_jal:
+	WRITE_RD(pc);
+	pc = INSTR_PC + IMM;
+	DISPATCH();
+
+op_jalr: {
+	uint32_t target = (RS1 + IMM) & ~1u;
+	WRITE_RD(pc);
+	pc = target;
+	DISPATCH();
+}
+
+op_beq:  BRANCH(RS1 == RS2);
+op_bne:  BRANCH(RS1 != RS2);
+op_blt:  BRANCH((int32_t)RS1 < (int32_t)RS2);
+op_bge:  BRANCH((int32_t)RS1 >= (int32_t)RS2);
+op_bltu: BRANCH(RS1 < RS2);
+op_bgeu: BRANCH(RS1 >= RS2);
+
+op_lb: {
+	uint8_t value;
+	if (!mem->load(RS1 + IMM, &value)) FAULT(CPU_EXECUTION_ERROR);
+	WRITE_RD((uint32_t)(int32_t)(int8_t)value);
+	DISPATCH();
+}
+
+op_lh: {
+	uint16_t value;
+	if (!mem->load(RS1 + IMM, &value)) FAULT(CPU_EXECUTION_ERROR);
+	WRITE_RD((uint32_t)(int32_t)(int16_t)value);
+	DISPATCH();
+}
+
+op_lw: {
+	uint32_t value;
+	if (!mem->load(RS1 + IMM, &value)) FAULT(CPU_EXECUTION_ERROR);
+	WRITE_RD(value);
+	DISPATCH();
+}
+
+op_lbu: {
+	uint8_t value;
+	if (!mem->load(RS1 + IMM, &value)) FAULT(CPU_EXECUTION_ERROR);
+	WRITE_RD(value);
+	DISPATCH();
+}
+
+op_lhu: {
+	uint16_t value;
+	if (!mem->load(RS1 + IMM, &value)) FAULT(CPU_EXECUTION_ERROR);
+	WRITE_RD(value);
+	DISPATCH();
+}
+
+op_sb:
+	if (!mem->store(RS1 + IMM, (uint8_t)RS2)) FAULT(CPU_EXECUTION_ERROR);
+	DISPATCH();
+
+op_sh:
+	if (!mem->store(RS1 + IMM, (uint16_t)RS2)) FAULT(CPU_EXECUTION_ERROR);
+	DISPATCH();
+
+op_sw:
+	if (!mem->store(RS1 + IMM, RS2)) FAULT(CPU_EXECUTION_ERROR);
+	DISPATCH();
+
+op_addi:  WRITE_RD(RS1 + IMM); DISPATCH();
+op_slti:  WRITE_RD((int32_t)RS1 < (int32_t)IMM ? 1 : 0); DISPATCH();
+op_sltiu: WRITE_RD(RS1 < IMM ? 1 : 0); DISPATCH();
+op_xori:  WRITE_RD(RS1 ^ IMM); DISPATCH();
+op_ori:   WRITE_RD(RS1 | IMM); DISPATCH();
+op_andi:  WRITE_RD(RS1 & IMM); DISPATCH();
+op_slli:  WRITE_RD(RS1 << (IMM & 0x1F)); DISPATCH();
+op_srli:  WRITE_RD(RS1 >> (IMM & 0x1F)); DISPATCH();
+op_srai:  WRITE_RD((uint32_t)((int32_t)RS1 >> (IMM & 0x1F))); DISPATCH();
+
+op_add:  WRITE_RD(RS1 + RS2); DISPATCH();
+op_sub:  WRITE_RD(RS1 - RS2); DISPATCH();
+op_sll:  WRITE_RD(RS1 << (RS2 & 0x1F)); DISPATCH();
+op_slt:  WRITE_RD((int32_t)RS1 < (int32_t)RS2 ? 1 : 0); DISPATCH();
+op_sltu: WRITE_RD(RS1 < RS2 ? 1 : 0); DISPATCH();
+op_xor:  WRITE_RD(RS1 ^ RS2); DISPATCH();
+op_srl:  WRITE_RD(RS1 >> (RS2 & 0x1F)); DISPATCH();
+op_sra:  WRITE_RD((uint32_t)((int32_t)RS1 >> (RS2 & 0x1F))); DISPATCH();
+op_or:   WRITE_RD(RS1 | RS2); DISPATCH();
+op_and:  WRITE_RD(RS1 & RS2); DISPATCH();
+
+op_mul:
+	WRITE_RD(RS1 * RS2);
+	DISPATCH();
+
+op_mulh:
+	WRITE_RD((uint32_t)(((int64_t)(int32_t)RS1 * (int64_t)(int32_t)RS2) >> 32));
+	DISPATCH();
+
+op_mulhsu:
+	WRITE_RD((uint32_t)(((int64_t)(int32_t)RS1 * (int64_t)(uint64_t)RS2) >> 32));
+	DISPATCH();
+
+op_mulhu:
+	WRITE_RD((uint32_t)(((uint64_t)RS1 * (uint64_t)RS2) >> 32));
+	DISPATCH();
+
+op_div: {
+	uint32_t a = RS1, b = RS2;
+	if (b == 0) WRITE_RD(0xFFFFFFFF);
+	else if (a == 0x80000000 && b == 0xFFFFFFFF) WRITE_RD(a);
+	else WRITE_RD((uint32_t)((int32_t)a / (int32_t)b));
+	DISPATCH();
+}
+
+op_divu: {
+	uint32_t a = RS1, b = RS2;
+	WRITE_RD(b == 0 ? 0xFFFFFFFF : a / b);
+	DISPATCH();
+}
+
+op_rem: {
+	uint32_t a = RS1, b = RS2;
+	if (b == 0) WRITE_RD(a);
+	else if (a == 0x80000000 && b == 0xFFFFFFFF) WRITE_RD(0);
+	else WRITE_RD((uint32_t)((int32_t)a % (int32_t)b));
+	DISPATCH();
+}
+
+op_remu: {
+	uint32_t a = RS1, b = RS2;
+	WRITE_RD(b == 0 ? a : a % b);
+	DISPATCH();
+}
+
+op_fence:
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	DISPATCH();
+
+op_ecall:
+op_ebreak: {
+	Instruction copy = *instr;
+	run_retired = count - 1;
+	status = execute_system(mem, &copy);
+	if (status == CPU_SYSCALL_EXIT || status == CPU_BREAKPOINT) goto done;
+	if (status != CPU_OK) FAULT(status);
+	DISPATCH();
+}
+
+done:
+	*retired = count;
+	return status;
+}
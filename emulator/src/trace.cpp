@@ -0,0 +1,155 @@
+/* trace.cpp */
+#include "trace.hpp"
+#include "instructions.hpp"
+#include <cstdio>
+
+/* Helper function to get instruction name */
+static const char* get_instruction_name(uint8_t opcode, uint8_t funct3, uint8_t funct7) {
+	switch (opcode) {
+		case 0x33: /* R-type ALU */
+			if (funct7 == 0x00) {
+				switch (funct3) {
+					case 0x0: return "add";
+					case 0x4: return "xor";
+					case 0x6: return "or";
+					case 0x7: return "and";
+					case 0x1: return "sll";
+					case 0x5: return "srl";
+					case 0x2: return "slt";
+					case 0x3: return "sltu";
+				}
+			} else if (funct7 == 0x20) {
+				if (funct3 == 0x0) return "sub";
+				if (funct3 == 0x5) return "sra";
+			} else if (funct7 == 0x01) {
+				/* M Extension */
+				switch (funct3) {
+					case 0x0: return "mul";
+					case 0x1: return "mulh";
+					case 0x2: return "mulhsu";
+					case 0x3: return "mulhu";
+					case 0x4: return "div";
+					case 0x5: return "divu";
+					case 0x6: return "rem";
+					case 0x7: return "remu";
+				}
+			}
+			return "alu-r";
+		case 0x13: /* I-type ALU */
+			switch (funct3) {
+				case 0x0: return "addi";
+				case 0x4: return "xori";
+				case 0x6: return "ori";
+				case 0x7: return "andi";
+				case 0x1: return "slli";
+				case 0x5: return (funct7 == 0x00) ? "srli" : "srai";
+				case 0x2: return "slti";
+				case 0x3: return "sltiu";
+			}
+			return "alu-i";
+		case 0x03: /* Load */
+			switch (funct3) {
+				case 0x0: return "lb";
+				case 0x1: return "lh";
+				case 0x2: return "lw";
+				case 0x4: return "lbu";
+				case 0x5: return "lhu";
+			}
+			return "load";
+		case 0x23: /* Store */
+			switch (funct3) {
+				case 0x0: return "sb";
+				case 0x1: return "sh";
+				case 0x2: return "sw";
+			}
+			return "store";
+		case 0x63: /* Branch */
+			switch (funct3) {
+				case 0x0: return "beq";
+				case 0x1: return "bne";
+				case 0x4: return "blt";
+				case 0x5: return "bge";
+				case 0x6: return "bltu";
+				case 0x7: return "bgeu";
+			}
+			return "branch";
+		case 0x6f: return "jal";
+		case 0x67: return "jalr";
+		case 0x37: return "lui";
+		case 0x17: return "auipc";
+		case 0x73: return (funct3 == 0x0) ? "ecall" : "csr";
+		case 0x2f: /* A Extension */
+			switch (funct7 >> 2) {
+				case 0x02: return "lr.w";
+				case 0x03: return "sc.w";
+				case 0x01: return "amoswap.w";
+				case 0x00: return "amoadd.w";
+				case 0x04: return "amoxor.w";
+				case 0x0c: return "amoand.w";
+				case 0x08: return "amoor.w";
+				case 0x10: return "amomin.w";
+				case 0x14: return "amomax.w";
+				case 0x18: return "amominu.w";
+				case 0x1c: return "amomaxu.w";
+			}
+			return "amo";
+		case 0x0f: return (funct3 == 0x1) ? "fence.i" : "fence";
+		default: return "unknown";
+	}
+}
+
+void TextTrace::fetch(uint32_t pc) {
+	std::printf("[FETCH] PC=0x%08x\n", pc);
+}
+
+void TextTrace::fetch_error(cpu_status_t status) {
+	std::printf("  %s ERROR: status=%d\n",
+		status == CPU_DECODE_ERROR ? "DECODE" : "FETCH", status);
+}
+
+void TextTrace::decode(const Instruction &decoded, uint32_t pc) {
+	std::printf("  Instruction: 0x%08x\n", decoded.get_raw());
+
+	const char* instr_name = get_instruction_name(decoded.get_opcode(),
+		decoded.get_funct3(), decoded.get_funct7());
+	std::printf("[DECODE] %s (opcode=0x%02x", instr_name, decoded.get_opcode());
+
+	switch (decoded.get_format()) {
+		case INSTR_R_TYPE:
+			std::printf(", rd=x%d, rs1=x%d, rs2=x%d, funct3=0x%x, funct7=0x%x)\n",
+				decoded.get_rd(), decoded.get_rs1(), decoded.get_rs2(),
+				decoded.get_funct3(), decoded.get_funct7());
+			break;
+		case INSTR_I_TYPE:
+			std::printf(", rd=x%d, rs1=x%d, imm=%d)\n",
+				decoded.get_rd(), decoded.get_rs1(), decoded.get_imm());
+			break;
+		case INSTR_S_TYPE:
+			std::printf(", rs1=x%d, rs2=x%d, imm=%d)\n",
+				decoded.get_rs1(), decoded.get_rs2(), decoded.get_imm());
+			break;
+		case INSTR_B_TYPE:
+			std::printf(", rs1=x%d, rs2=x%d, imm=%d, target=0x%08x)\n",
+				decoded.get_rs1(), decoded.get_rs2(), decoded.get_imm(),
+				pc + decoded.get_imm());
+			break;
+		case INSTR_U_TYPE:
+			std::printf(", rd=x%d, imm=0x%x)\n",
+				decoded.get_rd(), decoded.get_imm());
+			break;
+		case INSTR_J_TYPE:
+			std::printf(", rd=x%d, imm=%d, target=0x%08x)\n",
+				decoded.get_rd(), decoded.get_imm(), pc + decoded.get_imm());
+			break;
+	}
+
+	std::printf("[EXECUTE] ");
+}
+
+void TextTrace::execute(cpu_status_t status, uint32_t next_pc) {
+	if (status == CPU_OK) {
+		std::printf("OK, next_pc=0x%08x\n\n", next_pc);
+	} else {
+		std::printf("ERROR: status=%d\n\n", status);
+	}
+}
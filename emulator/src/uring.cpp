@@ -0,0 +1,430 @@
+/* uring.cpp */
+#include "uring.hpp"
+#include "fd_table.hpp"
+#include "memory.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <unistd.h>
+
+/* <asm/unistd.h> rather than <sys/syscall.h>, which would redefine the guest SYS_* numbers */
+#ifdef IO_URING_SUPPORTED
+#include <asm/unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
+/* Most guest pages covered by one direct read (longer reads come back short) */
+#define URING_MAX_IOVECS 1024
+
+#ifdef IO_URING_SUPPORTED
+
+struct SyscallUring::Ring {
+	int fd;
+	uint8_t *sq_map;
+	size_t sq_map_size;
+	uint8_t *cq_map;	/* Same as sq_map with IORING_FEAT_SINGLE_MMAP */
+	size_t cq_map_size;
+	io_uring_sqe *sqes;
+	size_t sqes_size;
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_mask;
+	uint32_t *sq_entries;
+	uint32_t *sq_array;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t *cq_mask;
+	io_uring_cqe *cqes;
+
+	Ring() : fd(-1), sq_map(nullptr), sq_map_size(0), cq_map(nullptr), cq_map_size(0),
+		sqes(nullptr), sqes_size(0) {}
+
+	~Ring() {
+		if (sqes) munmap(sqes, sqes_size);
+		if (cq_map && cq_map != sq_map) munmap(cq_map, cq_map_size);
+		if (sq_map) munmap(sq_map, sq_map_size);
+		if (fd >= 0) close(fd);
+	}
+
+	/**
+	 * Map one ring region
+	 *
+	 * size: Bytes to map
+	 * offset: IORING_OFF_* region
+	 *
+	 * Output: Mapping, or nullptr on failure
+	 */
+	void* map(size_t size, uint64_t offset) {
+		void *region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, (off_t)offset);
+		return region == MAP_FAILED ? nullptr : region;
+	}
+
+	/**
+	 * Append a request to the submission queue (not yet submitted)
+	 *
+	 * sqe: Filled request
+	 *
+	 * Output: true on success, false if the queue is full
+	 */
+	bool push(const io_uring_sqe &sqe) {
+		uint32_t tail = *sq_tail;
+		if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= *sq_entries) {
+			return false;
+		}
+		uint32_t index = tail & *sq_mask;
+		sqes[index] = sqe;
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+};
+
+int SyscallUring::open() {
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	std::unique_ptr<Ring> setup(new Ring());
+
+	setup->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (setup->fd < 0) {
+		return -1;
+	}
+
+	/* Reads and writes at the file position (offset -1) need Linux 5.6 */
+	if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+		return -1;
+	}
+
+	setup->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	setup->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single) {
+		setup->sq_map_size = std::max(setup->sq_map_size, setup->cq_map_size);
+		setup->cq_map_size = setup->sq_map_size;
+	}
+
+	setup->sq_map = (uint8_t*)setup->map(setup->sq_map_size, IORING_OFF_SQ_RING);
+	if (!setup->sq_map) {
+		return -1;
+	}
+	setup->cq_map = single ? setup->sq_map : (uint8_t*)setup->map(setup->cq_map_size, IORING_OFF_CQ_RING);
+	if (!setup->cq_map) {
+		return -1;
+	}
+	setup->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	setup->sqes = (io_uring_sqe*)setup->map(setup->sqes_size, IORING_OFF_SQES);
+	if (!setup->sqes) {
+		return -1;
+	}
+
+	setup->sq_head = (uint32_t*)(setup->sq_map + params.sq_off.head);
+	setup->sq_tail = (uint32_t*)(setup->sq_map + params.sq_off.tail);
+	setup->sq_mask = (uint32_t*)(setup->sq_map + params.sq_off.ring_mask);
+	setup->sq_entries = (uint32_t*)(setup->sq_map + params.sq_off.ring_entries);
+	setup->sq_array = (uint32_t*)(setup->sq_map + params.sq_off.array);
+	setup->cq_head = (uint32_t*)(setup->cq_map + params.cq_off.head);
+	setup->cq_tail = (uint32_t*)(setup->cq_map + params.cq_off.tail);
+	setup->cq_mask = (uint32_t*)(setup->cq_map + params.cq_off.ring_mask);
+	setup->cqes = (io_uring_cqe*)(setup->cq_map + params.cq_off.cqes);
+
+	ring = std::move(setup);
+	return 0;
+}
+
+int SyscallUring::submit_and_wait(uint32_t count, std::vector<int32_t> *results) {
+	uint32_t submitted = 0;
+	uint32_t completed = 0;
+
+	results->assign(count, -ECANCELED);
+	while (completed < count) {
+		int ret = (int)syscall(__NR_io_uring_enter, ring->fd, count - submitted, count - completed,
+			IORING_ENTER_GETEVENTS, nullptr, 0);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		submitted += (uint32_t)ret;
+
+		uint32_t head = *ring->cq_head;
+		uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			const io_uring_cqe &cqe = ring->cqes[head & *ring->cq_mask];
+			if (cqe.user_data < count) {
+				(*results)[cqe.user_data] = cqe.res;
+			}
+			completed++;
+			head++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	submissions++;
+	return 0;
+}
+
+int SyscallUring::flush() {
+	if (pending.empty()) {
+		return 0;
+	}
+
+	/* Linked requests run one after another, so the writes keep their order */
+	uint32_t count = (uint32_t)pending.size();
+	for (uint32_t i = 0; i < count; i++) {
+		io_uring_sqe sqe;
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_WRITE;
+		sqe.fd = pending[i].host_fd;
+		sqe.addr = (uint64_t)(uintptr_t)(output.data() + pending[i].offset);
+		sqe.len = (uint32_t)pending[i].length;
+		sqe.off = (uint64_t)-1;
+		sqe.flags = i + 1 < count ? IOSQE_IO_LINK : 0;
+		sqe.user_data = i;
+		ring->push(sqe);
+	}
+
+	std::vector<int32_t> results;
+	int status = submit_and_wait(count, &results);
+
+	/* A short write cancels the rest of the chain; finish those in order */
+	for (uint32_t i = 0; status == 0 && i < count; i++) {
+		int32_t result = results[i];
+		if (result >= 0 && (size_t)result == pending[i].length) {
+			continue;
+		}
+		if (result < 0 && result != -ECANCELED) {
+			status = -1;
+			break;
+		}
+		size_t done = result > 0 ? (size_t)result : 0;
+		const uint8_t *bytes = output.data() + pending[i].offset;
+		while (done < pending[i].length) {
+			ssize_t written = ::write(pending[i].host_fd, bytes + done, pending[i].length - done);
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				status = -1;
+				break;
+			}
+			done += (size_t)written;
+		}
+	}
+
+	output.clear();
+	pending.clear();
+	return status;
+}
+
+syscall_action_t SyscallUring::sys_read(SyscallCall *call, void *data) {
+	SyscallUring *uring = (SyscallUring*)data;
+	int fd = (int)call->args[0];
+	uint32_t buf_addr = call->args[1];
+	uint32_t count = call->args[2];
+
+	/* The guest may read back what it just wrote */
+	uring->flush();
+
+	if (count < URING_DIRECT_READ) {
+		const SyscallEntry &entry = uring->inner[SYS_read];
+		if (!entry.handler) {
+			call->result = (uint32_t)-EBADF;
+			return SYSCALL_CONTINUE;
+		}
+		return entry.handler(call, entry.data);
+	}
+
+	int host_fd = call->files->host_fd(fd);
+	if (host_fd < 0) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+
+	/* Prompts must be visible before blocking on input */
+	if (fd == 0) {
+		call->files->flush();
+	}
+
+	std::vector<std::pair<uint8_t*, uint32_t>> chunks;
+	if (call->mem->write_chunks(buf_addr, count, &chunks) != MEM_OK) {
+		call->result = (uint32_t)-EFAULT;
+		return SYSCALL_CONTINUE;
+	}
+	if (chunks.size() > URING_MAX_IOVECS) {
+		chunks.resize(URING_MAX_IOVECS);
+	}
+
+	std::vector<struct iovec> iov(chunks.size());
+	for (size_t i = 0; i < chunks.size(); i++) {
+		iov[i].iov_base = chunks[i].first;
+		iov[i].iov_len = chunks[i].second;
+	}
+
+	io_uring_sqe sqe;
+	std::memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_READV;
+	sqe.fd = host_fd;
+	sqe.addr = (uint64_t)(uintptr_t)iov.data();
+	sqe.len = (uint32_t)iov.size();
+	sqe.off = (uint64_t)-1;
+	sqe.user_data = 0;
+	uring->ring->push(sqe);
+
+	std::vector<int32_t> results;
+	if (uring->submit_and_wait(1, &results) != 0) {
+		call->result = (uint32_t)-EIO;
+		return SYSCALL_CONTINUE;
+	}
+	uring->direct_reads++;
+	call->result = (uint32_t)results[0];
+	return SYSCALL_CONTINUE;
+}
+
+#else
+
+struct SyscallUring::Ring {
+};
+
+int SyscallUring::open() {
+	return -1;
+}
+
+int SyscallUring::submit_and_wait(uint32_t count, std::vector<int32_t> *results) {
+	(void)count;
+	(void)results;
+	return -1;
+}
+
+int SyscallUring::flush() {
+	return pending.empty() ? 0 : -1;
+}
+
+syscall_action_t SyscallUring::sys_read(SyscallCall *call, void *data) {
+	SyscallUring *uring = (SyscallUring*)data;
+	const SyscallEntry &entry = uring->inner[SYS_read];
+	if (!entry.handler) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+	return entry.handler(call, entry.data);
+}
+
+#endif
+
+/**
+ * Check whether a call can run with writes still pending
+ *
+ * number: System call number
+ *
+ * Output: true for calls that never look at host files
+ */
+static bool skips_flush(uint32_t number) {
+	return number == SYS_brk || number == SYS_mmap || number == SYS_munmap ||
+		number == SYS_clock_gettime || number == SYS_clock_gettime64;
+}
+
+SyscallUring::SyscallUring()
+	: batching(true), guest_writes(0), submissions(0), direct_reads(0) {
+}
+
+SyscallUring::~SyscallUring() {
+	if (ring) {
+		flush();
+	}
+}
+
+void SyscallUring::install(SyscallTable *table) {
+	inner.assign(SYSCALL_TABLE_SIZE, SyscallEntry{nullptr, nullptr, nullptr, -1, 0});
+	for (uint32_t number = 0; number < SYSCALL_TABLE_SIZE; number++) {
+		const SyscallEntry *entry = table->get(number);
+		if (!entry) {
+			continue;
+		}
+		inner[number] = *entry;
+		if (number != SYS_read && number != SYS_write && number != SYS_writev && !skips_flush(number)) {
+			table->set(number, entry->name, sys_flush_first, this, entry->out_arg, entry->out_size);
+		}
+	}
+
+	table->set(SYS_read, "read", sys_read, this, 1, 0);
+	table->set(SYS_write, "write", sys_write, this);
+	table->set(SYS_writev, "writev", sys_writev, this);
+}
+
+void SyscallUring::set_batching(bool enable) {
+	batching = enable;
+	if (!enable) {
+		flush();
+	}
+}
+
+void SyscallUring::queue(SyscallCall *call, int host_fd, size_t start) {
+	size_t length = output.size() - start;
+	call->result = (uint32_t)length;
+	if (length == 0) {
+		return;
+	}
+
+	/* Back-to-back writes to one descriptor become one request */
+	if (!pending.empty() && pending.back().host_fd == host_fd) {
+		pending.back().length += length;
+	} else {
+		pending.push_back(PendingWrite{host_fd, start, length});
+	}
+	guest_writes++;
+
+	if (!batching || pending.size() >= URING_ENTRIES || output.size() >= URING_BATCH_BYTES) {
+		flush();
+	}
+}
+
+syscall_action_t SyscallUring::sys_write(SyscallCall *call, void *data) {
+	SyscallUring *uring = (SyscallUring*)data;
+	int host_fd = call->files->host_fd((int)call->args[0]);
+	uint32_t buf_addr = call->args[1];
+	uint32_t count = call->args[2];
+
+	if (host_fd < 0) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+	if (!call->mem->is_mapped(buf_addr, count)) {
+		call->result = (uint32_t)-EFAULT;
+		return SYSCALL_CONTINUE;
+	}
+
+	size_t start = uring->output.size();
+	uring->output.resize(start + count);
+	call->mem->read_block(buf_addr, uring->output.data() + start, count);
+	uring->queue(call, host_fd, start);
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t SyscallUring::sys_writev(SyscallCall *call, void *data) {
+	SyscallUring *uring = (SyscallUring*)data;
+	int host_fd = call->files->host_fd((int)call->args[0]);
+
+	if (host_fd < 0) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+
+	std::vector<uint8_t> buffer;
+	int status = gather_iovec(call->mem, call->args[1], call->args[2], &buffer);
+	if (status != 0) {
+		call->result = (uint32_t)status;
+		return SYSCALL_CONTINUE;
+	}
+
+	size_t start = uring->output.size();
+	uring->output.insert(uring->output.end(), buffer.begin(), buffer.end());
+	uring->queue(call, host_fd, start);
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t SyscallUring::sys_flush_first(SyscallCall *call, void *data) {
+	SyscallUring *uring = (SyscallUring*)data;
+	const SyscallEntry &entry = uring->inner[call->number];
+
+	uring->flush();
+	return entry.handler(call, entry.data);
+}
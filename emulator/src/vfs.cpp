@@ -0,0 +1,510 @@
+/* vfs.cpp */
+#include "vfs.hpp"
+#include "memory.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/* Guest open flags (Linux RISC-V values) */
+#define GUEST_O_ACCMODE 0x3
+#define GUEST_O_RDONLY 0x0
+#define GUEST_O_WRONLY 0x1
+#define GUEST_O_CREAT 0x40
+#define GUEST_O_TRUNC 0x200
+#define GUEST_O_APPEND 0x400
+
+/* Guest lseek origins */
+#define GUEST_SEEK_SET 0
+#define GUEST_SEEK_CUR 1
+#define GUEST_SEEK_END 2
+
+/* RV32 struct stat layout (first VFS_STAT_SIZE bytes) */
+#define VFS_STAT_SIZE 64
+#define VFS_STAT_MODE_OFFSET 16
+#define VFS_STAT_SIZE_OFFSET 48
+#define VFS_STAT_BLKSIZE_OFFSET 56
+#define VFS_STAT_MODE_REG 0100644
+
+/* ustar header fields */
+#define TAR_BLOCK 512
+#define TAR_NAME_OFFSET 0
+#define TAR_NAME_LENGTH 100
+#define TAR_SIZE_OFFSET 124
+#define TAR_SIZE_LENGTH 12
+#define TAR_TYPE_OFFSET 156
+#define TAR_MAGIC_OFFSET 257
+#define TAR_PREFIX_OFFSET 345
+#define TAR_PREFIX_LENGTH 155
+
+/**
+ * Read a whole host file
+ *
+ * path: Host path
+ * data: Output for contents
+ *
+ * Output: true on success
+ */
+static bool read_host_file(const char *path, std::vector<uint8_t> *data) {
+	FILE *file = std::fopen(path, "rb");
+	if (!file) {
+		return false;
+	}
+
+	uint8_t chunk[65536];
+	size_t count;
+	data->clear();
+	while ((count = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+		data->insert(data->end(), chunk, chunk + count);
+	}
+	bool ok = !std::ferror(file);
+	std::fclose(file);
+	return ok;
+}
+
+/**
+ * Load a directory tree
+ *
+ * vfs: Destination
+ * host_dir: Host directory
+ * prefix: Guest path of host_dir ("" for the root)
+ *
+ * Output: Files loaded, or -1 if host_dir cannot be read
+ */
+static int add_tree(Vfs *vfs, const std::string &host_dir, const std::string &prefix) {
+	DIR *dir = opendir(host_dir.c_str());
+	if (!dir) {
+		return -1;
+	}
+
+	int count = 0;
+	struct dirent *item;
+	while ((item = readdir(dir)) != nullptr) {
+		if (std::strcmp(item->d_name, ".") == 0 || std::strcmp(item->d_name, "..") == 0) {
+			continue;
+		}
+
+		std::string host_path = host_dir + "/" + item->d_name;
+		std::string guest_path = prefix.empty() ? item->d_name : prefix + "/" + item->d_name;
+		struct stat st;
+		if (stat(host_path.c_str(), &st) != 0) {
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			int nested = add_tree(vfs, host_path, guest_path);
+			if (nested > 0) {
+				count += nested;
+			}
+		} else if (S_ISREG(st.st_mode)) {
+			std::vector<uint8_t> data;
+			if (read_host_file(host_path.c_str(), &data)) {
+				vfs->add_file(guest_path, data);
+				count++;
+			}
+		}
+	}
+
+	closedir(dir);
+	return count;
+}
+
+Vfs::Vfs() : file_max(VFS_FILE_MAX), total_max(VFS_TOTAL_MAX), modified_bytes(0) {
+}
+
+std::string Vfs::normalize(const std::string &path) {
+	std::vector<std::string> parts;
+	size_t start = 0;
+
+	while (start <= path.size()) {
+		size_t end = path.find('/', start);
+		if (end == std::string::npos) {
+			end = path.size();
+		}
+
+		std::string part = path.substr(start, end - start);
+		if (part == "..") {
+			if (!parts.empty()) parts.pop_back();
+		} else if (!part.empty() && part != ".") {
+			parts.push_back(part);
+		}
+		start = end + 1;
+	}
+
+	std::string result;
+	for (const std::string &part : parts) {
+		if (!result.empty()) result += "/";
+		result += part;
+	}
+	return result;
+}
+
+void Vfs::add_file(const std::string &path, const std::vector<uint8_t> &data) {
+	File &file = files[normalize(path)];
+	if (file.modified) {
+		modified_bytes -= file.data->size();
+	}
+	file = File{std::make_shared<std::vector<uint8_t>>(data), false};
+}
+
+int Vfs::add_directory(const char *host_dir) {
+	return add_tree(this, host_dir, "");
+}
+
+int Vfs::add_archive(const char *host_path) {
+	std::vector<uint8_t> archive;
+	if (!read_host_file(host_path, &archive)) {
+		return -1;
+	}
+
+	int count = 0;
+	size_t offset = 0;
+	while (offset + TAR_BLOCK <= archive.size()) {
+		const char *header = (const char*)archive.data() + offset;
+		if (header[TAR_NAME_OFFSET] == '\0') {
+			return count;	/* End-of-archive block */
+		}
+
+		char size_text[TAR_SIZE_LENGTH + 1] = {};
+		std::memcpy(size_text, header + TAR_SIZE_OFFSET, TAR_SIZE_LENGTH);
+		uint64_t size = std::strtoull(size_text, nullptr, 8);
+
+		std::string name(header + TAR_NAME_OFFSET, strnlen(header + TAR_NAME_OFFSET, TAR_NAME_LENGTH));
+		if (std::memcmp(header + TAR_MAGIC_OFFSET, "ustar", 5) == 0 && header[TAR_PREFIX_OFFSET] != '\0') {
+			name = std::string(header + TAR_PREFIX_OFFSET, strnlen(header + TAR_PREFIX_OFFSET, TAR_PREFIX_LENGTH)) +
+				"/" + name;
+		}
+
+		offset += TAR_BLOCK;
+		if (size > archive.size() - offset) {
+			return -1;
+		}
+
+		char type = header[TAR_TYPE_OFFSET];
+		if (type == '0' || type == '\0') {
+			add_file(name, std::vector<uint8_t>(archive.begin() + offset, archive.begin() + offset + size));
+			count++;
+		}
+		offset += (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+	}
+
+	return count;
+}
+
+void Vfs::share_files(const Vfs &other) {
+	for (const auto &file : other.files) {
+		File &mine = files[file.first];
+		if (mine.modified) {
+			modified_bytes -= mine.data->size();
+		}
+		mine = File{file.second.data, false};
+	}
+}
+
+const std::vector<uint8_t>* Vfs::get_file(const std::string &path) const {
+	auto it = files.find(normalize(path));
+	return it == files.end() ? nullptr : it->second.data.get();
+}
+
+std::vector<std::string> Vfs::list_files() const {
+	std::vector<std::string> paths;
+	for (const auto &file : files) {
+		paths.push_back(file.first);
+	}
+	return paths;
+}
+
+int Vfs::write_directory(const char *host_dir, bool only_modified) const {
+	int count = 0;
+
+	for (const auto &file : files) {
+		if (only_modified && !file.second.modified) {
+			continue;
+		}
+
+		/* Create parent directories */
+		std::string host_path = std::string(host_dir) + "/" + file.first;
+		for (size_t slash = host_path.find('/', std::strlen(host_dir) + 1); slash != std::string::npos;
+				slash = host_path.find('/', slash + 1)) {
+			mkdir(host_path.substr(0, slash).c_str(), 0755);
+		}
+
+		FILE *out = std::fopen(host_path.c_str(), "wb");
+		if (!out) {
+			std::fprintf(stderr, "Error: Cannot write '%s'\n", host_path.c_str());
+			return -1;
+		}
+		const std::vector<uint8_t> &data = *file.second.data;
+		bool ok = data.empty() || std::fwrite(data.data(), 1, data.size(), out) == data.size();
+		ok = std::fclose(out) == 0 && ok;
+		if (!ok) {
+			std::fprintf(stderr, "Error: Cannot write '%s'\n", host_path.c_str());
+			return -1;
+		}
+		count++;
+	}
+
+	return count;
+}
+
+void Vfs::set_limits(uint64_t file_limit, uint64_t total_limit) {
+	file_max = file_limit;
+	total_max = total_limit;
+}
+
+void Vfs::install(SyscallTable *table) {
+	static const uint32_t numbers[] = {
+		SYS_openat, SYS_read, SYS_write, SYS_writev, SYS_lseek, SYS_fstat, SYS_close
+	};
+
+	inner.assign(SYSCALL_TABLE_SIZE, SyscallEntry{nullptr, nullptr, nullptr, -1, 0});
+	for (uint32_t number : numbers) {
+		const SyscallEntry *entry = table->get(number);
+		if (entry) {
+			inner[number] = *entry;
+		}
+	}
+
+	table->set(SYS_openat, "openat", sys_openat, this);
+	table->set(SYS_read, "read", sys_read, this, 1, 0);
+	table->set(SYS_write, "write", sys_write, this);
+	table->set(SYS_writev, "writev", sys_writev, this);
+	table->set(SYS_lseek, "lseek", sys_lseek, this);
+	table->set(SYS_fstat, "fstat", sys_fstat, this, 1, VFS_STAT_SIZE);
+	table->set(SYS_close, "close", sys_close, this);
+}
+
+Vfs::Handle* Vfs::find_handle(uint32_t guest_fd) {
+	if (guest_fd < VFS_FIRST_FD || guest_fd - VFS_FIRST_FD >= handles.size()) {
+		return nullptr;
+	}
+	Handle *handle = &handles[guest_fd - VFS_FIRST_FD];
+	return handle->path.empty() ? nullptr : handle;
+}
+
+syscall_action_t Vfs::forward(SyscallCall *call) {
+	const SyscallEntry &entry = inner[call->number];
+	if (!entry.handler) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+	return entry.handler(call, entry.data);
+}
+
+int32_t Vfs::write_handle(Handle *handle, const uint8_t *bytes, size_t length) {
+	if ((handle->flags & GUEST_O_ACCMODE) == GUEST_O_RDONLY) {
+		return -EBADF;
+	}
+
+	File &file = files[handle->path];
+	if (handle->flags & GUEST_O_APPEND) {
+		handle->offset = file.data->size();
+	}
+	if (handle->offset >= file_max && length > 0) {
+		return -EFBIG;
+	}
+	if (length > file_max - handle->offset) {
+		length = file_max - handle->offset;
+	}
+
+	/* Copying shared contents and growing the file both count against the total */
+	uint64_t end = handle->offset + length;
+	uint64_t growth = (file.modified ? 0 : file.data->size()) + (end > file.data->size() ? end - file.data->size() : 0);
+	if (modified_bytes + growth > total_max) {
+		return -ENOSPC;
+	}
+	modified_bytes += growth;
+
+	/* Contents loaded at startup may be shared; copy before the first write */
+	if (!file.modified) {
+		file.data = std::make_shared<std::vector<uint8_t>>(*file.data);
+		file.modified = true;
+	}
+
+	std::vector<uint8_t> &data = *file.data;
+	if (end > data.size()) {
+		data.resize(end);
+	}
+	if (length > 0) {
+		std::memcpy(data.data() + handle->offset, bytes, length);
+	}
+	handle->offset += length;
+	return (int32_t)length;
+}
+
+syscall_action_t Vfs::sys_openat(SyscallCall *call, void *data) {
+	Vfs *vfs = (Vfs*)data;
+	int flags = (int)call->args[2];
+
+	char path[VFS_PATH_MAX];
+	read_guest_string(call->mem, call->args[1], path, sizeof(path));
+	std::string key = normalize(path);
+
+	auto it = vfs->files.find(key);
+	if (it == vfs->files.end()) {
+		if (!(flags & GUEST_O_CREAT) || key.empty()) {
+			call->result = (uint32_t)-ENOENT;
+			return SYSCALL_CONTINUE;
+		}
+		it = vfs->files.emplace(key, File{std::make_shared<std::vector<uint8_t>>(), true}).first;
+	} else if ((flags & GUEST_O_TRUNC) && (flags & GUEST_O_ACCMODE) != GUEST_O_RDONLY) {
+		if (it->second.modified) {
+			vfs->modified_bytes -= it->second.data->size();
+		}
+		it->second = File{std::make_shared<std::vector<uint8_t>>(), true};
+	}
+
+	size_t slot = 0;
+	while (slot < vfs->handles.size() && !vfs->handles[slot].path.empty()) {
+		slot++;
+	}
+	if (slot == vfs->handles.size()) {
+		vfs->handles.push_back(Handle());
+	}
+	vfs->handles[slot] = Handle{key, flags, 0};
+
+	call->result = (uint32_t)(slot + VFS_FIRST_FD);
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t Vfs::sys_read(SyscallCall *call, void *data) {
+	Vfs *vfs = (Vfs*)data;
+	if (call->args[0] < VFS_FIRST_FD) {
+		return vfs->forward(call);
+	}
+
+	Handle *handle = vfs->find_handle(call->args[0]);
+	if (!handle || (handle->flags & GUEST_O_ACCMODE) == GUEST_O_WRONLY) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+	if (!call->mem->is_mapped(call->args[1], call->args[2])) {
+		call->result = (uint32_t)-EFAULT;
+		return SYSCALL_CONTINUE;
+	}
+
+	const std::vector<uint8_t> &contents = *vfs->files[handle->path].data;
+	uint64_t available = handle->offset < contents.size() ? contents.size() - handle->offset : 0;
+	uint32_t length = call->args[2] < available ? call->args[2] : (uint32_t)available;
+	if (length > 0 && call->mem->write_block(call->args[1], contents.data() + handle->offset, length) != MEM_OK) {
+		call->result = (uint32_t)-EFAULT;
+		return SYSCALL_CONTINUE;
+	}
+	handle->offset += length;
+	call->result = length;
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t Vfs::sys_write(SyscallCall *call, void *data) {
+	Vfs *vfs = (Vfs*)data;
+	if (call->args[0] < VFS_FIRST_FD) {
+		return vfs->forward(call);
+	}
+
+	Handle *handle = vfs->find_handle(call->args[0]);
+	if (!handle) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+	if (!call->mem->is_mapped(call->args[1], call->args[2])) {
+		call->result = (uint32_t)-EFAULT;
+		return SYSCALL_CONTINUE;
+	}
+
+	std::vector<uint8_t> buffer(call->args[2]);
+	call->mem->read_block(call->args[1], buffer.data(), call->args[2]);
+	call->result = (uint32_t)vfs->write_handle(handle, buffer.data(), buffer.size());
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t Vfs::sys_writev(SyscallCall *call, void *data) {
+	Vfs *vfs = (Vfs*)data;
+	if (call->args[0] < VFS_FIRST_FD) {
+		return vfs->forward(call);
+	}
+
+	Handle *handle = vfs->find_handle(call->args[0]);
+	if (!handle) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+
+	std::vector<uint8_t> buffer;
+	int status = gather_iovec(call->mem, call->args[1], call->args[2], &buffer);
+	call->result = status != 0 ? (uint32_t)status : (uint32_t)vfs->write_handle(handle, buffer.data(), buffer.size());
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t Vfs::sys_lseek(SyscallCall *call, void *data) {
+	Vfs *vfs = (Vfs*)data;
+	if (call->args[0] < VFS_FIRST_FD) {
+		return vfs->forward(call);
+	}
+
+	Handle *handle = vfs->find_handle(call->args[0]);
+	if (!handle) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+
+	int64_t offset = (int32_t)call->args[1];
+	switch (call->args[2]) {
+		case GUEST_SEEK_SET: break;
+		case GUEST_SEEK_CUR: offset += (int64_t)handle->offset; break;
+		case GUEST_SEEK_END: offset += (int64_t)vfs->files[handle->path].data->size(); break;
+		default:
+			call->result = (uint32_t)-EINVAL;
+			return SYSCALL_CONTINUE;
+	}
+	if (offset < 0 || offset > INT32_MAX) {
+		call->result = (uint32_t)-EINVAL;
+		return SYSCALL_CONTINUE;
+	}
+
+	handle->offset = (uint64_t)offset;
+	call->result = (uint32_t)offset;
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t Vfs::sys_fstat(SyscallCall *call, void *data) {
+	Vfs *vfs = (Vfs*)data;
+	if (call->args[0] < VFS_FIRST_FD) {
+		return vfs->forward(call);
+	}
+
+	Handle *handle = vfs->find_handle(call->args[0]);
+	if (!handle) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+
+	uint64_t size = vfs->files[handle->path].data->size();
+	uint8_t st[VFS_STAT_SIZE] = {};
+	uint32_t addr = call->args[1];
+	bool ok = call->mem->write_block(addr, st, sizeof(st)) == MEM_OK &&
+		call->mem->write32(addr + VFS_STAT_MODE_OFFSET, VFS_STAT_MODE_REG) == MEM_OK &&
+		call->mem->write32(addr + VFS_STAT_SIZE_OFFSET, (uint32_t)size) == MEM_OK &&
+		call->mem->write32(addr + VFS_STAT_SIZE_OFFSET + 4, (uint32_t)(size >> 32)) == MEM_OK &&
+		call->mem->write32(addr + VFS_STAT_BLKSIZE_OFFSET, MEM_PAGE_SIZE) == MEM_OK;
+	call->result = ok ? 0 : (uint32_t)-EFAULT;
+	return SYSCALL_CONTINUE;
+}
+
+syscall_action_t Vfs::sys_close(SyscallCall *call, void *data) {
+	Vfs *vfs = (Vfs*)data;
+	if (call->args[0] < VFS_FIRST_FD) {
+		return vfs->forward(call);
+	}
+
+	Handle *handle = vfs->find_handle(call->args[0]);
+	if (!handle) {
+		call->result = (uint32_t)-EBADF;
+		return SYSCALL_CONTINUE;
+	}
+
+	handle->path.clear();
+	call->result = 0;
+	return SYSCALL_CONTINUE;
+}
@@ -2,11 +2,30 @@
 #include "../include/cpu.hpp"
 #include "../include/memory.hpp"
 #include "../include/instructions.hpp"
+#include "../include/trace.hpp"
+#include "../include/fd_table.hpp"
+#include "../include/syscall_backends.hpp"
+#include "../include/vfs.hpp"
+#include "../include/uring.hpp"
+#include "../include/smp.hpp"
+#include "../include/batch.hpp"
+#include "../include/emulator_pool.hpp"
+#include "../include/program_image.hpp"
+#include "../include/lockstep.hpp"
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 /* Test 1: Basic CPU initialization */
 static void test_cpu_init() {
@@ -1262,6 +1281,1706 @@ static void test_m_extension_remu() {
 	std::printf("\tOK REMU instruction works\n");
 }
 
+/* Test 29: Decode cache and self-modifying code */
+static void test_decode_cache() {
+	std::printf("Test 29: Decode cache invalidation...\n");
+
+	CPU cpu;
+	Memory mem(8192);
+
+	uint32_t addi_instr = 0x00108093;  /* addi x1, x1, 1 */
+	uint32_t addi2_instr = 0x00208093; /* addi x1, x1, 2 */
+
+	/* First execution decodes and caches the instruction */
+	mem.write32(0x1000, addi_instr);
+	cpu.set_pc(0x1000);
+	assert(cpu.step(&mem) == CPU_OK);
+	assert(cpu.get_register(1) == 1);
+	assert(mem.lookup_decoded(0x1000) != nullptr);
+
+	/* Second execution hits the cache */
+	cpu.set_pc(0x1000);
+	assert(cpu.step(&mem) == CPU_OK);
+	assert(cpu.get_register(1) == 2);
+
+	/* A store into the code page drops the cached decode */
+	mem.write32(0x1000, addi2_instr);
+	assert(mem.lookup_decoded(0x1000) == nullptr);
+	cpu.set_pc(0x1000);
+	assert(cpu.step(&mem) == CPU_OK);
+	assert(cpu.get_register(1) == 4);
+
+	/* Bulk writes (syscalls, loader) invalidate like stores */
+	assert(mem.write_block(0x1000, &addi_instr, sizeof(addi_instr)) == MEM_OK);
+	assert(mem.lookup_decoded(0x1000) == nullptr);
+	cpu.set_pc(0x1000);
+	assert(cpu.step(&mem) == CPU_OK);
+	assert(cpu.get_register(1) == 5);
+
+	/* Writes to other pages leave the cache intact */
+	mem.write32(0x0100, 0);
+	assert(mem.lookup_decoded(0x1000) != nullptr);
+
+	std::printf("\tOK Decode cache invalidation works\n");
+}
+
+/* Test 30: Block engine with self-modifying code */
+static void test_block_engine() {
+	std::printf("Test 30: Block engine and block invalidation...\n");
+
+	CPU cpu;
+	Memory mem(8192);
+
+	/* The sw rewrites the instruction right after it in the same block */
+	uint32_t program[] = {
+		0x00100093,  /* addi x1, x0, 1 */
+		0x00000117,  /* auipc x2, 0 */
+		0x00312423,  /* sw x3, 8(x2)  -> overwrites the addi below */
+		0x00108093,  /* addi x1, x1, 1 (replaced by addi x1, x1, 100) */
+		0x05D00893,  /* addi x17, x0, 93 */
+		0x00000073,  /* ecall */
+	};
+
+	for (size_t i = 0; i < sizeof(program)/sizeof(program[0]); i++) {
+		assert(mem.write32(0x1000 + i*4, program[i]) == MEM_OK);
+	}
+
+	cpu.set_register(3, 0x06408093);  /* addi x1, x1, 100 */
+	cpu.set_pc(0x1000);
+
+	uint64_t retired = 0;
+	cpu_status_t status = cpu.run_blocks(&mem, 1000, &retired);
+	assert(status == CPU_SYSCALL_EXIT);
+	assert(retired == 6);
+	assert(cpu.get_register(1) == 101);  /* New instruction was executed */
+
+	BlockCache *blocks = mem.get_block_cache();
+	assert(blocks->get_misses() > 0);
+
+	/* Budget smaller than a block falls back to single steps */
+	CPU cpu2;
+	Memory mem2(8192);
+	assert(mem2.write32(0x0, 0x00108093) == MEM_OK);  /* addi x1, x1, 1 */
+	assert(mem2.write32(0x4, 0xFFDFF06F) == MEM_OK);  /* jal x0, -4 */
+	cpu2.set_pc(0x0);
+
+	status = cpu2.run_blocks(&mem2, 7, &retired);
+	assert(status == CPU_OK);
+	assert(retired == 7);
+	assert(cpu2.get_register(1) == 4);
+	assert(cpu2.get_pc() == 0x4);
+
+	status = cpu2.run_blocks(&mem2, 1000, &retired);
+	assert(status == CPU_OK);
+	assert(retired == 1000);
+	assert(cpu2.get_register(1) == 504);
+	assert(mem2.get_block_cache()->get_chained() > 0);
+
+	std::printf("\tOK Block engine and invalidation work\n");
+}
+
+/* Test 31: Batched run API stop reasons */
+static void test_run_api() {
+	std::printf("Test 31: Batched run API stop reasons...\n");
+
+	uint32_t program[] = {
+		0x00500093,  /* addi x1, x0, 5 */
+		0x00100073,  /* ebreak */
+		0x00108093,  /* addi x1, x1, 1 */
+		0x05D00893,  /* addi x17, x0, 93 */
+		0x00000073,  /* ecall */
+	};
+
+	const cpu_engine_t engines[] = { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+	for (cpu_engine_t engine : engines) {
+		CPU cpu;
+		Memory mem(4096);
+		for (size_t i = 0; i < sizeof(program)/sizeof(program[0]); i++) {
+			assert(mem.write32(i*4, program[i]) == MEM_OK);
+		}
+		cpu.set_pc(0);
+
+		RunResult result = cpu.run(&mem, engine, 1);
+		assert(result.reason == RUN_BUDGET && result.status == CPU_OK);
+		assert(result.retired == 1);
+
+		result = cpu.run(&mem, engine, 100);
+		assert(result.reason == RUN_BREAKPOINT);
+		assert(result.retired == 1);
+		assert(cpu.get_pc() == 0x8);
+
+		result = cpu.run(&mem, engine, 100);
+		assert(result.reason == RUN_EXIT);
+		assert(result.retired == 3);
+		assert(cpu.get_register(1) == 6);
+
+		/* Stopped CPU retires nothing */
+		result = cpu.run(&mem, engine, 100);
+		assert(result.reason == RUN_EXIT && result.retired == 0);
+
+		CPU faulting;
+		faulting.set_pc(0x2);
+		result = faulting.run(&mem, engine, 100);
+		assert(result.reason == RUN_FAULT);
+		assert(result.status == CPU_FETCH_MISALIGNED);
+		assert(result.retired == 0);
+	}
+
+	std::printf("\tOK All engines report exit, fault, budget and breakpoint\n");
+}
+
+/* Test 32: Binary tracing policy */
+static void test_binary_trace() {
+	std::printf("Test 32: Binary trace records...\n");
+
+	CPU cpu;
+	Memory mem(4096);
+	assert(mem.write32(0x0, 0x00500093) == MEM_OK);  /* addi x1, x0, 5 */
+	assert(mem.write32(0x4, 0x0080006F) == MEM_OK);  /* jal x0, 8 */
+	assert(mem.write32(0xC, 0x00108093) == MEM_OK);  /* addi x1, x1, 1 */
+	cpu.set_pc(0);
+
+	FILE *file = std::tmpfile();
+	assert(file);
+	cpu.set_trace(TRACE_BINARY, file);
+
+	RunResult result = cpu.run(&mem, ENGINE_SWITCH, 3);
+	assert(result.reason == RUN_BUDGET && result.retired == 3);
+	assert(cpu.get_register(1) == 6);
+
+	TraceRecord records[4];
+	std::rewind(file);
+	assert(std::fread(records, sizeof(TraceRecord), 4, file) == 3);
+	assert(records[0].pc == 0x0 && records[0].raw == 0x00500093 && records[0].next_pc == 0x4);
+	assert(records[1].pc == 0x4 && records[1].next_pc == 0xC);
+	assert(records[2].pc == 0xC && records[2].status == CPU_OK);
+	std::fclose(file);
+
+	/* Untraced run produces the same state */
+	CPU plain;
+	plain.set_pc(0);
+	result = plain.run(&mem, ENGINE_SWITCH, 3);
+	assert(result.retired == 3 && plain.get_register(1) == 6);
+
+	std::printf("\tOK Binary trace matches executed instructions\n");
+}
+
+/* Test 33: Sparse paged memory and TLB */
+static void test_paged_memory() {
+	std::printf("Test 33: Sparse paged memory...\n");
+
+	Memory mem(MEM_PAGE_SIZE * 128);
+	mem.map(STACK_BASE, STACK_SIZE);
+	mem.map(0xFFFFF000, MEM_PAGE_SIZE);
+	assert(mem.get_resident_pages() == 0);
+
+	/* Untouched pages read as zero without being allocated */
+	uint32_t value = 1;
+	assert(mem.read32(STACK_TOP - 4, &value) == MEM_OK);
+	assert(value == 0);
+	assert(mem.get_resident_pages() == 0);
+
+	/* First write allocates exactly one page */
+	assert(mem.write32(STACK_TOP - 4, 0xCAFEBABE) == MEM_OK);
+	assert(mem.write32(0xFFFFFFFC, 0x12345678) == MEM_OK);
+	assert(mem.get_resident_pages() == 2);
+	assert(mem.read32(STACK_TOP - 4, &value) == MEM_OK && value == 0xCAFEBABE);
+	assert(mem.read32(0xFFFFFFFC, &value) == MEM_OK && value == 0x12345678);
+
+	/* Pages sharing a TLB slot keep their own contents */
+	uint32_t conflict = MEM_PAGE_SIZE * MEM_TLB_ENTRIES;
+	assert(mem.write32(0x100, 1) == MEM_OK);
+	assert(mem.write32(conflict + 0x100, 2) == MEM_OK);
+	assert(mem.read32(0x100, &value) == MEM_OK && value == 1);
+	assert(mem.read32(conflict + 0x100, &value) == MEM_OK && value == 2);
+
+	/* Unmapped addresses fault */
+	assert(mem.read32(0x40000000, &value) == MEM_READ_ERROR);
+	assert(mem.write8(STACK_TOP, 0) == MEM_WRITE_ERROR);
+	assert(!mem.is_mapped(MEM_PAGE_SIZE * 127, MEM_PAGE_SIZE * 2));
+
+	/* Block copies cross page boundaries */
+	uint8_t out[16], in[16];
+	for (int i = 0; i < 16; i++) in[i] = (uint8_t)(i + 1);
+	assert(mem.write_block(MEM_PAGE_SIZE * 2 - 8, in, sizeof(in)) == MEM_OK);
+	assert(mem.read_block(MEM_PAGE_SIZE * 2 - 8, out, sizeof(out)) == MEM_OK);
+	assert(std::memcmp(in, out, sizeof(in)) == 0);
+
+	/* Stores through a cached TLB entry still invalidate decoded code */
+	CPU cpu;
+	assert(mem.write32(0x2000, 0x00108093) == MEM_OK);  /* addi x1, x1, 1 */
+	cpu.set_pc(0x2000);
+	assert(cpu.step(&mem) == CPU_OK);
+	assert(mem.lookup_decoded(0x2000) != nullptr);
+	assert(mem.write32(0x2000, 0x00508093) == MEM_OK);  /* addi x1, x1, 5 */
+	assert(mem.lookup_decoded(0x2000) == nullptr);
+	cpu.set_pc(0x2000);
+	assert(cpu.step(&mem) == CPU_OK);
+	assert(cpu.get_register(1) == 6);
+
+	std::printf("\tOK Pages are allocated on first write\n");
+}
+
+/* Test 34: Fast-path loads and stores */
+static void test_fast_access() {
+	std::printf("Test 34: Fast-path loads and stores...\n");
+
+	Memory mem(8192);
+	uint32_t word = 0;
+	uint16_t half = 0;
+	uint8_t byte = 0;
+
+	/* Round trip through the TLB, little-endian in guest memory */
+	assert(mem.store(0x100, (uint32_t)0x11223344));
+	assert(mem.load(0x100, &word) && word == 0x11223344);
+	assert(mem.load(0x102, &half) && half == 0x1122);
+	assert(mem.load(0x100, &byte) && byte == 0x44);
+	assert(mem.read8(0x103, &byte) == MEM_OK && byte == 0x11);
+
+	/* Misaligned and unmapped accesses fall through to the slow path */
+	assert(!mem.load(0x101, &word));
+	assert(mem.read32(0x101, &word) == MEM_MISALIGNED_ERROR);
+	assert(!mem.store(0x103, (uint16_t)1));
+	assert(!mem.load(0x4000, &byte));
+	assert(!mem.store(0xFFFFFFFC, (uint32_t)1));
+
+	/* Fast stores never bypass code invalidation */
+	CPU cpu;
+	assert(mem.store(0x1000, (uint32_t)0x00108093));  /* addi x1, x1, 1 */
+	cpu.set_pc(0x1000);
+	assert(cpu.step(&mem) == CPU_OK);
+	assert(mem.store(0x1000, (uint32_t)0x00A08093));  /* addi x1, x1, 10 */
+	assert(mem.lookup_decoded(0x1000) == nullptr);
+	cpu.set_pc(0x1000);
+	assert(cpu.step(&mem) == CPU_OK);
+	assert(cpu.get_register(1) == 11);
+
+	std::printf("\tOK Fast path matches the checked accessors\n");
+}
+
+/* Test 35: Reserved memory backend */
+static void test_reserved_memory() {
+	std::printf("Test 35: Reserved memory backend...\n");
+
+	Memory mem(MEM_PAGE_SIZE * 16, MEM_BACKEND_RESERVED);
+	if (mem.get_backend() != MEM_BACKEND_RESERVED) {
+		std::printf("\tOK Skipped (reserved backend unavailable on this host)\n");
+		return;
+	}
+
+	/* Mapped memory reads as zero and round-trips */
+	uint32_t word = 1;
+	uint8_t byte = 0;
+	assert(mem.load(0x200, &word) && word == 0);
+	assert(mem.store(0x200, (uint32_t)0xDEADBEEF));
+	assert(mem.load(0x203, &byte) && byte == 0xDE);
+	assert(mem.read32(0x200, &word) == MEM_OK && word == 0xDEADBEEF);
+
+	/* Host faults become failed accesses */
+	assert(!mem.load(0x40000000, &word));
+	assert(!mem.store(MEM_PAGE_SIZE * 16, (uint8_t)1));
+	assert(mem.read32(0x40000000, &word) == MEM_READ_ERROR);
+	assert(!mem.load(0x202, &word));
+	mem.map(0x40000000, MEM_PAGE_SIZE);
+	assert(mem.store(0x40000000, (uint32_t)7));
+
+	/* Stores to write-protected code pages still invalidate */
+	CPU cpu;
+	assert(mem.store(0x1000, (uint32_t)0x00108093));  /* addi x1, x1, 1 */
+	cpu.set_pc(0x1000);
+	assert(cpu.step(&mem) == CPU_OK);
+	assert(mem.store(0x1004, (uint32_t)0x00108093));
+	assert(mem.lookup_decoded(0x1000) == nullptr);
+
+	/* Every engine reports the faulting load like the paged backend */
+	const uint32_t program[] = {
+		0x400012B7,	/* lui x5, 0x40001 */
+		0x0002A303	/* lw x6, 0(x5) */
+	};
+	const cpu_engine_t engines[] = { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+	for (cpu_engine_t engine : engines) {
+		Memory paged(MEM_PAGE_SIZE * 16);
+		Memory direct(MEM_PAGE_SIZE * 16, MEM_BACKEND_RESERVED);
+		CPU paged_cpu, direct_cpu;
+		assert(paged.write_block(0, program, sizeof(program)) == MEM_OK);
+		assert(direct.write_block(0, program, sizeof(program)) == MEM_OK);
+
+		RunResult expected = paged_cpu.run(&paged, engine, 100);
+		RunResult result = direct_cpu.run(&direct, engine, 100);
+		assert(expected.reason == RUN_FAULT && result.reason == RUN_FAULT);
+		assert(result.status == CPU_EXECUTION_ERROR);
+		assert(result.retired == expected.retired);
+		assert(direct_cpu.get_pc() == paged_cpu.get_pc());
+	}
+
+	std::printf("\tOK Host faults map to guest faults on every engine\n");
+}
+
+/* Test 36: Copy-on-write file mapping */
+static void test_map_file() {
+	std::printf("Test 36: Copy-on-write file mapping...\n");
+
+	char path[] = "/tmp/emulator_map_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	const uint32_t image[] = { 0x00500093, 0x11223344, 0x55667788 };	/* addi x1, x0, 5 */
+	assert(write(fd, image, sizeof(image)) == (ssize_t)sizeof(image));
+
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	for (mem_backend_t backend : backends) {
+		Memory mem(MEM_PAGE_SIZE * 16, backend);
+		uint32_t value = 0;
+
+		/* Misaligned or unmapped destinations are refused */
+		assert(mem.map_file(0x1004, fd, sizeof(image)) != MEM_OK);
+		assert(mem.map_file(MEM_PAGE_SIZE * 16, fd, sizeof(image)) != MEM_OK);
+
+		/* Mapping replaces previously decoded code */
+		assert(mem.write32(0x1000, 0x00108093) == MEM_OK);	/* addi x1, x1, 1 */
+		CPU cpu;
+		cpu.set_pc(0x1000);
+		assert(cpu.step(&mem) == CPU_OK && cpu.get_register(1) == 1);
+
+		assert(mem.map_file(0x1000, fd, sizeof(image)) == MEM_OK);
+		assert(mem.read32(0x1004, &value) == MEM_OK && value == 0x11223344);
+		assert(mem.read32(0x100C, &value) == MEM_OK && value == 0);
+		cpu.set_pc(0x1000);
+		assert(cpu.step(&mem) == CPU_OK && cpu.get_register(1) == 5);
+
+		/* Guest writes stay private to this Memory */
+		assert(mem.write32(0x1008, 0xCAFEBABE) == MEM_OK);
+		assert(mem.read32(0x1008, &value) == MEM_OK && value == 0xCAFEBABE);
+	}
+
+	uint32_t on_disk[3];
+	assert(pread(fd, on_disk, sizeof(on_disk), 0) == (ssize_t)sizeof(on_disk));
+	assert(std::memcmp(on_disk, image, sizeof(image)) == 0);
+	close(fd);
+	unlink(path);
+
+	std::printf("\tOK File image mapped privately on both backends\n");
+}
+
+/* Test 37: Memory snapshot and restore */
+static void test_memory_snapshot() {
+	std::printf("Test 37: Memory snapshot and restore...\n");
+
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	for (mem_backend_t backend : backends) {
+		Memory mem(MEM_PAGE_SIZE * 16, backend);
+		CPU cpu;
+		uint32_t value = 0;
+
+		assert(mem.write32(0x100, 1) == MEM_OK);
+		assert(mem.write32(0x2000, 0x00108093) == MEM_OK);	/* addi x1, x1, 1 */
+		cpu.set_pc(0x2000);
+		assert(cpu.step(&mem) == CPU_OK);
+
+		assert(!mem.has_snapshot());
+		mem.snapshot();
+		assert(mem.has_snapshot() && mem.get_dirty_count() == 0);
+		size_t resident = mem.get_resident_pages();
+
+		/* Two rounds: restore must leave the snapshot reusable */
+		for (int round = 0; round < 2; round++) {
+			assert(mem.store(0x100, (uint32_t)(2 + round)));
+			assert(mem.store(0x104, (uint32_t)9));
+			assert(mem.write32(0x3000, 5) == MEM_OK);
+			assert(mem.write32(0x2000, 0x00A08093) == MEM_OK);	/* addi x1, x1, 10 */
+			assert(mem.get_dirty_count() == 3);
+			assert(mem.read32(0x100, &value) == MEM_OK && value == (uint32_t)(2 + round));
+
+			mem.restore();
+			assert(mem.get_dirty_count() == 0);
+			assert(mem.read32(0x100, &value) == MEM_OK && value == 1);
+			assert(mem.load(0x104, &value) && value == 0);
+			assert(mem.read32(0x3000, &value) == MEM_OK && value == 0);
+			if (backend == MEM_BACKEND_PAGED) {
+				assert(mem.get_resident_pages() == resident);
+			}
+
+			/* Restored code is decoded again */
+			assert(mem.lookup_decoded(0x2000) == nullptr);
+			cpu.set_register(1, 0);
+			cpu.set_pc(0x2000);
+			assert(cpu.step(&mem) == CPU_OK && cpu.get_register(1) == 1);
+		}
+	}
+
+	std::printf("\tOK Only dirtied pages are restored on both backends\n");
+}
+
+/* Test 38: Per-page dirty bits for checkpoints */
+static void test_modified_pages() {
+	std::printf("Test 38: Per-page dirty bits for checkpoints...\n");
+
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	for (mem_backend_t backend : backends) {
+		Memory mem(MEM_PAGE_SIZE * 16, backend);
+		mem.map(STACK_BASE, STACK_SIZE);
+		std::vector<uint32_t> pages;
+
+		/* First call reports everything that may hold data */
+		assert(mem.write32(0x1000, 1) == MEM_OK);
+		assert(mem.write32(0x5000, 2) == MEM_OK);
+		mem.take_modified_pages(&pages);
+		assert(pages.size() >= 2);
+		assert(std::find(pages.begin(), pages.end(), 0x1u) != pages.end());
+		assert(std::find(pages.begin(), pages.end(), 0x5u) != pages.end());
+
+		/* Nothing written, nothing reported */
+		mem.take_modified_pages(&pages);
+		assert(pages.empty());
+
+		/* Fast-path stores, block copies and repeated writes count once */
+		uint32_t value = 0;
+		assert(mem.load(0x5000, &value) && value == 2);
+		assert(mem.store(0x5004, (uint32_t)3));
+		assert(mem.store(0x5008, (uint32_t)4));
+		uint8_t buffer[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+		assert(mem.write_block(STACK_TOP - 4, buffer, sizeof(buffer) - 4) == MEM_OK);
+		assert(mem.write_block(0x2FFC, buffer, sizeof(buffer)) == MEM_OK);
+		mem.take_modified_pages(&pages);
+		const uint32_t expected[] = { 0x2, 0x3, 0x5, (STACK_TOP - 4) >> MEM_PAGE_SHIFT };
+		assert(pages.size() == 4);
+		assert(std::equal(pages.begin(), pages.end(), expected));
+
+		/* Snapshot restores count as modifications */
+		mem.snapshot();
+		assert(mem.store(0x1000, (uint32_t)9));
+		mem.take_modified_pages(&pages);
+		assert(pages.size() == 1 && pages[0] == 0x1);
+		mem.restore();
+		mem.take_modified_pages(&pages);
+		assert(pages.size() == 1 && pages[0] == 0x1);
+		assert(mem.read32(0x1000, &value) == MEM_OK && value == 1);
+	}
+
+	std::printf("\tOK Writes from every path are tracked on both backends\n");
+}
+
+/* Test 39: Guest file descriptor table */
+static void test_fd_table() {
+	std::printf("Test 39: Guest file descriptor table...\n");
+
+	char path[] = "/tmp/emulator_fd_XXXXXX";
+	int tmp = mkstemp(path);
+	assert(tmp >= 0);
+	assert(write(tmp, "0123456789", 10) == 10);
+	close(tmp);
+
+	FdTable files;
+	assert(files.host_fd(1) == 1);
+	assert(files.host_fd(3) == -1);
+
+	/* Lowest free descriptor is reused */
+	int a = files.open(path, O_RDONLY, 0);
+	int b = files.open(path, O_RDONLY, 0);
+	assert(a == 3 && b == 4);
+	assert(files.close(a) == 0);
+	assert(files.close(a) == -1);
+	assert(files.open(path, O_RDONLY, 0) == 3);
+	assert(files.open("/nonexistent/file", O_RDONLY, 0) == -1);
+
+	/* Reopen at a saved offset (state restore) */
+	assert(files.reopen(7, path, O_RDONLY | O_CREAT | O_TRUNC, 4) == 0);
+	char c = 0;
+	assert(read(files.host_fd(7), &c, 1) == 1 && c == '4');
+	assert(files.get(7).path == path);
+	assert(files.size() == 8);
+
+	/* Guest syscalls go through the table */
+	CPU cpu;
+	Memory mem(8192);
+	assert(cpu.get_files()->reopen(5, path, O_RDONLY, 8) == 0);
+	cpu.set_register(17, SYS_read);
+	cpu.set_register(10, 5);
+	cpu.set_register(11, 0x100);
+	cpu.set_register(12, 8);
+	assert(mem.write32(0, 0x00000073) == MEM_OK);	/* ecall */
+	cpu.set_pc(0);
+	assert(cpu.step(&mem) == CPU_OK);
+	assert(cpu.get_register(10) == 2);
+	uint8_t byte = 0;
+	assert(mem.read8(0x101, &byte) == MEM_OK && byte == '9');
+
+	unlink(path);
+
+	std::printf("\tOK Descriptors translated and reopened by path\n");
+}
+
+/* Test 40: Watchpoints */
+static void test_watchpoints() {
+	std::printf("Test 40: Watchpoints...\n");
+
+	const uint32_t program[] = {
+		0x000022B7,	/* lui x5, 0x2 */
+		0x00700313,	/* addi x6, x0, 7 */
+		0x0062A023,	/* sw x6, 0(x5) */
+		0x0062A423,	/* sw x6, 8(x5) (same page, not watched) */
+		0x0002A383,	/* lw x7, 0(x5) */
+		0x05D00893,	/* addi x17, x0, 93 */
+		0x00000073	/* ecall */
+	};
+
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	const cpu_engine_t engines[] = { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+	for (mem_backend_t backend : backends) {
+		for (cpu_engine_t engine : engines) {
+			Memory mem(MEM_PAGE_SIZE * 16, backend);
+			CPU cpu;
+			assert(mem.write_block(0, program, sizeof(program)) == MEM_OK);
+			int id = mem.add_watchpoint(0x2000, 4, WATCH_ACCESS);
+			assert(id >= 0);
+
+			/* Stops before the store, with the PC on it */
+			WatchHit hit;
+			RunResult result = cpu.run(&mem, engine, 100);
+			assert(result.reason == RUN_WATCHPOINT && result.retired == 2);
+			assert(cpu.get_pc() == 0x8);
+			assert(mem.take_watch_hit(&hit) && !mem.has_watch_hit());
+			assert(hit.id == id && hit.addr == 0x2000 && hit.size == 4 && hit.kind == WATCH_WRITE);
+			uint32_t word = 1;
+			assert(mem.read32(0x2000, &word) == MEM_OK && word == 0);
+
+			/* Resuming performs the store; the neighbouring store is not caught */
+			result = cpu.run(&mem, engine, 100);
+			assert(result.reason == RUN_WATCHPOINT && result.retired == 2);
+			assert(cpu.get_pc() == 0x10);
+			assert(mem.take_watch_hit(&hit) && hit.kind == WATCH_READ);
+			assert(mem.read32(0x2000, &word) == MEM_OK && word == 7);
+			assert(mem.read32(0x2008, &word) == MEM_OK && word == 7);
+
+			result = cpu.run(&mem, engine, 100);
+			assert(result.reason == RUN_EXIT && cpu.get_register(7) == 7);
+
+			/* Without the watchpoint the program runs straight through */
+			assert(mem.remove_watchpoint(id) && !mem.remove_watchpoint(id));
+			CPU rerun;
+			result = rerun.run(&mem, engine, 100);
+			assert(result.reason == RUN_EXIT && result.retired == 7);
+			assert(!mem.has_watch_hit());
+		}
+	}
+
+	/* Read-only watchpoints let stores through */
+	Memory mem(MEM_PAGE_SIZE * 4);
+	mem.add_watchpoint(0x100, 1, WATCH_READ);
+	uint8_t byte = 0;
+	assert(mem.store(0x100, (uint8_t)5));
+	assert(!mem.load(0x100, &byte) && mem.has_watch_hit());
+	assert(mem.load(0x100, &byte) && byte == 5);
+	assert(mem.add_watchpoint(0x100, 0, WATCH_READ) == -1);
+
+	std::printf("\tOK Watched accesses stop precisely on every engine and backend\n");
+}
+
+/* Test 41: Buffered guest output */
+static void test_output_buffering() {
+	std::printf("Test 41: Buffered guest output...\n");
+	std::fflush(stdout);
+
+	/* Capture the host's stdout and stderr in a pipe */
+	int pipe_fds[2];
+	assert(pipe(pipe_fds) == 0);
+	int saved_out = dup(1);
+	int saved_err = dup(2);
+	dup2(pipe_fds[1], 1);
+	dup2(pipe_fds[1], 2);
+
+	char text[8192];
+	uint64_t host_writes;
+	{
+		FdTable files;
+
+		/* Byte-at-a-time writes are held until the newline */
+		for (int i = 0; i < 10; i++) {
+			assert(files.write(1, "a", 1) == 1);
+		}
+		assert(files.get_host_writes() == 0);
+		assert(files.write(1, "b\n", 2) == 2);
+		assert(files.get_guest_writes() == 11 && files.get_host_writes() == 1);
+
+		/* Switching streams flushes first, so the order is kept */
+		files.write(1, "x", 1);
+		files.write(2, "y", 1);
+		files.flush();
+		assert(files.get_host_writes() == 3);
+
+		/* Large writes go straight through */
+		std::vector<char> large(FD_OUTPUT_BUFFER, 'z');
+		files.write(1, "c", 1);
+		assert(files.write(1, large.data(), large.size()) == (ssize_t)large.size());
+		assert(files.get_host_writes() == 5);
+
+		/* Unbuffered mode writes immediately; destruction flushes */
+		files.set_buffered(false);
+		files.write(2, "d", 1);
+		assert(files.get_host_writes() == 6);
+		files.set_buffered(true);
+		files.write(1, "e", 1);
+		host_writes = files.get_host_writes();
+	}
+
+	dup2(saved_out, 1);
+	dup2(saved_err, 2);
+	close(saved_out);
+	close(saved_err);
+	close(pipe_fds[1]);
+
+	size_t total = 0;
+	ssize_t count;
+	while ((count = read(pipe_fds[0], text + total, sizeof(text) - total)) > 0) {
+		total += (size_t)count;
+	}
+	close(pipe_fds[0]);
+
+	assert(host_writes == 6);
+	assert(total == 12 + 2 + 1 + FD_OUTPUT_BUFFER + 2);
+	assert(std::memcmp(text, "aaaaaaaaaab\nxyc", 15) == 0);
+	assert(text[15] == 'z' && text[total - 3] == 'z');
+	assert(std::memcmp(text + total - 2, "de", 2) == 0);
+
+	std::printf("\tOK 17 guest writes reached the host as 7 writes\n");
+}
+
+/* Issue one ecall with a7 = number and a0-a3 = args (ecall at address 0) */
+static uint32_t run_syscall(CPU *cpu, Memory *mem, uint32_t number, uint32_t a0 = 0, uint32_t a1 = 0,
+		uint32_t a2 = 0, uint32_t a3 = 0) {
+	assert(mem->write32(0, 0x00000073) == MEM_OK);  /* ecall */
+	cpu->set_pc(0);
+	cpu->set_register(17, number);
+	cpu->set_register(10, a0);
+	cpu->set_register(11, a1);
+	cpu->set_register(12, a2);
+	cpu->set_register(13, a3);
+	cpu->step(mem);
+	return cpu->get_register(10);
+}
+
+static syscall_action_t test_getpid(SyscallCall *call, void *data) {
+	call->result = *(uint32_t*)data;
+	return SYSCALL_CONTINUE;
+}
+
+/* Test 42: Syscall table and backends */
+static void test_syscall_table() {
+	std::printf("Test 42: Syscall table and backends...\n");
+
+	/* Embedders can add calls; unknown numbers return -ENOSYS */
+	CPU cpu;
+	Memory mem(MEM_PAGE_SIZE * 4);
+	uint32_t pid = 1234;
+	assert(cpu.get_syscalls()->get(172) == nullptr);
+	assert(run_syscall(&cpu, &mem, 172) == (uint32_t)-ENOSYS);
+	cpu.get_syscalls()->set(172, "getpid", test_getpid, &pid);
+	assert(run_syscall(&cpu, &mem, 172) == 1234);
+
+	/* Anonymous mmap hands out fresh mapped memory */
+	uint32_t first = run_syscall(&cpu, &mem, SYS_mmap, 0, 5000, 3, 0x22);
+	uint32_t second = run_syscall(&cpu, &mem, SYS_mmap, 0, 4096, 3, 0x22);
+	assert(first == MMAP_BASE && second == MMAP_BASE + 2 * MEM_PAGE_SIZE);
+	assert(mem.is_mapped(first, 3 * MEM_PAGE_SIZE));
+	assert(run_syscall(&cpu, &mem, SYS_mmap, 0, 4096, 3, 0x02) == (uint32_t)-ENODEV);
+
+	/* Sandbox: stdin from a string, output captured, no files, virtual clock */
+	SyscallSandbox sandbox("hi\n");
+	sandbox.install(cpu.get_syscalls());
+	const uint32_t iov[] = { 0x100, 2, 0x200, 3 };
+	assert(mem.write_block(0x300, iov, sizeof(iov)) == MEM_OK);
+	assert(mem.write_block(0x100, "ab", 2) == MEM_OK && mem.write_block(0x200, "cd\n", 3) == MEM_OK);
+	assert(run_syscall(&cpu, &mem, SYS_writev, 1, 0x300, 2) == 5);
+	assert(sandbox.get_output(1) == "abcd\n" && sandbox.get_output(2).empty());
+	assert(run_syscall(&cpu, &mem, SYS_openat, (uint32_t)-100, 0x100, 0) == (uint32_t)-EACCES);
+	assert(run_syscall(&cpu, &mem, SYS_clock_gettime, 1, 0x400) == 0);
+	uint32_t nanoseconds = 0;
+	assert(mem.read32(0x404, &nanoseconds) == MEM_OK && nanoseconds == SANDBOX_CLOCK_STEP_NS);
+
+	/* Record the sandboxed calls, then replay them into a fresh machine */
+	char path[] = "/tmp/emulator_syscalls_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+	{
+		SyscallRecorder recorder;
+		assert(recorder.open(path) == 0);
+		recorder.install(cpu.get_syscalls());
+		assert(run_syscall(&cpu, &mem, SYS_read, 0, 0x500, 16) == 3);
+		assert(run_syscall(&cpu, &mem, SYS_clock_gettime, 1, 0x600) == 0);
+		run_syscall(&cpu, &mem, SYS_exit_group, 7);
+		assert(!cpu.is_running());
+	}
+
+	CPU replay_cpu;
+	Memory replay_mem(MEM_PAGE_SIZE * 4);
+	SyscallReplayer replayer;
+	assert(replayer.open(path) == 0);
+	replayer.install(replay_cpu.get_syscalls());
+	assert(run_syscall(&replay_cpu, &replay_mem, SYS_read, 0, 0x500, 16) == 3);
+	uint8_t bytes[3] = {};
+	assert(replay_mem.read_block(0x500, bytes, 3) == MEM_OK && std::memcmp(bytes, "hi\n", 3) == 0);
+	assert(run_syscall(&replay_cpu, &replay_mem, SYS_clock_gettime, 1, 0x600) == 0);
+	assert(replay_mem.read32(0x604, &nanoseconds) == MEM_OK && nanoseconds == 2 * SANDBOX_CLOCK_STEP_NS);
+	assert(!replayer.finished());
+	run_syscall(&replay_cpu, &replay_mem, SYS_exit_group, 7);
+	assert(!replay_cpu.is_running() && replayer.finished());
+
+	/* Calls that do not match the log stop the run */
+	CPU diverged;
+	SyscallReplayer again;
+	assert(again.open(path) == 0);
+	again.install(diverged.get_syscalls());
+	assert(mem.write32(0, 0x00000073) == MEM_OK);
+	diverged.set_pc(0);
+	diverged.set_register(17, SYS_write);
+	assert(diverged.step(&mem) == CPU_EXECUTION_ERROR);
+	unlink(path);
+
+	std::printf("\tOK Handlers registered, sandboxed, recorded and replayed\n");
+}
+
+/* Test 43: In-memory virtual filesystem */
+static void test_vfs() {
+	std::printf("Test 43: In-memory virtual filesystem...\n");
+
+	assert(Vfs::normalize("/a//b/./c/../d") == "a/b/d");
+	assert(Vfs::normalize("./x") == "x");
+
+	/* Load a one-file ustar archive */
+	char archive[] = "/tmp/emulator_vfs_XXXXXX";
+	int fd = mkstemp(archive);
+	assert(fd >= 0);
+	std::vector<char> tar(4 * 512, 0);
+	std::strcpy(&tar[0], "input.txt");
+	std::strcpy(&tar[124], "00000000013");
+	tar[156] = '0';
+	std::memcpy(&tar[257], "ustar", 5);
+	std::strcpy(&tar[345], "data");
+	std::memcpy(&tar[512], "hello world", 11);
+	assert(write(fd, tar.data(), tar.size()) == (ssize_t)tar.size());
+	close(fd);
+
+	Vfs base;
+	assert(base.add_archive(archive) == 1);
+	unlink(archive);
+	assert(base.get_file("/data/input.txt") != nullptr && base.get_file("/data/input.txt")->size() == 11);
+
+	CPU cpu;
+	Memory mem(MEM_PAGE_SIZE * 4);
+	SyscallSandbox sandbox;
+	sandbox.install(cpu.get_syscalls());
+	Vfs vfs;
+	vfs.share_files(base);
+	vfs.install(cpu.get_syscalls());
+
+	/* Reads copy straight from the in-memory file; lseek and fstat see its size */
+	assert(mem.write_block(0x100, "data/input.txt", 15) == MEM_OK);
+	assert(run_syscall(&cpu, &mem, SYS_openat, (uint32_t)-100, 0x100, 0) == 3);
+	assert(run_syscall(&cpu, &mem, SYS_read, 3, 0x200, 5) == 5);
+	assert(run_syscall(&cpu, &mem, SYS_lseek, 3, 1, 1) == 6);
+	assert(run_syscall(&cpu, &mem, SYS_read, 3, 0x205, 100) == 5);
+	assert(run_syscall(&cpu, &mem, SYS_read, 3, 0x205, 100) == 0);
+	char text[16] = {};
+	assert(mem.read_block(0x200, text, 10) == MEM_OK && std::memcmp(text, "helloworld", 10) == 0);
+	assert(run_syscall(&cpu, &mem, SYS_fstat, 3, 0x300) == 0);
+	uint32_t size = 0;
+	assert(mem.read32(0x300 + 48, &size) == MEM_OK && size == 11);
+	assert(run_syscall(&cpu, &mem, SYS_write, 3, 0x200, 1) == (uint32_t)-EBADF);
+	assert(run_syscall(&cpu, &mem, SYS_close, 3) == 0);
+	assert(run_syscall(&cpu, &mem, SYS_close, 3) == (uint32_t)-EBADF);
+
+	/* Writes copy the shared contents first; new files are created in memory */
+	assert(run_syscall(&cpu, &mem, SYS_openat, (uint32_t)-100, 0x100, 0x401) == 3);
+	assert(run_syscall(&cpu, &mem, SYS_write, 3, 0x200, 1) == 1);
+	assert(vfs.get_file("data/input.txt")->size() == 12 && base.get_file("data/input.txt")->size() == 11);
+	assert(mem.write_block(0x100, "out.txt", 8) == MEM_OK);
+	assert(run_syscall(&cpu, &mem, SYS_openat, (uint32_t)-100, 0x100, 0) == (uint32_t)-ENOENT);
+	assert(run_syscall(&cpu, &mem, SYS_openat, (uint32_t)-100, 0x100, 0x241, 0644) == 4);
+	assert(run_syscall(&cpu, &mem, SYS_write, 4, 0x200, 5) == 5);
+	assert(vfs.list_files().size() == 2 && base.list_files().size() == 1);
+
+	/* Descriptors 0-2 still reach the sandbox */
+	assert(run_syscall(&cpu, &mem, SYS_write, 1, 0x200, 5) == 5);
+	assert(sandbox.get_output(1) == "hello");
+	assert(run_syscall(&cpu, &mem, SYS_lseek, 1, 0, 0) == (uint32_t)-ESPIPE);
+
+	/* Collect only what the guest wrote */
+	char dir[] = "/tmp/emulator_vfs_out_XXXXXX";
+	assert(mkdtemp(dir) != nullptr);
+	assert(vfs.write_directory(dir, true) == 2);
+	Vfs collected;
+	assert(collected.add_directory(dir) == 2);
+	assert(*collected.get_file("out.txt") == std::vector<uint8_t>({'h', 'e', 'l', 'l', 'o'}));
+	std::string nested = std::string(dir) + "/data";
+	unlink((nested + "/input.txt").c_str());
+	rmdir(nested.c_str());
+	unlink((std::string(dir) + "/out.txt").c_str());
+	rmdir(dir);
+
+	/* Guest writes are bounded per file (EFBIG) and in total (ENOSPC) */
+	assert(run_syscall(&cpu, &mem, SYS_lseek, 4, INT32_MAX, 0) == (uint32_t)INT32_MAX);
+	assert(run_syscall(&cpu, &mem, SYS_write, 4, 0x200, 1) == (uint32_t)-EFBIG);
+	assert(vfs.get_file("out.txt")->size() == 5);
+	vfs.set_limits(8, 24);
+	assert(run_syscall(&cpu, &mem, SYS_lseek, 4, 6, 0) == 6);
+	assert(run_syscall(&cpu, &mem, SYS_write, 4, 0x200, 5) == 2);
+	assert(run_syscall(&cpu, &mem, SYS_write, 4, 0x200, 1) == (uint32_t)-EFBIG);
+	assert(vfs.get_file("out.txt")->size() == 8);
+	assert(mem.write_block(0x100, "new.txt", 8) == MEM_OK);
+	assert(run_syscall(&cpu, &mem, SYS_openat, (uint32_t)-100, 0x100, 0x241, 0644) == 5);
+	assert(run_syscall(&cpu, &mem, SYS_write, 5, 0x200, 5) == (uint32_t)-ENOSPC);
+	assert(mem.write_block(0x100, "out.txt", 8) == MEM_OK);
+	assert(run_syscall(&cpu, &mem, SYS_openat, (uint32_t)-100, 0x100, 0x241, 0644) == 6);
+	assert(run_syscall(&cpu, &mem, SYS_write, 5, 0x200, 5) == 5);
+
+	std::printf("\tOK Files read, written, created and collected in memory, writes bounded\n");
+}
+
+/* Test 44: Program break, mmap and munmap */
+static void test_guest_heap() {
+	std::printf("Test 44: Program break, mmap and munmap...\n");
+
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	for (mem_backend_t backend : backends) {
+		CPU cpu;
+		Memory mem(MEM_PAGE_SIZE * 4, backend);
+		const uint32_t heap = MEM_PAGE_SIZE * 4;
+
+		/* The break starts at the end of RAM; bad requests return it unchanged */
+		assert(run_syscall(&cpu, &mem, SYS_brk, 0) == heap);
+		assert(run_syscall(&cpu, &mem, SYS_brk, heap - 4) == heap);
+		assert(run_syscall(&cpu, &mem, SYS_brk, BRK_END + 1) == heap);
+		assert(run_syscall(&cpu, &mem, SYS_brk, heap + 5000) == heap + 5000);
+		assert(mem.is_mapped(heap, 2 * MEM_PAGE_SIZE) && !mem.is_mapped(heap + 2 * MEM_PAGE_SIZE, 1));
+		assert(mem.write32(heap + 4096, 0x1234) == MEM_OK);
+
+		/* Shrinking releases pages; growing again sees zeros */
+		size_t resident = mem.get_resident_pages();
+		assert(run_syscall(&cpu, &mem, SYS_brk, heap + 10) == heap + 10);
+		assert(!mem.is_mapped(heap + MEM_PAGE_SIZE, 1));
+		assert(mem.get_resident_pages() < resident || backend == MEM_BACKEND_RESERVED);
+		assert(run_syscall(&cpu, &mem, SYS_brk, heap + 8192) == heap + 8192);
+		uint32_t value = 1;
+		assert(mem.read32(heap + 4096, &value) == MEM_OK && value == 0);
+
+		/* munmap leaves a hole that the next mmap reuses */
+		uint32_t first = run_syscall(&cpu, &mem, SYS_mmap, 0, 3 * MEM_PAGE_SIZE, 3, 0x22);
+		assert(first == MMAP_BASE);
+		assert(mem.write32(first + MEM_PAGE_SIZE, 7) == MEM_OK);
+		assert(run_syscall(&cpu, &mem, SYS_munmap, first + 1, MEM_PAGE_SIZE) == (uint32_t)-EINVAL);
+		assert(run_syscall(&cpu, &mem, SYS_munmap, first + MEM_PAGE_SIZE, MEM_PAGE_SIZE) == 0);
+		assert(mem.is_mapped(first, MEM_PAGE_SIZE) && !mem.is_mapped(first + MEM_PAGE_SIZE, 1));
+		assert(mem.is_mapped(first + 2 * MEM_PAGE_SIZE, MEM_PAGE_SIZE));
+		assert(mem.read32(first + MEM_PAGE_SIZE, &value) == MEM_READ_ERROR);
+		assert(!mem.load(first + MEM_PAGE_SIZE, &value));
+		assert(run_syscall(&cpu, &mem, SYS_mmap, 0, MEM_PAGE_SIZE, 3, 0x22) == first + MEM_PAGE_SIZE);
+		assert(mem.read32(first + MEM_PAGE_SIZE, &value) == MEM_OK && value == 0);
+
+		/* MAP_FIXED replaces an existing mapping with zero pages */
+		assert(mem.write32(0x1000, 99) == MEM_OK);
+		assert(run_syscall(&cpu, &mem, SYS_mmap, 0x1001, MEM_PAGE_SIZE, 3, 0x32) == (uint32_t)-EINVAL);
+		assert(run_syscall(&cpu, &mem, SYS_mmap, 0x1000, MEM_PAGE_SIZE, 3, 0x32) == 0x1000);
+		assert(mem.read32(0x1000, &value) == MEM_OK && value == 0);
+
+		/* restore() brings back the mappings, contents and break of the snapshot */
+		mem.snapshot();
+		assert(mem.write32(first, 5) == MEM_OK);
+		assert(run_syscall(&cpu, &mem, SYS_munmap, first, 3 * MEM_PAGE_SIZE) == 0);
+		assert(run_syscall(&cpu, &mem, SYS_brk, heap + 20000) == heap + 20000);
+		uint32_t later = run_syscall(&cpu, &mem, SYS_mmap, 0, 4 * MEM_PAGE_SIZE, 3, 0x22);
+		assert(later == first);
+		assert(mem.store(later + 3 * MEM_PAGE_SIZE, (uint32_t)3));
+		mem.restore();
+		assert(mem.get_program_break() == heap + 8192);
+		assert(mem.is_mapped(first, 3 * MEM_PAGE_SIZE) && !mem.is_mapped(heap + 3 * MEM_PAGE_SIZE, 1));
+		assert(!mem.load(first + 3 * MEM_PAGE_SIZE, &value));
+		assert(mem.load(first, &value) && value == 0);
+		assert(mem.store(first, (uint32_t)6) && mem.read32(first, &value) == MEM_OK && value == 6);
+	}
+
+	std::printf("\tOK Heap grows and shrinks, holes are reused, restore() undoes the mappings\n");
+}
+
+/* Test 45: Syscall trace ring buffer */
+static void test_syscall_trace() {
+	std::printf("Test 45: Syscall trace ring buffer...\n");
+
+	/* addi a7, x0, 172; ecall; addi a7, x0, 172; ecall; addi a7, x0, 93; ecall */
+	const uint32_t program[] = { 0x0AC00893, 0x00000073, 0x0AC00893, 0x00000073, 0x05D00893, 0x00000073 };
+	const cpu_engine_t engines[] = { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+	uint32_t pid = 42;
+	for (cpu_engine_t engine : engines) {
+		CPU cpu;
+		Memory mem(MEM_PAGE_SIZE * 4);
+		assert(mem.write_block(0, program, sizeof(program)) == MEM_OK);
+		cpu.get_syscalls()->set(172, "getpid", test_getpid, &pid);
+
+		/* Only the two newest calls are kept */
+		SyscallTracer tracer(2);
+		tracer.install(cpu.get_syscalls());
+		RunResult result = cpu.run(&mem, engine, 100);
+		assert(result.reason == RUN_EXIT && result.retired == 6 && cpu.get_instret() == 6);
+
+		std::vector<SyscallTraceRecord> records;
+		tracer.get_records(&records);
+		assert(tracer.get_total() == 3 && records.size() == 2);
+		assert(records[0].sequence == 1 && records[0].number == 172 && records[0].result == 42);
+		assert(records[0].pc == 12 && records[0].retired == 3 && records[0].action == SYSCALL_CONTINUE);
+		assert(records[1].sequence == 2 && records[1].number == SYS_exit && records[1].pc == 20);
+		assert(records[1].retired == 5 && records[1].action == SYSCALL_EXIT);
+	}
+
+	/* Saved rings decode to one line per call */
+	CPU cpu;
+	Memory mem(MEM_PAGE_SIZE * 4);
+	SyscallSandbox sandbox;
+	sandbox.install(cpu.get_syscalls());
+	SyscallTracer tracer;
+	tracer.install(cpu.get_syscalls());
+	assert(mem.write_block(0x100, "ok\n", 3) == MEM_OK);
+	assert(run_syscall(&cpu, &mem, SYS_write, 1, 0x100, 3) == 3);
+	assert(run_syscall(&cpu, &mem, SYS_close, 9) == (uint32_t)-EBADF);
+
+	char path[] = "/tmp/emulator_strace_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+	assert(tracer.write(path) == 0);
+	FILE *text = tmpfile();
+	assert(text && SyscallTracer::decode(path, text) == 0);
+	rewind(text);
+	char buffer[1024] = {};
+	size_t length = std::fread(buffer, 1, sizeof(buffer) - 1, text);
+	std::fclose(text);
+	assert(length > 0);
+	assert(std::strstr(buffer, "write(0x1, 0x100, 0x3) = 3") != nullptr);
+	assert(std::strstr(buffer, "close(0x9) = -1 ") != nullptr);
+	unlink(path);
+
+	std::printf("\tOK Calls recorded with pc, retired count and latency; ring decoded\n");
+}
+
+/* Test 46: io_uring read/write backend */
+static void test_io_uring() {
+	std::printf("Test 46: io_uring syscall backend...\n");
+
+	{
+		SyscallUring probe;
+		if (probe.open() != 0) {
+			std::printf("\tOK Skipped (io_uring unavailable on this host)\n");
+			return;
+		}
+	}
+
+	char path[] = "/tmp/emulator_uring_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	const uint32_t total = MEM_PAGE_SIZE * 3 + 100;
+	std::vector<uint8_t> pattern(total);
+	for (uint32_t i = 0; i < total; i++) {
+		pattern[i] = (uint8_t)(i * 7 + 1);
+	}
+
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	for (mem_backend_t backend : backends) {
+		CPU cpu;
+		Memory mem(MEM_PAGE_SIZE * 16, backend);
+		if (mem.get_backend() != backend) {
+			continue;
+		}
+		SyscallUring uring;
+		assert(uring.open() == 0);
+		uring.install(cpu.get_syscalls());
+
+		assert(mem.write_block(0x100, path, sizeof(path)) == MEM_OK);
+		assert(run_syscall(&cpu, &mem, SYS_openat, (uint32_t)-100, 0x100, O_RDWR | O_TRUNC) == 3);
+
+		/* Writes stay queued until another call needs the file */
+		assert(mem.write_block(0x1000, pattern.data(), total) == MEM_OK);
+		assert(run_syscall(&cpu, &mem, SYS_write, 3, 0x1000, 100) == 100);
+		assert(run_syscall(&cpu, &mem, SYS_write, 3, 0x1064, total - 100) == total - 100);
+		struct stat st;
+		assert(stat(path, &st) == 0 && st.st_size == 0);
+		assert(uring.get_guest_writes() == 2 && uring.get_submissions() == 0);
+		assert(run_syscall(&cpu, &mem, SYS_lseek, 3, 0, 0) == 0);
+		assert(stat(path, &st) == 0 && st.st_size == total);
+		assert(uring.get_submissions() == 1);
+
+		/* A large read lands in guest pages directly and is undone by restore */
+		mem.snapshot();
+		assert(run_syscall(&cpu, &mem, SYS_read, 3, 0x5800, total) == total);
+		assert(uring.get_direct_reads() == 1);
+		std::vector<uint8_t> buffer(total);
+		assert(mem.read_block(0x5800, buffer.data(), total) == MEM_OK);
+		assert(buffer == pattern);
+		mem.restore();
+		assert(mem.read_block(0x5800, buffer.data(), total) == MEM_OK);
+		assert(std::all_of(buffer.begin(), buffer.end(), [](uint8_t b) { return b == 0; }));
+
+		/* Small reads use the host handler */
+		assert(run_syscall(&cpu, &mem, SYS_lseek, 3, 0, 0) == 0);
+		assert(run_syscall(&cpu, &mem, SYS_read, 3, 0x9000, 16) == 16);
+		assert(mem.read_block(0x9000, buffer.data(), 16) == MEM_OK);
+		assert(std::memcmp(buffer.data(), pattern.data(), 16) == 0);
+		assert(uring.get_direct_reads() == 1);
+
+		/* Bad descriptors fail at once instead of at the flush */
+		assert(run_syscall(&cpu, &mem, SYS_write, 9, 0x1000, 4) == (uint32_t)-EBADF);
+		assert(run_syscall(&cpu, &mem, SYS_close, 3) == 0);
+	}
+	unlink(path);
+
+	std::printf("\tOK Writes batched into one submission; large reads go straight to guest pages\n");
+}
+
+/* Test 47: A extension and harts on host threads */
+static void test_atomics_smp() {
+	std::printf("Test 47: A extension and harts on host threads...\n");
+
+	uint32_t program[] = {
+		0x10000293,  /* addi x5, x0, 0x100 */
+		0x00700313,  /* addi x6, x0, 7 */
+		0x0062A023,  /* sw x6, 0(x5) */
+		0x00500393,  /* addi x7, x0, 5 */
+		0x0072A42F,  /* amoadd.w x8, x7, (x5) */
+		0x0862A4AF,  /* amoswap.w x9, x6, (x5) */
+		0xFFD00513,  /* addi x10, x0, -3 */
+		0x80A2A5AF,  /* amomin.w x11, x10, (x5) */
+		0xE062A62F,  /* amomaxu.w x12, x6, (x5) */
+		0xA062A6AF,  /* amomax.w x13, x6, (x5) */
+		0x1002A72F,  /* lr.w x14, (x5) */
+		0x1872A7AF,  /* sc.w x15, x7, (x5) */
+		0x1862A82F,  /* sc.w x16, x6, (x5) */
+		0xF1402973,  /* csrrs x18, mhartid, x0 */
+		0x0FF0000F,  /* fence */
+		0x0002A983,  /* lw x19, 0(x5) */
+		0x4072AA2F,  /* amoor.w x20, x7, (x5) */
+		0x6062AAAF,  /* amoand.w x21, x6, (x5) */
+		0x2072AB2F,  /* amoxor.w x22, x7, (x5) */
+		0xC0A2ABAF,  /* amominu.w x23, x10, (x5) */
+		0x05D00893,  /* addi x17, x0, 93 */
+		0x00000073,  /* ecall */
+	};
+
+	/* Every engine runs atomics, CSR reads and fences (block/JIT through CPU::step) */
+	const cpu_engine_t engines[] = { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+	for (cpu_engine_t engine : engines) {
+		CPU cpu;
+		Memory mem(4096);
+		for (size_t i = 0; i < sizeof(program)/sizeof(program[0]); i++) {
+			assert(mem.write32(i*4, program[i]) == MEM_OK);
+		}
+		cpu.set_pc(0);
+		cpu.set_hartid(3);
+
+		RunResult result = cpu.run(&mem, engine, 1000);
+		assert(result.reason == RUN_EXIT);
+		assert(cpu.get_register(8) == 7 && cpu.get_register(9) == 12);
+		assert(cpu.get_register(11) == 7 && cpu.get_register(12) == 0xFFFFFFFD);
+		assert(cpu.get_register(13) == 0xFFFFFFFD && cpu.get_register(14) == 7);
+		assert(cpu.get_register(15) == 0 && cpu.get_register(16) == 1);
+		assert(cpu.get_register(18) == 3 && cpu.get_register(19) == 5);
+		assert(cpu.get_register(20) == 5 && cpu.get_register(21) == 5);
+		assert(cpu.get_register(22) == 5 && cpu.get_register(23) == 0);
+		uint32_t value = 1;
+		assert(mem.read32(0x100, &value) == MEM_OK && value == 0);
+	}
+
+	/* Misaligned and unmapped AMOs fail; writing mhartid is illegal */
+	{
+		Memory mem(4096);
+		uint32_t old;
+		assert(mem.atomic_rmw(0x102, AMO_ADD, 1, &old) == MEM_MISALIGNED_ERROR);
+		assert(mem.atomic_cas(0x10000, 0, 1, &old) == MEM_WRITE_ERROR);
+		assert(mem.atomic_cas(0x100, 1, 2, &old) == MEM_OK && old == 0);
+		assert(mem.atomic_cas(0x100, 0, 2, &old) == MEM_OK && old == 0);
+		assert(mem.read32(0x100, &old) == MEM_OK && old == 2);
+
+		CPU cpu;
+		assert(mem.write32(0, 0xF14110F3) == MEM_OK);  /* csrrw x1, mhartid, x2 */
+		cpu.set_pc(0);
+		RunResult result = cpu.run(&mem, ENGINE_SWITCH, 10);
+		assert(result.reason == RUN_FAULT && result.status == CPU_ILLEGAL_INSTRUCTION);
+	}
+
+	/* Four harts bump two counters with amoadd and an lr/sc loop */
+	uint32_t counter[] = {
+		0x10000293,  /* addi x5, x0, 0x100 */
+		0x3E800313,  /* addi x6, x0, 1000 */
+		0x00100393,  /* addi x7, x0, 1 */
+		0x0072A02F,  /* amoadd.w x0, x7, (x5) */
+		0x00428E13,  /* addi x28, x5, 4 */
+		0x100E2EAF,  /* lr.w x29, (x28) */
+		0x001E8E93,  /* addi x29, x29, 1 */
+		0x19DE2F2F,  /* sc.w x30, x29, (x28) */
+		0xFE0F1AE3,  /* bne x30, x0, -12 */
+		0xFFF30313,  /* addi x6, x6, -1 */
+		0xFE0312E3,  /* bne x6, x0, -28 */
+		0x00251F93,  /* slli x31, x10, 2 */
+		0x005F8FB3,  /* add x31, x31, x5 */
+		0xF1402EF3,  /* csrrs x29, mhartid, x0 */
+		0x01DFA823,  /* sw x29, 16(x31) */
+		0x05D00893,  /* addi x17, x0, 93 */
+		0x00000073,  /* ecall */
+	};
+
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	for (mem_backend_t backend : backends) {
+		for (cpu_engine_t engine : engines) {
+			Memory mem(4096, backend);
+			CPU boot;
+			for (size_t i = 0; i < sizeof(counter)/sizeof(counter[0]); i++) {
+				assert(mem.write32(i*4, counter[i]) == MEM_OK);
+			}
+			boot.set_pc(0);
+
+			Smp smp(&mem, &boot, 4);
+			assert(smp.get_hart_count() == 4);
+			assert(smp.get_hart(2)->get_register(2) == STACK_TOP - 2 * SMP_HART_STACK);
+			SmpResult result = smp.run(engine, 1000000);
+			assert(result.reason == RUN_EXIT);
+			assert(result.retired >= 4 * (3 + 8 * 1000 + 6));  /* More if sc.w retried */
+			assert(smp.get_exit_status() == 0);
+
+			uint32_t value;
+			assert(mem.read32(0x100, &value) == MEM_OK && value == 4000);
+			assert(mem.read32(0x104, &value) == MEM_OK && value == 4000);
+			for (uint32_t hart = 0; hart < 4; hart++) {
+				assert(mem.read32(0x110 + 4 * hart, &value) == MEM_OK && value == hart);
+			}
+
+			/* The syscall tables are unwrapped after the run */
+			assert(boot.get_syscalls()->get(SYS_exit)->handler == smp.get_hart(1)->get_syscalls()->get(SYS_exit)->handler);
+		}
+	}
+
+	/* exit_group from hart 0 stops harts spinning forever */
+	{
+		uint32_t spin[] = {
+			0x00051063,  /* bne x10, x0, 0 */
+			0x02A00513,  /* addi x10, x0, 42 */
+			0x05E00893,  /* addi x17, x0, 94 */
+			0x00000073,  /* ecall */
+		};
+		Memory mem(4096);
+		CPU boot;
+		for (size_t i = 0; i < sizeof(spin)/sizeof(spin[0]); i++) {
+			assert(mem.write32(i*4, spin[i]) == MEM_OK);
+		}
+		boot.set_pc(0);
+
+		Smp smp(&mem, &boot, 3);
+		SmpResult result = smp.run(ENGINE_THREADED, 100000000);
+		assert(result.reason == RUN_EXIT && result.hart == 0);
+		assert(smp.get_exit_status() == 42);
+		assert(smp.get_hart(1)->is_running());
+		assert(smp.run(ENGINE_THREADED, 100).reason == RUN_EXIT);
+	}
+
+	std::printf("\tOK AMOs, lr/sc and mhartid on every engine; 4 harts count to 4000 on both backends\n");
+}
+
+/**
+ * Write a file for a batch test
+ *
+ * path: Output path
+ * data: Contents
+ * size: Byte count
+ */
+static void write_test_file(const std::string &path, const void *data, size_t size) {
+	FILE *file = std::fopen(path.c_str(), "wb");
+	assert(file);
+	assert(std::fwrite(data, 1, size, file) == size);
+	std::fclose(file);
+}
+
+/* Test 48: Batch runner */
+static void test_batch_runner() {
+	std::printf("Test 48: Batch runner...\n");
+
+	char dir[] = "/tmp/emulator_batch_XXXXXX";
+	assert(mkdtemp(dir) != nullptr);
+	std::string base = dir;
+
+	/* Echo up to 64 bytes of stdin and exit with the count */
+	const uint32_t echo[] = {
+		0x00000513,  /* addi a0, x0, 0 */
+		0x20000593,  /* addi a1, x0, 0x200 */
+		0x04000613,  /* addi a2, x0, 64 */
+		0x03F00893,  /* addi a7, x0, 63 */
+		0x00000073,  /* ecall */
+		0x00050613,  /* addi a2, a0, 0 */
+		0x00100513,  /* addi a0, x0, 1 */
+		0x20000593,  /* addi a1, x0, 0x200 */
+		0x04000893,  /* addi a7, x0, 64 */
+		0x00000073,  /* ecall */
+		0x05D00893,  /* addi a7, x0, 93 */
+		0x00000073,  /* ecall */
+	};
+	const uint32_t spin[] = { 0x0000006F };  /* jal x0, 0 */
+	const uint32_t illegal[] = { 0xFFFFFFFF };
+	write_test_file(base + "/echo.bin", echo, sizeof(echo));
+	write_test_file(base + "/spin.bin", spin, sizeof(spin));
+	write_test_file(base + "/illegal.bin", illegal, sizeof(illegal));
+	write_test_file(base + "/a.txt", "a", 1);
+	write_test_file(base + "/hello.txt", "hello\n", 6);
+
+	std::string list = "# program stdin limit\n\n";
+	list += base + "/echo.bin " + base + "/a.txt\n";
+	list += base + "/echo.bin -\n";
+	list += "  " + base + "/spin.bin - 5000\n";
+	list += base + "/illegal.bin\n";
+	list += base + "/missing.bin\n";
+	list += base + "/echo.bin " + base + "/missing.txt\n";
+	for (int i = 0; i < 40; i++) {
+		list += base + "/echo.bin " + base + "/hello.txt 100\n";
+	}
+	write_test_file(base + "/jobs.txt", list.data(), list.size());
+
+	std::vector<BatchJob> jobs;
+	assert(BatchRunner::parse_jobs((base + "/jobs.txt").c_str(), &jobs) == 0);
+	assert(jobs.size() == 46);
+	assert(jobs[1].input.empty() && jobs[1].max_instructions == BATCH_DEFAULT_LIMIT);
+	assert(jobs[2].max_instructions == 5000);
+
+	/* Results do not depend on the thread count or engine */
+	BatchRunner serial(ENGINE_SWITCH, MEM_BACKEND_PAGED);
+	std::vector<BatchResult> expected = serial.run(jobs, 1);
+	assert(serial.get_steals() == 0);
+	const cpu_engine_t engines[] = { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+	for (cpu_engine_t engine : engines) {
+		BatchRunner runner(engine, MEM_BACKEND_RESERVED);
+		std::vector<BatchResult> results = runner.run(jobs, 4);
+		assert(results.size() == jobs.size());
+		for (size_t i = 0; i < jobs.size(); i++) {
+			assert(results[i].status == expected[i].status);
+			assert(results[i].exit_code == expected[i].exit_code);
+			assert(results[i].stdout_hash == expected[i].stdout_hash);
+			assert(results[i].retired == expected[i].retired);
+		}
+	}
+
+	assert(expected[0].status == BATCH_EXITED && expected[0].exit_code == 1);
+	assert(expected[0].stdout_hash == 0xaf63dc4c8601ec8cull);  /* FNV-1a("a") */
+	assert(expected[0].stdout_bytes == 1 && expected[0].retired == 12);
+	assert(expected[1].status == BATCH_EXITED && expected[1].exit_code == 0);
+	assert(expected[1].stdout_hash == 0xcbf29ce484222325ull && expected[1].stdout_bytes == 0);
+	assert(expected[2].status == BATCH_LIMIT && expected[2].retired == 5000);
+	assert(expected[3].status == BATCH_FAULT && expected[3].fault == CPU_DECODE_ERROR);
+	assert(expected[4].status == BATCH_LOAD_ERROR && expected[5].status == BATCH_LOAD_ERROR);
+	assert(expected[6].exit_code == 6 && expected[45].stdout_hash == expected[6].stdout_hash);
+
+	/* Reports: CSV header plus one line per job, JSON array */
+	for (batch_format_t format : { BATCH_CSV, BATCH_JSON }) {
+		FILE *report = std::tmpfile();
+		assert(report);
+		assert(BatchRunner::write_report(report, format, jobs, expected) == 0);
+		std::rewind(report);
+		char line[4096];
+		int lines = 0;
+		bool found_limit = false;
+		while (std::fgets(line, sizeof(line), report)) {
+			if (lines == 0) {
+				assert(std::strncmp(line, format == BATCH_CSV ? "job,program," : "[", format == BATCH_CSV ? 12 : 1) == 0);
+			}
+			found_limit = found_limit || std::strstr(line, "limit") != nullptr;
+			lines++;
+		}
+		assert(lines == (format == BATCH_CSV ? 47 : 48) && found_limit);
+		std::fclose(report);
+	}
+
+	/* Malformed lines are rejected */
+	const char bad[] = "prog.bin - many\n";
+	write_test_file(base + "/bad.txt", bad, sizeof(bad) - 1);
+	std::vector<BatchJob> rejected;
+	assert(BatchRunner::parse_jobs((base + "/bad.txt").c_str(), &rejected) == -1);
+	assert(BatchRunner::parse_jobs((base + "/none.txt").c_str(), &rejected) == -1);
+
+	const char *names[] = { "echo.bin", "spin.bin", "illegal.bin", "a.txt", "hello.txt", "jobs.txt", "bad.txt" };
+	for (const char *name : names) {
+		unlink((base + "/" + name).c_str());
+	}
+	rmdir(dir);
+
+	std::printf("\tOK 46 jobs give the same results on 1 and 4 threads and every engine\n");
+}
+
+/* Test 49: Emulator pool */
+static void test_emulator_pool() {
+	std::printf("Test 49: Emulator pool...\n");
+
+	/* Exits with the word at 0x2000 after incrementing it (0 on a clean instance) */
+	uint32_t image[MEM_PAGE_SIZE / 4] = {
+		0x00002337,  /* lui t1, 0x2 */
+		0x00032503,  /* lw a0, 0(t1) */
+		0x00150293,  /* addi t0, a0, 1 */
+		0x00532023,  /* sw t0, 0(t1) */
+		0x10502023,  /* sw t0, 0x100(x0) */
+		0x05D00893,  /* addi a7, x0, 93 */
+		0x00000073,  /* ecall */
+	};
+	char path[] = "/tmp/emulator_pool_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	assert(write(fd, image, sizeof(image)) == (ssize_t)sizeof(image));
+	close(fd);
+
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	for (mem_backend_t backend : backends) {
+		EmulatorPool pool(MEMORY_SIZE, backend, 2);
+		std::unique_ptr<Emulator> first = pool.acquire();
+		assert(pool.get_created() == 1 && pool.get_reused() == 0);
+
+		/* Dirty everything reset() has to undo */
+		first->set_quiet(true);
+		assert(first->load_program(path, 0) == 0 && first->is_program_mapped());
+		first->set_pc(0);
+		first->set_engine(ENGINE_JIT);
+		assert(first->run(1000).reason == RUN_EXIT && first->get_cpu()->get_register(10) == 0);
+		Memory *mem = first->get_memory();
+		mem->map(0x40000000, MEM_PAGE_SIZE);
+		assert(mem->write32(0x40000000, 0x1234) == MEM_OK);
+		first->snapshot();
+		assert(mem->write32(0x2000, 99) == MEM_OK);
+		mem->add_watchpoint(0x3000, 4, WATCH_WRITE);
+		assert(first->get_cpu()->get_files()->open("/dev/null", O_RDONLY, 0) == 3);
+
+		Emulator *recycled = first.get();
+		pool.release(std::move(first));
+		pool.drain();
+		assert(pool.get_ready_count() == 1);
+
+		std::unique_ptr<Emulator> second = pool.acquire();
+		assert(second.get() == recycled && pool.get_reused() == 1 && pool.get_created() == 1);
+		CPU *cpu = second->get_cpu();
+		mem = second->get_memory();
+		assert(mem->get_resident_pages() == 0);
+		assert(cpu->get_pc() == 0 && cpu->is_running());
+		assert(cpu->get_register(2) == STACK_TOP && cpu->get_register(10) == 0 && cpu->get_register(5) == 0);
+		uint32_t value = 1;
+		assert(mem->read32(0x2000, &value) == MEM_OK && value == 0);
+		assert(mem->read32(0x100, &value) == MEM_OK && value == 0);
+		assert(mem->read32(0, &value) == MEM_OK && value == 0);
+		assert(!mem->is_mapped(0x40000000, 4) && mem->is_mapped(STACK_BASE, STACK_SIZE));
+		assert(!mem->has_watchpoints() && !mem->has_snapshot());
+		assert(mem->get_program_break() == MEMORY_SIZE);
+		assert(cpu->get_files()->open("/dev/null", O_RDONLY, 0) == 3);
+		assert(second->restore() == -1);
+
+		/* The recycled instance runs like a new one (JIT code buffer included) */
+		assert(second->load_program(path, 0) == 0);
+		second->set_pc(0);
+		second->set_engine(ENGINE_JIT);
+		for (int i = 0; i < 40; i++) {
+			assert(second->run(1000).reason == RUN_EXIT && cpu->get_register(10) == (uint32_t)i);
+			cpu->set_state(CpuState{cpu->get_state().x, 0, true});
+		}
+		pool.release(std::move(second));
+	}
+
+	uint32_t on_disk[7];
+	fd = open(path, O_RDONLY);
+	assert(pread(fd, on_disk, sizeof(on_disk), 0) == (ssize_t)sizeof(on_disk));
+	assert(std::memcmp(on_disk, image, sizeof(on_disk)) == 0);
+	close(fd);
+
+	/* Warm instances are built in the background */
+	{
+		EmulatorPool warm(MEMORY_SIZE, MEM_BACKEND_PAGED, 4, 3);
+		warm.drain();
+		assert(warm.get_ready_count() == 3 && warm.get_created() == 3);
+	}
+
+	/* Threads share one pool; every run sees a clean instance */
+	{
+		EmulatorPool shared(MEMORY_SIZE, MEM_BACKEND_PAGED, 4);
+		std::vector<std::thread> threads;
+		std::atomic<int> failures(0);
+		for (int t = 0; t < 4; t++) {
+			threads.emplace_back([&shared, &failures, &path] {
+				for (int i = 0; i < 25; i++) {
+					std::unique_ptr<Emulator> emulator = shared.acquire();
+					emulator->set_quiet(true);
+					emulator->set_engine(ENGINE_THREADED);
+					if (emulator->load_program(path, 0) != 0 ||
+							emulator->run(1000).reason != RUN_EXIT ||
+							emulator->get_cpu()->get_register(10) != 0) {
+						failures++;
+					}
+					shared.release(std::move(emulator));
+				}
+			});
+		}
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+		shared.drain();
+		assert(failures == 0);
+		assert(shared.get_created() + shared.get_reused() == 100);
+		assert(shared.get_ready_count() <= 4);
+	}
+	unlink(path);
+
+	std::printf("\tOK Released instances come back clean on both backends\n");
+}
+
+/**
+ * Run an emulator from pc 0 until it exits
+ *
+ * emulator: Instance with a program loaded
+ * engine: Execution engine
+ *
+ * Output: a0 at exit, or -1 if it did not exit
+ */
+static int32_t run_to_exit(Emulator *emulator, cpu_engine_t engine) {
+	emulator->set_pc(0);
+	emulator->set_engine(engine);
+	if (emulator->run(1000).reason != RUN_EXIT) {
+		return -1;
+	}
+	return (int32_t)emulator->get_cpu()->get_register(10);
+}
+
+/* Test 50: Shared program image */
+static void test_program_image() {
+	std::printf("Test 50: Shared program image...\n");
+
+	/* Exits with 7, or with 9 after patching 0x20 when the word at 0x100 is set */
+	uint32_t program[MEM_PAGE_SIZE / 4 + 2] = {
+		0x10002283,  /* lw t0, 0x100(x0) */
+		0x00028663,  /* beq t0, x0, 12 */
+		0x10402303,  /* lw t1, 0x104(x0) */
+		0x02602023,  /* sw t1, 0x20(x0) */
+		0x0100006f,  /* jal x0, 16 */
+		0x00000013,  /* nop */
+		0x00000013,  /* nop */
+		0x00000013,  /* nop */
+		0x00700513,  /* addi a0, x0, 7 */
+		0x05D00893,  /* addi a7, x0, 93 */
+		0x00000073,  /* ecall */
+	};
+	program[0x104 / 4] = 0x00900513;  /* addi a0, x0, 9 */
+	std::string path = "/tmp/emulator_image_" + std::to_string(getpid());
+	write_test_file(path, program, sizeof(program));
+
+	std::shared_ptr<ProgramImage> image = std::make_shared<ProgramImage>();
+	assert(image->load(path.c_str(), 0) == 0 && image->load(path.c_str(), 0) == -1);
+	assert(image->get_base() == 0 && image->get_length() == 2 * MEM_PAGE_SIZE);
+	assert(image->get_file_size() == sizeof(program));
+	assert(image->get_decoded(0)->valid[0] && !image->get_decoded(0)->valid[0x100 / 4]);
+	std::unique_ptr<ProgramImage> missing = std::make_unique<ProgramImage>();
+	assert(missing->load("/nonexistent/program.bin", 0) == -1 && !missing->is_loaded());
+
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	const cpu_engine_t engines[] = { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+	for (mem_backend_t backend : backends) {
+		for (cpu_engine_t engine : engines) {
+			Emulator first(MEMORY_SIZE, backend);
+			Emulator second(MEMORY_SIZE, backend);
+			first.set_quiet(true);
+			second.set_quiet(true);
+			assert(first.load_image(image) == 0 && second.load_image(image) == 0);
+			assert(first.is_program_mapped());
+
+			/* Both borrow the image's decoded instructions */
+			const Instruction *shared = &image->get_decoded(0)->slots[0];
+			assert(first.get_memory()->lookup_decoded(0) == shared);
+			assert(second.get_memory()->lookup_decoded(0) == shared);
+			assert(run_to_exit(&first, engine) == 7);
+
+			/* Patching code in one instance leaves the other and the image alone */
+			assert(second.get_memory()->write32(0x100, 1) == MEM_OK);
+			assert(run_to_exit(&second, engine) == 9);
+			assert(second.get_memory()->lookup_decoded(0) != shared);
+			assert(run_to_exit(&first, engine) == 7);
+			assert(first.get_memory()->lookup_decoded(0) == shared);
+
+			Emulator third(MEMORY_SIZE, backend);
+			third.set_quiet(true);
+			assert(third.load_image(image) == 0 && run_to_exit(&third, engine) == 7);
+			uint32_t value = 0;
+			assert(third.get_memory()->read32(0x104, &value) == MEM_OK && value == 0x00900513);
+		}
+	}
+
+	/* A pooled instance drops the image on reset and maps it again */
+	{
+		EmulatorPool pool(MEMORY_SIZE, MEM_BACKEND_RESERVED, 1);
+		for (int i = 0; i < 3; i++) {
+			std::unique_ptr<Emulator> emulator = pool.acquire();
+			emulator->set_quiet(true);
+			assert(emulator->get_memory()->lookup_decoded(0) == nullptr);
+			assert(emulator->load_image(image) == 0);
+			assert(emulator->get_memory()->write32(0x100, 1) == MEM_OK);
+			assert(run_to_exit(emulator.get(), ENGINE_JIT) == 9);
+			pool.release(std::move(emulator));
+			pool.drain();
+		}
+		assert(pool.get_reused() == 2);
+	}
+
+	/* Images outlive their holders through the memories that map them */
+	Emulator last(MEMORY_SIZE);
+	last.set_quiet(true);
+	assert(last.load_image(image) == 0);
+	image.reset();
+	assert(run_to_exit(&last, ENGINE_BLOCK) == 7);
+	assert(last.load_image(std::make_shared<ProgramImage>()) == -1);
+
+	unlink(path.c_str());
+	std::printf("\tOK Instances share one image and decode until they write to it\n");
+}
+
+/**
+ * Create a lane for the lockstep test: program mapped, a0/a1 set
+ *
+ * image: Program image
+ * backend: Memory backend
+ * engine: Engine the lane finishes on if it is split off
+ * n: Value of a0
+ * seed: Value of a1
+ *
+ * Output: Emulator ready to run at pc 0
+ */
+static std::unique_ptr<Emulator> make_lane(const std::shared_ptr<ProgramImage> &image, mem_backend_t backend,
+	cpu_engine_t engine, int32_t n, int32_t seed) {
+	std::unique_ptr<Emulator> emulator = std::make_unique<Emulator>(MEMORY_SIZE, backend);
+	emulator->set_quiet(true);
+	assert(emulator->load_image(image) == 0);
+	emulator->set_pc(0);
+	emulator->set_engine(engine);
+	emulator->get_cpu()->set_register(10, (uint32_t)n);
+	emulator->get_cpu()->set_register(11, (uint32_t)seed);
+	return emulator;
+}
+
+/**
+ * Check that a lockstep lane ended like the same program run alone
+ */
+static void assert_same_lane(Emulator *lane, const RunResult &result, Emulator *alone, const RunResult &expected) {
+	assert(result.reason == expected.reason && result.status == expected.status);
+	assert(result.retired == expected.retired);
+	CpuState got = lane->get_cpu()->get_state();
+	CpuState want = alone->get_cpu()->get_state();
+	assert(got.x == want.x && got.pc == want.pc && got.running == want.running);
+	assert(lane->get_cpu()->get_instret() == alone->get_cpu()->get_instret());
+	uint32_t got_word = 0;
+	uint32_t want_word = 1;
+	assert(lane->get_memory()->read32(0x10000, &got_word) == MEM_OK);
+	assert(alone->get_memory()->read32(0x10000, &want_word) == MEM_OK);
+	assert(got_word == want_word);
+}
+
+/* Test 51: Lockstep lanes */
+static void test_lockstep() {
+	std::printf("Test 51: Lockstep lanes...\n");
+
+	/* Loop of a0 iterations over a1 (with a call), every M op, byte/word access, fault if a0 == 7, exit */
+	uint32_t sweep[] = {
+		0x00000293, 0x00000313, 0x02a35863, 0x00030d93, 0x08c000ef, 0x01b282b3, 0x00137e13, 0x000e0663,
+		0x00b2c2b3, 0x00c0006f, 0x4032de93, 0x41d282b3, 0x00130313, 0xfd5ff06f, 0x02a5cf33, 0x02a5efb3,
+		0x02559433, 0x0255a4b3, 0x0255b933, 0x02b2d9b3, 0x02b2fa33, 0x0055bab3, 0x0055ab33, 0x00b29bb3,
+		0x00b2dc33, 0x40b2dcb3, 0x00010637, 0x00562023, 0x00b602a3, 0x00062d03, 0x00560683, 0x00265703,
+		0x00700393, 0x00751663, 0x400007b7, 0x0007a803, 0x0ff2f513, 0x05d00893, 0x00000073, 0x03bd8db3,
+		0x00008067,
+	};
+	std::string path = "/tmp/emulator_lockstep_" + std::to_string(getpid());
+	write_test_file(path, sweep, sizeof(sweep));
+	std::shared_ptr<ProgramImage> image = std::make_shared<ProgramImage>();
+	assert(image->load(path.c_str(), 0) == 0);
+
+	/* Same loop, exit code masked with 127: lanes holding it run on their own */
+	sweep[36] = 0x07f2f513;  /* andi a0, t0, 127 */
+	write_test_file(path, sweep, sizeof(sweep));
+	std::shared_ptr<ProgramImage> other = std::make_shared<ProgramImage>();
+	assert(other->load(path.c_str(), 0) == 0);
+	unlink(path.c_str());
+
+	const int32_t inputs[][2] = {
+		{0, 5}, {1, -1}, {3, INT32_MIN}, {3, 7}, {7, 3}, {4, 0}, {12, INT32_MAX}, {5, -123456},
+		{2, 31}, {6, 33}, {200, 9}, {3, 7}, {9, -2}, {1, 1},
+	};
+	const size_t count = sizeof(inputs) / sizeof(inputs[0]);
+
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	for (mem_backend_t backend : backends) {
+		std::vector<std::unique_ptr<Emulator>> lanes;
+		std::vector<std::unique_ptr<Emulator>> alone;
+		std::vector<Emulator*> pointers;
+		for (size_t lane = 0; lane < count; lane++) {
+			std::shared_ptr<ProgramImage> code = lane == 8 ? other : image;
+			lanes.push_back(make_lane(code, backend, ENGINE_JIT, inputs[lane][0], inputs[lane][1]));
+			alone.push_back(make_lane(code, backend, ENGINE_SWITCH, inputs[lane][0], inputs[lane][1]));
+			pointers.push_back(lanes.back().get());
+		}
+
+		/* A short budget stops every lane where running it alone would */
+		Lockstep group(pointers);
+		assert(group.get_lane_count() == count);
+		std::vector<RunResult> results = group.run(60);
+		for (size_t lane = 0; lane < count; lane++) {
+			assert_same_lane(lanes[lane].get(), results[lane], alone[lane].get(), alone[lane]->run(60));
+		}
+
+		/* Resumed to the end: exits, the fault in lane 4, divergence and the odd program out */
+		results = group.run(100000);
+		for (size_t lane = 0; lane < count; lane++) {
+			RunResult expected = alone[lane]->run(100000);
+			assert_same_lane(lanes[lane].get(), results[lane], alone[lane].get(), expected);
+			assert(expected.reason == (lane == 4 ? RUN_FAULT : RUN_EXIT));
+		}
+		assert(results[8].reason == RUN_EXIT && lanes[8]->get_cpu()->get_register(10) < 128);
+		assert(group.get_lane_steps() > 2 * group.get_steps());
+		assert(group.get_splits() >= 2);
+
+		/* Exited lanes stay exited */
+		results = group.run(100);
+		assert(results[0].reason == RUN_EXIT && results[0].retired == 0);
+	}
+
+	/* Batch jobs of one program run as lockstep groups with identical results */
+	const uint32_t sum[] = {
+		0x00000513, 0x000105b7, 0x04000613, 0x03f00893, 0x00000073, 0x00050293, 0x00000313, 0x00000393,
+		0x02535063, 0x00658e33, 0x000e4e83, 0x01d383b3, 0x00339f13, 0x01e3c3b3, 0x00130313, 0xfe5ff06f,
+		0x0075a023, 0x00100513, 0x00400613, 0x04000893, 0x00000073, 0x0ff3f513, 0x05d00893, 0x00000073,
+	};
+	std::string base = "/tmp/emulator_lockstep_batch_" + std::to_string(getpid());
+	assert(mkdir(base.c_str(), 0700) == 0);
+	write_test_file(base + "/sum.bin", sum, sizeof(sum));
+	std::vector<BatchJob> jobs;
+	for (int job = 0; job < 21; job++) {
+		std::string input = base + "/in" + std::to_string(job) + ".txt";
+		std::string text(job * 3 % 40, (char)('a' + job));
+		write_test_file(input, text.data(), text.size());
+		jobs.push_back(BatchJob{base + "/sum.bin", input, job == 5 ? 40u : 100000u});
+	}
+	jobs.push_back(BatchJob{base + "/sum.bin", base + "/missing.txt", 100000});
+
+	BatchRunner scalar(ENGINE_THREADED, MEM_BACKEND_PAGED);
+	std::vector<BatchResult> expected = scalar.run(jobs, 2);
+	BatchRunner lockstep(ENGINE_THREADED, MEM_BACKEND_PAGED);
+	lockstep.set_lockstep(8);
+	std::vector<BatchResult> results = lockstep.run(jobs, 2);
+	for (size_t job = 0; job < jobs.size(); job++) {
+		assert(results[job].status == expected[job].status && results[job].exit_code == expected[job].exit_code);
+		assert(results[job].fault == expected[job].fault && results[job].retired == expected[job].retired);
+		assert(results[job].stdout_hash == expected[job].stdout_hash);
+		assert(results[job].stdout_bytes == expected[job].stdout_bytes);
+	}
+	assert(expected[0].status == BATCH_EXITED && expected[0].stdout_bytes == 4);
+	assert(expected[5].status == BATCH_LIMIT && expected[21].status == BATCH_LOAD_ERROR);
+
+	for (int job = 0; job < 21; job++) {
+		unlink((base + "/in" + std::to_string(job) + ".txt").c_str());
+	}
+	unlink((base + "/sum.bin").c_str());
+	rmdir(base.c_str());
+	std::printf("\tOK Lockstep lanes end exactly like lanes run alone\n");
+}
+
 int main() {
 	std::printf("=== RISC-V Emulator Comprehensive Tests ===\n\n");
 
@@ -1299,6 +3018,31 @@ int main() {
 	test_m_extension_rem(); test_count++;
 	test_m_extension_remu(); test_count++;
 
+	/* Execution engine tests */
+	test_decode_cache(); test_count++;
+	test_block_engine(); test_count++;
+	test_run_api(); test_count++;
+	test_binary_trace(); test_count++;
+	test_paged_memory(); test_count++;
+	test_fast_access(); test_count++;
+	test_reserved_memory(); test_count++;
+	test_map_file(); test_count++;
+	test_memory_snapshot(); test_count++;
+	test_modified_pages(); test_count++;
+	test_fd_table(); test_count++;
+	test_watchpoints(); test_count++;
+	test_output_buffering(); test_count++;
+	test_syscall_table(); test_count++;
+	test_vfs(); test_count++;
+	test_guest_heap(); test_count++;
+	test_syscall_trace(); test_count++;
+	test_io_uring(); test_count++;
+	test_atomics_smp(); test_count++;
+	test_batch_runner(); test_count++;
+	test_emulator_pool(); test_count++;
+	test_program_image(); test_count++;
+	test_lockstep(); test_count++;
+
 	std::printf("\n=== All %d tests passed! ===\n", test_count);
 	return 0;
 }
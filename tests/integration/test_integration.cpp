@@ -2,11 +2,16 @@
 #include "../../assembler/include/assembler.hpp"
 #include "../../emulator/include/cpu.hpp"
 #include "../../emulator/include/memory.hpp"
+#include "../../emulator/include/jit.hpp"
+#include "../../emulator/include/emulator.hpp"
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <cassert>
 #include <memory>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /* Helper function to assemble code from string to memory buffer */
 static bool assemble_to_memory(const char *asm_code, uint8_t *buffer, size_t buffer_size, uint32_t *bytes_written) {
@@ -66,7 +71,7 @@ static void test_simple_arithmetic() {
 	auto cpu = std::make_unique<CPU>();
 
 	/* Load program into memory */
-	memcpy(&mem->get_data()[0], binary, size);
+	assert(mem->write_block(0, binary, size) == MEM_OK);
 	cpu->set_pc(0);
 
 	/* Execute until exit */
@@ -120,7 +125,7 @@ static void test_loop_accumulator() {
 	auto mem = std::make_unique<Memory>(MEMORY_SIZE);
 	auto cpu = std::make_unique<CPU>();
 
-	memcpy(&mem->get_data()[0], binary, size);
+	assert(mem->write_block(0, binary, size) == MEM_OK);
 	cpu->set_pc(0);
 
 	int step_count = 0;
@@ -164,7 +169,7 @@ static void test_memory_operations() {
 	auto mem = std::make_unique<Memory>(MEMORY_SIZE);
 	auto cpu = std::make_unique<CPU>();
 
-	memcpy(&mem->get_data()[0], binary, size);
+	assert(mem->write_block(0, binary, size) == MEM_OK);
 	cpu->set_pc(0);
 
 	int step_count = 0;
@@ -217,7 +222,7 @@ static void test_function_call() {
 	auto mem = std::make_unique<Memory>(MEMORY_SIZE);
 	auto cpu = std::make_unique<CPU>();
 
-	memcpy(&mem->get_data()[0], binary, size);
+	assert(mem->write_block(0, binary, size) == MEM_OK);
 	cpu->set_pc(0);
 
 	int step_count = 0;
@@ -263,7 +268,7 @@ static void test_conditional_branches() {
 	auto mem = std::make_unique<Memory>(MEMORY_SIZE);
 	auto cpu = std::make_unique<CPU>();
 
-	memcpy(&mem->get_data()[0], binary, size);
+	assert(mem->write_block(0, binary, size) == MEM_OK);
 	cpu->set_pc(0);
 
 	int step_count = 0;
@@ -311,7 +316,7 @@ static void test_data_section() {
 	auto cpu = std::make_unique<CPU>();
 
 	/* Load entire binary (text + data) into memory */
-	memcpy(&mem->get_data()[0], binary, size);
+	assert(mem->write_block(0, binary, size) == MEM_OK);
 	cpu->set_pc(0);
 
 	int step_count = 0;
@@ -356,7 +361,7 @@ static void test_logical_operations() {
 	auto mem = std::make_unique<Memory>(MEMORY_SIZE);
 	auto cpu = std::make_unique<CPU>();
 
-	memcpy(&mem->get_data()[0], binary, size);
+	assert(mem->write_block(0, binary, size) == MEM_OK);
 	cpu->set_pc(0);
 
 	int step_count = 0;
@@ -398,7 +403,7 @@ static void test_shift_operations() {
 	auto mem = std::make_unique<Memory>(MEMORY_SIZE);
 	auto cpu = std::make_unique<CPU>();
 
-	memcpy(&mem->get_data()[0], binary, size);
+	assert(mem->write_block(0, binary, size) == MEM_OK);
 	cpu->set_pc(0);
 
 	int step_count = 0;
@@ -444,7 +449,7 @@ static void test_byte_halfword_operations() {
 	auto mem = std::make_unique<Memory>(MEMORY_SIZE);
 	auto cpu = std::make_unique<CPU>();
 
-	memcpy(&mem->get_data()[0], binary, size);
+	assert(mem->write_block(0, binary, size) == MEM_OK);
 	cpu->set_pc(0);
 
 	int step_count = 0;
@@ -485,7 +490,7 @@ static void test_upper_immediate() {
 	auto mem = std::make_unique<Memory>(MEMORY_SIZE);
 	auto cpu = std::make_unique<CPU>();
 
-	memcpy(&mem->get_data()[0], binary, size);
+	assert(mem->write_block(0, binary, size) == MEM_OK);
 	cpu->set_pc(0);
 
 	int step_count = 0;
@@ -510,6 +515,568 @@ static void test_upper_immediate() {
 	std::printf("\tOK Upper immediate works (result = 0x12345)\n");
 }
 
+/* Shared program for execution engine comparisons */
+static const char *engine_test_program =
+	".text\n"
+	"main:\n"
+	"    li s0, 0x2000     # buffer\n"
+	"    li s1, 0          # i\n"
+	"    li s2, 50         # limit\n"
+	"    li a0, 0          # checksum\n"
+	"loop:\n"
+	"    mul t0, s1, s1\n"
+	"    addi t1, s1, 7\n"
+	"    div t2, t0, t1\n"
+	"    rem t3, t0, t1\n"
+	"    xor a0, a0, t2\n"
+	"    add a0, a0, t3\n"
+	"    slli t4, s1, 2\n"
+	"    add t4, t4, s0\n"
+	"    sw a0, 0(t4)\n"
+	"    lh t5, 0(t4)\n"
+	"    lbu t6, 1(t4)\n"
+	"    sub a1, t5, t6\n"
+	"    sra a1, a1, s1\n"
+	"    sltu a2, a1, a0\n"
+	"    or a0, a0, a2\n"
+	"    call helper\n"
+	"    addi s1, s1, 1\n"
+	"    blt s1, s2, loop\n"
+	"    li a7, 93\n"
+	"    ecall\n"
+	"helper:\n"
+	"    srai a3, a0, 3\n"
+	"    andi a3, a3, 0xff\n"
+	"    bgeu a3, s2, skip\n"
+	"    addi a0, a0, 1\n"
+	"skip:\n"
+	"    ret\n";
+
+/* Run the engine test program with a batch engine in small budgets */
+static void run_engine_program(CPU *cpu, Memory *mem, cpu_engine_t engine,
+		uint64_t *total, cpu_status_t *status) {
+	*total = 0;
+	do {
+		uint64_t retired = 0;
+		if (engine == ENGINE_BLOCK) {
+			*status = cpu->run_blocks(mem, 37, &retired);
+		} else if (engine == ENGINE_JIT) {
+			*status = cpu->run_jit(mem, 37, &retired);
+		} else {
+			*status = cpu->run_threaded(mem, 37, &retired);
+		}
+		*total += retired;
+	} while (*status == CPU_OK && *total < 100000);
+}
+
+/* Test 11: Batch engines match the switch engine */
+static void test_execution_engines() {
+	std::printf("Test 11: Threaded, block and JIT engines vs switch engine...\n");
+
+	uint8_t binary[1024];
+	uint32_t size;
+
+	assert(assemble_to_memory(engine_test_program, binary, sizeof(binary), &size));
+
+	/* Reference run */
+	auto ref_mem = std::make_unique<Memory>(MEMORY_SIZE);
+	auto ref_cpu = std::make_unique<CPU>();
+	assert(ref_mem->write_block(0, binary, size) == MEM_OK);
+	ref_cpu->set_pc(0);
+
+	uint64_t ref_steps = 0;
+	cpu_status_t status = CPU_OK;
+	while (ref_cpu->is_running() && ref_steps < 100000) {
+		status = ref_cpu->step(ref_mem.get());
+		ref_steps++;
+		if (status == CPU_SYSCALL_EXIT) break;
+		assert(status == CPU_OK);
+	}
+	assert(status == CPU_SYSCALL_EXIT);
+
+	/* Budgets are split into small slices to exercise resumption */
+	const cpu_engine_t engines[] = { ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+	for (cpu_engine_t engine : engines) {
+		auto mem = std::make_unique<Memory>(MEMORY_SIZE);
+		auto cpu = std::make_unique<CPU>();
+		assert(mem->write_block(0, binary, size) == MEM_OK);
+		cpu->set_pc(0);
+
+		uint64_t total = 0;
+		run_engine_program(cpu.get(), mem.get(), engine, &total, &status);
+
+		assert(status == CPU_SYSCALL_EXIT);
+		assert(total == ref_steps);
+		for (int i = 0; i < 32; i++) {
+			assert(cpu->get_register(i) == ref_cpu->get_register(i));
+		}
+		assert(cpu->get_pc() == ref_cpu->get_pc());
+
+		if (engine != ENGINE_THREADED) {
+			BlockCache *blocks = mem->get_block_cache();
+			assert(blocks->get_block_count() > 0);
+			assert(blocks->get_chained() > 0);
+		}
+	}
+
+	std::printf("\tOK Engines match (%llu instructions, a0=0x%08x)\n",
+		(unsigned long long)ref_steps, ref_cpu->get_register(10));
+}
+
+static const char *jit_test_program =
+	".text\n"
+	"main:\n"
+	"    li s0, 0x2000\n"
+	"    li s1, 0\n"
+	"    li s2, 100\n"
+	"    li a0, 0x12345\n"
+	"loop:\n"
+	"    li t0, -7\n"
+	"    mulh t1, a0, t0\n"
+	"    mulhsu t2, t0, a0\n"
+	"    mulhu t3, a0, t0\n"
+	"    xor a0, a0, t1\n"
+	"    add a0, a0, t2\n"
+	"    sub a0, a0, t3\n"
+	"    divu t4, a0, s2\n"
+	"    remu t5, a0, s1   # remainder by zero on the first pass\n"
+	"    add a0, a0, t4\n"
+	"    xor a0, a0, t5\n"
+	"    slt t6, a0, t0\n"
+	"    slti a1, a0, -3\n"
+	"    sltiu a2, s1, 50\n"
+	"    or a0, a0, t6\n"
+	"    ori a0, a0, 0x10\n"
+	"    add a0, a0, a1\n"
+	"    add a0, a0, a2\n"
+	"    sll a3, a0, s1\n"
+	"    srl a4, a0, s1\n"
+	"    xor a0, a3, a4\n"
+	"    sb a0, 0(s0)\n"
+	"    sh a0, 2(s0)\n"
+	"    lb a5, 0(s0)\n"
+	"    lhu a6, 2(s0)\n"
+	"    add a0, a0, a5\n"
+	"    add a0, a0, a6\n"
+	"    auipc a7, 0\n"
+	"    add a0, a0, a7\n"
+	"    bne a5, zero, nonzero\n"
+	"    addi a0, a0, 3\n"
+	"nonzero:\n"
+	"    bge a0, zero, positive\n"
+	"    xori a0, a0, -1\n"
+	"positive:\n"
+	"    addi s1, s1, 1\n"
+	"    bltu s1, s2, loop\n"
+	"    li a7, 93\n"
+	"    ecall\n";
+
+/* Test 12: JIT-compiled blocks match the switch engine */
+static void test_jit_engine() {
+	std::printf("Test 12: JIT engine covers RV32IM operations...\n");
+
+	uint8_t binary[1024];
+	uint32_t size;
+
+	assert(assemble_to_memory(jit_test_program, binary, sizeof(binary), &size));
+
+	auto ref_mem = std::make_unique<Memory>(MEMORY_SIZE);
+	auto ref_cpu = std::make_unique<CPU>();
+	assert(ref_mem->write_block(0, binary, size) == MEM_OK);
+	ref_cpu->set_pc(0);
+
+	uint64_t ref_steps = 0;
+	cpu_status_t status = CPU_OK;
+	while (ref_cpu->is_running() && ref_steps < 100000) {
+		status = ref_cpu->step(ref_mem.get());
+		ref_steps++;
+		if (status == CPU_SYSCALL_EXIT) break;
+		assert(status == CPU_OK);
+	}
+	assert(status == CPU_SYSCALL_EXIT);
+
+	auto mem = std::make_unique<Memory>(MEMORY_SIZE);
+	auto cpu = std::make_unique<CPU>();
+	assert(mem->write_block(0, binary, size) == MEM_OK);
+	cpu->set_pc(0);
+
+	uint64_t total = 0;
+	run_engine_program(cpu.get(), mem.get(), ENGINE_JIT, &total, &status);
+
+	assert(status == CPU_SYSCALL_EXIT);
+	assert(total == ref_steps);
+	for (int i = 0; i < 32; i++) {
+		assert(cpu->get_register(i) == ref_cpu->get_register(i));
+	}
+	uint32_t word, ref_word;
+	assert(mem->read32(0x2000, &word) == MEM_OK);
+	assert(ref_mem->read32(0x2000, &ref_word) == MEM_OK);
+	assert(word == ref_word);
+
+#if defined(__x86_64__)
+	assert(mem->get_block_cache()->get_jit()->get_compiled_count() > 0);
+#endif
+
+	std::printf("\tOK JIT matches (%llu instructions, a0=0x%08x)\n",
+		(unsigned long long)ref_steps, ref_cpu->get_register(10));
+}
+
+/* Test 13: Snapshot/restore for repeated runs */
+static void test_snapshot_restore() {
+	std::printf("Test 13: Snapshot and restore between runs...\n");
+
+	uint8_t binary[1024];
+	uint32_t size;
+
+	assert(assemble_to_memory(engine_test_program, binary, sizeof(binary), &size));
+
+	const cpu_engine_t engines[] = { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	for (mem_backend_t backend : backends) {
+		for (cpu_engine_t engine : engines) {
+			auto emulator = std::make_unique<Emulator>(MEMORY_SIZE, backend);
+			assert(emulator->restore() == -1);
+			assert(emulator->get_memory()->write_block(0, binary, size) == MEM_OK);
+			emulator->set_pc(0);
+			emulator->set_engine(engine);
+			emulator->snapshot();
+
+			uint32_t first_a0 = 0;
+			uint64_t first_retired = 0;
+			for (int run = 0; run < 3; run++) {
+				RunResult result = emulator->run(100000);
+				assert(result.reason == RUN_EXIT);
+				if (run == 0) {
+					first_a0 = emulator->get_cpu()->get_register(10);
+					first_retired = result.retired;
+				}
+				assert(emulator->get_cpu()->get_register(10) == first_a0);
+				assert(result.retired == first_retired);
+
+				/* Only the stack and the 0x2000 buffer were written */
+				assert(emulator->get_memory()->get_dirty_count() <= 2);
+				assert(emulator->restore() == 0);
+
+				uint32_t word = 1;
+				assert(emulator->get_memory()->read32(0x2000, &word) == MEM_OK && word == 0);
+				assert(emulator->get_cpu()->get_pc() == 0);
+				assert(emulator->get_cpu()->is_running());
+			}
+		}
+	}
+
+	std::printf("\tOK Restored runs repeat exactly on every engine and backend\n");
+}
+
+/* Test 14: Incremental checkpoints resume a run */
+static void test_checkpoints() {
+	std::printf("Test 14: Incremental checkpoints...\n");
+
+	uint8_t binary[1024];
+	uint32_t size;
+
+	assert(assemble_to_memory(engine_test_program, binary, sizeof(binary), &size));
+
+	/* Uninterrupted reference */
+	auto reference = std::make_unique<Emulator>(MEMORY_SIZE);
+	assert(reference->get_memory()->write_block(0, binary, size) == MEM_OK);
+	reference->set_pc(0);
+	assert(reference->run(100000).reason == RUN_EXIT);
+
+	char full[] = "/tmp/emulator_ckpt_XXXXXX";
+	char delta[] = "/tmp/emulator_ckpt_XXXXXX";
+	close(mkstemp(full));
+	close(mkstemp(delta));
+
+	/* Checkpoint twice part-way, then abandon the run */
+	auto first = std::make_unique<Emulator>(MEMORY_SIZE, MEM_BACKEND_RESERVED);
+	assert(first->get_memory()->write_block(0, binary, size) == MEM_OK);
+	first->set_pc(0);
+	first->set_engine(ENGINE_BLOCK);
+	assert(first->run(300).reason == RUN_BUDGET);
+	assert(first->write_checkpoint(full) == 0);
+	assert(first->run(500).reason == RUN_BUDGET);
+	assert(first->write_checkpoint(delta) == 0);
+
+	/* Only the buffer page changed between the two checkpoints */
+	FILE *file = std::fopen(delta, "rb");
+	CheckpointHeader header;
+	assert(std::fread(&header, sizeof(header), 1, file) == 1);
+	std::fclose(file);
+	assert(header.sequence == 1 && header.page_count == 1);
+
+	/* Recover into a fresh emulator and finish */
+	auto resumed = std::make_unique<Emulator>(MEMORY_SIZE);
+	assert(resumed->apply_checkpoint(full) == 0);
+	assert(resumed->apply_checkpoint(delta) == 0);
+	assert(resumed->get_cpu()->get_pc() == first->get_cpu()->get_pc());
+	assert(resumed->run(100000).reason == RUN_EXIT);
+	for (int i = 0; i < 32; i++) {
+		assert(resumed->get_cpu()->get_register(i) == reference->get_cpu()->get_register(i));
+	}
+
+	/* Missing files are rejected */
+	assert(resumed->apply_checkpoint("/nonexistent/checkpoint") == -1);
+
+	unlink(full);
+	unlink(delta);
+
+	std::printf("\tOK Resumed run matches (delta held %u page)\n", header.page_count);
+}
+
+/* Test 15: Save and restore machine state */
+static void test_save_state() {
+	std::printf("Test 15: Save and restore machine state...\n");
+
+	uint8_t binary[1024];
+	uint32_t size;
+
+	assert(assemble_to_memory(engine_test_program, binary, sizeof(binary), &size));
+
+	auto reference = std::make_unique<Emulator>(MEMORY_SIZE);
+	assert(reference->get_memory()->write_block(0, binary, size) == MEM_OK);
+	reference->set_pc(0);
+	assert(reference->run(100000).reason == RUN_EXIT);
+
+	char state_path[] = "/tmp/emulator_state_XXXXXX";
+	char data_path[] = "/tmp/emulator_data_XXXXXX";
+	close(mkstemp(state_path));
+	int data = mkstemp(data_path);
+	assert(write(data, "abcdefgh", 8) == 8);
+	close(data);
+
+	/* Warm up, open a guest file part-way through, save */
+	auto warm = std::make_unique<Emulator>(MEMORY_SIZE);
+	assert(warm->get_memory()->write_block(0, binary, size) == MEM_OK);
+	warm->set_pc(0);
+	assert(warm->run(400).reason == RUN_BUDGET);
+	FdTable *files = warm->get_cpu()->get_files();
+	int guest_fd = files->open(data_path, O_RDONLY, 0);
+	assert(lseek(files->host_fd(guest_fd), 3, SEEK_SET) == 3);
+	assert(warm->save_state(state_path) == 0);
+
+	/* Zero pages are skipped: only the code and buffer pages are stored */
+	struct stat info;
+	assert(stat(state_path, &info) == 0);
+	FILE *file = std::fopen(state_path, "rb");
+	StateHeader header;
+	assert(std::fread(&header, sizeof(header), 1, file) == 1);
+	std::fclose(file);
+	assert((uint64_t)info.st_size == header.data_offset + 2 * MEM_PAGE_SIZE);
+
+	/* Fan out resumed runs on every engine */
+	const cpu_engine_t engines[] = { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+	for (cpu_engine_t engine : engines) {
+		auto resumed = std::make_unique<Emulator>(MEMORY_SIZE, MEM_BACKEND_RESERVED);
+		assert(resumed->restore_state(state_path) == 0);
+		resumed->set_engine(engine);
+
+		int host = resumed->get_cpu()->get_files()->host_fd(guest_fd);
+		char c = 0;
+		assert(host >= 0 && read(host, &c, 1) == 1 && c == 'd');
+
+		assert(resumed->run(100000).reason == RUN_EXIT);
+		for (int i = 0; i < 32; i++) {
+			assert(resumed->get_cpu()->get_register(i) == reference->get_cpu()->get_register(i));
+		}
+	}
+
+	/* Garbage is rejected */
+	assert(warm->restore_state(data_path) == -1);
+
+	/* Regions match the file: ones unmapped before saving are unmapped again */
+	auto trimmed = std::make_unique<Emulator>(MEMORY_SIZE);
+	trimmed->get_memory()->unmap(STACK_BASE, MEM_PAGE_SIZE);
+	assert(trimmed->get_memory()->write32(STACK_BASE + MEM_PAGE_SIZE, 7) == MEM_OK);
+	assert(trimmed->save_state(state_path) == 0);
+	auto fresh = std::make_unique<Emulator>(MEMORY_SIZE);
+	fresh->get_memory()->map(MMAP_BASE, MEM_PAGE_SIZE);
+	assert(fresh->restore_state(state_path) == 0);
+	uint32_t word = 0;
+	assert(!fresh->get_memory()->is_mapped(STACK_BASE, 1) && !fresh->get_memory()->is_mapped(MMAP_BASE, 1));
+	assert(fresh->get_memory()->read32(STACK_BASE + MEM_PAGE_SIZE, &word) == MEM_OK && word == 7);
+
+	/* Runs past the address space and empty regions are rejected, not wrapped or clamped */
+	file = std::fopen(state_path, "r+b");
+	assert(std::fread(&header, sizeof(header), 1, file) == 1 && header.run_count == 1);
+	long runs = (long)(sizeof(header) + header.region_count * sizeof(StateRegion));
+	StateRun run;
+	assert(std::fseek(file, runs, SEEK_SET) == 0 && std::fread(&run, sizeof(run), 1, file) == 1);
+	StateRun wrapped = { 1u << (32 - MEM_PAGE_SHIFT), run.page_count };
+	assert(std::fseek(file, runs, SEEK_SET) == 0 && std::fwrite(&wrapped, sizeof(wrapped), 1, file) == 1);
+	std::fflush(file);
+	assert(std::make_unique<Emulator>(MEMORY_SIZE)->restore_state(state_path) == -1);
+	StateRegion empty = { STACK_BASE, STACK_BASE };
+	assert(std::fseek(file, runs, SEEK_SET) == 0 && std::fwrite(&run, sizeof(run), 1, file) == 1);
+	assert(std::fseek(file, sizeof(header), SEEK_SET) == 0 && std::fwrite(&empty, sizeof(empty), 1, file) == 1);
+	std::fclose(file);
+	assert(std::make_unique<Emulator>(MEMORY_SIZE)->restore_state(state_path) == -1);
+
+	unlink(state_path);
+	unlink(data_path);
+
+	std::printf("\tOK Resumed runs match the uninterrupted run\n");
+}
+
+/* Program that allocates with brk and mmap instead of a .space buffer */
+static const char *heap_test_program =
+	".text\n"
+	"main:\n"
+	"    li a0, 0\n"
+	"    li a7, 214        # brk(0)\n"
+	"    ecall\n"
+	"    mv s0, a0         # heap start\n"
+	"    li t0, 0x10000\n"
+	"    add a0, s0, t0\n"
+	"    li a7, 214        # grow by 64 KiB\n"
+	"    ecall\n"
+	"    sub s2, a0, s0    # 0x10000 on success\n"
+	"    mv t1, s0\n"
+	"    li t2, 0\n"
+	"    li t3, 16384\n"
+	"    li s1, 0          # sum\n"
+	"fill:\n"
+	"    sw t2, 0(t1)\n"
+	"    lw t4, 0(t1)\n"
+	"    add s1, s1, t4\n"
+	"    addi t1, t1, 4\n"
+	"    addi t2, t2, 1\n"
+	"    blt t2, t3, fill\n"
+	"    li a0, 0\n"
+	"    li a1, 8192\n"
+	"    li a2, 3\n"
+	"    li a3, 0x22\n"
+	"    li a7, 222        # mmap(0, 8192, RW, PRIVATE|ANONYMOUS)\n"
+	"    ecall\n"
+	"    mv s3, a0\n"
+	"    lw t4, 4096(s3)   # fresh pages read as zero\n"
+	"    add s1, s1, t4\n"
+	"    sw s1, 4096(s3)\n"
+	"    lw s4, 4096(s3)\n"
+	"    li a1, 8192\n"
+	"    li a7, 215        # munmap\n"
+	"    ecall\n"
+	"    mv a0, s0\n"
+	"    li a7, 214        # shrink the heap again\n"
+	"    ecall\n"
+	"    mv a0, s4\n"
+	"    li a7, 93\n"
+	"    ecall\n";
+
+/* Test 16: Guest heap through brk, mmap and munmap */
+static void test_guest_heap() {
+	std::printf("Test 16: Guest heap through brk, mmap and munmap...\n");
+
+	uint8_t binary[1024];
+	uint32_t size;
+
+	assert(assemble_to_memory(heap_test_program, binary, sizeof(binary), &size));
+
+	const cpu_engine_t engines[] = { ENGINE_SWITCH, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	for (mem_backend_t backend : backends) {
+		for (cpu_engine_t engine : engines) {
+			auto emulator = std::make_unique<Emulator>(MEMORY_SIZE, backend);
+			Memory *mem = emulator->get_memory();
+			assert(mem->write_block(0, binary, size) == MEM_OK);
+			emulator->set_pc(0);
+			emulator->set_engine(engine);
+
+			RunResult result = emulator->run(1000000);
+			assert(result.reason == RUN_EXIT);
+			assert(emulator->get_cpu()->get_register(10) == 16383u * 16384u / 2);
+			assert(emulator->get_cpu()->get_register(18) == 0x10000);
+
+			/* The heap and the mapping are gone again */
+			uint32_t heap = emulator->get_cpu()->get_register(8);
+			uint32_t mapping = emulator->get_cpu()->get_register(19);
+			assert(heap == MEMORY_SIZE && mem->get_program_break() == heap);
+			assert(mapping == MMAP_BASE);
+			assert(!mem->is_mapped(heap, 1) && !mem->is_mapped(mapping, 1));
+		}
+	}
+
+	std::printf("\tOK 64 KiB heap and an 8 KiB mapping on every engine and backend\n");
+}
+
+/* Test 17: Checkpoints of a guest heap */
+static void test_heap_checkpoints() {
+	std::printf("Test 17: Checkpoints of a guest heap...\n");
+
+	uint8_t binary[1024];
+	uint32_t size;
+
+	assert(assemble_to_memory(heap_test_program, binary, sizeof(binary), &size));
+
+	auto reference = std::make_unique<Emulator>(MEMORY_SIZE);
+	assert(reference->get_memory()->write_block(0, binary, size) == MEM_OK);
+	reference->set_pc(0);
+	assert(reference->run(1000000).reason == RUN_EXIT);
+
+	char full[] = "/tmp/emulator_ckpt_XXXXXX";
+	char mapped[] = "/tmp/emulator_ckpt_XXXXXX";
+	char last[] = "/tmp/emulator_ckpt_XXXXXX";
+	close(mkstemp(full));
+	close(mkstemp(mapped));
+	close(mkstemp(last));
+
+	/* Checkpoint while filling the heap, with the mmap region live, then after both are released */
+	auto first = std::make_unique<Emulator>(MEMORY_SIZE, MEM_BACKEND_RESERVED);
+	assert(first->get_memory()->write_block(0, binary, size) == MEM_OK);
+	first->set_pc(0);
+	assert(first->run(1000).reason == RUN_BUDGET);
+	uint32_t heap = first->get_cpu()->get_register(8);
+	uint32_t grown = first->get_memory()->get_program_break();
+	assert(grown == heap + 0x10000);
+	assert(first->write_checkpoint(full) == 0);
+	while (first->get_cpu()->get_register(20) == 0) {
+		assert(first->run(1).reason == RUN_BUDGET);
+	}
+	uint32_t stored[2];	/* Both pages of the mapping; one holds the guest's sum */
+	assert(first->get_memory()->read32(MMAP_BASE, &stored[0]) == MEM_OK);
+	assert(first->get_memory()->read32(MMAP_BASE + 4096, &stored[1]) == MEM_OK);
+	assert(stored[0] + stored[1] == first->get_cpu()->get_register(20));
+	assert(first->write_checkpoint(mapped) == 0);
+	while (first->get_cpu()->get_register(17) != 93) {
+		assert(first->run(1).reason == RUN_BUDGET);
+	}
+	assert(first->write_checkpoint(last) == 0);
+
+	const mem_backend_t backends[] = { MEM_BACKEND_PAGED, MEM_BACKEND_RESERVED };
+	for (mem_backend_t backend : backends) {
+		auto resumed = std::make_unique<Emulator>(MEMORY_SIZE, backend);
+		Memory *mem = resumed->get_memory();
+
+		/* The heap is mapped again and holds the stored words */
+		assert(resumed->apply_checkpoint(full) == 0);
+		assert(mem->get_program_break() == grown && mem->is_mapped(heap, 0x10000));
+		uint32_t word = 0;
+		assert(mem->read32(heap + 4, &word) == MEM_OK && word == 1);
+
+		/* The anonymous mapping comes back with the word stored in it */
+		assert(resumed->apply_checkpoint(mapped) == 0);
+		assert(mem->is_mapped(MMAP_BASE, 8192));
+		assert(mem->read32(MMAP_BASE, &word) == MEM_OK && word == stored[0]);
+		assert(mem->read32(MMAP_BASE + 4096, &word) == MEM_OK && word == stored[1]);
+
+		/* munmap and shrinking the heap are replayed as well */
+		assert(resumed->apply_checkpoint(last) == 0);
+		assert(mem->get_program_break() == heap && !mem->is_mapped(heap, 1));
+		assert(!mem->is_mapped(MMAP_BASE, 1));
+
+		assert(resumed->run(100).reason == RUN_EXIT);
+		for (int i = 0; i < 32; i++) {
+			assert(resumed->get_cpu()->get_register(i) == reference->get_cpu()->get_register(i));
+		}
+	}
+
+	unlink(full);
+	unlink(mapped);
+	unlink(last);
+
+	std::printf("\tOK brk and mmap regions survive checkpoints on both backends\n");
+}
+
 int main() {
 	std::printf("=== RISC-V Integration Tests (Assembler + Emulator) ===\n\n");
 
@@ -526,6 +1093,13 @@ int main() {
 	test_shift_operations(); test_count++;
 	test_byte_halfword_operations(); test_count++;
 	test_upper_immediate(); test_count++;
+	test_execution_engines(); test_count++;
+	test_jit_engine(); test_count++;
+	test_snapshot_restore(); test_count++;
+	test_checkpoints(); test_count++;
+	test_save_state(); test_count++;
+	test_guest_heap(); test_count++;
+	test_heap_checkpoints(); test_count++;
 
 	std::printf("\n=== All %d integration tests passed! ===\n", test_count);
 	return 0;